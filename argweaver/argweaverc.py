@@ -216,6 +216,9 @@ if argweaverclib:
          C.c_int, "region_start", C.c_int, "region_end", C.c_int, "niters"])
 
     # ARG probability.
+    argweaver_set_prob_threads = export(
+        argweaverclib, "arghmm_set_prob_threads", C.c_int,
+        [C.c_int, "nthreads"])
     argweaver_likelihood = export(
         argweaverclib, "arghmm_likelihood", C.c_double,
         [C.c_void_p, "trees", C.c_double_list, "times", C.c_int, "ntimes",
@@ -322,6 +325,11 @@ if argweaverclib:
         argweaverclib, "read_local_trees", C.c_void_p,
         [C.c_char_p, "filename",
          C.c_double_list, "times", C.c_int, "ntimes"])
+    write_local_trees_binary = export(
+        argweaverclib, "write_local_trees_binary", C.c_bool,
+        [C.c_char_p, "filename", C.c_void_p, "trees",
+         C.c_char_p_list, "names",
+         C.c_double_list, "times", C.c_int, "ntimes"])
 
     # Thread data structures.
     delete_path = export(
@@ -1093,6 +1101,13 @@ def resample_arg_regions(arg, seqs, niters, width=1000,
 # ARG probabilities
 
 
+def set_prob_threads(nthreads):
+    """
+    Set the number of threads used to calculate ARG probabilities
+    """
+    argweaver_set_prob_threads(nthreads)
+
+
 def calc_likelihood(arg, seqs, ntimes=20, mu=2.5e-8,
                     times=None, delete_arg=True, verbose=False):
     """
@@ -7,14 +7,19 @@
 #include <unistd.h>
 
 // arghmm includes
+#include "binary_sites.h"
+#include "binary_trees.h"
 #include "compress.h"
 #include "ConfigParam.h"
 #include "emit.h"
+#include "forward_runs.h"
 #include "fs.h"
 #include "logging.h"
+#include "matrices.h"
 #include "mem.h"
 #include "parsing.h"
 #include "sample_arg.h"
+#include "sample_thread.h"
 #include "sequences.h"
 #include "total_prob.h"
 #include "track.h"
@@ -34,7 +39,9 @@ Sampler for large ancestral recombination graphs\n\
 
 // file extensions
 const char *SMC_SUFFIX = ".smc";
+const char *SMC_BINARY_SUFFIX = "b";  // appended to SMC_SUFFIX
 const char *STATS_SUFFIX = ".stats";
+const char *RANDOM_SUFFIX = ".rng";
 const char *LOG_SUFFIX = ".log";
 
 
@@ -66,7 +73,7 @@ public:
         // input/output
 	config.add(new ConfigParam<string>
 		   ("-s", "--sites", "<sites alignment>", &sites_file,
-		    "sequence alignment in sites format"));
+		    "sequence alignment in sites format (text or binary *.sitesb)"));
 	config.add(new ConfigParam<string>
 		   ("-f", "--fasta", "<fasta alignment>", &fasta_file,
 		    "sequence alignment in FASTA format"));
@@ -147,9 +154,24 @@ public:
  	config.add(new ConfigSwitch
 		   ("", "--no-compress-output", &no_compress_output,
                     "do not use compressed output"));
+	config.add(new ConfigSwitch
+		   ("", "--smc-binary", &smc_binary,
+                    "write ARG samples in the binary format (*.smcb)"));
         config.add(new ConfigParam<int>
                    ("-x", "--randseed", "<random seed>", &randseed, 0,
                     "seed for random number generator (default=current time)"));
+        config.add(new ConfigParam<string>
+                   ("", "--random-generator", "xoshiro|libc",
+                    &random_generator, "xoshiro",
+                    "random number generator, libc reproduces runs of older versions (default=xoshiro)",
+                    DEBUG_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--threads", "<# of threads>", &nthreads, 1,
+                    "number of threads for resampling windows and ARG statistics (default=1)"));
+        config.add(new ConfigParam<int>
+                   ("", "--matrix-threads", "<# of threads>",
+                    &matrix_threads, 0,
+                    "total number of threads computing HMM matrices ahead of the forward algorithm, shared by the --threads samplers (default=0)"));
 
         // advance options
         config.add(new ConfigParamComment("Advanced Options", DEBUG_OPT));
@@ -172,6 +194,26 @@ public:
                    ("", "--resample-window-iters", "<iterations>",
                     &resample_window_iters, 10,
                     "number of iterations per sliding window for resampling (default=10)", DEBUG_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--emission-cache", "<megabytes>",
+                    &emission_cache_size, 64,
+                    "memory for caching emissions of unchanged blocks, 0 disables (default=64)", DEBUG_OPT));
+        config.add(new ConfigSwitch
+                   ("", "--forward-runs", &forward_runs,
+                    "skip long invariant runs in the forward algorithm with matrix powers when cheaper",
+                    DEBUG_OPT));
+        config.add(new ConfigSwitch
+                   ("", "--forward-float", &forward_float,
+                    "store the forward table in single precision, for full threading and window resampling (columns are still computed in double)",
+                    DEBUG_OPT));
+        config.add(new ConfigSwitch
+                   ("", "--forward-checkpoints", &forward_checkpoints,
+                    "store only checkpoints of the forward table and recompute columns during traceback (for full threading and window resampling)",
+                    DEBUG_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--checkpoint-spacing", "<sites>",
+                    &checkpoint_spacing, 0,
+                    "sites between forward table checkpoints, 0 uses sqrt of region length (default=0)", DEBUG_OPT));
 
 
         // help information
@@ -255,13 +297,22 @@ public:
     int resume_iter;
     int resample_window;
     int resample_window_iters;
+    int emission_cache_size;
+    bool forward_runs;
+    bool forward_float;
+    bool forward_checkpoints;
+    int checkpoint_spacing;
     bool gibbs;
 
     // misc
     int compress_seq;
     int sample_step;
     bool no_compress_output;
+    bool smc_binary;
     int randseed;
+    string random_generator;
+    int nthreads;
+    int matrix_threads;
     double prob_path_switch;
     bool infsites;
 
@@ -434,31 +485,18 @@ void print_stats(FILE *stats_file, const char *stage, int iter,
     // calculate number of recombinations
     int nrecombs = trees->get_num_trees() - 1;
 
-    // calculate number of non-compatiable sites
-    int nseqs = trees->get_num_leaves();
-    char *seqs[nseqs];
-    for (int i=0; i<nseqs; i++)
-        seqs[i] = sequences->seqs[trees->seqids[i]];
-    int noncompats = count_noncompat(trees, seqs, nseqs, sequences->length());
-
     // get memory usage in MB
     double maxrss = get_max_memory_usage() / 1000.0;
 
-
-    // calculate likelihood, prior, and joint probabilities
-    // uncompressed local trees
-    if (sites_mapping)
-        uncompress_local_trees(trees, sites_mapping);
-
-    double prior = calc_arg_prior(&config->model, trees);
-    double likelihood = calc_arg_likelihood(&config->model, sequences, trees,
-                                            sites_mapping);
+    // calculate likelihood, prior, joint probabilities and number of
+    // non-compatible sites.  Blocks of the ARG that have not changed since
+    // the last call are not recomputed.
+    static ArgStatsCache stats_cache;
+    double prior, likelihood, arglen;
+    int noncompats;
+    stats_cache.calc(&config->model, sequences, trees, sites_mapping,
+                     &prior, &likelihood, &noncompats, &arglen);
     double joint = prior + likelihood;
-    double arglen = get_arglen(trees, config->model.times);
-
-    // recompress local trees
-    if (sites_mapping)
-        compress_local_trees(trees, sites_mapping);
 
     // output stats
     fprintf(stats_file, "%s\t%d\t%f\t%f\t%f\t%d\t%d\t%f\n",
@@ -491,35 +529,90 @@ string get_out_arg_file(const Config &config, int iter)
 }
 
 
+// Returns the filename of the random state saved with an iteration's ARG
+string get_out_random_file(const Config &config, int iter)
+{
+    char iterstr[10];
+    snprintf(iterstr, 10, ".%d", iter);
+    return config.out_prefix + iterstr + RANDOM_SUFFIX;
+}
+
+
 bool log_local_trees(
     const ArgModel *model, const Sequences *sequences, LocalTrees *trees,
     const SitesMapping* sites_mapping, const Config *config, int iter)
 {
     string out_arg_file = get_out_arg_file(*config, iter);
-    if (!config->no_compress_output)
+    if (config->smc_binary)
+        out_arg_file += SMC_BINARY_SUFFIX;
+    else if (!config->no_compress_output)
         out_arg_file += ".gz";
 
     // write local trees uncompressed
     if (sites_mapping)
         uncompress_local_trees(trees, sites_mapping);
 
-    // setup output stream
-    CompressStream stream(out_arg_file.c_str(), "w");
-    if (!stream.stream) {
-        printError("cannot write '%s'", out_arg_file.c_str());
-        return false;
-    }
-
+    if (config->smc_binary) {
+        if (!write_local_trees_binary(out_arg_file.c_str(), trees,
+                                      *sequences, model->times,
+                                      model->ntimes)) {
+            printError("cannot write '%s'", out_arg_file.c_str());
+            return false;
+        }
+    } else {
+        // setup output stream
+        CompressStream stream(out_arg_file.c_str(), "w");
+        if (!stream.stream) {
+            printError("cannot write '%s'", out_arg_file.c_str());
+            return false;
+        }
 
-    write_local_trees(stream.stream, trees, sequences, model->times);
+        write_local_trees(stream.stream, trees, sequences, model->times);
+    }
 
     if (sites_mapping)
         compress_local_trees(trees, sites_mapping);
 
+    // save random state for resuming from this ARG, and use the node ids
+    // of the written ARG, so that resuming from it continues exactly as
+    // this run does.  The state of libc rand() cannot be saved, so its
+    // runs keep their node ids as older versions did.
+    string state = get_random_generator()->get_state();
+    if (state != "") {
+        renumber_local_trees(trees);
+
+        string out_random_file = get_out_random_file(*config, iter);
+        FILE *out = fopen(out_random_file.c_str(), "w");
+        if (!out) {
+            printError("cannot write '%s'", out_random_file.c_str());
+            return false;
+        }
+        fprintf(out, "%s\n", state.c_str());
+        fclose(out);
+    }
+
     return true;
 }
 
 
+// Restores the random state saved with the ARG of an iteration
+bool read_random_state(const Config &config, int iter)
+{
+    string random_file = get_out_random_file(config, iter);
+    FILE *infile = fopen(random_file.c_str(), "r");
+    if (!infile)
+        return false;
+
+    char *line = fgetline(infile);
+    fclose(infile);
+    if (!line)
+        return false;
+    bool ok = get_random_generator()->set_state(line);
+    delete [] line;
+    return ok;
+}
+
+
 //=============================================================================
 
 
@@ -543,6 +636,10 @@ bool read_doubles(const char *filename, vector<double> &values) {
 bool read_init_arg(const char *arg_file, const ArgModel *model,
                    LocalTrees *trees, vector<string> &seqnames)
 {
+    if (is_local_trees_binary(arg_file))
+        return read_local_trees_binary(arg_file, model->times, model->ntimes,
+                                       trees, seqnames);
+
     CompressStream stream(arg_file, "r");
     if (!stream.stream) {
         printError("cannot read '%s'", arg_file);
@@ -603,6 +700,7 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
     int niters = config->resample_window_iters;
     window /= config->compress_seq;
     int step = window / 2;
+    ThreadPool pool(config->nthreads);
 
     // set iteration counter
     int iter = 1;
@@ -626,7 +724,7 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
             resample_arg(model, sequences, trees);
         else
             resample_arg_mcmc_all(model, sequences, trees, frac_leaf,
-                                  window, step, niters);
+                                  window, step, niters, &pool);
         printTimerLog(timer, LOG_LOW, "sample time:");
 
 
@@ -715,11 +813,17 @@ bool parse_status_line(const char* line, const Config &config,
     }
 
     // try compress output
-    out_arg_file += ".gz";
-    if (stat(out_arg_file.c_str(), &st) == 0) {
+    if (stat((out_arg_file + ".gz").c_str(), &st) == 0) {
         stage = stage2;
         iter = iter2;
-        arg_file = out_arg_file;
+        arg_file = out_arg_file + ".gz";
+    }
+
+    // try binary output
+    if (stat((out_arg_file + SMC_BINARY_SUFFIX).c_str(), &st) == 0) {
+        stage = stage2;
+        iter = iter2;
+        arg_file = out_arg_file + SMC_BINARY_SUFFIX;
     }
 
 
@@ -862,7 +966,15 @@ int main(int argc, char **argv)
     // init random number generator
     if (c.randseed == 0)
         c.randseed = time(NULL);
-    srand(c.randseed);
+    if (c.random_generator == "xoshiro") {
+        get_random_generator()->set_seed(c.randseed, RANDOM_XOSHIRO);
+    } else if (c.random_generator == "libc") {
+        get_random_generator()->set_seed(c.randseed, RANDOM_LIBC);
+    } else {
+        printError("unknown random generator '%s'",
+                   c.random_generator.c_str());
+        return EXIT_ERROR;
+    }
     printLog(LOG_LOW, "random seed: %d\n", c.randseed);
 
 
@@ -918,13 +1030,22 @@ int main(int argc, char **argv)
         }
 
         // read sites
-        CompressStream stream(c.sites_file.c_str());
-        if (!stream.stream ||
-            !read_sites(stream.stream, &sites, subregion[0], subregion[1])) {
-            printError("could not read sites file");
-            return EXIT_ERROR;
+        if (is_sites_binary(c.sites_file.c_str())) {
+            if (!read_sites_binary(c.sites_file.c_str(), &sites,
+                                   subregion[0], subregion[1])) {
+                printError("could not read sites file");
+                return EXIT_ERROR;
+            }
+        } else {
+            CompressStream stream(c.sites_file.c_str());
+            if (!stream.stream ||
+                !read_sites(stream.stream, &sites,
+                            subregion[0], subregion[1])) {
+                printError("could not read sites file");
+                return EXIT_ERROR;
+            }
+            stream.close();
         }
-        stream.close();
 
         printLog(LOG_LOW, "read input sites (chrom=%s, start=%d, end=%d, length=%d, nseqs=%d, nsites=%d)\n",
                  sites.chrom.c_str(), sites.start_coord, sites.end_coord,
@@ -1112,9 +1233,39 @@ int main(int argc, char **argv)
     double maxrss = get_max_memory_usage() / 1000.0;
     printLog(LOG_LOW, "max memory usage: %.1f MB\n", maxrss);
 
+    // setup emission calculations
+    sequences.find_site_flags();
+    EmissionCache emission_cache(
+        long(c.emission_cache_size) * 1024 * 1024 / sizeof(double));
+    if (c.emission_cache_size > 0)
+        model.emission_cache = &emission_cache;
+    if (c.forward_runs)
+        model.forward_run_mode = FORWARD_RUNS_AUTO;
+    set_matrix_threads(c.matrix_threads);
+    set_compress_threads(c.nthreads);
+    set_prob_threads(c.nthreads);
+    if (c.forward_float)
+        model.forward_float = true;
+    if (c.forward_checkpoints)
+        model.forward_checkpoints = max(c.checkpoint_spacing, 0);
+
+    // continue the random stream of the resumed iteration
+    if (c.resume && c.random_generator == "xoshiro") {
+        if (read_random_state(c, c.resume_iter))
+            printLog(LOG_LOW, "restored random state of iter %d\n",
+                     c.resume_iter);
+        else
+            printLog(LOG_LOW, "could not restore random state of iter %d, "
+                     "resumed run will differ from an uninterrupted run\n",
+                     c.resume_iter);
+    }
+
     // sample ARG
     printLog(LOG_LOW, "\n");
     sample_arg(&model, &sequences, trees, sites_mapping, &c);
+    model.emission_cache = NULL;
+    printLog(LOG_LOW, "emission cache: %ld hits, %ld misses\n",
+             emission_cache.get_hits(), emission_cache.get_misses());
 
     // final log message
     maxrss = get_max_memory_usage() / 1000.0;
@@ -22,6 +22,7 @@
 #include "tabix.h"
 #include "compress.h"
 #include "IntervalIterator.h"
+#include "parallel.h"
 #include <set>
 
 //#include "allele_age.h"
@@ -60,9 +61,10 @@ public:
         config.add(new ConfigParam<string>
                    ("-a", "--arg-file", "<file.bed.gz>", &argfile,
                     "Bed file containing args sampled by ARGweaver. Should"
-                    " be created with smc2bed and sorted with sort-bed. If"
+                    " be created with smc2bed from all of the smc files. If"
                     " using --region or --bedfile, also needs to be gzipped"
-                    " and tabix'd"));
+                    " and tabix'd, which smc2bed does when its output file"
+                    " ends in .gz"));
         config.add(new ConfigParam<string>
                    ("-r", "--region", "<chr:start-end>", &region,
                     "region to retrieve statistics from (1-based coords)"));
@@ -159,6 +161,10 @@ public:
         config.add(new ConfigParam<string>
                    ("-t", "--tabix-dir", "<tabix dir>", &tabix_dir,
                     "Specify the directory of the tabix executable"));
+        config.add(new ConfigParam<int>
+                   ("", "--threads", "<# of threads>", &nthreads, 1,
+                    "number of regions of --bed-file to summarize at once"
+                    " (default=1)"));
         config.add(new ConfigSwitch
                    ("-v", "--version", &version, "display version information"));
         config.add(new ConfigSwitch
@@ -210,16 +216,17 @@ public:
 
     bool noheader;
     string tabix_dir;
+    int nthreads;
     bool version;
     bool help;
 };
 
-void checkResults(IntervalIterator<vector<double> > *results) {
+void checkResults(FILE *out, IntervalIterator<vector<double> > *results) {
     Interval<vector<double> > summary=results->next();
     vector<vector <double> > scores;
     while (summary.start != summary.end) {
-        cout << summary.chrom << "\t" << summary.start << "\t"
-             << summary.end;
+        fprintf(out, "%s\t%i\t%i", summary.chrom.c_str(), summary.start,
+                summary.end);
         scores = summary.get_scores();
         if (scores.size() > 0) {
             vector<double> tmpScore(scores.size());
@@ -230,26 +237,26 @@ void checkResults(IntervalIterator<vector<double> > *results) {
                 double meanval=-1;
                 for (unsigned int j=0; j < scores.size(); j++)
                     tmpScore[j] = scores[j][i];
-                if (i==0 && getNumSample > 0) printf("\t%i", (int)scores.size());
+                if (i==0 && getNumSample > 0) fprintf(out, "\t%i", (int)scores.size());
                 for (int j=1; j <= summarize; j++) {
                     if (getMean==j) {
                         meanval = compute_mean(tmpScore);
                         have_mean=1;
-                        printf("\t%g", meanval);
+                        fprintf(out, "\t%g", meanval);
                     } else if (getStdev==j) {
                         if (!have_mean)
                             meanval = compute_mean(tmpScore);
-                        printf("\t%g", compute_stdev(tmpScore, meanval));
+                        fprintf(out, "\t%g", compute_stdev(tmpScore, meanval));
                     } else if (getQuantiles==j) {
                         vector<double> q =
                             compute_quantiles(tmpScore, quantiles);
                         for (unsigned int k=0; k < quantiles.size(); k++) {
-                            printf("\t%g", q[k]);
+                            fprintf(out, "\t%g", q[k]);
                         }
                     }
                 }
             }
-            printf("\n");
+            fprintf(out, "\n");
         }
         summary = results->next();
     }
@@ -381,13 +388,25 @@ struct CompareBedLineEnd
     }
 };
 
-void processNextBedLine(BedLine *line,
+// Output of one region.  Lines are held in bedlist until they can be
+// written in sorted order.
+class RegionOutput {
+public:
+    RegionOutput(FILE *out) : out(out), counter(0) {}
+    FILE *out;
+    int counter;
+    list<BedLine*> bedlist;
+};
+
+
+void processNextBedLine(BedLine *line, RegionOutput *output,
                         IntervalIterator<vector<double> > *results,
                         vector<string> &statname,
                         char *region_chrom, int region_start, int region_end,
                         vector<double> times) {
-    static int counter=0;
-    static list<BedLine*> bedlist;
+    FILE *out = output->out;
+    int &counter = output->counter;
+    list<BedLine*> &bedlist = output->bedlist;
 
     if (line != NULL) {
         if (line->stats.size() == 0)
@@ -414,16 +433,16 @@ void processNextBedLine(BedLine *line,
             for (list<BedLine*>::iterator it=bedlist.begin();
                  it != bedlist.end(); ++it) {
                 BedLine *l = *it;
-                printf("%s\t%i\t%i\t%i", l->chrom, l->start, l->end, l->sample);
+                fprintf(out, "%s\t%i\t%i\t%i", l->chrom, l->start, l->end, l->sample);
                 for (unsigned int i=0; i < statname.size(); i++) {
                     if (statname[i]=="tree") {
-                        printf("\t");
-                        printf("%s", l->newick);
+                        fprintf(out, "\t");
+                        fprintf(out, "%s", l->newick);
                     } else {
-                        printf("\t%g", l->stats[i]);
+                        fprintf(out, "\t%g", l->stats[i]);
                     }
                 }
-                printf("\n");
+                fprintf(out, "\n");
                 delete l;
             }
             bedlist.clear();
@@ -434,7 +453,7 @@ void processNextBedLine(BedLine *line,
             results->append(line->chrom, line->start, line->end, line->stats);
             counter++;
             if (counter%100==0) {
-                checkResults(results);
+                checkResults(out, results);
             }
             delete line;
         }
@@ -580,7 +599,7 @@ public:
 
 
 
-void print_summaries(vector<double> &stat) {
+void print_summaries(FILE *out, vector<double> &stat) {
     double meanval=0;
     int have_mean=0;
     for (int j=1; j <= summarize; j++) {
@@ -588,23 +607,23 @@ void print_summaries(vector<double> &stat) {
             if (stat.size() > 0) {
                 meanval = compute_mean(stat);
                 have_mean=1;
-                printf("\t%g", meanval);
-            } else printf("\tNA");
+                fprintf(out, "\t%g", meanval);
+            } else fprintf(out, "\tNA");
         } else if (getStdev==j) {
             if (stat.size() > 1) {
                 if (!have_mean)
                     meanval = compute_mean(stat);
-                printf("\t%g", compute_stdev(stat, meanval));
-            } else printf("\tNA");
+                fprintf(out, "\t%g", compute_stdev(stat, meanval));
+            } else fprintf(out, "\tNA");
         } else if (getQuantiles==j) {
             if (stat.size() > 0) {
                 vector<double> q = compute_quantiles(stat, quantiles);
                 for (unsigned int k=0; k < quantiles.size(); k++) {
-                    printf("\t%g", q[k]);
+                    fprintf(out, "\t%g", q[k]);
                 }
             } else {
                 for (unsigned int k=0; k < quantiles.size(); k++) {
-                    printf("\tNA");
+                    fprintf(out, "\tNA");
                 }
             }
         }
@@ -614,7 +633,7 @@ void print_summaries(vector<double> &stat) {
 
 int summarizeRegionBySnp(Config *config, const char *region,
                          set<string> inds, vector<string> statname,
-                         vector<double> times) {
+                         vector<double> times, FILE *out) {
     TabixStream snp_infile(config->snpfile, region, config->tabix_dir);
     TabixStream infile(config->argfile, region, config->tabix_dir);
     vector<string> token;
@@ -696,20 +715,20 @@ int summarizeRegionBySnp(Config *config, const char *region,
                 for (list<BedLine*>::iterator it=bedlist.begin();
                      it != bedlist.end(); ++it) {
                     BedLine *l = *it;
-                    printf("%s\t%i\t%i\t%i\t%c\t%c\t%i\t%i", l->chrom,
+                    fprintf(out, "%s\t%i\t%i\t%i\t%c\t%c\t%i\t%i", l->chrom,
                            snpStream.coord-1, snpStream.coord, l->sample,
                            l->derAllele, l->otherAllele, l->derFreq,
                            l->otherFreq);
                     for (unsigned int i=0; i < statname.size(); i++) {
                         if (statname[i]=="tree") {
-                            printf("\t%s", l->newick);
+                            fprintf(out, "\t%s", l->newick);
                         } else if (statname[i]=="infSites") {
-                            printf("\t%i", (int)(l->stats[i]==1));
+                            fprintf(out, "\t%i", (int)(l->stats[i]==1));
                         } else {
-                            printf("\t%g", l->stats[i]);
+                            fprintf(out, "\t%g", l->stats[i]);
                         }
                     }
-                    printf("\n");
+                    fprintf(out, "\n");
                     l->stats.clear();
                 }
             } else {
@@ -738,7 +757,7 @@ int summarizeRegionBySnp(Config *config, const char *region,
                     derFreq = first->otherFreq;
                     otherFreq = first->derFreq;
                 }
-                printf("%s\t%i\t%i\t%c\t%c\t%i\t%i\t%i\t%i",
+                fprintf(out, "%s\t%i\t%i\t%c\t%c\t%i\t%i\t%i\t%i",
                        l->chrom, snpStream.coord-1, snpStream.coord,
                        derAllele, otherAllele, derFreq, otherFreq,
                        (int)bedlist.size(), infsites);
@@ -751,7 +770,7 @@ int summarizeRegionBySnp(Config *config, const char *region,
                             BedLine *l = *it;
                             stat.push_back(l->stats[i]);
                         }
-                        print_summaries(stat);
+                        print_summaries(out, stat);
 
                         stat.clear();
                         //now stats for infinite sites set
@@ -762,10 +781,10 @@ int summarizeRegionBySnp(Config *config, const char *region,
                                 stat.push_back(l->stats[i]);
                             l->stats.clear();
                         }
-                        print_summaries(stat);
+                        print_summaries(out, stat);
                     }
                 }
-                printf("\n");
+                fprintf(out, "\n");
             }
         }
     }
@@ -783,7 +802,7 @@ int summarizeRegionBySnp(Config *config, const char *region,
 
 int summarizeRegionNoSnp(Config *config, const char *region,
                          set<string> inds, vector<string>statname,
-                         vector<double> times) {
+                         vector<double> times, FILE *out) {
     TabixStream *infile;
     char c;
     char *region_chrom = NULL;
@@ -791,6 +810,7 @@ int summarizeRegionNoSnp(Config *config, const char *region,
     vector<string> token;
     int region_start=-1, region_end=-1, start, end, sample;
     IntervalIterator<vector<double> > results;
+    RegionOutput output(out);
     queue<BedLine*> bedlineQueue;
     map<int,BedLine*> bedlineMap;
     map<int,SprPruned*> trees;
@@ -920,7 +940,7 @@ int summarizeRegionNoSnp(Config *config, const char *region,
         while (bedlineQueue.size() > 0) {
             BedLine *firstline = bedlineQueue.front();
             if (firstline->stats.size() == statname.size()) {
-                processNextBedLine(firstline, &results, statname,
+                processNextBedLine(firstline, &output, &results, statname,
                                    region_chrom, region_start, region_end,
                                    times);
                 bedlineQueue.pop();
@@ -933,7 +953,7 @@ int summarizeRegionNoSnp(Config *config, const char *region,
 
     while (bedlineQueue.size() > 0) {
         BedLine *firstline = bedlineQueue.front();
-        processNextBedLine(firstline, &results, statname,
+        processNextBedLine(firstline, &output, &results, statname,
                            region_chrom, region_start, region_end, times);
         //        delete firstline;
         bedlineQueue.pop();
@@ -941,9 +961,9 @@ int summarizeRegionNoSnp(Config *config, const char *region,
 
     if (summarize) {
         results.finish();
-        checkResults(&results);
+        checkResults(out, &results);
     } else {
-        processNextBedLine(NULL, &results, statname, region_chrom,
+        processNextBedLine(NULL, &output, &results, statname, region_chrom,
                            region_start, region_end, times);
     }
 
@@ -958,12 +978,63 @@ int summarizeRegionNoSnp(Config *config, const char *region,
 
 int summarizeRegion(Config *config, const char *region,
                     set<string> inds, vector<string>statname,
-                    vector<double> times) {
+                    vector<double> times, FILE *out=stdout) {
     if (config->snpfile.empty())
-        return summarizeRegionNoSnp(config, region, inds, statname, times);
+        return summarizeRegionNoSnp(config, region, inds, statname, times,
+                                    out);
     else
         return summarizeRegionBySnp(config, region,
-                                    inds, statname, times);
+                                    inds, statname, times, out);
+}
+
+
+// Reads up to max regions from a bed file as chr:start-end strings
+bool read_bed_regions(FILE *bedfile, const char *filename, unsigned int max,
+                      vector<string> &regions) {
+    char *line;
+    vector<string> token;
+    char regionStr[1000];
+    regions.clear();
+    while (regions.size() < max && (line = fgetline(bedfile))) {
+        split(line, '\t', token);
+        delete [] line;
+        if (token.size() < 3) {
+            fprintf(stderr, "expected at least 3 files in %s\n", filename);
+            return false;
+        }
+        int start = atoi(token[1].c_str());
+        int end = atoi(token[2].c_str());
+        snprintf(regionStr, sizeof(regionStr), "%s:%i-%i", token[0].c_str(),
+                 start+1, end);
+        regions.push_back(string(regionStr));
+    }
+    return true;
+}
+
+
+// Regions summarized by worker threads.  The output of each region is
+// kept in memory until all regions of the batch are done.
+class RegionJob {
+public:
+    RegionJob(Config *config, set<string> *inds, vector<string> *statname,
+              vector<double> *times) :
+        config(config), inds(inds), statname(statname), times(times) {}
+    Config *config;
+    set<string> *inds;
+    vector<string> *statname;
+    vector<double> *times;
+    vector<string> regions;
+    vector<char*> buffers;
+    vector<size_t> sizes;
+};
+
+
+void summarize_region_task(int i, void *data) {
+    RegionJob *job = (RegionJob*) data;
+    FILE *out = open_memstream(&job->buffers[i], &job->sizes[i]);
+    summarizeRegion(job->config, job->regions[i].c_str(), *job->inds,
+                    *job->statname, *job->times, out);
+    fclose(out);
 }
 
 
@@ -1060,6 +1131,10 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (c.nthreads < 1) {
+        fprintf(stderr, "Error: --threads must be at least 1\n");
+        return 1;
+    }
     if ((!c.region.empty()) && (!c.bedfile.empty())) {
         fprintf(stderr, "Error: --bed and --region cannot be used together.\n");
         return 1;
@@ -1165,27 +1240,33 @@ int main(int argc, char *argv[]) {
                         inds, statname, times);
     } else {
         CompressStream bedstream(c.bedfile.c_str());
-        char *line;
-        vector<string> token;
-        char *regionStr;
         if (!bedstream.stream) {
             fprintf(stderr, "error reading %s\n", c.bedfile.c_str());
             return 1;
         }
-        while ((line = fgetline(bedstream.stream))) {
-            split(line, '\t', token);
-            if (token.size() < 3) {
-                fprintf(stderr, "expected at least 3 files in %s\n",
-                        c.bedfile.c_str());
+        RegionJob job(&c, &inds, &statname, &times);
+        ThreadPool pool(c.nthreads);
+        const unsigned int batch = (c.nthreads > 1) ? 4 * c.nthreads : 1;
+        while (true) {
+            if (!read_bed_regions(bedstream.stream, c.bedfile.c_str(), batch,
+                                  job.regions))
                 return 1;
+            if (job.regions.empty())
+                break;
+            if (c.nthreads <= 1) {
+                summarizeRegion(&c, job.regions[0].c_str(), inds, statname,
+                                times);
+                continue;
+            }
+
+            // regions are written in the order of the bed file
+            job.buffers.assign(job.regions.size(), (char*) NULL);
+            job.sizes.assign(job.regions.size(), 0);
+            pool.run(job.regions.size(), summarize_region_task, &job);
+            for (unsigned int i=0; i < job.regions.size(); i++) {
+                fwrite(job.buffers[i], 1, job.sizes[i], stdout);
+                free(job.buffers[i]);
             }
-            regionStr = new char[token[0].size()+token[1].size()+
-                                 token[2].size()+3];
-            int start = atoi(token[1].c_str());
-            int end = atoi(token[2].c_str());
-            sprintf(regionStr, "%s:%i-%i", token[0].c_str(), start+1, end);
-            summarizeRegion(&c, regionStr, inds, statname, times);
-            delete [] regionStr;
         }
         bedstream.close();
     }
@@ -0,0 +1,327 @@
+//=============================================================================
+// Binary format for sites alignments (*.sitesb)
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "binary_sites.h"
+#include "logging.h"
+#include "seq.h"
+
+
+namespace argweaver {
+
+
+static const char BINARY_SITES_MAGIC[] = "SITB";
+static const int BINARY_SITES_VERSION = 1;
+
+// allele code of a masked base
+static const int BINARY_SITES_N = 4;
+
+
+static inline uint64_t align8(uint64_t offset)
+{
+    return (offset + 7) & ~uint64_t(7);
+}
+
+
+// Returns the number of bytes of a column of nseqs alleles
+static inline uint64_t get_column_size(int nseqs)
+{
+    return (uint64_t(nseqs) + 1) / 2;
+}
+
+
+//=============================================================================
+// output
+
+
+static inline void put_int(string &buf, int x)
+{
+    buf.append((const char*) &x, sizeof(x));
+}
+
+
+static inline void put_uint64(string &buf, uint64_t x)
+{
+    buf.append((const char*) &x, sizeof(x));
+}
+
+
+static inline void put_string(string &buf, const string &str)
+{
+    put_int(buf, str.size());
+    buf.append(str);
+}
+
+
+bool write_sites_binary(FILE *out, const Sites *sites)
+{
+    const int nseqs = sites->get_num_seqs();
+    const int nsites = sites->get_num_sites();
+
+    // positions must be increasing for the index to be searched
+    for (int i=1; i<nsites; i++) {
+        if (sites->positions[i] <= sites->positions[i-1]) {
+            printError("sites are not sorted by position (%d after %d)",
+                       sites->positions[i] + 1, sites->positions[i-1] + 1);
+            return false;
+        }
+    }
+
+    // header
+    string header;
+    header.append(BINARY_SITES_MAGIC, 4);
+    put_int(header, BINARY_SITES_VERSION);
+    put_int(header, nseqs);
+    put_int(header, nsites);
+    put_string(header, sites->chrom);
+    put_int(header, sites->start_coord);
+    put_int(header, sites->end_coord);
+    for (int i=0; i<nseqs; i++)
+        put_string(header, sites->names[i]);
+    const uint64_t positions_offset = align8(header.size() + 16);
+    const uint64_t alleles_offset = positions_offset + 4 * uint64_t(nsites);
+    put_uint64(header, positions_offset);
+    put_uint64(header, alleles_offset);
+    header.resize(positions_offset, '\0');
+
+    bool ok = fwrite(header.c_str(), 1, header.size(), out) == header.size();
+
+    // positions
+    for (int i=0; ok && i<nsites; i++) {
+        const int32_t pos = sites->positions[i];
+        ok = fwrite(&pos, sizeof(pos), 1, out) == 1;
+    }
+
+    // alleles
+    const uint64_t column_size = get_column_size(nseqs);
+    vector<unsigned char> column(column_size);
+    for (int i=0; ok && i<nsites; i++) {
+        const char *col = sites->cols[i];
+        fill(column.begin(), column.end(), 0);
+        for (int j=0; j<nseqs; j++) {
+            int code = dna2int[(unsigned char) col[j]];
+            if (code == -1) {
+                if (toupper(col[j]) != 'N') {
+                    printError("invalid sequence character '%c' at position %d",
+                               col[j], sites->positions[i] + 1);
+                    return false;
+                }
+                code = BINARY_SITES_N;
+            }
+            column[j / 2] |= code << (4 * (j % 2));
+        }
+        ok = fwrite(&column[0], 1, column_size, out) == column_size;
+    }
+
+    if (!ok)
+        printError("error writing binary sites");
+    return ok;
+}
+
+
+bool write_sites_binary(const char *filename, const Sites *sites)
+{
+    FILE *out = NULL;
+
+    if ((out = fopen(filename, "wb")) == NULL) {
+        printError("cannot write file '%s'", filename);
+        return false;
+    }
+
+    bool ok = write_sites_binary(out, sites);
+    if (fclose(out) != 0)
+        ok = false;
+    return ok;
+}
+
+
+//=============================================================================
+// input
+
+
+bool is_sites_binary(const char *filename)
+{
+    FILE *infile = fopen(filename, "rb");
+    if (!infile)
+        return false;
+    char magic[4];
+    bool result = (fread(magic, 1, 4, infile) == 4 &&
+                   memcmp(magic, BINARY_SITES_MAGIC, 4) == 0);
+    fclose(infile);
+    return result;
+}
+
+
+// A file mapped into memory for reading
+class MappedFile
+{
+public:
+    MappedFile() : data(NULL), size(0) {}
+    ~MappedFile()
+    {
+        if (data)
+            munmap((void*) data, size);
+    }
+
+    bool open(const char *filename)
+    {
+        const int fd = ::open(filename, O_RDONLY);
+        if (fd == -1)
+            return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void *addr = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED)
+            return false;
+        data = (const char*) addr;
+        size = info.st_size;
+        return true;
+    }
+
+    const char *data;
+    size_t size;
+};
+
+
+// Reads fixed size values from memory, checking the bounds
+class MemoryReader
+{
+public:
+    MemoryReader(const char *data, size_t size) :
+        data(data), size(size), pos(0), ok(true) {}
+
+    void get(void *dest, size_t n)
+    {
+        if (!ok || n > size - pos) {
+            ok = false;
+            return;
+        }
+        memcpy(dest, data + pos, n);
+        pos += n;
+    }
+
+    int get_int() { int x = 0; get(&x, sizeof(x)); return x; }
+    uint64_t get_uint64() { uint64_t x = 0; get(&x, sizeof(x)); return x; }
+
+    string get_string()
+    {
+        const int len = get_int();
+        if (!ok || len < 0 || size_t(len) > size - pos) {
+            ok = false;
+            return "";
+        }
+        string str(data + pos, len);
+        pos += len;
+        return str;
+    }
+
+    const char *data;
+    size_t size;
+    size_t pos;
+    bool ok;
+};
+
+
+bool read_sites_binary(const char *filename, Sites *sites,
+                       int subregion_start, int subregion_end)
+{
+    sites->clear();
+
+    MappedFile file;
+    if (!file.open(filename)) {
+        printError("cannot read file '%s'", filename);
+        return false;
+    }
+
+    // header
+    MemoryReader reader(file.data, file.size);
+    char magic[4];
+    reader.get(magic, 4);
+    if (!reader.ok || memcmp(magic, BINARY_SITES_MAGIC, 4) != 0) {
+        printError("not a binary sites file '%s'", filename);
+        return false;
+    }
+    const int version = reader.get_int();
+    if (version != BINARY_SITES_VERSION) {
+        printError("unsupported binary sites version %d", version);
+        return false;
+    }
+    const int nseqs = reader.get_int();
+    const int nsites = reader.get_int();
+    sites->chrom = reader.get_string();
+    sites->start_coord = reader.get_int();
+    sites->end_coord = reader.get_int();
+    if (!reader.ok || nseqs < 0 || nsites < 0 ||
+        uint64_t(nseqs) > file.size) {
+        printError("bad binary sites header");
+        return false;
+    }
+    for (int i=0; reader.ok && i<nseqs; i++)
+        sites->names.push_back(reader.get_string());
+    const uint64_t positions_offset = reader.get_uint64();
+    const uint64_t alleles_offset = reader.get_uint64();
+    const uint64_t column_size = get_column_size(nseqs);
+    if (!reader.ok || positions_offset % 4 != 0 ||
+        positions_offset > file.size ||
+        alleles_offset != positions_offset + 4 * uint64_t(nsites) ||
+        alleles_offset > file.size ||
+        (file.size - alleles_offset) / max(column_size, uint64_t(1)) <
+        uint64_t(nsites)) {
+        printError("bad binary sites header");
+        return false;
+    }
+
+    // set region by subregion if specified
+    if (subregion_start != -1)
+        sites->start_coord = subregion_start;
+    if (subregion_end != -1)
+        sites->end_coord = subregion_end;
+
+    // find sites within region, keeping the same sites as read_sites(),
+    // which compares the 1-index position of a site to the region
+    const int32_t *positions =
+        (const int32_t*) (file.data + positions_offset);
+    const int first = lower_bound(positions, positions + nsites,
+                                  sites->start_coord - 1) - positions;
+    const int last = max(first, int(lower_bound(
+        positions, positions + nsites, sites->end_coord - 1) - positions));
+    sites->positions.reserve(max(last - first, 0));
+    sites->cols.reserve(max(last - first, 0));
+
+    // decode alleles
+    const unsigned char *alleles =
+        (const unsigned char*) (file.data + alleles_offset);
+    for (int i=first; i<last; i++) {
+        const unsigned char *column = &alleles[i * column_size];
+        char *col = new char [nseqs + 1];
+        for (int j=0; j<nseqs; j++) {
+            const int code = (column[j / 2] >> (4 * (j % 2))) & 0xf;
+            if (code > BINARY_SITES_N) {
+                printError("invalid allele in binary sites file '%s'",
+                           filename);
+                delete [] col;
+                return false;
+            }
+            col[j] = (code == BINARY_SITES_N) ? 'N' : int2dna[code];
+        }
+        col[nseqs] = '\0';
+        sites->append(positions[i], col);
+    }
+
+    return true;
+}
+
+
+} // namespace argweaver
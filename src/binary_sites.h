@@ -0,0 +1,48 @@
+//=============================================================================
+// Binary format for sites alignments (*.sitesb)
+//
+// A compact alternative to the text sites format read by read_sites().
+// The file is read through mmap, and the sites of a region are found by
+// binary search of the position index, so only the columns of the region
+// are decoded.
+//
+// Layout (little-endian):
+//
+//   header     "SITB", version, nseqs, nsites, chrom, start, end,
+//              names of the sequences,
+//              uint64 offset of the positions, uint64 offset of the alleles
+//   positions  int32 per site (0-index, strictly increasing), aligned to 8
+//   alleles    one column of (nseqs + 1) / 2 bytes per site, each allele in
+//              4 bits (A=0, C=1, G=2, T=3, N=4), even sequences in the low
+//              bits of a byte
+
+#ifndef ARGWEAVER_BINARY_SITES_H
+#define ARGWEAVER_BINARY_SITES_H
+
+#include <stdio.h>
+
+#include "sequences.h"
+
+
+namespace argweaver {
+
+
+#define BINARY_SITES_SUFFIX ".sitesb"
+
+
+// Returns true if filename is in the binary sites format
+bool is_sites_binary(const char *filename);
+
+bool write_sites_binary(FILE *out, const Sites *sites);
+bool write_sites_binary(const char *filename, const Sites *sites);
+
+// Reads sites written by write_sites_binary().  As for read_sites(), the
+// region of the file is replaced by the subregion if given, and only sites
+// within the region are read.
+bool read_sites_binary(const char *filename, Sites *sites,
+                       int subregion_start=-1, int subregion_end=-1);
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_BINARY_SITES_H
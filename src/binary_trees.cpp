@@ -0,0 +1,630 @@
+//=============================================================================
+// Binary format for local trees (*.smcb)
+
+#include <zlib.h>
+
+#include "binary_trees.h"
+#include "logging.h"
+
+
+namespace argweaver {
+
+
+static const char BINARY_TREES_MAGIC[] = "SMCB";
+static const char BINARY_TREES_INDEX_MAGIC[] = "SMCBINDX";
+static const unsigned int BINARY_TREES_VERSION = 1;
+
+
+// defined in local_tree.cpp
+int find_time(double time, const double *times, int ntimes);
+
+
+//=============================================================================
+// encoding
+
+// Appends x as a variable length integer (7 bits per byte)
+static inline void put_varint(string &buf, unsigned int x)
+{
+    while (x >= 0x80) {
+        buf += char((x & 0x7f) | 0x80);
+        x >>= 7;
+    }
+    buf += char(x);
+}
+
+
+static inline bool get_varint(const string &buf, size_t &pos,
+                              unsigned int *x)
+{
+    *x = 0;
+    for (int shift=0; shift<35; shift+=7) {
+        if (pos >= buf.size())
+            return false;
+        const unsigned char c = buf[pos++];
+        *x |= (unsigned int) (c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+
+// Writes fixed size values and counts the bytes written
+class BinaryWriter
+{
+public:
+    BinaryWriter(FILE *out) : out(out), offset(0), ok(true) {}
+
+    void put(const void *data, size_t size)
+    {
+        if (fwrite(data, 1, size, out) != size)
+            ok = false;
+        offset += size;
+    }
+
+    void put_int(int x) { put(&x, sizeof(x)); }
+    void put_uint64(uint64_t x) { put(&x, sizeof(x)); }
+    void put_double(double x) { put(&x, sizeof(x)); }
+
+    void put_string(const string &str)
+    {
+        put_int(str.size());
+        put(str.c_str(), str.size());
+    }
+
+    FILE *out;
+    uint64_t offset;
+    bool ok;
+};
+
+
+class BinaryReader
+{
+public:
+    BinaryReader(FILE *infile) : infile(infile), ok(true) {}
+
+    void get(void *data, size_t size)
+    {
+        if (ok && fread(data, 1, size, infile) != size)
+            ok = false;
+    }
+
+    int get_int() { int x = 0; get(&x, sizeof(x)); return x; }
+    uint64_t get_uint64() { uint64_t x = 0; get(&x, sizeof(x)); return x; }
+    double get_double() { double x = 0; get(&x, sizeof(x)); return x; }
+
+    string get_string()
+    {
+        const int len = get_int();
+        if (!ok || len < 0 || len > (1 << 20)) {
+            ok = false;
+            return "";
+        }
+        string str(len, '\0');
+        if (len > 0)
+            get(&str[0], len);
+        return str;
+    }
+
+    FILE *infile;
+    bool ok;
+};
+
+
+static inline void put_node(string &buf, const LocalNode &node)
+{
+    put_varint(buf, node.parent + 1);
+    put_varint(buf, node.child[0] + 1);
+    put_varint(buf, node.child[1] + 1);
+    put_varint(buf, node.age);
+}
+
+
+static inline bool get_node(const string &buf, size_t &pos, LocalNode *node)
+{
+    unsigned int parent, child0, child1, age;
+    if (!(get_varint(buf, pos, &parent) && get_varint(buf, pos, &child0) &&
+          get_varint(buf, pos, &child1) && get_varint(buf, pos, &age)))
+        return false;
+    node->parent = int(parent) - 1;
+    node->child[0] = int(child0) - 1;
+    node->child[1] = int(child1) - 1;
+    node->age = age;
+    return true;
+}
+
+
+static inline bool same_node(const LocalNode &a, const LocalNode &b)
+{
+    return a.parent == b.parent && a.age == b.age &&
+        a.child[0] == b.child[0] && a.child[1] == b.child[1];
+}
+
+
+//=============================================================================
+// output
+
+
+// Compresses and writes a block of encoded trees
+static void write_trees_block(BinaryWriter &writer, const string &raw,
+                              int ntrees, int start,
+                              vector<pair<int, uint64_t> > &index)
+{
+    uLongf size = compressBound(raw.size());
+    vector<Bytef> data(size);
+    if (compress2(&data[0], &size, (const Bytef*) raw.c_str(), raw.size(),
+                  Z_DEFAULT_COMPRESSION) != Z_OK) {
+        writer.ok = false;
+        return;
+    }
+
+    index.push_back(make_pair(start, writer.offset));
+    writer.put_int(ntrees);
+    writer.put_int(start);
+    writer.put_int(raw.size());
+    writer.put_int(size);
+    writer.put(&data[0], size);
+}
+
+
+void write_local_trees_binary(FILE *out, const LocalTrees *trees,
+                              const char *const *names,
+                              const double *times, int ntimes)
+{
+    const int nnodes = trees->nnodes;
+    const int nleaves = trees->get_num_leaves();
+    BinaryWriter writer(out);
+
+    // header
+    writer.put(BINARY_TREES_MAGIC, 4);
+    writer.put_int(BINARY_TREES_VERSION);
+    writer.put_int(nnodes);
+    writer.put_int(ntimes);
+    for (int i=0; i<ntimes; i++)
+        writer.put_double(times[i]);
+    writer.put_string(trees->chrom);
+    writer.put_int(trees->start_coord);
+    writer.put_int(trees->end_coord);
+    writer.put_int(names ? nleaves : 0);
+    for (int i=0; names && i<nleaves; i++)
+        writer.put_string(names[trees->seqids[i]]);
+
+    // node ids are renumbered as in write_local_trees()
+    vector<int> total_mapping(nnodes), tmp_mapping(nnodes);
+    vector<LocalNode> nodes(nnodes), last_nodes(nnodes);
+    for (int i=0; i<nnodes; i++)
+        total_mapping[i] = i;
+
+    vector<pair<int, uint64_t> > index;
+    string raw;
+    int ntrees = 0;
+    int block_start = trees->start_coord;
+    Spr spr;
+    spr.set_null();
+
+    int end = trees->start_coord;
+    for (LocalTrees::const_iterator it=trees->begin();
+         it != trees->end(); ++it)
+    {
+        const int start = end;
+        end += it->blocklen;
+        const LocalTree *tree = it->tree;
+
+        if (ntrees == BINARY_TREES_BLOCK) {
+            write_trees_block(writer, raw, ntrees, block_start, index);
+            raw.clear();
+            ntrees = 0;
+        }
+        if (ntrees == 0)
+            block_start = start;
+
+        // renumber nodes
+        for (int i=0; i<nnodes; i++) {
+            const LocalNode &node = tree->nodes[i];
+            LocalNode &node2 = nodes[total_mapping[i]];
+            node2.parent = (node.parent == -1) ?
+                -1 : total_mapping[node.parent];
+            for (int j=0; j<2; j++)
+                node2.child[j] = (node.child[j] == -1) ?
+                    -1 : total_mapping[node.child[j]];
+            node2.age = node.age;
+        }
+
+        // block length, SPR and nodes
+        put_varint(raw, it->blocklen);
+        put_varint(raw, spr.recomb_node + 1);
+        put_varint(raw, spr.recomb_time + 1);
+        put_varint(raw, spr.coal_node + 1);
+        put_varint(raw, spr.coal_time + 1);
+        if (ntrees == 0) {
+            for (int i=0; i<nnodes; i++)
+                put_node(raw, nodes[i]);
+        } else {
+            int nchanged = 0;
+            for (int i=0; i<nnodes; i++)
+                if (!same_node(nodes[i], last_nodes[i]))
+                    nchanged++;
+            put_varint(raw, nchanged);
+            for (int i=0; i<nnodes; i++) {
+                if (!same_node(nodes[i], last_nodes[i])) {
+                    put_varint(raw, i);
+                    put_node(raw, nodes[i]);
+                }
+            }
+        }
+        last_nodes.swap(nodes);
+        ntrees++;
+
+        LocalTrees::const_iterator it2 = it;
+        ++it2;
+        if (it2 != trees->end()) {
+            // SPR to the next tree in the renumbered ids
+            const Spr &spr2 = it2->spr;
+            spr = Spr(total_mapping[spr2.recomb_node], spr2.recomb_time,
+                      total_mapping[spr2.coal_node], spr2.coal_time);
+
+            // update total mapping
+            const int *mapping = it2->mapping;
+            for (int i=0; i<nnodes; i++)
+                tmp_mapping[i] = total_mapping[i];
+            for (int i=0; i<nnodes; i++) {
+                if (mapping[i] != -1)
+                    total_mapping[mapping[i]] = tmp_mapping[i];
+                else {
+                    int recoal = get_recoal_node(tree, spr2, mapping);
+                    total_mapping[recoal] = tmp_mapping[i];
+                }
+            }
+        }
+    }
+    if (ntrees > 0)
+        write_trees_block(writer, raw, ntrees, block_start, index);
+
+    // end of blocks
+    for (int i=0; i<4; i++)
+        writer.put_int(0);
+
+    // index
+    const uint64_t index_offset = writer.offset;
+    writer.put_int(index.size());
+    for (unsigned int i=0; i<index.size(); i++) {
+        writer.put_int(index[i].first);
+        writer.put_uint64(index[i].second);
+    }
+    writer.put_uint64(index_offset);
+    writer.put(BINARY_TREES_INDEX_MAGIC, 8);
+
+    if (!writer.ok)
+        printError("error writing binary local trees");
+}
+
+
+bool write_local_trees_binary(const char *filename, const LocalTrees *trees,
+                              const char *const *names,
+                              const double *times, int ntimes)
+{
+    FILE *out = NULL;
+
+    if ((out = fopen(filename, "wb")) == NULL) {
+        printError("cannot write file '%s'\n", filename);
+        return false;
+    }
+
+    write_local_trees_binary(out, trees, names, times, ntimes);
+    bool ok = !ferror(out);
+    if (fclose(out) != 0)
+        ok = false;
+    return ok;
+}
+
+
+bool write_local_trees_binary(const char *filename, const LocalTrees *trees,
+                              const Sequences &seqs,
+                              const double *times, int ntimes)
+{
+    // setup names
+    const unsigned int nleaves = trees->get_num_leaves();
+    vector<string> names(nleaves);
+    vector<const char*> names2(nleaves);
+    for (unsigned int i=0; i<nleaves; i++) {
+        if (i < seqs.names.size()) {
+            names[i] = seqs.names[i];
+        } else {
+            // use ids
+            char id[11];
+            snprintf(id, 10, "%d", i);
+            names[i] = id;
+        }
+        names2[i] = names[i].c_str();
+    }
+
+    return write_local_trees_binary(filename, trees, &names2[0],
+                                    times, ntimes);
+}
+
+
+//=============================================================================
+// input
+
+
+bool is_local_trees_binary(const char *filename)
+{
+    FILE *infile = fopen(filename, "rb");
+    if (!infile)
+        return false;
+    char magic[4];
+    bool result = (fread(magic, 1, 4, infile) == 4 &&
+                   memcmp(magic, BINARY_TREES_MAGIC, 4) == 0);
+    fclose(infile);
+    return result;
+}
+
+
+// Header of a binary local trees file
+class BinaryTreesHeader
+{
+public:
+    bool read(BinaryReader &reader)
+    {
+        char magic[4];
+        reader.get(magic, 4);
+        if (!reader.ok || memcmp(magic, BINARY_TREES_MAGIC, 4) != 0) {
+            printError("not a binary local trees file");
+            return false;
+        }
+        const int version = reader.get_int();
+        if (version != int(BINARY_TREES_VERSION)) {
+            printError("unsupported binary local trees version %d", version);
+            return false;
+        }
+
+        nnodes = reader.get_int();
+        const int ntimes = reader.get_int();
+        if (!reader.ok || nnodes < 0 || ntimes < 0 || ntimes > (1 << 20))
+            return false;
+        times.resize(ntimes);
+        for (int i=0; i<ntimes; i++)
+            times[i] = reader.get_double();
+        chrom = reader.get_string();
+        start_coord = reader.get_int();
+        end_coord = reader.get_int();
+        const int nnames = reader.get_int();
+        if (!reader.ok || nnames < 0 || nnames > nnodes)
+            return false;
+        names.resize(nnames);
+        for (int i=0; i<nnames; i++)
+            names[i] = reader.get_string();
+        return reader.ok;
+    }
+
+    int nnodes;
+    vector<double> times;
+    string chrom;
+    int start_coord;
+    int end_coord;
+    vector<string> names;
+};
+
+
+// Decodes a block of trees and appends them to trees
+static bool read_trees_block(BinaryReader &reader, int ntrees,
+                             const vector<int> &time_map, LocalTrees *trees)
+{
+    const int size = reader.get_int();
+    const int compressed_size = reader.get_int();
+    if (!reader.ok || size < 0 || compressed_size < 0)
+        return false;
+
+    vector<Bytef> data(compressed_size);
+    if (compressed_size > 0)
+        reader.get(&data[0], compressed_size);
+    string raw(size, '\0');
+    uLongf size2 = size;
+    if (!reader.ok ||
+        uncompress((Bytef*) &raw[0], &size2, &data[0], compressed_size) !=
+        Z_OK || size2 != uLongf(size))
+        return false;
+
+    const int nnodes = trees->nnodes;
+    const int ntimes = time_map.size();
+    vector<LocalNode> nodes(nnodes);
+    size_t pos = 0;
+    for (int k=0; k<ntrees; k++) {
+        unsigned int blocklen, sprs[4];
+        if (!get_varint(raw, pos, &blocklen))
+            return false;
+        for (int i=0; i<4; i++)
+            if (!get_varint(raw, pos, &sprs[i]))
+                return false;
+
+        if (k == 0) {
+            for (int i=0; i<nnodes; i++)
+                if (!get_node(raw, pos, &nodes[i]))
+                    return false;
+        } else {
+            unsigned int nchanged, node;
+            if (!get_varint(raw, pos, &nchanged))
+                return false;
+            for (unsigned int i=0; i<nchanged; i++)
+                if (!get_varint(raw, pos, &node) || int(node) >= nnodes ||
+                    !get_node(raw, pos, &nodes[node]))
+                    return false;
+        }
+
+        // make tree
+        LocalTree *tree = new LocalTree(nnodes, nnodes);
+        for (int i=0; i<nnodes; i++) {
+            tree->nodes[i] = nodes[i];
+            if (nodes[i].age < 0 || nodes[i].age >= ntimes ||
+                nodes[i].parent >= nnodes) {
+                delete tree;
+                return false;
+            }
+            tree->nodes[i].age = time_map[nodes[i].age];
+        }
+        tree->set_root();
+
+        // the first tree read has no SPR
+        Spr spr;
+        spr.set_null();
+        int *mapping = NULL;
+        if (trees->get_num_trees() > 0 && sprs[0] > 0) {
+            spr = Spr(sprs[0] - 1, time_map[sprs[1] - 1],
+                      sprs[2] - 1, time_map[sprs[3] - 1]);
+            const LocalTree *last_tree = trees->back().tree;
+            mapping = new int [nnodes];
+            for (int i=0; i<nnodes; i++)
+                mapping[i] = i;
+            mapping[last_tree->nodes[spr.recomb_node].parent] = -1;
+        }
+
+        trees->trees.push_back(LocalTreeSpr(tree, spr, blocklen, mapping));
+        trees->end_coord += blocklen;
+    }
+
+    return pos == raw.size();
+}
+
+
+bool read_local_trees_binary(FILE *infile, const double *times, int ntimes,
+                             LocalTrees *trees, vector<string> &seqnames,
+                             int start, int end)
+{
+    BinaryReader reader(infile);
+    BinaryTreesHeader header;
+    if (!header.read(reader)) {
+        printError("bad binary local trees header");
+        return false;
+    }
+
+    // map time points of the file to the given time points
+    vector<int> time_map(header.times.size());
+    for (unsigned int i=0; i<time_map.size(); i++)
+        time_map[i] = find_time(header.times[i], times, ntimes);
+
+    seqnames = header.names;
+    trees->clear();
+    trees->chrom = header.chrom;
+    trees->nnodes = header.nnodes;
+    trees->start_coord = header.start_coord;
+    trees->end_coord = header.start_coord;
+
+    // find blocks overlapping the region
+    vector<pair<int, uint64_t> > index;
+    if (start < end) {
+        if (fseeko(infile, -16, SEEK_END) != 0) {
+            printError("cannot seek in binary local trees file");
+            return false;
+        }
+        const uint64_t index_offset = reader.get_uint64();
+        char magic[8];
+        reader.get(magic, 8);
+        if (!reader.ok || memcmp(magic, BINARY_TREES_INDEX_MAGIC, 8) != 0 ||
+            fseeko(infile, index_offset, SEEK_SET) != 0) {
+            printError("bad binary local trees index");
+            return false;
+        }
+        const int nblocks = reader.get_int();
+        vector<pair<int, uint64_t> > blocks(max(nblocks, 0));
+        for (int i=0; i<nblocks && reader.ok; i++) {
+            blocks[i].first = reader.get_int();
+            blocks[i].second = reader.get_uint64();
+        }
+        for (int i=0; i<nblocks; i++) {
+            const int block_end = (i+1 < nblocks) ?
+                blocks[i+1].first : header.end_coord;
+            if (blocks[i].first < end && block_end > start)
+                index.push_back(blocks[i]);
+        }
+        if (!reader.ok || index.empty()) {
+            printError("region not found in binary local trees file");
+            return false;
+        }
+        trees->start_coord = trees->end_coord = index[0].first;
+    }
+
+    for (unsigned int i=0; ; i++) {
+        if (start < end) {
+            if (i == index.size())
+                break;
+            if (fseeko(infile, index[i].second, SEEK_SET) != 0)
+                return false;
+        }
+
+        const int ntrees = reader.get_int();
+        const int block_start = reader.get_int();
+        if (reader.ok && ntrees == 0)
+            break;
+        if (!reader.ok || ntrees < 0 || block_start != trees->end_coord) {
+            printError("bad binary local trees block");
+            return false;
+        }
+        if (!read_trees_block(reader, ntrees, time_map, trees)) {
+            printError("bad binary local trees block");
+            return false;
+        }
+    }
+
+    // set trees info
+    if (trees->get_num_trees() > 0)
+        trees->set_default_seqids();
+
+    assert_trees(trees);
+
+    return true;
+}
+
+
+bool read_local_trees_binary(const char *filename, const double *times,
+                             int ntimes, LocalTrees *trees,
+                             vector<string> &seqnames, int start, int end)
+{
+    FILE *infile = NULL;
+
+    if ((infile = fopen(filename, "rb")) == NULL) {
+        printError("cannot read file '%s'\n", filename);
+        return false;
+    }
+
+    bool result = read_local_trees_binary(infile, times, ntimes, trees,
+                                          seqnames, start, end);
+
+    fclose(infile);
+    return result;
+}
+
+
+bool read_local_trees_binary_times(const char *filename,
+                                   vector<double> &times)
+{
+    FILE *infile = fopen(filename, "rb");
+    if (!infile)
+        return false;
+
+    BinaryReader reader(infile);
+    BinaryTreesHeader header;
+    bool result = header.read(reader);
+    fclose(infile);
+    if (result)
+        times = header.times;
+    return result;
+}
+
+
+//=============================================================================
+// C interface
+extern "C" {
+
+bool write_local_trees_binary(char *filename, LocalTrees *trees,
+                              char **names, double *times, int ntimes)
+{
+    return write_local_trees_binary((const char*) filename,
+                                    (const LocalTrees*) trees,
+                                    (const char *const *) names,
+                                    (const double*) times, ntimes);
+}
+
+} // extern C
+
+
+} // namespace argweaver
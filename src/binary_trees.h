@@ -0,0 +1,80 @@
+//=============================================================================
+// Binary format for local trees (*.smcb)
+//
+// A compact alternative to the text SMC format written by
+// write_local_trees().  Trees are stored as node arrays rather than newick,
+// so they can be loaded without parsing.
+//
+// Layout (little-endian):
+//
+//   header   "SMCB", version, nnodes, ntimes, times, chrom, start, end,
+//            names of the leaves
+//   blocks   up to BINARY_TREES_BLOCK trees each, zlib compressed:
+//              uint32 ntrees, int32 start coordinate,
+//              uint32 size, uint32 compressed size, data
+//            followed by a block with ntrees = 0
+//   index    uint32 nblocks, (int32 start, uint64 file offset) per block,
+//            uint64 offset of the index, "SMCBINDX"
+//
+// Within a block each tree is stored as its block length and the SPR
+// leading to it, followed by all of its nodes for the first tree of the
+// block and only the nodes that differ from the previous tree otherwise.
+// Node ids follow the numbering of the text format, where a node keeps its
+// id from one tree to the next, so consecutive trees differ in a few nodes.
+// Integers within blocks are stored as variable length integers.
+
+#ifndef ARGWEAVER_BINARY_TREES_H
+#define ARGWEAVER_BINARY_TREES_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "local_tree.h"
+#include "sequences.h"
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+#define BINARY_TREES_SUFFIX ".smcb"
+
+// number of trees per compressed block
+#define BINARY_TREES_BLOCK 256
+
+
+// Returns true if filename is in the binary local trees format
+bool is_local_trees_binary(const char *filename);
+
+void write_local_trees_binary(FILE *out, const LocalTrees *trees,
+                              const char *const *names,
+                              const double *times, int ntimes);
+bool write_local_trees_binary(const char *filename, const LocalTrees *trees,
+                              const char *const *names,
+                              const double *times, int ntimes);
+bool write_local_trees_binary(const char *filename, const LocalTrees *trees,
+                              const Sequences &seqs,
+                              const double *times, int ntimes);
+
+// Reads local trees written by write_local_trees_binary().  Node ages and
+// SPR times are mapped to the closest of the given times.  If start < end,
+// only the blocks of trees overlapping [start, end) are read, using the
+// index to seek to them.
+bool read_local_trees_binary(FILE *infile, const double *times, int ntimes,
+                             LocalTrees *trees, vector<string> &seqnames,
+                             int start=0, int end=0);
+bool read_local_trees_binary(const char *filename, const double *times,
+                             int ntimes, LocalTrees *trees,
+                             vector<string> &seqnames,
+                             int start=0, int end=0);
+
+// Reads the time points stored in a binary local trees file
+bool read_local_trees_binary_times(const char *filename,
+                                   vector<double> &times);
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_BINARY_TREES_H
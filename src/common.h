@@ -10,6 +10,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "random.h"
 #include "t2exp.h"
 
 
@@ -100,26 +101,21 @@ void permute(T* array, int *perm, int size)
 //=============================================================================
 // Math
 
+// random numbers come from the calling thread's stream (see random.h)
 inline double frand()
-{ return rand() / double(RAND_MAX); }
+{ return get_random_generator()->uniform(); }
 
 inline double frand(double max)
-{ return rand() / double(RAND_MAX) * max; }
+{ return frand() * max; }
 
 inline double frand(double min, double max)
-{ return min + (rand() / double(RAND_MAX) * (max-min)); }
+{ return min + (frand() * (max-min)); }
 
 inline int irand(int max)
-{
-    const int i = int(rand() / float(RAND_MAX) * max);
-    return (i == max) ? max - 1 : i;
-}
+{ return get_random_generator()->uniform_int(max); }
 
 inline int irand(int min, int max)
-{
-    const int i = min + int(rand() / float(RAND_MAX) * (max - min));
-    return (i == max) ? max - 1 : i;
-}
+{ return min + irand(max - min); }
 
 inline double expovariate(double lambda)
 { return -log(frand()) / lambda; }
@@ -1,31 +1,301 @@
 
 #include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <set>
 #include <string>
+#include <vector>
 
 #include "compress.h"
+#include "parallel.h"
 #include "parsing.h"
 
 namespace argweaver {
 
 using namespace std;
 
+
+static int g_compress_threads = 1;
+
+// streams opened with popen(), which must be closed with pclose()
+static set<FILE*> g_pipes;
+static pthread_mutex_t g_pipes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+FILE *open_pipe(const char *command, const char *mode)
+{
+    FILE *stream = popen(command, mode);
+    if (stream) {
+        pthread_mutex_lock(&g_pipes_lock);
+        g_pipes.insert(stream);
+        pthread_mutex_unlock(&g_pipes_lock);
+    }
+    return stream;
+}
+
+
+void set_compress_threads(int nthreads)
+{
+    g_compress_threads = max(nthreads, 1);
+}
+
+
+int get_compress_threads()
+{
+    return g_compress_threads;
+}
+
+
+#ifdef __GLIBC__
+
+//=============================================================================
+// BGZF writer
+//
+// BGZF is a series of gzip members of at most 64KB each, whose header
+// records the compressed size of the member.  This lets tabix seek to any
+// member of the file.  The file ends with an empty member.
+
+static const int BGZF_HEADER_SIZE = 18;
+static const int BGZF_FOOTER_SIZE = 8;
+static const int BGZF_MAX_SIZE = 0x10000;
+
+static const unsigned char BGZF_EOF[28] = {
+    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00,
+    0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00};
+
+
+static inline void put_uint16(unsigned char *buf, unsigned int x)
+{
+    buf[0] = x & 0xff;
+    buf[1] = (x >> 8) & 0xff;
+}
+
+
+static inline void put_uint32(unsigned char *buf, unsigned int x)
+{
+    put_uint16(buf, x & 0xffff);
+    put_uint16(buf + 2, x >> 16);
+}
+
+
+// Compresses len bytes of data into one BGZF block.  Returns the size of
+// the block or -1 on error.
+static int compress_bgzf_block(const char *data, int len,
+                               unsigned char *block, int level)
+{
+    unsigned char *body = block + BGZF_HEADER_SIZE;
+    const int max_body = BGZF_MAX_SIZE - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+    int body_size = -1;
+
+    // incompressible data may not fit in a block unless stored
+    for (int attempt=0; attempt<2 && body_size < 0; attempt++) {
+        if (attempt > 0)
+            level = Z_NO_COMPRESSION;
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK)
+            return -1;
+        zs.next_in = (Bytef*) data;
+        zs.avail_in = len;
+        zs.next_out = body;
+        zs.avail_out = max_body;
+        if (deflate(&zs, Z_FINISH) == Z_STREAM_END)
+            body_size = zs.total_out;
+        deflateEnd(&zs);
+    }
+    if (body_size < 0)
+        return -1;
+
+    const int size = BGZF_HEADER_SIZE + body_size + BGZF_FOOTER_SIZE;
+    static const unsigned char header[BGZF_HEADER_SIZE] = {
+        0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0,
+        0, 0};
+    memcpy(block, header, BGZF_HEADER_SIZE);
+    put_uint16(block + 16, size - 1);
+
+    unsigned long crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, (const Bytef*) data, len);
+    put_uint32(body + body_size, crc);
+    put_uint32(body + body_size + 4, len);
+    return size;
+}
+
+
+// Uncompressed data is collected into a batch of blocks, which are
+// compressed in parallel and written in order.
+class BgzfWriter
+{
+public:
+    BgzfWriter(FILE *out, int nthreads) :
+        out(out),
+        pool(NULL),
+        nblocks(1),
+        len(0),
+        error(false)
+    {
+        if (nthreads > 1) {
+            pool = new ThreadPool(nthreads);
+            nblocks = 4 * nthreads;
+        }
+        data.resize(nblocks * BGZF_BLOCK_SIZE);
+        blocks.resize(nblocks * BGZF_MAX_SIZE);
+        sizes.resize(nblocks);
+    }
+
+    ~BgzfWriter()
+    {
+        delete pool;
+    }
+
+    ssize_t write(const char *buf, size_t size)
+    {
+        size_t written = 0;
+        while (written < size) {
+            size_t n = min(size - written, data.size() - len);
+            memcpy(&data[len], buf + written, n);
+            len += n;
+            written += n;
+            if (len == data.size() && !flush())
+                return 0;
+        }
+        return size;
+    }
+
+    // Writes all buffered data as complete blocks
+    bool flush()
+    {
+        const int n = (len + BGZF_BLOCK_SIZE - 1) / BGZF_BLOCK_SIZE;
+        if (pool && n > 1)
+            pool->run(n, compress_task, this);
+        else
+            for (int i=0; i<n; i++)
+                compress_task(i, this);
+
+        for (int i=0; i<n && !error; i++)
+            if (sizes[i] < 0 ||
+                fwrite(&blocks[i * BGZF_MAX_SIZE], 1, sizes[i], out) !=
+                size_t(sizes[i]))
+                error = true;
+        len = 0;
+        return !error;
+    }
+
+    int close()
+    {
+        flush();
+        if (!error && fwrite(BGZF_EOF, 1, sizeof(BGZF_EOF), out) !=
+            sizeof(BGZF_EOF))
+            error = true;
+        if (fclose(out) != 0)
+            error = true;
+        return error ? -1 : 0;
+    }
+
+protected:
+    static void compress_task(int i, void *writer)
+    {
+        BgzfWriter *w = (BgzfWriter*) writer;
+        const size_t start = size_t(i) * BGZF_BLOCK_SIZE;
+        const int n = min(w->len - start, size_t(BGZF_BLOCK_SIZE));
+        w->sizes[i] = compress_bgzf_block(
+            &w->data[start], n, &w->blocks[size_t(i) * BGZF_MAX_SIZE],
+            Z_DEFAULT_COMPRESSION);
+    }
+
+    FILE *out;
+    ThreadPool *pool;
+    int nblocks;
+    vector<char> data;            // uncompressed data of current batch
+    size_t len;
+    vector<unsigned char> blocks; // compressed blocks of current batch
+    vector<int> sizes;
+    bool error;
+};
+
+
+static ssize_t bgzf_write(void *cookie, const char *buf, size_t size)
+{
+    return ((BgzfWriter*) cookie)->write(buf, size);
+}
+
+
+static int bgzf_close(void *cookie)
+{
+    BgzfWriter *writer = (BgzfWriter*) cookie;
+    int ret = writer->close();
+    delete writer;
+    return ret;
+}
+
+
+//=============================================================================
+// gzip reader
+
+static ssize_t gz_read(void *cookie, char *buf, size_t size)
+{
+    int n = gzread((gzFile) cookie, buf, size);
+    return n < 0 ? -1 : n;
+}
+
+
+static int gz_close(void *cookie)
+{
+    return gzclose((gzFile) cookie) == Z_OK ? 0 : EOF;
+}
+
+#endif // __GLIBC__
+
+
+//=============================================================================
+
 FILE *read_compress(const char *filename, const char *command)
 {
     bool exists = !access(filename, F_OK);
     if (!exists)
         return NULL;
+
+#ifdef __GLIBC__
+    if (!command) {
+        gzFile infile = gzopen(filename, "rb");
+        if (!infile)
+            return NULL;
+        gzbuffer(infile, 1 << 17);
+        cookie_io_functions_t funcs = {gz_read, NULL, NULL, gz_close};
+        FILE *stream = fopencookie(infile, "r", funcs);
+        if (!stream)
+            gzclose(infile);
+        return stream;
+    }
+#endif
+
     const char *command2 = (command ? command : UNZIP_COMMAND);
     string cmd = string(command2) + " < " + quote_arg(filename);
-    return popen(cmd.c_str(), "r");
+    return open_pipe(cmd.c_str(), "r");
 }
 
 
 FILE *write_compress(const char *filename, const char *command)
 {
+#ifdef __GLIBC__
+    if (!command) {
+        FILE *out = fopen(filename, "wb");
+        if (!out)
+            return NULL;
+        BgzfWriter *writer = new BgzfWriter(out, g_compress_threads);
+        cookie_io_functions_t funcs = {NULL, bgzf_write, NULL, bgzf_close};
+        FILE *stream = fopencookie(writer, "w", funcs);
+        if (!stream)
+            bgzf_close(writer);
+        return stream;
+    }
+#endif
+
     // TODO: add check to prevent write error
     const char *command2 = (command ? command : ZIP_COMMAND);
     string cmd = string(command2) + " > " + quote_arg(filename);
-    return popen(cmd.c_str(), "w");
+    return open_pipe(cmd.c_str(), "w");
 }
 
 
@@ -38,16 +308,20 @@ FILE *open_compress(const char *filename, const char *mode,
     else if (mode[0] == 'r')
         cmd = string(command) + " < " + quote_arg(filename);
 
-    return popen(cmd.c_str(), mode);
+    return open_pipe(cmd.c_str(), mode);
 }
 
 
 int close_compress(FILE *stream)
 {
-    return pclose(stream);
+    pthread_mutex_lock(&g_pipes_lock);
+    bool pipe = g_pipes.erase(stream) > 0;
+    pthread_mutex_unlock(&g_pipes_lock);
+
+    if (pipe)
+        return pclose(stream);
+    return fclose(stream);
 }
 
 
 } // namespace argweaver
-
-
@@ -11,16 +11,33 @@ namespace argweaver {
 #define ZIP_COMMAND "gzip -"
 #define UNZIP_COMMAND "gunzip -"
 
+// maximum number of uncompressed bytes in a BGZF block
+#define BGZF_BLOCK_SIZE 0xff00
 
-FILE *read_compress(const char *filename, const char *command=UNZIP_COMMAND);
 
-FILE *write_compress(const char *filename, const char *command=ZIP_COMMAND);
+// Opens a gzip file for reading.  If command is NULL the file is
+// decompressed in-process with zlib (plain gzip, BGZF and multi-member
+// files are all supported), otherwise through a pipe to command.
+FILE *read_compress(const char *filename, const char *command=NULL);
+
+// Opens a gzip file for writing.  If command is NULL the file is written
+// in-process as BGZF, which is valid gzip and can be indexed by tabix,
+// otherwise through a pipe to command.
+FILE *write_compress(const char *filename, const char *command=NULL);
 
 FILE *open_compress(const char *filename, const char *mode,
                     const char *command=ZIP_COMMAND);
 
+// Runs command with popen()
+FILE *open_pipe(const char *command, const char *mode);
+
+// Closes a stream returned by any of the functions above
 int close_compress(FILE *stream);
 
+// Number of threads used to compress the blocks of a BGZF stream
+void set_compress_threads(int nthreads);
+int get_compress_threads();
+
 
 class CompressStream
 {
@@ -1,4 +1,6 @@
 
+#include <stdint.h>
+
 #include "common.h"
 #include "emit.h"
 #include "seq.h"
@@ -196,58 +198,6 @@ inline void likelihood_site_node_inner(
 }
 
 
-// calculate outer partial likelihood for one node and site
-inline void likelihood_site_node_outer(
-    const LocalTree *tree, const int root, const int node,
-    const char *const *seqs, const int pos,
-    const double *muts, const double *nomuts,
-    lk_row* outer, lk_row* inner)
-{
-    const LocalNode* nodes = tree->nodes;
-    const int j = node;
-
-    if (node == root) {
-        // root case
-        outer[j][0] = 1.0;
-        outer[j][1] = 1.0;
-        outer[j][2] = 1.0;
-        outer[j][3] = 1.0;
-    } else {
-        // non-root case
-        int sib = tree->get_sibling(j);
-        int parent = nodes[j].parent;
-
-        if (parent != root) {
-            for (int a=0; a<4; a++) {
-                double p1 = 0.0;
-                double p2 = 0.0;
-                for (int b=0; b<4; b++) {
-                    if (a == b) {
-                        p1 += inner[sib][b] * nomuts[sib];
-                        p2 += outer[parent][b] * nomuts[parent];
-                    } else {
-                        p1 += inner[sib][b] * muts[sib];
-                        p2 += outer[parent][b] * muts[parent];
-                    }
-                }
-                outer[j][a] = p1 * p2;
-            }
-        } else {
-            for (int a=0; a<4; a++) {
-                double p1 = 0.0;
-                for (int b=0; b<4; b++) {
-                    if (a == b)
-                        p1 += inner[sib][b] * nomuts[sib];
-                    else
-                        p1 += inner[sib][b] * muts[sib];
-                }
-                outer[j][a] = p1;
-            }
-        }
-    }
-}
-
-
 // calculate entire inner partial likelihood table
 double likelihood_site_inner(
     const LocalTree *tree, const char *const *seqs,
@@ -269,57 +219,264 @@ double likelihood_site_inner(
 }
 
 
-// calculate eniter outer partial likelihood table
-void likelihood_site_outer(
-    const LocalTree *tree, const char *const *seqs, const int pos,
-    const double *muts, const double *nomuts, bool internal,
-    lk_row *inner, lk_row *outer)
+//=============================================================================
+// site-batched partial likelihoods
+//
+// The variant sites of a block are processed LK_BATCH sites at a time.  The
+// partial likelihoods of a batch are stored by node, state and site, so that
+// the innermost loops run over the sites of the batch and can be vectorized.
+// Each site is computed with the same operations, in the same order, as by
+// likelihood_site_inner(), so results do not depend on the batching.
+
+
+// number of sites processed together
+#define LK_BATCH 4
+
+// partial likelihoods of a node for a batch of sites
+typedef double lk_batch[4][LK_BATCH];
+
+
+// table of partial likelihoods for batches of sites
+class LikelihoodBatchTable
+{
+public:
+    LikelihoodBatchTable(int nsites, int nnodes) :
+        nbatches((nsites + LK_BATCH - 1) / LK_BATCH),
+        nnodes(nnodes)
+    {
+        data = new lk_batch [max(nbatches * nnodes, 1)];
+    }
+
+    ~LikelihoodBatchTable()
+    {
+        delete [] data;
+    }
+
+    // Returns the table of a batch, indexed by node
+    lk_batch *get_batch(int batch) { return &data[batch * nnodes]; }
+
+    int nbatches;
+    int nnodes;
+    lk_batch *data;
+};
+
+
+// Sets the partial likelihoods of a leaf for a batch of sites
+static inline void likelihood_batch_leaf(const char *seq, const int *pos,
+                                         lk_batch &inner)
+{
+    for (int w=0; w<LK_BATCH; w++) {
+        const char c = seq[pos[w]];
+        if (c == 'N') {
+            for (int a=0; a<4; a++)
+                inner[a][w] = 1.0;
+        } else {
+            for (int a=0; a<4; a++)
+                inner[a][w] = 0.0;
+            inner[dna2int[(int) c]][w] = 1.0;
+        }
+    }
+}
+
+
+// calculate inner partial likelihood tables for a batch of sites
+static void likelihood_batch_inner(
+    const LocalTree *tree, const char *const *seqs, const int *pos,
+    const int *order, const int norder,
+    const double *muts, const double *nomuts, lk_batch *inner)
 {
+    const LocalNode* nodes = tree->nodes;
+
+    // iterate postorder through nodes
+    for (int i=0; i<norder; i++) {
+        const int j = order[i];
+        if (nodes[j].is_leaf()) {
+            likelihood_batch_leaf(seqs[j], pos, inner[j]);
+            continue;
+        }
+
+        const int c1 = nodes[j].child[0];
+        const int c2 = nodes[j].child[1];
+        for (int a=0; a<4; a++) {
+            double p1[LK_BATCH], p2[LK_BATCH];
+            for (int w=0; w<LK_BATCH; w++)
+                p1[w] = p2[w] = 0.0;
+
+            for (int b=0; b<4; b++) {
+                const double m1 = (a == b) ? nomuts[c1] : muts[c1];
+                const double m2 = (a == b) ? nomuts[c2] : muts[c2];
+                for (int w=0; w<LK_BATCH; w++) {
+                    p1[w] += inner[c1][b][w] * m1;
+                    p2[w] += inner[c2][b][w] * m2;
+                }
+            }
+
+            for (int w=0; w<LK_BATCH; w++)
+                inner[j][a][w] = p1[w] * p2[w];
+        }
+    }
+}
+
+
+// calculate outer partial likelihood tables for a batch of sites
+static void likelihood_batch_outer(
+    const LocalTree *tree, const int root,
+    const double *muts, const double *nomuts,
+    lk_batch *inner, lk_batch *outer)
+{
+    const LocalNode* nodes = tree->nodes;
     int queue[tree->nnodes];
     int top = 0;
 
     // process in preorder
-    int maintree_root = internal ? tree->nodes[tree->root].child[1] :
-        tree->root;
-    queue[top++] = maintree_root;
+    queue[top++] = root;
     while (top > 0) {
-        int node = queue[--top];
-        likelihood_site_node_outer(tree, maintree_root, node, seqs, pos,
-                                   muts, nomuts, outer, inner);
+        const int j = queue[--top];
+        if (!nodes[j].is_leaf()) {
+            queue[top++] = nodes[j].child[0];
+            queue[top++] = nodes[j].child[1];
+        }
 
-        // recurse
-        if (!tree->nodes[node].is_leaf()) {
-            queue[top++] = tree->nodes[node].child[0];
-            queue[top++] = tree->nodes[node].child[1];
+        if (j == root) {
+            // root case
+            for (int a=0; a<4; a++)
+                for (int w=0; w<LK_BATCH; w++)
+                    outer[j][a][w] = 1.0;
+            continue;
+        }
+
+        const int sib = tree->get_sibling(j);
+        const int parent = nodes[j].parent;
+        for (int a=0; a<4; a++) {
+            double p1[LK_BATCH], p2[LK_BATCH];
+            for (int w=0; w<LK_BATCH; w++)
+                p1[w] = p2[w] = 0.0;
+
+            for (int b=0; b<4; b++) {
+                const double m1 = (a == b) ? nomuts[sib] : muts[sib];
+                for (int w=0; w<LK_BATCH; w++)
+                    p1[w] += inner[sib][b][w] * m1;
+            }
+
+            if (parent != root) {
+                for (int b=0; b<4; b++) {
+                    const double m2 = (a == b) ?
+                        nomuts[parent] : muts[parent];
+                    for (int w=0; w<LK_BATCH; w++)
+                        p2[w] += outer[parent][b][w] * m2;
+                }
+                for (int w=0; w<LK_BATCH; w++)
+                    outer[j][a][w] = p1[w] * p2[w];
+            } else {
+                for (int w=0; w<LK_BATCH; w++)
+                    outer[j][a][w] = p1[w];
+            }
         }
     }
 }
 
 
+// Fills pos with the sites of a batch, repeating the last site if there
+// are fewer than LK_BATCH sites left
+static inline int get_batch_sites(const int *sites, int nsites, int batch,
+                                  int *pos)
+{
+    const int first = batch * LK_BATCH;
+    const int n = min(nsites - first, LK_BATCH);
+    for (int w=0; w<LK_BATCH; w++)
+        pos[w] = sites[first + min(w, n - 1)];
+    return n;
+}
+
+
+// blocks with fewer variant sites are not searched for repeated columns
+#define MIN_PATTERN_SITES 16
+
+
+// Groups sites with identical columns in the first nseqs sequences, so that
+// the partial likelihoods of each distinct column are computed once.
+// Fills 'patterns' with the first site of each distinct column and
+// 'site_patterns' with the index of the pattern of each site, and returns
+// the number of patterns.
+static int find_site_patterns(const char *const *seqs, const int nseqs,
+                              const int *sites, const int nsites,
+                              int *patterns, int *site_patterns)
+{
+    if (nsites < MIN_PATTERN_SITES) {
+        for (int s=0; s<nsites; s++) {
+            patterns[s] = sites[s];
+            site_patterns[s] = s;
+        }
+        return nsites;
+    }
+
+    // open addressing hash table of pattern indices
+    int size = 1;
+    while (size < 2 * nsites)
+        size *= 2;
+    vector<int> table(size, -1);
+    vector<uint64_t> hashes(nsites);
+    int npatterns = 0;
+
+    for (int s=0; s<nsites; s++) {
+        const int pos = sites[s];
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (int j=0; j<nseqs; j++)
+            h = (h ^ (unsigned char) seqs[j][pos]) * 0x100000001b3ULL;
+
+        int slot = int((h ^ (h >> 32)) & (size - 1));
+        for (; table[slot] != -1; slot = (slot + 1) & (size - 1)) {
+            // columns with the same hash are compared in full
+            const int k = table[slot];
+            if (hashes[k] != h)
+                continue;
+            const int pos2 = patterns[k];
+            int j = 0;
+            while (j < nseqs && seqs[j][pos] == seqs[j][pos2])
+                j++;
+            if (j == nseqs)
+                break;
+        }
+
+        if (table[slot] == -1) {
+            table[slot] = npatterns;
+            hashes[npatterns] = h;
+            patterns[npatterns++] = pos;
+        }
+        site_patterns[s] = table[slot];
+    }
+
+    return npatterns;
+}
+
+
+// calculate inner and outer partial likelihood tables of the given sites
 void calc_inner_outer(const LocalTree *tree, const ArgModel *model,
-                      const char *const *seqs, const int seqlen,
-                      const bool *invariant, bool internal,
-                      lk_row **inner, lk_row **outer)
+                      const char *const *seqs,
+                      const int *sites, const int nsites, bool internal,
+                      LikelihoodBatchTable &inner, LikelihoodBatchTable &outer)
 {
     // get postorder
     int norder = tree->nnodes;
     int order[tree->nnodes];
     tree->get_postorder(order);
 
-
     // get mutation probabilities and treelen
     double muts[tree->nnodes];
     double nomuts[tree->nnodes];
     prob_tree_mutation(tree, model, muts, nomuts);
 
-    // calculate emissions for tree at each site
-    for (int i=0; i<seqlen; i++) {
-        if (!invariant[i]) {
-            likelihood_site_inner(tree, seqs, i, order, norder,
-                                  muts, nomuts, inner[i]);
-            likelihood_site_outer(tree, seqs, i,
-                                  muts, nomuts, internal, inner[i], outer[i]);
-        }
+    const int maintree_root = internal ? tree->nodes[tree->root].child[1] :
+        tree->root;
+
+    // calculate partial likelihoods for each batch of sites
+    int pos[LK_BATCH];
+    for (int k=0; k<inner.nbatches; k++) {
+        get_batch_sites(sites, nsites, k, pos);
+        likelihood_batch_inner(tree, seqs, pos, order, norder,
+                               muts, nomuts, inner.get_batch(k));
+        likelihood_batch_outer(tree, maintree_root, muts, nomuts,
+                               inner.get_batch(k), outer.get_batch(k));
     }
 }
 
@@ -424,25 +581,49 @@ double likelihood_tree(const LocalTree *tree, const ArgModel *model,
     }
 
 
-    // calculate emissions for tree at each site
-    double lnl = 0.0;
+    // find variant sites and their distinct columns
+    vector<int> sites;
     for (int i=start; i<end; i++) {
-        double lk;
-        bool invariant = is_invariant_site(seqs, nseqs, i);
-
-        if (invariant && invariant_lk > 0)
-            // use precommuted invariant site likelihood
-            lk = invariant_lk;
-        else {
-            lk = likelihood_site_inner(tree, seqs, i, order, tree->nnodes,
-                                       muts, nomuts, table);
-
+        if (!is_invariant_site(seqs, nseqs, i)) {
+            sites.push_back(i);
+        } else if (invariant_lk < 0) {
             // save invariant likelihood
-            if (invariant)
-                invariant_lk = lk;
+            invariant_lk = likelihood_site_inner(
+                tree, seqs, i, order, tree->nnodes, muts, nomuts, table);
         }
+    }
+    const int nsites = sites.size();
+    vector<int> patterns(nsites + 1), site_patterns(nsites + 1);
+    const int npatterns = find_site_patterns(
+        seqs, tree->get_num_leaves(), &sites[0], nsites,
+        &patterns[0], &site_patterns[0]);
+
+    // calculate likelihood of each pattern in batches
+    vector<double> pattern_lk(npatterns + 1);
+    lk_batch inner[nnodes];
+    int pos[LK_BATCH];
+    for (int k=0; k*LK_BATCH<npatterns; k++) {
+        const int n = get_batch_sites(&patterns[0], npatterns, k, pos);
+        likelihood_batch_inner(tree, seqs, pos, order, tree->nnodes,
+                               muts, nomuts, inner);
+
+        // sum over root node
+        for (int w=0; w<n; w++) {
+            double p = 0.0;
+            for (int a=0; a<4; a++)
+                p += inner[tree->root][a][w]  * .25;
+            pattern_lk[k*LK_BATCH + w] = p;
+        }
+    }
 
-        lnl += log(lk);
+    // add site likelihoods in site order
+    double lnl = 0.0;
+    int s = 0;
+    for (int i=start; i<end; i++) {
+        if (s < nsites && sites[s] == i)
+            lnl += log(pattern_lk[site_patterns[s++]]);
+        else
+            lnl += log(invariant_lk);
     }
 
     return lnl;
@@ -456,7 +637,7 @@ double likelihood_tree(const LocalTree *tree, const ArgModel *model,
 
 void get_infinite_sites_states(const States &states, const LocalTree *tree,
                                const char *const *seqs, int nseqs, int seqlen,
-                               bool *invariant,
+                               const bool *invariant,
                                bool internal, bool **valid_states)
 {
     const int nstates = states.size();
@@ -592,7 +773,8 @@ void get_infinite_sites_states(const States &states, const LocalTree *tree,
 // calculate emissions for external branch resampling
 void calc_emissions(const States &states, const LocalTree *tree,
                     const char *const *seqs, int nseqs, int seqlen,
-                    const ArgModel *model, bool internal, double **emit)
+                    const ArgModel *model, bool internal, double **emit,
+                    const bool *site_invariant, const bool *site_masked)
 {
     const int nstates = states.size();
     const double mintime = model->get_mintime();
@@ -612,36 +794,50 @@ void calc_emissions(const States &states, const LocalTree *tree,
 
 
     // find invariant sites
-    bool *invariant = new bool [seqlen];
-    bool *masked = new bool [seqlen];
-    find_invariant_sites(seqs, nseqs, seqlen, invariant);
-    find_masked_sites(seqs, nseqs, seqlen, masked, invariant);
+    bool *invariant_buf = NULL;
+    bool *masked_buf = NULL;
+    const bool *invariant = site_invariant;
+    const bool *masked = site_masked;
+    if (!invariant) {
+        invariant_buf = new bool [seqlen];
+        masked_buf = new bool [seqlen];
+        find_invariant_sites(seqs, nseqs, seqlen, invariant_buf);
+        find_masked_sites(seqs, nseqs, seqlen, masked_buf, invariant_buf);
+        invariant = invariant_buf;
+        masked = masked_buf;
+    }
 
 
+    // find variant sites and their distinct columns among the leaves of
+    // the tree and the new leaf
+    int *sites = new int [seqlen];
+    int nsites = 0;
+    for (int i=0; i<seqlen; i++)
+        if (!invariant[i])
+            sites[nsites++] = i;
+    int *patterns = new int [nsites];
+    int *site_patterns = new int [nsites];
+    const int npatterns = find_site_patterns(
+        seqs, newleaf + (internal ? 0 : 1), sites, nsites,
+        patterns, site_patterns);
+    double *pattern_emit = new double [npatterns * nstates];
+    double *invariant_emit = new double [nstates];
+
     // compute inner and outer likelihood tables
-    LikelihoodTable inner(seqlen, tree->nnodes);
-    LikelihoodTable inner_subtree(seqlen, 1);
-    LikelihoodTable outer(seqlen, tree->nnodes);
-    calc_inner_outer(tree, model, seqs, seqlen, invariant, internal,
-                     inner.data, outer.data);
+    LikelihoodBatchTable inner(npatterns, tree->nnodes);
+    LikelihoodBatchTable inner_subtree(npatterns, 1);
+    LikelihoodBatchTable outer(npatterns, tree->nnodes);
+    calc_inner_outer(tree, model, seqs, patterns, npatterns, internal,
+                     inner, outer);
 
 
     if (!internal) {
         // compute inner table for new leaf
-        for (int i=0; i<seqlen; i++) {
-            const char c = seqs[newleaf][i];
-            if (c == 'N') {
-                inner_subtree.data[i][0][0] = 1.0;
-                inner_subtree.data[i][0][1] = 1.0;
-                inner_subtree.data[i][0][2] = 1.0;
-                inner_subtree.data[i][0][3] = 1.0;
-            } else {
-                inner_subtree.data[i][0][0] = 0.0;
-                inner_subtree.data[i][0][1] = 0.0;
-                inner_subtree.data[i][0][2] = 0.0;
-                inner_subtree.data[i][0][3] = 0.0;
-                inner_subtree.data[i][0][dna2int[(int) c]] = 1.0;
-            }
+        int pos[LK_BATCH];
+        for (int k=0; k<inner_subtree.nbatches; k++) {
+            get_batch_sites(patterns, npatterns, k, pos);
+            likelihood_batch_leaf(seqs[newleaf], pos,
+                                  inner_subtree.get_batch(k)[0]);
         }
     }
 
@@ -722,42 +918,63 @@ void calc_emissions(const States &states, const LocalTree *tree,
         // calculate invariant_lk
         double invariant_lk = .25 * exp(- model->mu * max(treelen, mintime));
 
-        // fill in row of emission table
-        for (int i=0; i<seqlen; i++) {
-            if (masked[i]) {
-                // masked site
-                emit[i][j] = 1.0;
-            } else if (invariant[i]) {
-                // invariant site
-                emit[i][j] = invariant_lk;
-            } else {
-                // variant site
-                lk_row *in = inner.data[i];
-                lk_row *out = outer.data[i];
-                lk_row *in2 = internal ? in : inner_subtree.data[i];
-
-                emit[i][j] = 0.0;
-                for (int a=0; a<4; a++) {
-                    double p1 = 0.0, p2 = 0.0, p3 = 0.0;
-                    for (int b=0; b<4; b++) {
-                        if (a == b) {
-                            p1 += in2[node1][b] * nomut1;
-                            p2 += in[node2][b] * nomut2;
-                            p3 += out[node2][b] * nomut3;
-                        } else {
-                            p1 += in2[node1][b] * mut1;
-                            p2 += in[node2][b] * mut2;
-                            p3 += out[node2][b] * mut3;
-                        }
-                    }
+        // invariant sites
+        invariant_emit[j] = invariant_lk;
+
+        // variant site patterns
+        for (int k=0; k<inner.nbatches; k++) {
+            lk_batch *in = inner.get_batch(k);
+            lk_batch *out = outer.get_batch(k);
+            lk_batch *in2 = internal ? in : inner_subtree.get_batch(k);
+
+            double lk[LK_BATCH];
+            for (int w=0; w<LK_BATCH; w++)
+                lk[w] = 0.0;
 
-                    if (node2 != maintree_root) {
-                        emit[i][j] += p1 * p2 * p3 * .25;
-                    } else {
-                        emit[i][j] += p1 * p2 * .25;
+            for (int a=0; a<4; a++) {
+                double p1[LK_BATCH], p2[LK_BATCH], p3[LK_BATCH];
+                for (int w=0; w<LK_BATCH; w++)
+                    p1[w] = p2[w] = p3[w] = 0.0;
+
+                for (int b=0; b<4; b++) {
+                    const double m1 = (a == b) ? nomut1 : mut1;
+                    const double m2 = (a == b) ? nomut2 : mut2;
+                    const double m3 = (a == b) ? nomut3 : mut3;
+                    for (int w=0; w<LK_BATCH; w++) {
+                        p1[w] += in2[node1][b][w] * m1;
+                        p2[w] += in[node2][b][w] * m2;
+                        p3[w] += out[node2][b][w] * m3;
                     }
                 }
+
+                if (node2 != maintree_root) {
+                    for (int w=0; w<LK_BATCH; w++)
+                        lk[w] += p1[w] * p2[w] * p3[w] * .25;
+                } else {
+                    for (int w=0; w<LK_BATCH; w++)
+                        lk[w] += p1[w] * p2[w] * .25;
+                }
             }
+
+            const int first = k * LK_BATCH;
+            const int n = min(npatterns - first, LK_BATCH);
+            for (int w=0; w<n; w++)
+                pattern_emit[(first + w) * nstates + j] = lk[w];
+        }
+    }
+
+    // fill in emission table one site at a time from the emissions of its
+    // pattern
+    for (int i=0, s=0; i<seqlen; i++) {
+        if (masked[i]) {
+            // masked site
+            for (int j=0; j<nstates; j++)
+                emit[i][j] = 1.0;
+        } else {
+            const double *row = invariant[i] ?
+                invariant_emit : &pattern_emit[site_patterns[s++] * nstates];
+            for (int j=0; j<nstates; j++)
+                emit[i][j] = row[j];
         }
     }
 
@@ -778,24 +995,35 @@ void calc_emissions(const States &states, const LocalTree *tree,
 
 
     // clean up
-    delete [] invariant;
-    delete [] masked;
+    delete [] sites;
+    delete [] patterns;
+    delete [] site_patterns;
+    delete [] pattern_emit;
+    delete [] invariant_emit;
+    delete [] invariant_buf;
+    delete [] masked_buf;
 }
 
 // calculate emissions for external branch resampling
 void calc_emissions_external(const States &states, const LocalTree *tree,
                              const char *const *seqs, int nseqs, int seqlen,
-                             const ArgModel *model, double **emit)
+                             const ArgModel *model, double **emit,
+                             const bool *site_invariant,
+                             const bool *site_masked)
 {
-    calc_emissions(states, tree, seqs, nseqs, seqlen, model, false, emit);
+    calc_emissions(states, tree, seqs, nseqs, seqlen, model, false, emit,
+                   site_invariant, site_masked);
 }
 
 // calculate emissions for internal branch resampling
 void calc_emissions_internal(const States &states, const LocalTree *tree,
                              const char *const *seqs, int nseqs, int seqlen,
-                             const ArgModel *model, double **emit)
+                             const ArgModel *model, double **emit,
+                             const bool *site_invariant,
+                             const bool *site_masked)
 {
-    calc_emissions(states, tree, seqs, nseqs, seqlen, model, true, emit);
+    calc_emissions(states, tree, seqs, nseqs, seqlen, model, true, emit,
+                   site_invariant, site_masked);
 }
 
 
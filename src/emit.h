@@ -18,17 +18,38 @@ void parsimony_ancestral_set(const LocalTree *tree, const char * const *seqs,
                              char *ancestral);
 int parsimony_cost_seq(const LocalTree *tree, const char * const *seqs,
                        int nseqs, int pos, int *postorder);
+
+// Emissions for one block.  If given, site_invariant and site_masked are the
+// invariant and masked flags of the block's sites among seqs (see
+// find_block_site_flags) and are not recomputed.
 void calc_emissions_external(const States &states, const LocalTree *tree,
                              const char * const*seqs, int nseqs, int seqlen,
-                             const ArgModel *model, double **emit);
+                             const ArgModel *model, double **emit,
+                             const bool *site_invariant=NULL,
+                             const bool *site_masked=NULL);
 void calc_emissions_internal(const States &states, const LocalTree *tree,
                              const char *const *seqs, int nseqs, int seqlen,
-                             const ArgModel *model, double **emit);
+                             const ArgModel *model, double **emit,
+                             const bool *site_invariant=NULL,
+                             const bool *site_masked=NULL);
 
 double likelihood_tree(const LocalTree *tree, const ArgModel *model,
                        const char *const *seqs, const int nseqs,
                        const int start, const int end);
 
+// Emissions computed by adding the new branch to the tree for each state.
+// Slow, but useful for testing against.
+void calc_emissions_external_slow(
+    const States &states, const LocalTree *tree,
+    const char *const *seqs, int nseqs, int seqlen,
+    const ArgModel *model, double **emit);
+void calc_emissions_internal_slow(
+    const States &states, const LocalTree *tree,
+    const char *const *seqs, int nseqs, int seqlen,
+    const ArgModel *model, double **emit);
+
+int count_noncompat(const LocalTree *tree, const char * const *seqs,
+                    int nseqs, int seqlen, int *postorder);
 int count_noncompat(const LocalTrees *trees, const char * const *seqs,
                     int nseqs, int seqlen);
 
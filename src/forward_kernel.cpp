@@ -0,0 +1,277 @@
+//=============================================================================
+// Vectorized kernels for the forward algorithm within one block
+//
+// The same kernel body (forward_kernel.inl) is compiled once for each
+// supported instruction set and the best one is chosen at runtime.
+
+#include "forward_kernel.h"
+
+
+#if defined(__GNUC__) && !defined(__clang__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#   define ARGWEAVER_FORWARD_SIMD
+#   include <immintrin.h>
+#endif
+
+
+namespace argweaver {
+
+
+//=============================================================================
+// scalar kernel
+
+
+// Computes one branch of a forward column
+//
+//   c2[k] = (tf[k] + sum_j t2[j][k] * c1[j]) * e[k]
+//
+// where t2 is a (len x len) row-major matrix.
+static inline void forward_branch_scalar(
+    const int len, const double *tf, const double *t2,
+    const double *c1, const double *e, double *c2)
+{
+    for (int k=0; k<len; k++) {
+        double sum = tf[k];
+        for (int j=0; j<len; j++)
+            sum += t2[j*len + k] * c1[j];
+        c2[k] = sum * e[k];
+    }
+}
+
+
+static inline double sum_array_scalar(const double *x, const int n)
+{
+    double sum = 0.0;
+    for (int i=0; i<n; i++)
+        sum += x[i];
+    return sum;
+}
+
+
+#define FORWARD_COLUMNS_FUNC forward_columns_scalar
+#define FORWARD_BRANCH_FUNC forward_branch_scalar
+#define FORWARD_SUM_FUNC sum_array_scalar
+#include "forward_kernel.inl"
+#undef FORWARD_COLUMNS_FUNC
+#undef FORWARD_BRANCH_FUNC
+#undef FORWARD_SUM_FUNC
+
+
+#ifdef ARGWEAVER_FORWARD_SIMD
+
+//=============================================================================
+// AVX2 kernel
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+
+// Returns a mask selecting the first n (< 4) lanes
+static inline __m256i tail_mask_avx2(const int n)
+{
+    return _mm256_cmpgt_epi64(_mm256_set1_epi64x(n),
+                              _mm256_set_epi64x(3, 2, 1, 0));
+}
+
+
+// Same as forward_branch_scalar, four destination states at a time.
+// Each lane accumulates over j in order.
+static inline void forward_branch_avx2(
+    const int len, const double *tf, const double *t2,
+    const double *c1, const double *e, double *c2)
+{
+    int k = 0;
+    for (; k + 4 <= len; k += 4) {
+        __m256d sum = _mm256_loadu_pd(&tf[k]);
+        const double *t = &t2[k];
+        for (int j=0; j<len; j++, t += len)
+            sum = _mm256_fmadd_pd(_mm256_loadu_pd(t),
+                                  _mm256_broadcast_sd(&c1[j]), sum);
+        _mm256_storeu_pd(&c2[k], _mm256_mul_pd(sum, _mm256_loadu_pd(&e[k])));
+    }
+
+    if (k < len) {
+        const __m256i mask = tail_mask_avx2(len - k);
+        __m256d sum = _mm256_maskload_pd(&tf[k], mask);
+        const double *t = &t2[k];
+        for (int j=0; j<len; j++, t += len)
+            sum = _mm256_fmadd_pd(_mm256_maskload_pd(t, mask),
+                                  _mm256_broadcast_sd(&c1[j]), sum);
+        _mm256_maskstore_pd(&c2[k], mask,
+            _mm256_mul_pd(sum, _mm256_maskload_pd(&e[k], mask)));
+    }
+}
+
+
+static inline double hsum_avx2(const __m256d x)
+{
+    __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(x),
+                             _mm256_extractf128_pd(x, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+}
+
+
+static inline double sum_array_avx2(const double *x, const int n)
+{
+    __m256d sum = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+        sum = _mm256_add_pd(sum, _mm256_loadu_pd(&x[i]));
+    if (i < n)
+        sum = _mm256_add_pd(sum, _mm256_maskload_pd(&x[i],
+                                                     tail_mask_avx2(n - i)));
+    return hsum_avx2(sum);
+}
+
+
+#define FORWARD_COLUMNS_FUNC forward_columns_avx2
+#define FORWARD_BRANCH_FUNC forward_branch_avx2
+#define FORWARD_SUM_FUNC sum_array_avx2
+#include "forward_kernel.inl"
+#undef FORWARD_COLUMNS_FUNC
+#undef FORWARD_BRANCH_FUNC
+#undef FORWARD_SUM_FUNC
+
+#pragma GCC pop_options
+
+
+//=============================================================================
+// AVX-512 kernel
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx2,fma")
+
+// Same as forward_branch_scalar, eight destination states at a time.
+// Each lane accumulates over j in order.
+static inline void forward_branch_avx512(
+    const int len, const double *tf, const double *t2,
+    const double *c1, const double *e, double *c2)
+{
+    for (int k=0; k<len; k += 8) {
+        const __mmask8 mask = (len - k >= 8) ? 0xff :
+            (__mmask8) ((1 << (len - k)) - 1);
+        __m512d sum = _mm512_maskz_loadu_pd(mask, &tf[k]);
+        const double *t = &t2[k];
+        for (int j=0; j<len; j++, t += len)
+            sum = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, t),
+                                  _mm512_set1_pd(c1[j]), sum);
+        _mm512_mask_storeu_pd(&c2[k], mask, _mm512_mul_pd(
+            sum, _mm512_maskz_loadu_pd(mask, &e[k])));
+    }
+}
+
+
+static inline double sum_array_avx512(const double *x, const int n)
+{
+    __m512d sum = _mm512_setzero_pd();
+    for (int i=0; i<n; i += 8) {
+        const __mmask8 mask = (n - i >= 8) ? 0xff :
+            (__mmask8) ((1 << (n - i)) - 1);
+        sum = _mm512_add_pd(sum, _mm512_maskz_loadu_pd(mask, &x[i]));
+    }
+    return hsum_avx2(_mm256_add_pd(
+        _mm512_maskz_extractf64x4_pd(0xff, sum, 0),
+        _mm512_maskz_extractf64x4_pd(0xff, sum, 1)));
+}
+
+
+#define FORWARD_COLUMNS_FUNC forward_columns_avx512
+#define FORWARD_BRANCH_FUNC forward_branch_avx512
+#define FORWARD_SUM_FUNC sum_array_avx512
+#include "forward_kernel.inl"
+#undef FORWARD_COLUMNS_FUNC
+#undef FORWARD_BRANCH_FUNC
+#undef FORWARD_SUM_FUNC
+
+#pragma GCC pop_options
+
+#endif // ARGWEAVER_FORWARD_SIMD
+
+
+//=============================================================================
+// kernel selection
+
+static ForwardKernel g_forward_kernel = FORWARD_KERNEL_AUTO;
+
+
+// Returns true if kernel is supported by this cpu
+bool has_forward_kernel(ForwardKernel kernel)
+{
+    switch (kernel) {
+    case FORWARD_KERNEL_AUTO:
+    case FORWARD_KERNEL_SCALAR:
+        return true;
+#ifdef ARGWEAVER_FORWARD_SIMD
+    case FORWARD_KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2") &&
+            __builtin_cpu_supports("fma");
+    case FORWARD_KERNEL_AVX512:
+        return __builtin_cpu_supports("avx512f") &&
+            has_forward_kernel(FORWARD_KERNEL_AVX2);
+#endif
+    default:
+        return false;
+    }
+}
+
+
+// Returns the best kernel supported by this cpu
+static ForwardKernel find_forward_kernel()
+{
+    if (has_forward_kernel(FORWARD_KERNEL_AVX512))
+        return FORWARD_KERNEL_AVX512;
+    if (has_forward_kernel(FORWARD_KERNEL_AVX2))
+        return FORWARD_KERNEL_AVX2;
+    return FORWARD_KERNEL_SCALAR;
+}
+
+
+bool set_forward_kernel(ForwardKernel kernel)
+{
+    if (!has_forward_kernel(kernel))
+        return false;
+    if (kernel == FORWARD_KERNEL_AUTO)
+        kernel = find_forward_kernel();
+    g_forward_kernel = kernel;
+    return true;
+}
+
+
+ForwardKernel get_forward_kernel()
+{
+    if (g_forward_kernel == FORWARD_KERNEL_AUTO)
+        g_forward_kernel = find_forward_kernel();
+    return g_forward_kernel;
+}
+
+
+ForwardColumnsFunc get_forward_columns_func(ForwardKernel kernel)
+{
+    if (kernel == FORWARD_KERNEL_AUTO)
+        kernel = get_forward_kernel();
+
+    switch (kernel) {
+#ifdef ARGWEAVER_FORWARD_SIMD
+    case FORWARD_KERNEL_AVX2:
+        return forward_columns_avx2;
+    case FORWARD_KERNEL_AVX512:
+        return forward_columns_avx512;
+#endif
+    default:
+        return forward_columns_scalar;
+    }
+}
+
+
+const char *get_forward_kernel_name(ForwardKernel kernel)
+{
+    switch (kernel) {
+    case FORWARD_KERNEL_AUTO:   return "auto";
+    case FORWARD_KERNEL_SCALAR: return "scalar";
+    case FORWARD_KERNEL_AVX2:   return "avx2";
+    case FORWARD_KERNEL_AVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+
+} // namespace argweaver
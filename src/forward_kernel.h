@@ -0,0 +1,113 @@
+//=============================================================================
+// Vectorized kernels for the forward algorithm within one block
+
+#ifndef ARGWEAVER_FORWARD_KERNEL_H
+#define ARGWEAVER_FORWARD_KERNEL_H
+
+#include <stddef.h>
+#include <vector>
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+// Instruction sets available for the forward block kernel
+enum ForwardKernel {
+    FORWARD_KERNEL_AUTO=0,   // choose best kernel supported by the cpu
+    FORWARD_KERNEL_SCALAR,
+    FORWARD_KERNEL_AVX2,
+    FORWARD_KERNEL_AVX512
+};
+
+
+// Computes columns 1..blocklen-1 of the forward table for one block.
+//
+// The state space is described by its branches: states of the same branch
+// are contiguous in the state space and their times increase by one.
+// Branch i has states [branch_start[i], branch_start[i] + branch_len[i])
+// with times starting at branch_age[i].
+//
+// tmatrix:  (ntimes x ntimes) row-major, transition terms between times
+//           for differing branches
+// tmatrix2: additional transition terms for remaining on the same branch,
+//           packed as one (len x len) row-major matrix per branch
+typedef void (*ForwardColumnsFunc)(
+    const int ntimes, const int nstates, const int blocklen,
+    const double *tmatrix, const double *tmatrix2,
+    const int nbranches, const int *branch_start, const int *branch_len,
+    const int *branch_age,
+    const double* const *emit, double **fw);
+
+
+// Temporaries of arghmm_forward_block and of the traceback.  Buffers only
+// grow, so a workspace reused across blocks stops allocating once it has
+// seen the largest block.  Each thread running the forward algorithm needs
+// its own.
+class ForwardWorkspace
+{
+public:
+    // Makes room for a block of a tree with nnodes nodes
+    void reserve(int ntimes, int nnodes)
+    {
+        grow(tmatrix, ntimes * ntimes);
+        grow(branch_start, nnodes);
+        grow(branch_len, nnodes);
+        grow(branch_age, nnodes);
+    }
+
+    // Makes room for sampling a traceback through nstates states
+    void reserve_traceback(int ntimes, int nstates)
+    {
+        grow(weights, nstates);
+        grow(weight_sums, (nstates + 3) / 4);
+        grow(trans_col, nstates);
+        grow(time_trans, ntimes);
+        grow(column, nstates);
+    }
+
+    template <class T>
+    static T *grow(vector<T> &buf, int size)
+    {
+        if (int(buf.size()) < size)
+            buf.resize(size);
+        return buf.empty() ? NULL : &buf[0];
+    }
+
+    vector<double> tmatrix;   // (ntimes x ntimes)
+    vector<double> tmatrix2;  // same branch terms, packed by branch
+    vector<int> branch_start;
+    vector<int> branch_len;
+    vector<int> branch_age;
+    vector<double> trans;     // dense (nstates x nstates) for forward runs
+
+    // traceback
+    vector<double> weights;      // weights of the states of a column
+    vector<double> weight_sums;  // weights summed in blocks of four
+    vector<double> trans_col;    // transitions into the next state
+    vector<double> time_trans;   // the same by time of the other branches
+    vector<double> column;       // copy of a forward column
+};
+
+
+// Returns true if kernel is supported by this cpu
+bool has_forward_kernel(ForwardKernel kernel);
+
+// Selects the kernel used by arghmm_forward_block.
+// Returns false if kernel is not supported by this cpu.
+bool set_forward_kernel(ForwardKernel kernel);
+
+// Returns the currently selected kernel (never FORWARD_KERNEL_AUTO)
+ForwardKernel get_forward_kernel();
+
+// Returns the function implementing a kernel
+ForwardColumnsFunc get_forward_columns_func(
+    ForwardKernel kernel=FORWARD_KERNEL_AUTO);
+
+const char *get_forward_kernel_name(ForwardKernel kernel);
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_FORWARD_KERNEL_H
@@ -0,0 +1,61 @@
+// Body of a forward block kernel.
+//
+// This file is included by forward_kernel.cpp once per instruction set with
+// FORWARD_COLUMNS_FUNC defined as the kernel name and FORWARD_BRANCH_FUNC
+// and FORWARD_SUM_FUNC defined as the instruction set specific helpers.
+// Sums over the previous column are accumulated in the same order as in
+// arghmm_forward_block_slow, only the normalization constant may be summed
+// in a different order.
+
+static void FORWARD_COLUMNS_FUNC(
+    const int ntimes, const int nstates, const int blocklen,
+    const double *__restrict tmatrix, const double *__restrict tmatrix2,
+    const int nbranches, const int *branch_start, const int *branch_len,
+    const int *branch_age,
+    const double* const *emit, double **fw)
+{
+    double fgroups[ntimes];
+    double tmatrix_fgroups[ntimes];
+
+    for (int i=1; i<blocklen; i++) {
+        const double *__restrict col1 = fw[i-1];
+        double *__restrict col2 = fw[i];
+        const double *__restrict emit2 = emit[i];
+
+        // precompute the fgroup sums, one branch at a time
+        for (int a=0; a<ntimes; a++)
+            fgroups[a] = 0.0;
+        for (int n=0; n<nbranches; n++) {
+            const int len = branch_len[n];
+            const double *__restrict c1 = &col1[branch_start[n]];
+            double *__restrict f = &fgroups[branch_age[n]];
+            for (int j=0; j<len; j++)
+                f[j] += c1[j];
+        }
+
+        // multiply tmatrix and fgroups together, one row at a time
+        for (int b=0; b<ntimes-1; b++)
+            tmatrix_fgroups[b] = 0.0;
+        for (int a=0; a<ntimes-1; a++) {
+            const double f = fgroups[a];
+            const double *__restrict row = &tmatrix[a*ntimes];
+            for (int b=0; b<ntimes-1; b++)
+                tmatrix_fgroups[b] += row[b] * f;
+        }
+
+        // fill in one column of forward table, one branch at a time
+        const double *t2 = tmatrix2;
+        for (int n=0; n<nbranches; n++) {
+            const int start = branch_start[n];
+            const int len = branch_len[n];
+            FORWARD_BRANCH_FUNC(len, &tmatrix_fgroups[branch_age[n]], t2,
+                                &col1[start], &emit2[start], &col2[start]);
+            t2 += len * len;
+        }
+
+        // normalize column for numerical stability
+        const double scale = 1.0 / FORWARD_SUM_FUNC(col2, nstates);
+        for (int k=0; k<nstates; k++)
+            col2[k] *= scale;
+    }
+}
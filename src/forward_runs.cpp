@@ -0,0 +1,117 @@
+//=============================================================================
+// Forward algorithm across runs of identical emissions
+//
+// Within a block the forward algorithm applies the same linear operator
+// B = trans * diag(emit) to every column whose emission row is shared (see
+// new_block_emissions).  A run of len such columns can therefore be
+// advanced with the power B^len, computed by repeated squaring.  This costs
+// O(nstates^3 log(len)) instead of O(len) column updates, so it only pays
+// off for long runs and small state spaces.
+
+#include "forward_runs.h"
+
+#include "common.h"
+
+
+namespace argweaver {
+
+
+bool use_forward_run(ForwardRunMode mode, int len, int nstates,
+                     double step_cost)
+{
+    switch (mode) {
+    case FORWARD_RUNS_OFF:
+        return false;
+    case FORWARD_RUNS_ALWAYS:
+        return len > 0;
+    case FORWARD_RUNS_AUTO:
+        break;
+    }
+
+    int nsquares = 0;
+    while ((len >> (nsquares + 1)) > 0)
+        nsquares++;
+    const double n = nstates;
+    const double power_cost = nsquares * n * n * n + (nsquares + 2) * n * n;
+    return power_cost < len * step_cost;
+}
+
+
+// c = a b for (n x n) row-major matrices
+static void mult_matrix(const int n, const double *a, const double *b,
+                        double *c)
+{
+    fill(c, c + n*n, 0.0);
+    for (int i=0; i<n; i++) {
+        double *ci = &c[i*n];
+        for (int j=0; j<n; j++) {
+            const double aij = a[i*n + j];
+            if (aij == 0.0)
+                continue;
+            const double *bj = &b[j*n];
+            for (int k=0; k<n; k++)
+                ci[k] += aij * bj[k];
+        }
+    }
+}
+
+
+// y = x a for a (n x n) row-major matrix
+static void mult_vector(const int n, const double *x, const double *a,
+                        double *y)
+{
+    fill(y, y + n, 0.0);
+    for (int j=0; j<n; j++) {
+        const double xj = x[j];
+        const double *aj = &a[j*n];
+        for (int k=0; k<n; k++)
+            y[k] += xj * aj[k];
+    }
+}
+
+
+double forward_run_power(int nstates, int len, const double *trans,
+                         const double *emit, const double *col1,
+                         double *col2)
+{
+    const int n = nstates;
+    vector<double> power(n*n), tmp(n*n);
+    vector<double> vec(col1, col1 + n), vec2(n);
+
+    for (int j=0; j<n; j++)
+        for (int k=0; k<n; k++)
+            power[j*n + k] = trans[j*n + k] * emit[k];
+
+    // invariants: col1 B^m = exp(log_scale) vec for the bits m of len
+    // consumed so far, and B^(2^b) = exp(power_scale) power
+    double log_scale = 0.0;
+    double power_scale = 0.0;
+    for (int bits=len; bits > 0; bits >>= 1) {
+        if (bits & 1) {
+            mult_vector(n, &vec[0], &power[0], &vec2[0]);
+            double total = 0.0;
+            for (int k=0; k<n; k++)
+                total += vec2[k];
+            for (int k=0; k<n; k++)
+                vec[k] = vec2[k] / total;
+            log_scale += log(total) + power_scale;
+        }
+
+        if (bits > 1) {
+            // square the power, rescaled to avoid underflow
+            mult_matrix(n, &power[0], &power[0], &tmp[0]);
+            double top = 0.0;
+            for (int i=0; i<n*n; i++)
+                top = max(top, tmp[i]);
+            for (int i=0; i<n*n; i++)
+                power[i] = tmp[i] / top;
+            power_scale = 2.0 * power_scale + log(top);
+        }
+    }
+
+    std::copy(vec.begin(), vec.end(), col2);
+    return log_scale;
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,68 @@
+//=============================================================================
+// Forward algorithm across runs of identical emissions
+
+#ifndef ARGWEAVER_FORWARD_RUNS_H
+#define ARGWEAVER_FORWARD_RUNS_H
+
+#include <vector>
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+// When to advance the forward algorithm across a run of identical
+// emission rows with a matrix power instead of one column at a time
+enum ForwardRunMode {
+    FORWARD_RUNS_OFF=0,  // always compute every column
+    FORWARD_RUNS_AUTO,   // use matrix powers when they are expected to be
+                         // cheaper than computing the columns
+    FORWARD_RUNS_ALWAYS  // use matrix powers for every run (for testing)
+};
+
+
+// A run of forward columns that was advanced with a matrix power.
+//
+// Columns start+1..start+len of the forward table share one emission row.
+// Only columns start and start+len are computed, the columns in between
+// are recomputed by the traceback if it needs them.
+//
+// With B[j][k] = trans[j][k] * emit[k], the forward columns satisfy
+//
+//   fw[start] B^len = exp(log_scale) fw[start+len]
+//
+class ForwardRun
+{
+public:
+    ForwardRun() :
+        start(0), len(0), log_scale(0.0)
+    {}
+
+    int start;
+    int len;
+    double log_scale;
+    vector<double> emit;  // shared emission row
+    vector<double> diag;  // diagonal of B
+};
+
+typedef vector<ForwardRun> ForwardRuns;
+
+
+// Returns true if a run of len columns with nstates states should be
+// advanced with a matrix power under mode, given that computing one column
+// directly costs about step_cost operations
+bool use_forward_run(ForwardRunMode mode, int len, int nstates,
+                     double step_cost);
+
+// Computes col2 = col1 B^len / Z with B[j][k] = trans[j][k] * emit[k],
+// where trans is (nstates x nstates) row-major and col2 is normalized to
+// sum to one.  Returns log(Z).
+double forward_run_power(int nstates, int len, const double *trans,
+                         const double *emit, const double *col1,
+                         double *col2);
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_FORWARD_RUNS_H
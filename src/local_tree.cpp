@@ -4,6 +4,7 @@
 #include "stdio.h"
 
 // argweaver includes
+#include "binary_trees.h"
 #include "compress.h"
 #include "common.h"
 #include "local_tree.h"
@@ -327,8 +328,14 @@ LocalTrees::LocalTrees(int **ptrees, int**ages, int **isprs, int *blocklens,
     if (capacity < nnodes)
         capacity = nnodes;
 
+    // all nodes are kept in one arena
+    LocalNodeArena *arena = NULL;
+    if (ntrees > 0)
+        arena = new LocalNodeArena(ntrees * capacity);
+
     // copy data
     int pos = start;
+    trees.reserve(ntrees);
     for (int i=0; i<ntrees; i++) {
         end_coord = pos + blocklens[i];
 
@@ -339,9 +346,10 @@ LocalTrees::LocalTrees(int **ptrees, int**ages, int **isprs, int *blocklens,
             make_node_mapping(ptrees[i-1], nnodes, isprs[i][0], mapping);
         }
 
-        trees.push_back(LocalTreeSpr(new LocalTree(ptrees[i], nnodes, ages[i],
-                                                   capacity),
-                                     isprs[i], blocklens[i], mapping));
+        LocalTree *tree = new LocalTree();
+        tree->set_arena(arena, i * capacity, capacity);
+        tree->set_ptree(ptrees[i], nnodes, ages[i]);
+        trees.push_back(LocalTreeSpr(tree, isprs[i], blocklens[i], mapping));
 
         pos = end_coord;
     }
@@ -351,10 +359,16 @@ LocalTrees::LocalTrees(int **ptrees, int**ages, int **isprs, int *blocklens,
 
 
 // Copy tree structure from another tree
+//
+// The nodes of all trees are copied into one arena.  The arena, local trees
+// and node mappings already allocated by this object are reused when
+// possible, so that repeatedly copying between the same two sets of local
+// trees (e.g. saving and restoring during MCMC) does not allocate.
 void LocalTrees::copy(const LocalTrees &other)
 {
-    // clear previous data
-    clear();
+    // existing allocations can only be reused for trees of the same size
+    if (nnodes != other.nnodes)
+        clear();
 
     // copy over information
     chrom = other.chrom;
@@ -363,22 +377,71 @@ void LocalTrees::copy(const LocalTrees &other)
     nnodes = other.nnodes;
     seqids = other.seqids;
 
+    // each tree gets a slot large enough for any of the trees
+    const int ntrees = other.get_num_trees();
+    int capacity = 1;
+    for (const_iterator it=other.begin(); it != other.end(); ++it)
+        capacity = max(capacity, it->tree->capacity);
+
+    // reuse our arena if no other trees use it and it is large enough
+    LocalNodeArena *arena = trees.empty() ? NULL : trees.front().tree->arena;
+    if (arena) {
+        int refs = 0;
+        for (iterator it=begin(); it != end(); ++it)
+            if (it->tree->arena == arena)
+                refs++;
+        if (refs != arena->get_refs() || arena->size < ntrees * capacity)
+            arena = NULL;
+    }
+    if (!arena && ntrees > 0)
+        arena = new LocalNodeArena(ntrees * capacity);
+
     // copy local trees
+    trees.reserve(ntrees);
+    iterator it2 = begin();
     for (const_iterator it=other.begin(); it != other.end(); ++it) {
+        const int i = it.index;
         const int nnodes = it->tree->nnodes;
-        LocalTree *tree2 = new LocalTree();
-        tree2->copy(*it->tree);
+        const int *mapping = it->mapping;
 
-        int *mapping = it->mapping;
-        int *mapping2 = NULL;
-        if (mapping) {
-            mapping2 = new int [nnodes];
-            for (int i=0; i<nnodes; i++)
-                mapping2[i] = mapping[i];
+        if (it2 == end()) {
+            // allocate a new local tree
+            LocalTree *tree2 = new LocalTree();
+            tree2->set_arena(arena, i * capacity, capacity);
+            tree2->copy(*it->tree);
+
+            int *mapping2 = NULL;
+            if (mapping) {
+                mapping2 = new int [nnodes];
+                std::copy(mapping, mapping + nnodes, mapping2);
+            }
+
+            trees.push_back(LocalTreeSpr(tree2, it->spr, it->blocklen,
+                                         mapping2));
+            it2 = end();
+            continue;
         }
 
-        trees.push_back(LocalTreeSpr(tree2, it->spr, it->blocklen, mapping2));
+        // reuse existing local tree
+        it2->tree->set_arena(arena, i * capacity, capacity);
+        it2->tree->copy(*it->tree);
+        if (mapping) {
+            if (!it2->mapping)
+                it2->mapping = new int [nnodes];
+            std::copy(mapping, mapping + nnodes, it2->mapping);
+        } else if (it2->mapping) {
+            delete [] it2->mapping;
+            it2->mapping = NULL;
+        }
+        it2->spr = it->spr;
+        it2->blocklen = it->blocklen;
+        ++it2;
     }
+
+    // remove unused local trees
+    for (iterator it=it2; it != end(); ++it)
+        it->clear();
+    trees.erase(trees.begin() + it2.index, trees.end());
 }
 
 
@@ -450,7 +513,7 @@ bool remove_null_spr(LocalTrees *trees, LocalTrees::iterator it)
     // delete this tree
     it2->blocklen += it->blocklen;
     it->clear();
-    trees->trees.erase(it);
+    trees->erase(it);
 
     return true;
 }
@@ -460,11 +523,10 @@ bool remove_null_spr(LocalTrees *trees, LocalTrees::iterator it)
 // Removes trees with null SPRs from the local trees
 void remove_null_sprs(LocalTrees *trees)
 {
+    // a removed tree is replaced by the next one at the same position
     for (LocalTrees::iterator it=trees->begin(); it != trees->end();) {
-        LocalTrees::iterator it2 = it;
-        ++it2;
-        remove_null_spr(trees, it);
-        it = it2;
+        if (!remove_null_spr(trees, it))
+            ++it;
     }
 }
 
@@ -508,8 +570,9 @@ LocalTrees *partition_local_trees(LocalTrees *trees, int pos,
     trees2->seqids.insert(trees2->seqids.end(), trees->seqids.begin(),
                           trees->seqids.end());
 
-    // splice trees over
-    trees2->trees.splice(trees2->begin(), trees->trees, it, trees->end());
+    // move trees over
+    trees2->trees.assign(trees->trees.begin() + it.index, trees->trees.end());
+    trees->trees.erase(trees->trees.begin() + it.index, trees->trees.end());
 
     LocalTrees::iterator it2 = trees2->begin();
     if (trim) {
@@ -556,8 +619,7 @@ LocalTrees *partition_local_trees(LocalTrees *trees, int pos, bool trim)
                                             trees->nnodes);
         trees2->seqids.insert(trees2->seqids.end(), trees->seqids.begin(),
                               trees->seqids.end());
-        trees2->trees.splice(trees2->begin(), trees->trees,
-                             trees->begin(), trees->end());
+        trees2->trees.swap(trees->trees);
         trees->end_coord = pos;
         return trees2;
     }
@@ -755,8 +817,9 @@ void append_local_trees(LocalTrees *trees, LocalTrees *trees2, bool merge)
     // move trees2 onto end of trees
     LocalTrees::iterator it = trees->end();
     --it;
-    trees->trees.splice(trees->end(),
-                        trees2->trees, trees2->begin(), trees2->end());
+    trees->trees.insert(trees->trees.end(),
+                        trees2->trees.begin(), trees2->trees.end());
+    trees2->trees.clear();
     trees->end_coord = trees2->end_coord;
     trees2->end_coord = trees2->start_coord;
 
@@ -1362,6 +1425,66 @@ void write_local_trees(FILE *out, const LocalTrees *trees,
 }
 
 
+// Renumber nodes so that each node keeps its id from one tree to the next,
+// as in the files written by write_local_trees().  Reading back a written
+// ARG then gives the same node ids as the trees in memory.
+void renumber_local_trees(LocalTrees *trees)
+{
+    const int nnodes = trees->nnodes;
+    vector<int> total_mapping(nnodes);
+    vector<int> next_mapping(nnodes);
+    vector<LocalNode> nodes(nnodes);
+    for (int i=0; i<nnodes; i++)
+        total_mapping[i] = i;
+
+    for (LocalTrees::iterator it=trees->begin(); it != trees->end(); ++it) {
+        LocalTree *tree = it->tree;
+        LocalTrees::iterator it2 = it;
+        ++it2;
+
+        if (it2 != trees->end()) {
+            // node ids in the next tree
+            Spr &spr = it2->spr;
+            int *mapping = it2->mapping;
+            int recoal = get_recoal_node(tree, spr, mapping);
+            for (int i=0; i<nnodes; i++) {
+                if (mapping[i] != -1)
+                    next_mapping[mapping[i]] = total_mapping[i];
+                else
+                    next_mapping[recoal] = total_mapping[i];
+            }
+
+            // only the broken node is not kept in the next tree
+            const int broken = total_mapping[
+                tree->nodes[spr.recomb_node].parent];
+            for (int i=0; i<nnodes; i++)
+                mapping[i] = i;
+            mapping[broken] = -1;
+            spr.recomb_node = total_mapping[spr.recomb_node];
+            spr.coal_node = total_mapping[spr.coal_node];
+        }
+
+        // renumber tree
+        for (int i=0; i<nnodes; i++)
+            nodes[i] = tree->nodes[i];
+        for (int i=0; i<nnodes; i++) {
+            LocalNode &node = tree->nodes[total_mapping[i]];
+            node.age = nodes[i].age;
+            node.parent = (nodes[i].parent == -1) ?
+                -1 : total_mapping[nodes[i].parent];
+            for (int j=0; j<2; j++)
+                node.child[j] = (nodes[i].child[j] == -1) ?
+                    -1 : total_mapping[nodes[i].child[j]];
+        }
+        tree->root = total_mapping[tree->root];
+
+        total_mapping.swap(next_mapping);
+    }
+
+    assert_trees(trees);
+}
+
+
 bool write_local_trees(const char *filename, const LocalTrees *trees,
                        const char *const *names, const double *times)
 {
@@ -1911,11 +2034,18 @@ LocalTrees *read_local_trees(const char *filename, const double *times,
     char ***names = NULL;
     LocalTrees *trees = new LocalTrees();
     vector<string> seqnames;
+    bool result;
 
-    CompressStream stream(filename, "r");
-    if (stream.stream &&
-        read_local_trees(stream.stream, times, ntimes, trees, seqnames))
-    {
+    if (is_local_trees_binary(filename)) {
+        result = read_local_trees_binary(filename, times, ntimes, trees,
+                                         seqnames);
+    } else {
+        CompressStream stream(filename, "r");
+        result = stream.stream &&
+            read_local_trees(stream.stream, times, ntimes, trees, seqnames);
+    }
+
+    if (result) {
         if (names) {
             // copy names
             *names = new char* [seqnames.size()];
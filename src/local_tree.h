@@ -6,6 +6,7 @@
 
 // c++ includes
 #include <assert.h>
+#include <iterator>
 #include <list>
 #include <vector>
 #include <string.h>
@@ -135,6 +136,49 @@ public:
 extern LocalNode null_node;
 
 
+// A buffer holding the nodes of several local trees
+//
+// Each tree uses its own slot of the buffer.  The buffer is freed when the
+// last of its trees is freed or moves its nodes elsewhere.  Trees of one
+// buffer can end up in local trees that are resampled concurrently, so the
+// reference count is updated atomically.
+class LocalNodeArena
+{
+public:
+    LocalNodeArena(int size) :
+        refs(0),
+        size(size)
+    {
+        nodes = new LocalNode [size];
+    }
+
+    ~LocalNodeArena()
+    {
+        delete [] nodes;
+    }
+
+    inline void ref()
+    {
+        __sync_add_and_fetch(&refs, 1);
+    }
+
+    // returns true if the last reference was released
+    inline bool unref()
+    {
+        return __sync_sub_and_fetch(&refs, 1) == 0;
+    }
+
+    inline int get_refs()
+    {
+        return __sync_add_and_fetch(&refs, 0);
+    }
+
+    int refs;          // number of trees using the buffer
+    int size;          // number of nodes in buffer
+    LocalNode *nodes;  // nodes buffer
+};
+
+
 // A local tree in a set of local trees
 //
 //   Leaves are always listed first in nodes array
@@ -146,13 +190,15 @@ public:
         nnodes(0),
         capacity(0),
         root(-1),
-        nodes(NULL)
+        nodes(NULL),
+        arena(NULL)
     {}
 
     LocalTree(int nnodes, int capacity=0) :
         nnodes(nnodes),
         capacity(capacity),
-        root(-1)
+        root(-1),
+        arena(NULL)
     {
         if (capacity < nnodes)
             capacity = nnodes;
@@ -164,7 +210,8 @@ public:
         nnodes(nnodes),
         capacity(0),
         root(-1),
-        nodes(NULL)
+        nodes(NULL),
+        arena(NULL)
     {
         set_ptree(ptree, nnodes, ages, capacity);
     }
@@ -173,32 +220,57 @@ public:
         nnodes(0),
         capacity(0),
         root(-1),
-        nodes(NULL)
+        nodes(NULL),
+        arena(NULL)
     {
         copy(other);
     }
 
 
     ~LocalTree() {
-        if (nodes) {
+        free_nodes();
+    }
+
+    // Frees the nodes array, or releases it if it belongs to an arena
+    void free_nodes()
+    {
+        if (arena) {
+            if (arena->unref())
+                delete arena;
+            arena = NULL;
+        } else if (nodes) {
             delete [] nodes;
-            nodes = NULL;
         }
+        nodes = NULL;
+    }
+
+    // Moves the nodes array into a slot of an arena
+    // The slot starts at 'offset' and holds '_capacity' nodes.  The
+    // current nodes are discarded.
+    void set_arena(LocalNodeArena *_arena, int offset, int _capacity)
+    {
+        _arena->ref();
+        free_nodes();
+        arena = _arena;
+        nodes = _arena->nodes + offset;
+        capacity = _capacity;
     }
 
     // initialize a local tree by on a parent array
     void set_ptree(int *ptree, int _nnodes, int *ages=NULL, int _capacity=-1)
     {
+        const int old_capacity = capacity;
         nnodes = _nnodes;
         if (_capacity >= 0)
             capacity = _capacity;
         if (capacity < nnodes)
             capacity = nnodes;
 
-        // delete existing nodes if they exist
-        if (nodes)
-            delete [] nodes;
-        nodes = new LocalNode [capacity];
+        // reallocate nodes unless they already have this capacity
+        if (!nodes || capacity != old_capacity) {
+            free_nodes();
+            nodes = new LocalNode [capacity];
+        }
 
         // populate parent pointers
         for (int i=0; i<nnodes; i++) {
@@ -253,7 +325,7 @@ public:
 
         // copy over nodes
         std::copy(nodes, nodes + capacity, tmp);
-        delete [] nodes;
+        free_nodes();
 
         nodes = tmp;
         capacity = _capacity;
@@ -387,8 +459,7 @@ public:
         root = other.root;
 
         // copy node info
-        for (int i=0; i<nnodes; i++)
-            nodes[i].copy(other.nodes[i]);
+        std::copy(other.nodes, other.nodes + nnodes, nodes);
     }
 
 
@@ -420,6 +491,7 @@ public:
     int capacity;      // capacity of nodes array
     int root;          // id of root node
     LocalNode *nodes;  // nodes array
+    LocalNodeArena *arena;  // arena holding nodes array, NULL if owned
 };
 
 
@@ -495,6 +567,93 @@ public:
 };
 
 
+// An iterator over the local trees of a set of local trees
+//
+// Local trees are referred to by their index, so iterators stay valid when
+// local trees are added to the end.  Inserting or erasing a local tree
+// shifts the local trees after it.
+template <class TreeSpr, class Blocks>
+class LocalTreesIterator
+{
+public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef TreeSpr value_type;
+    typedef ptrdiff_t difference_type;
+    typedef TreeSpr *pointer;
+    typedef TreeSpr &reference;
+
+    LocalTreesIterator() :
+        blocks(NULL),
+        index(0)
+    {}
+
+    LocalTreesIterator(Blocks *blocks, int index) :
+        blocks(blocks),
+        index(index)
+    {}
+
+    // allows converting an iterator to a const_iterator
+    template <class TreeSpr2, class Blocks2>
+    LocalTreesIterator(const LocalTreesIterator<TreeSpr2, Blocks2> &other) :
+        blocks(other.blocks),
+        index(other.index)
+    {}
+
+    inline TreeSpr &operator*() const
+    {
+        return (*blocks)[index];
+    }
+
+    inline TreeSpr *operator->() const
+    {
+        return &(*blocks)[index];
+    }
+
+    inline LocalTreesIterator &operator++()
+    {
+        index++;
+        return *this;
+    }
+
+    inline LocalTreesIterator operator++(int)
+    {
+        LocalTreesIterator it = *this;
+        index++;
+        return it;
+    }
+
+    inline LocalTreesIterator &operator--()
+    {
+        index--;
+        return *this;
+    }
+
+    inline LocalTreesIterator operator--(int)
+    {
+        LocalTreesIterator it = *this;
+        index--;
+        return it;
+    }
+
+    template <class TreeSpr2, class Blocks2>
+    inline bool operator==(
+        const LocalTreesIterator<TreeSpr2, Blocks2> &other) const
+    {
+        return index == other.index;
+    }
+
+    template <class TreeSpr2, class Blocks2>
+    inline bool operator!=(
+        const LocalTreesIterator<TreeSpr2, Blocks2> &other) const
+    {
+        return index != other.index;
+    }
+
+    Blocks *blocks;  // local trees being iterated
+    int index;       // index of current local tree
+};
+
+
 
 // A set of local trees that together specify an ARG
 //
@@ -517,32 +676,51 @@ public:
     }
 
     // iterators for the local trees
-    typedef list<LocalTreeSpr>::iterator iterator;
-    typedef list<LocalTreeSpr>::reverse_iterator reverse_iterator;
-    typedef list<LocalTreeSpr>::const_iterator const_iterator;
-    typedef list<LocalTreeSpr>::const_reverse_iterator const_reverse_iterator;
+    typedef LocalTreesIterator<LocalTreeSpr, vector<LocalTreeSpr> > iterator;
+    typedef LocalTreesIterator<const LocalTreeSpr,
+                               const vector<LocalTreeSpr> > const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
 
 
     // Returns iterator for first local tree
-    iterator begin() { return trees.begin(); }
-    reverse_iterator rbegin() { return trees.rbegin(); }
+    iterator begin() { return iterator(&trees, 0); }
+    reverse_iterator rbegin() { return reverse_iterator(end()); }
     LocalTreeSpr &front() { return trees.front(); }
 
-    const_iterator begin() const { return trees.begin(); }
-    const_reverse_iterator rbegin() const { return trees.rbegin(); }
+    const_iterator begin() const { return const_iterator(&trees, 0); }
+    const_reverse_iterator rbegin() const
+    { return const_reverse_iterator(end()); }
     const LocalTreeSpr &front() const { return trees.front(); }
 
 
     // Returns the ending iterator
-    iterator end() { return trees.end(); }
-    reverse_iterator rend() { return trees.rend(); }
+    iterator end() { return iterator(&trees, trees.size()); }
+    reverse_iterator rend() { return reverse_iterator(begin()); }
     LocalTreeSpr &back() { return trees.back(); }
 
-    const_iterator end() const { return trees.end(); }
-    const_reverse_iterator rend() const { return trees.rend(); }
+    const_iterator end() const { return const_iterator(&trees, trees.size()); }
+    const_reverse_iterator rend() const
+    { return const_reverse_iterator(begin()); }
     const LocalTreeSpr &back() const { return trees.back(); }
 
 
+    // Inserts a local tree before 'it' and returns an iterator to it
+    iterator insert(iterator it, const LocalTreeSpr &tree_spr)
+    {
+        trees.insert(trees.begin() + it.index, tree_spr);
+        return it;
+    }
+
+    // Removes a local tree without deallocating it
+    // Returns an iterator to the following local tree.
+    iterator erase(iterator it)
+    {
+        trees.erase(trees.begin() + it.index);
+        return it;
+    }
+
+
     // Returns number of leaves
     inline int get_num_leaves() const
     {
@@ -564,6 +742,17 @@ public:
     // Copy trees from another set of local trees
     void copy(const LocalTrees &other);
 
+    // Exchange contents with another set of local trees in constant time
+    void swap(LocalTrees &other)
+    {
+        chrom.swap(other.chrom);
+        std::swap(start_coord, other.start_coord);
+        std::swap(end_coord, other.end_coord);
+        std::swap(nnodes, other.nnodes);
+        trees.swap(other.trees);
+        seqids.swap(other.seqids);
+    }
+
     // deallocate local trees
     void clear()
     {
@@ -668,7 +857,11 @@ public:
     int start_coord;           // start coordinate of whole tree list
     int end_coord;             // end coordinate of whole tree list
     int nnodes;                // number of nodes in each tree
-    list<LocalTreeSpr> trees;  // linked list of local trees
+
+    // Local trees are stored contiguously by block.  copy() and the
+    // constructor place the nodes of all trees in one arena, which
+    // partitioning and appending keep sharing instead of copying nodes.
+    vector<LocalTreeSpr> trees;  // local trees in order of blocks
 
     vector<int> seqids;        // mapping from tree leaves to sequence ids
 };
@@ -798,6 +991,10 @@ void write_local_trees(FILE *out, const LocalTrees *trees,
 bool write_local_trees(const char *filename, const LocalTrees *trees,
                        const Sequences &seqs, const double *times);
 
+// Renumber nodes so that each node keeps its id from one tree to the next,
+// as in the files written by write_local_trees()
+void renumber_local_trees(LocalTrees *trees);
+
 bool parse_local_tree(const char* newick, LocalTree *tree,
                       const double *times, int ntimes);
 bool read_local_trees(FILE *infile, const double *times, int ntimes,
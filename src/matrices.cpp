@@ -4,6 +4,131 @@
 
 namespace argweaver {
 
+
+// Allocates a (blocklen x nstates) matrix in which site i uses distinct row
+// rows[i] of nrows.  Distinct rows must be numbered in order of first use
+// so that the matrix can be freed with delete_matrix.
+static double **new_shared_matrix(int blocklen, int nstates, int nrows,
+                                  const int *rows)
+{
+    double **mat = new double* [max(blocklen, 1)];
+    double *data = new double [max(nrows * nstates, 1)];
+    for (int i=0; i<blocklen; i++)
+        mat[i] = &data[rows[i] * nstates];
+    if (blocklen == 0)
+        mat[0] = data;
+    return mat;
+}
+
+
+double **new_block_emissions(int blocklen, int nstates,
+                             const bool *invariant, const bool *masked)
+{
+    vector<int> rows(blocklen);
+    int nrows = 0;
+    int invariant_row = -1;
+    int masked_row = -1;
+    for (int i=0; i<blocklen; i++) {
+        if (masked[i]) {
+            if (masked_row == -1)
+                masked_row = nrows++;
+            rows[i] = masked_row;
+        } else if (invariant[i]) {
+            if (invariant_row == -1)
+                invariant_row = nrows++;
+            rows[i] = invariant_row;
+        } else {
+            rows[i] = nrows++;
+        }
+    }
+
+    return new_shared_matrix(blocklen, nstates, nrows, &rows[0]);
+}
+
+
+// Returns the sequence ids threaded in a block
+static int get_block_seqids(const LocalTrees *trees, const int new_chrom,
+                            const bool internal, int *seqids)
+{
+    const int nleaves = trees->get_num_leaves();
+    for (int i=0; i<nleaves; i++)
+        seqids[i] = trees->seqids[i];
+    if (internal)
+        return nleaves;
+    seqids[nleaves] = new_chrom;
+    return nleaves + 1;
+}
+
+
+// calculate emissions for current block, given its invariant and masked
+// sites
+static double **calc_block_emissions(
+    const ArgModel *model, const Sequences *seqs, const LocalTree *tree,
+    const States &states, const int start, const int end,
+    const int *seqids, const int nseqs, const bool internal,
+    const int nstates, const bool *invariant, const bool *masked)
+{
+    const int blocklen = end - start;
+    char *subseqs[nseqs];
+    for (int i=0; i<nseqs; i++)
+        subseqs[i] = &seqs->seqs[seqids[i]][start];
+
+    // invariant sites share one emission row, as do masked sites
+    double **emit = new_block_emissions(blocklen, nstates, invariant, masked);
+    if (internal)
+        calc_emissions_internal(states, tree, subseqs, nseqs,
+                                blocklen, model, emit, invariant, masked);
+    else
+        calc_emissions_external(states, tree, subseqs, nseqs,
+                                blocklen, model, emit, invariant, masked);
+    return emit;
+}
+
+
+// calculate emissions for current block, reusing the emissions cached by
+// the model if possible
+static double **calc_block_emissions_cached(
+    const ArgModel *model, const Sequences *seqs, const LocalTrees *trees,
+    const LocalTree *tree, const States &states, const int start,
+    const int end, const int new_chrom, const bool internal, const int minage,
+    const int nstates)
+{
+    const int blocklen = end - start;
+    int seqids[trees->get_num_leaves() + 1];
+    const int nseqs = get_block_seqids(trees, new_chrom, internal, seqids);
+
+    // find invariant sites of the threaded sequences
+    bool *invariant = new bool [max(blocklen, 1)];
+    bool *masked = new bool [max(blocklen, 1)];
+    find_block_site_flags(seqs, seqids, nseqs, start, end, invariant, masked);
+
+    double **emit = NULL;
+    EmissionCache *cache = model->emission_cache;
+    if (!cache) {
+        emit = calc_block_emissions(model, seqs, tree, states, start, end,
+                                    seqids, nseqs, internal, nstates,
+                                    invariant, masked);
+    } else {
+        EmissionKey key(tree, trees, start, end, internal, minage,
+                        internal ? -1 : new_chrom, invariant, masked,
+                        hash_block_columns(seqs, seqids, nseqs, start, end,
+                                           invariant),
+                        model);
+        emit = cache->get(key, blocklen, nstates);
+        if (!emit) {
+            emit = calc_block_emissions(model, seqs, tree, states, start, end,
+                                        seqids, nseqs, internal, nstates,
+                                        invariant, masked);
+            cache->put(key, blocklen, nstates, emit);
+        }
+    }
+
+    delete [] invariant;
+    delete [] masked;
+    return emit;
+}
+
+
 // calculate transition and emission matrices for current block
 void calc_arghmm_matrices_internal(
     const ArgModel *model, const Sequences *seqs, const LocalTrees *trees,
@@ -27,13 +152,9 @@ void calc_arghmm_matrices_internal(
 
     // calculate emissions
     if (seqs) {
-        const int nleaves = trees->get_num_leaves();
-        char *subseqs[nleaves];
-        for (int i=0; i<nleaves; i++)
-            subseqs[i] = &seqs->seqs[trees->seqids[i]][start];
-        matrices->emit = new_matrix<double>(blocklen, max(nstates, 1));
-        calc_emissions_internal(states, tree, subseqs, nleaves,
-                                blocklen, model, matrices->emit);
+        matrices->emit = calc_block_emissions_cached(
+            model, seqs, trees, tree, states, start, end, -1, internal,
+            minage, max(nstates, 1));
     } else {
         matrices->emit = NULL;
     }
@@ -93,14 +214,9 @@ void calc_arghmm_matrices_external(
 
     // calculate emissions
     if (seqs) {
-        const int nleaves = trees->get_num_leaves();
-        char *subseqs[seqs->get_num_seqs()];
-        for (int i=0; i<nleaves; i++)
-            subseqs[i] = &seqs->seqs[trees->seqids[i]][start];
-        subseqs[nleaves] = &seqs->seqs[new_chrom][start];
-        matrices->emit = new_matrix<double>(blocklen, nstates);
-        calc_emissions_external(states, tree, subseqs, nleaves + 1, blocklen,
-                                model, matrices->emit);
+        matrices->emit = calc_block_emissions_cached(
+            model, seqs, trees, tree, states, start, end, new_chrom, false,
+            0, nstates);
     } else {
         matrices->emit = NULL;
     }
@@ -155,5 +271,413 @@ void calc_arghmm_matrices(
 }
 
 
+
+
+//=============================================================================
+// emission cache
+
+
+// mix an integer into a FNV-1a hash
+static inline void hash_mix(unsigned long long &hash, unsigned long long x)
+{
+    hash = (hash ^ x) * 1099511628211ULL;
+}
+
+
+unsigned long long hash_block_columns(
+    const Sequences *seqs, const int *seqids, int nseqids, int start, int end,
+    const bool *invariant)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for (int i=start; i<end; i++) {
+        if (invariant[i - start])
+            continue;
+        for (int j=0; j<nseqids; j++)
+            hash_mix(hash, (unsigned char) seqs->seqs[seqids[j]][i]);
+    }
+    return hash;
+}
+
+
+EmissionKey::EmissionKey(const LocalTree *tree, const LocalTrees *trees,
+                         int start, int end, bool internal, int minage,
+                         int new_chrom, const bool *invariant,
+                         const bool *masked, unsigned long long columns_hash,
+                         const ArgModel *model)
+{
+    const int nnodes = tree->nnodes;
+    const int nleaves = trees->get_num_leaves();
+    const int blocklen = end - start;
+
+    // block, threading and tree information
+    data.reserve(9 + nleaves + 4 * nnodes + blocklen / 16 + 1);
+    data.push_back(start);
+    data.push_back(end);
+    data.push_back(int(internal));
+    data.push_back(minage);
+    data.push_back(new_chrom);
+    data.push_back(nnodes);
+    data.push_back(tree->root);
+    data.push_back(int(columns_hash & 0xffffffff));
+    data.push_back(int(columns_hash >> 32));
+    for (int i=0; i<nleaves; i++)
+        data.push_back(trees->seqids[i]);
+    for (int i=0; i<nnodes; i++) {
+        const LocalNode &node = tree->nodes[i];
+        data.push_back(node.parent);
+        data.push_back(node.child[0]);
+        data.push_back(node.child[1]);
+        data.push_back(node.age);
+    }
+
+    // invariant and masked sites, two bits per site
+    for (int i=0; i<blocklen; i += 16) {
+        unsigned int flags = 0;
+        for (int j=i; j<min(i + 16, blocklen); j++)
+            flags |= (unsigned(invariant[j]) | (unsigned(masked[j]) << 1)) <<
+                (2 * (j - i));
+        data.push_back(int(flags));
+    }
+
+    // model parameters
+    params.reserve(2 + model->ntimes);
+    params.push_back(model->mu);
+    params.push_back(model->infsites_penalty);
+    for (int i=0; i<model->ntimes; i++)
+        params.push_back(model->times[i]);
+
+    hash = 14695981039346656037ULL;
+    for (unsigned int i=0; i<data.size(); i++)
+        hash_mix(hash, (unsigned int) data[i]);
+}
+
+
+EmissionCache::EmissionCache(long max_size) :
+    size(0),
+    max_size(max_size),
+    hits(0),
+    misses(0)
+{
+    pthread_mutex_init(&lock, NULL);
+}
+
+
+EmissionCache::~EmissionCache()
+{
+    clear();
+    pthread_mutex_destroy(&lock);
+}
+
+
+double **EmissionCache::get(const EmissionKey &key, int blocklen,
+                            int nstates)
+{
+    pthread_mutex_lock(&lock);
+    EntryMap::iterator it = lookup.find(key);
+    if (it == lookup.end()) {
+        misses++;
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+
+    // mark entry as most recently used
+    EntryList::iterator entry = it->second;
+    entries.splice(entries.begin(), entries, entry);
+    assert(entry->blocklen == blocklen && entry->nstates == nstates);
+
+    double **emit = new_shared_matrix(blocklen, nstates, entry->nrows,
+                                      entry->rows);
+    std::copy(entry->data, entry->data + entry->nrows * nstates, emit[0]);
+    hits++;
+    pthread_mutex_unlock(&lock);
+
+    return emit;
+}
+
+
+void EmissionCache::put(const EmissionKey &key, int blocklen, int nstates,
+                        const double *const *emit)
+{
+    // find distinct rows of emit, which are numbered in order of first use
+    int *rows = new int [max(blocklen, 1)];
+    int nrows = 0;
+    for (int i=0; i<blocklen; i++) {
+        rows[i] = nstates > 0 ? int((emit[i] - emit[0]) / nstates) : 0;
+        nrows = max(nrows, rows[i] + 1);
+    }
+
+    const long entry_size = entry_size_of(blocklen, nstates, nrows);
+    if (entry_size > max_size) {
+        delete [] rows;
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (lookup.find(key) != lookup.end()) {
+        // another thread stored these emissions already
+        pthread_mutex_unlock(&lock);
+        delete [] rows;
+        return;
+    }
+
+    // make room for new entry
+    while (size + entry_size > max_size)
+        remove_last();
+
+    double *data = new double [max(nrows * nstates, 1)];
+    std::copy(emit[0], emit[0] + nrows * nstates, data);
+
+    Entry entry;
+    entry.blocklen = blocklen;
+    entry.nstates = nstates;
+    entry.nrows = nrows;
+    entry.rows = rows;
+    entry.data = data;
+    entries.push_front(entry);
+    EntryMap::iterator it = lookup.insert(
+        std::make_pair(key, entries.begin())).first;
+    entries.front().key = &it->first;
+    size += entry_size;
+    pthread_mutex_unlock(&lock);
+}
+
+
+void EmissionCache::clear()
+{
+    pthread_mutex_lock(&lock);
+    while (!entries.empty())
+        remove_last();
+    pthread_mutex_unlock(&lock);
+}
+
+
+// Removes least recently used entry
+void EmissionCache::remove_last()
+{
+    Entry &entry = entries.back();
+    size -= entry_size_of(entry.blocklen, entry.nstates, entry.nrows);
+    delete [] entry.rows;
+    delete [] entry.data;
+    lookup.erase(*entry.key);
+    entries.pop_back();
+}
+
+
+//=============================================================================
+// matrix pipeline
+
+
+static int g_matrix_threads = 0;
+static int g_matrix_threads_used = 0;
+static pthread_mutex_t g_matrix_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+void set_matrix_threads(int nthreads)
+{
+    g_matrix_threads = max(nthreads, 0);
+}
+
+
+int get_matrix_threads()
+{
+    return g_matrix_threads;
+}
+
+
+// Reserves up to nthreads of the matrix threads not used by other
+// pipelines and returns the number reserved
+static int reserve_matrix_threads(int nthreads)
+{
+    pthread_mutex_lock(&g_matrix_threads_lock);
+    const int n = max(min(nthreads, g_matrix_threads - g_matrix_threads_used),
+                      0);
+    g_matrix_threads_used += n;
+    pthread_mutex_unlock(&g_matrix_threads_lock);
+    return n;
+}
+
+
+static void release_matrix_threads(int nthreads)
+{
+    pthread_mutex_lock(&g_matrix_threads_lock);
+    g_matrix_threads_used -= nthreads;
+    pthread_mutex_unlock(&g_matrix_threads_lock);
+}
+
+
+ArgHmmMatrixPipeline::ArgHmmMatrixPipeline(
+    const ArgModel *model, const Sequences *seqs, const LocalTrees *trees,
+    int new_chrom, int nthreads, int capacity) :
+    ArgHmmMatrixIter(model, seqs, trees, new_chrom),
+    nthreads(nthreads),
+    capacity(capacity > 0 ? capacity : 4 * max(nthreads, 1)),
+    workers(NULL),
+    nworkers(0),
+    running(false),
+    stopping(false),
+    next_compute(0),
+    next_read(0),
+    slots(this->capacity),
+    ready(this->capacity, false)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&ready_cond, NULL);
+    pthread_cond_init(&space_cond, NULL);
+}
+
+
+ArgHmmMatrixPipeline::~ArgHmmMatrixPipeline()
+{
+    stop();
+    pthread_mutex_destroy(&lock);
+    pthread_cond_destroy(&ready_cond);
+    pthread_cond_destroy(&space_cond);
+}
+
+
+void ArgHmmMatrixPipeline::begin()
+{
+    stop();
+    ArgHmmMatrixIter::begin();
+    start();
+}
+
+
+void ArgHmmMatrixPipeline::rbegin()
+{
+    stop();
+    ArgHmmMatrixIter::rbegin();
+}
+
+
+bool ArgHmmMatrixPipeline::next()
+{
+    bool more = ArgHmmMatrixIter::next();
+    if (!more)
+        stop();
+    return more;
+}
+
+
+ArgHmmMatrices &ArgHmmMatrixPipeline::ref_matrices()
+{
+    mat.clear();
+
+    if (running && block_index == next_read) {
+        // take matrices computed by the workers
+        const int slot = block_index % capacity;
+        pthread_mutex_lock(&lock);
+        while (!ready[slot])
+            pthread_cond_wait(&ready_cond, &lock);
+        mat = slots[slot];
+        slots[slot].detach();
+        ready[slot] = false;
+        next_read++;
+        pthread_cond_broadcast(&space_cond);
+        pthread_mutex_unlock(&lock);
+        return mat;
+    }
+
+    stop();
+    calc_matrices(&mat);
+    return mat;
+}
+
+
+void ArgHmmMatrixPipeline::start()
+{
+    if (nthreads <= 0 || running || get_num_blocks() <= 1)
+        return;
+    const int n = reserve_matrix_threads(nthreads);
+    if (n == 0)
+        return;
+
+    running = true;
+    stopping = false;
+    next_compute = block_index;
+    next_read = block_index;
+
+    // use the workers that could be started, or compute the matrices on
+    // the calling thread if there are none
+    workers = new pthread_t [n];
+    nworkers = 0;
+    while (nworkers < n &&
+           pthread_create(&workers[nworkers], NULL, worker_main, this) == 0)
+        nworkers++;
+    release_matrix_threads(n - nworkers);
+    if (nworkers < n)
+        printLog(LOG_LOW, "could only start %d of %d matrix threads\n",
+                 nworkers, n);
+    if (nworkers == 0) {
+        delete [] workers;
+        workers = NULL;
+        running = false;
+    }
+}
+
+
+void ArgHmmMatrixPipeline::stop()
+{
+    if (!running)
+        return;
+
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&space_cond);
+    pthread_mutex_unlock(&lock);
+
+    for (int i=0; i<nworkers; i++)
+        pthread_join(workers[i], NULL);
+    release_matrix_threads(nworkers);
+    delete [] workers;
+    workers = NULL;
+    nworkers = 0;
+
+    // free blocks that were not read
+    for (int i=0; i<capacity; i++) {
+        if (ready[i]) {
+            slots[i].clear();
+            ready[i] = false;
+        }
+    }
+    running = false;
+}
+
+
+void *ArgHmmMatrixPipeline::worker_main(void *pipeline)
+{
+    ((ArgHmmMatrixPipeline*) pipeline)->work();
+    return NULL;
+}
+
+
+void ArgHmmMatrixPipeline::work()
+{
+    const int nblocks = get_num_blocks();
+
+    pthread_mutex_lock(&lock);
+    while (!stopping && next_compute < nblocks) {
+        // wait for a free slot
+        const int index = next_compute;
+        if (index >= next_read + capacity) {
+            pthread_cond_wait(&space_cond, &lock);
+            continue;
+        }
+        next_compute++;
+        pthread_mutex_unlock(&lock);
+
+        ArgHmmMatrices matrices;
+        calc_matrices(index, &matrices);
+
+        pthread_mutex_lock(&lock);
+        const int slot = index % capacity;
+        slots[slot] = matrices;
+        ready[slot] = true;
+        pthread_cond_broadcast(&ready_cond);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+
 } // namespace argweaver
 
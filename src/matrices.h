@@ -7,12 +7,15 @@
 
 // c++ includes
 #include <list>
+#include <map>
 #include <vector>
 #include <string.h>
+#include <pthread.h>
 
 // arghmm includes
 #include "common.h"
 #include "emit.h"
+#include "forward_kernel.h"
 #include "local_tree.h"
 #include "logging.h"
 #include "model.h"
@@ -92,7 +95,7 @@ public:
     StatesModel states_model;
     TransMatrix* transmat; // transition matrix within this block
     TransMatrixSwitch* transmat_switch; // transition matrix from previous block
-    double **emit; // emission matrix
+    double **emit; // emission matrix, sites may share rows
 };
 
 
@@ -104,6 +107,120 @@ void calc_arghmm_matrices(
 
 
 
+//=============================================================================
+// emission cache
+
+
+// Identifies the emissions of one block: the block coordinates, the local
+// tree (topology and ages), the sequences threaded, which of their sites
+// are invariant or masked, a hash of their variant columns and the model
+// parameters that emissions depend on.  The column hash keeps a cache
+// shared by several alignments, or used while an alignment is edited in
+// place, from returning emissions of other sequences.
+class EmissionKey
+{
+public:
+    EmissionKey(const LocalTree *tree, const LocalTrees *trees,
+                int start, int end, bool internal, int minage, int new_chrom,
+                const bool *invariant, const bool *masked,
+                unsigned long long columns_hash, const ArgModel *model);
+
+    bool operator<(const EmissionKey &other) const
+    {
+        if (hash != other.hash)
+            return hash < other.hash;
+        if (data != other.data)
+            return data < other.data;
+        return params < other.params;
+    }
+
+    unsigned long long hash;
+    vector<int> data;
+    vector<double> params;
+};
+
+
+// Returns a hash of the bases of the sequences seqids at the sites of
+// [start, end) that are not invariant
+unsigned long long hash_block_columns(
+    const Sequences *seqs, const int *seqids, int nseqids, int start, int end,
+    const bool *invariant);
+
+
+// A cache of emission matrices of recently seen blocks.
+//
+// The same partial local tree is often seen again over the same block in
+// later MCMC iterations (e.g. when the same branch is removed again), in
+// which case the emissions can be copied instead of recomputed.  The least
+// recently used entries are dropped when the cache exceeds its maximum
+// size.  The cache may be shared by several threads.  It is used by the
+// matrix calculations of a model through ArgModel::emission_cache.
+class EmissionCache
+{
+public:
+    // max_size is the maximum number of cached emission values
+    explicit EmissionCache(long max_size);
+    ~EmissionCache();
+
+    // Returns a new copy of the cached emissions for key (to be freed
+    // with delete_matrix) or NULL if the emissions are not cached.
+    double **get(const EmissionKey &key, int blocklen, int nstates);
+
+    // Stores a copy of emissions for key.  Rows shared by several sites
+    // (see new_block_emissions) are stored once.
+    void put(const EmissionKey &key, int blocklen, int nstates,
+             const double *const *emit);
+
+    // Removes all entries
+    void clear();
+
+    long get_size() const { return size; }
+    long get_max_size() const { return max_size; }
+    long get_hits() const { return hits; }
+    long get_misses() const { return misses; }
+
+protected:
+    struct Entry
+    {
+        const EmissionKey *key;  // key stored in lookup
+        int blocklen;
+        int nstates;
+        int nrows;     // number of distinct rows
+        int *rows;     // distinct row of each site
+        double *data;  // distinct rows
+    };
+    typedef list<Entry> EntryList;
+    typedef map<EmissionKey, EntryList::iterator> EntryMap;
+
+    void remove_last();
+
+    // Returns the size of an entry, counting each site's row index as one
+    // value
+    static long entry_size_of(int blocklen, int nstates, int nrows)
+    {
+        return long(nrows) * nstates + blocklen;
+    }
+
+    long size;
+    long max_size;
+    long hits;
+    long misses;
+    EntryList entries;  // most recently used first
+    EntryMap lookup;
+    pthread_mutex_t lock;
+};
+
+
+// Allocates an emission matrix for a block in which all masked sites share
+// one row and all other invariant sites share another.  The matrix is
+// freed with delete_matrix.
+double **new_block_emissions(int blocklen, int nstates,
+                             const bool *invariant, const bool *masked);
+
+
+
+
+
 // A block of the ARG and model
 class ArgModelBlock
 {
@@ -279,6 +396,21 @@ public:
         return block_index >= 0 && block_index < blocks.size();
     }
 
+    // moves iterator to block 'index'
+    void set_block_index(int index) {
+        if (blocks.size() == 0)
+            setup();
+        block_index = index;
+    }
+
+    int get_block_index() const {
+        return block_index;
+    }
+
+    int get_num_blocks() const {
+        return blocks.size();
+    }
+
     //==================================================
     // accessors
 
@@ -334,18 +466,31 @@ public:
         states_model.get_coal_states(get_tree_spr()->tree, states);
     }
 
+    // Temporaries for the forward algorithm and traceback over the blocks
+    // of this iterator
+    ForwardWorkspace *get_workspace() {
+        return &workspace;
+    }
+
 
     StatesModel states_model;
 
 protected:
 
     void calc_matrices(ArgHmmMatrices *matrices)
+    {
+        calc_matrices(block_index, matrices);
+    }
+
+    // calculate matrices of block 'index'
+    void calc_matrices(int index, ArgHmmMatrices *matrices) const
     {
         ArgModel local_model;
-        ArgModelBlock &block = blocks.at(block_index);
+        const ArgModelBlock &block = blocks.at(index);
 
         model->get_local_model_index(block.model_index, local_model);
-        const LocalTreeSpr * last_tree_spr = get_last_tree_spr();
+        const LocalTreeSpr *last_tree_spr =
+            (index > 0) ? blocks.at(index-1).tree_spr : NULL;
 
         argweaver::calc_arghmm_matrices(
             &local_model, seqs, trees, last_tree_spr, block.tree_spr,
@@ -360,6 +505,7 @@ protected:
     int new_chrom;
 
     ArgHmmMatrices mat;
+    ForwardWorkspace workspace;
 
     // record of common blocks
     ArgModelBlocks blocks;
@@ -446,6 +592,72 @@ protected:
 };
 
 
+// Computes the matrices of the blocks ahead of a forward iteration on
+// other threads.
+//
+// Worker threads claim blocks in order and compute their matrices into a
+// ring of slots, at most 'capacity' blocks ahead of the block being read,
+// so that the forward algorithm does not wait for calc_arghmm_matrices.
+// Iterating forward with begin() and next() takes matrices from the ring,
+// any other access stops the workers and computes matrices on the calling
+// thread.  With nthreads = 0 no workers are started.
+//
+// Pipelines that run at the same time share the threads of
+// set_matrix_threads(): each starts at most nthreads workers among the
+// threads not used by other pipelines, and computes matrices on the
+// calling thread if none are free or none can be created.
+//
+// The local trees must not change while the workers are running, i.e.
+// until the iteration passes the last block or another access stops them.
+class ArgHmmMatrixPipeline : public ArgHmmMatrixIter
+{
+public:
+    ArgHmmMatrixPipeline(const ArgModel *model, const Sequences *seqs,
+                         const LocalTrees *trees, int new_chrom=-1,
+                         int nthreads=0, int capacity=0);
+    virtual ~ArgHmmMatrixPipeline();
+
+    //==================================================
+    // iteration methods
+
+    virtual void begin();
+    virtual void rbegin();
+    virtual bool next();
+
+    //==================================================
+    // accessors
+
+    virtual ArgHmmMatrices &ref_matrices();
+
+protected:
+    void start();
+    void stop();
+    static void *worker_main(void *pipeline);
+    void work();
+
+    int nthreads;
+    int capacity;
+    pthread_t *workers;
+    int nworkers;               // number of workers started
+    bool running;
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t ready_cond;  // signals a computed block
+    pthread_cond_t space_cond;  // signals a free slot or stopping
+    int next_compute;           // next block to be claimed by a worker
+    int next_read;              // next block to be read
+    vector<ArgHmmMatrices> slots;
+    vector<bool> ready;
+};
+
+
+// Sets the total number of threads that compute matrices ahead of the
+// forward algorithm when sampling threads, shared by all pipelines (0
+// computes them on the sampling thread)
+void set_matrix_threads(int nthreads);
+int get_matrix_threads();
+
+
 } // namespace argweaver
 
 
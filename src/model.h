@@ -9,6 +9,7 @@
 #include <math.h>
 
 // arghmm includes
+#include "forward_runs.h"
 #include "track.h"
 
 namespace argweaver {
@@ -32,6 +33,8 @@ inline void get_time_points(int ntimes, double maxtime,
 void get_coal_time_steps(const double *times, int ntimes,
                          double *coal_time_steps);
 
+class EmissionCache;
+
 
 
 // The model parameters and time discretization scheme
@@ -47,7 +50,11 @@ public:
         popsizes(NULL),
         rho(rho),
         mu(mu),
-        infsites_penalty(1.0)
+        infsites_penalty(1.0),
+        emission_cache(NULL),
+        forward_checkpoints(-1),
+        forward_float(false),
+        forward_run_mode(FORWARD_RUNS_OFF)
     {}
 
     // Model with constant population sizes and log-spaced time points
@@ -61,7 +68,11 @@ public:
         popsizes(NULL),
         rho(rho),
         mu(mu),
-        infsites_penalty(1.0)
+        infsites_penalty(1.0),
+        emission_cache(NULL),
+        forward_checkpoints(-1),
+        forward_float(false),
+        forward_run_mode(FORWARD_RUNS_OFF)
     {
         set_log_times(maxtime, ntimes);
         set_popsizes(popsize, ntimes);
@@ -78,7 +89,11 @@ public:
         popsizes(NULL),
         rho(rho),
         mu(mu),
-        infsites_penalty(1.0)
+        infsites_penalty(1.0),
+        emission_cache(NULL),
+        forward_checkpoints(-1),
+        forward_float(false),
+        forward_run_mode(FORWARD_RUNS_OFF)
     {
         set_log_times(maxtime, ntimes);
         if (_popsizes)
@@ -97,7 +112,11 @@ public:
         popsizes(NULL),
         rho(rho),
         mu(mu),
-        infsites_penalty(1.0)
+        infsites_penalty(1.0),
+        emission_cache(NULL),
+        forward_checkpoints(-1),
+        forward_float(false),
+        forward_run_mode(FORWARD_RUNS_OFF)
     {
         set_times(_times, ntimes);
         if (_popsizes)
@@ -115,7 +134,11 @@ public:
         popsizes(other.popsizes),
         rho(rho),
         mu(mu),
-        infsites_penalty(other.infsites_penalty)
+        infsites_penalty(other.infsites_penalty),
+        emission_cache(other.emission_cache),
+        forward_checkpoints(other.forward_checkpoints),
+        forward_float(other.forward_float),
+        forward_run_mode(other.forward_run_mode)
     {}
 
 
@@ -128,7 +151,11 @@ public:
         popsizes(NULL),
         rho(other.rho),
         mu(other.mu),
-        infsites_penalty(other.infsites_penalty)
+        infsites_penalty(other.infsites_penalty),
+        emission_cache(NULL),
+        forward_checkpoints(-1),
+        forward_float(false),
+        forward_run_mode(FORWARD_RUNS_OFF)
     {
         copy(other);
     }
@@ -167,6 +194,10 @@ public:
         rho = other.rho;
         mu = other.mu;
         infsites_penalty = other.infsites_penalty;
+        emission_cache = other.emission_cache;
+        forward_checkpoints = other.forward_checkpoints;
+        forward_float = other.forward_float;
+        forward_run_mode = other.forward_run_mode;
 
         // copy popsizes and times
         set_times(other.times, ntimes);
@@ -262,6 +293,10 @@ public:
         model.mu = mutmap.find(pos, mu);
         model.rho = recombmap.find(pos, rho);
         model.infsites_penalty = infsites_penalty;
+        model.emission_cache = emission_cache;
+        model.forward_checkpoints = forward_checkpoints;
+        model.forward_float = forward_float;
+        model.forward_run_mode = forward_run_mode;
 
         model.owned = false;
         model.times = times;
@@ -280,6 +315,10 @@ public:
             model.rho = recombmap[index].value;
         }
         model.infsites_penalty = infsites_penalty;
+        model.emission_cache = emission_cache;
+        model.forward_checkpoints = forward_checkpoints;
+        model.forward_float = forward_float;
+        model.forward_run_mode = forward_run_mode;
 
         model.owned = false;
         model.times = times;
@@ -323,6 +362,17 @@ public:
     double infsites_penalty; // penalty for violating infinite sites
     Track<double> mutmap;    // mutation map
     Track<double> recombmap; // recombination map
+
+    // cache of block emissions shared by copies of the model (not owned),
+    // or NULL if emissions are always computed
+    EmissionCache *emission_cache;
+
+    // forward algorithm used when sampling threads
+    int forward_checkpoints;  // columns between checkpoints of the forward
+                              // table (0 for the square root of the region
+                              // length), or -1 to keep the whole table
+    bool forward_float;       // store the forward table in single precision
+    ForwardRunMode forward_run_mode;  // when to skip runs of shared emissions
 };
 
 
@@ -0,0 +1,137 @@
+//=============================================================================
+// Thread pool for running independent tasks in parallel
+
+#include "parallel.h"
+
+#include "logging.h"
+
+
+namespace argweaver {
+
+
+// Stack size for worker threads.  The HMM code keeps several per-block
+// arrays on the stack.
+static const size_t WORKER_STACK_SIZE = 64 * 1024 * 1024;
+
+
+ThreadPool::ThreadPool(int nthreads) :
+    nthreads(nthreads < 1 ? 1 : nthreads),
+    workers(NULL),
+    batch(0),
+    nactive(0),
+    stop(false),
+    func(NULL),
+    data(NULL),
+    ntasks(0),
+    next_task(0)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&start_cond, NULL);
+    pthread_cond_init(&done_cond, NULL);
+
+    if (this->nthreads == 1)
+        return;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+
+    workers = new pthread_t [this->nthreads - 1];
+    for (int i=0; i<this->nthreads - 1; i++) {
+        if (pthread_create(&workers[i], &attr, worker_main, this) != 0) {
+            printError("could not create worker thread");
+            abort();
+        }
+    }
+    pthread_attr_destroy(&attr);
+}
+
+
+ThreadPool::~ThreadPool()
+{
+    if (workers) {
+        pthread_mutex_lock(&lock);
+        stop = true;
+        pthread_cond_broadcast(&start_cond);
+        pthread_mutex_unlock(&lock);
+
+        for (int i=0; i<nthreads - 1; i++)
+            pthread_join(workers[i], NULL);
+        delete [] workers;
+    }
+
+    pthread_mutex_destroy(&lock);
+    pthread_cond_destroy(&start_cond);
+    pthread_cond_destroy(&done_cond);
+}
+
+
+void ThreadPool::run(int ntasks, TaskFunc func, void *data)
+{
+    // run small batches without waking the workers
+    if (nthreads == 1 || ntasks <= 1) {
+        for (int i=0; i<ntasks; i++)
+            func(i, data);
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    this->func = func;
+    this->data = data;
+    this->ntasks = ntasks;
+    next_task = 0;
+    nactive = nthreads - 1;
+    batch++;
+    pthread_cond_broadcast(&start_cond);
+    pthread_mutex_unlock(&lock);
+
+    work();
+
+    pthread_mutex_lock(&lock);
+    while (nactive > 0)
+        pthread_cond_wait(&done_cond, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+
+// Claim and run tasks of the current batch until none are left
+void ThreadPool::work()
+{
+    while (true) {
+        const int task = __sync_fetch_and_add(&next_task, 1);
+        if (task >= ntasks)
+            break;
+        func(task, data);
+    }
+}
+
+
+void *ThreadPool::worker_main(void *_pool)
+{
+    ThreadPool *pool = (ThreadPool*) _pool;
+    int last_batch = 0;
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stop && pool->batch == last_batch)
+            pthread_cond_wait(&pool->start_cond, &pool->lock);
+        if (pool->stop) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        last_batch = pool->batch;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->work();
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->nactive == 0)
+            pthread_cond_signal(&pool->done_cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,59 @@
+//=============================================================================
+// Thread pool for running independent tasks in parallel
+
+#ifndef ARGWEAVER_PARALLEL_H
+#define ARGWEAVER_PARALLEL_H
+
+#include <pthread.h>
+
+
+namespace argweaver {
+
+
+// A task function is called once for each task index
+typedef void (*TaskFunc)(int task, void *data);
+
+
+// A fixed set of worker threads that run batches of independent tasks.
+//
+// Tasks are not assigned to threads in advance.  Each thread repeatedly
+// claims the next unclaimed task index, so threads that finish early take
+// over the remaining work of a batch.  The calling thread also works on
+// the batch, so a pool of nthreads threads starts nthreads-1 workers.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int nthreads=1);
+    ~ThreadPool();
+
+    // Returns the number of threads working on a batch (including caller)
+    int get_num_threads() const { return nthreads; }
+
+    // Run func(task, data) for task = 0..ntasks-1 and wait for all tasks
+    // to finish.  Batches must not be run from within a task.
+    void run(int ntasks, TaskFunc func, void *data);
+
+protected:
+    static void *worker_main(void *pool);
+    void work();
+
+    int nthreads;
+    pthread_t *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;  // signals a new batch or shutdown
+    pthread_cond_t done_cond;   // signals the end of a batch
+    int batch;                  // number of batches started so far
+    int nactive;                // workers still working on current batch
+    bool stop;
+
+    // current batch
+    TaskFunc func;
+    void *data;
+    int ntasks;
+    int next_task;
+};
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_PARALLEL_H
@@ -0,0 +1,113 @@
+//=============================================================================
+// Random number generation
+//
+// xoshiro256** by David Blackman and Sebastiano Vigna,
+// http://prng.di.unimi.it/xoshiro256starstar.c
+
+#include "random.h"
+
+#include <stdio.h>
+
+
+namespace argweaver {
+
+
+static RandomGenerator g_random_generator;
+static __thread RandomGenerator *g_thread_random_generator = NULL;
+
+
+// splitmix64, used to expand a seed into a full state
+static uint64_t splitmix64(uint64_t &x)
+{
+    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+
+void RandomGenerator::set_seed(uint64_t seed, RandomKind kind)
+{
+    this->kind = kind;
+    uint64_t x = seed;
+    for (int i=0; i<4; i++)
+        s[i] = splitmix64(x);
+    if (kind == RANDOM_LIBC)
+        srand(seed);
+}
+
+
+void RandomGenerator::jump()
+{
+    static const uint64_t JUMP[] = {
+        0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+        0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL};
+
+    uint64_t t[4] = {0, 0, 0, 0};
+    for (int i=0; i<4; i++) {
+        for (int b=0; b<64; b++) {
+            if (JUMP[i] & (uint64_t(1) << b)) {
+                for (int j=0; j<4; j++)
+                    t[j] ^= s[j];
+            }
+            next();
+        }
+    }
+    for (int j=0; j<4; j++)
+        s[j] = t[j];
+}
+
+
+RandomGenerator RandomGenerator::split()
+{
+    RandomGenerator rng(*this);
+    jump();
+    return rng;
+}
+
+
+std::string RandomGenerator::get_state() const
+{
+    if (kind != RANDOM_XOSHIRO)
+        return "";
+
+    char state[100];
+    snprintf(state, sizeof(state),
+             "xoshiro256** %016llx %016llx %016llx %016llx",
+             (unsigned long long) s[0], (unsigned long long) s[1],
+             (unsigned long long) s[2], (unsigned long long) s[3]);
+    return state;
+}
+
+
+bool RandomGenerator::set_state(const std::string &state)
+{
+    unsigned long long t[4];
+    if (sscanf(state.c_str(), "xoshiro256** %llx %llx %llx %llx",
+               &t[0], &t[1], &t[2], &t[3]) != 4)
+        return false;
+    if (t[0] == 0 && t[1] == 0 && t[2] == 0 && t[3] == 0)
+        return false;
+
+    kind = RANDOM_XOSHIRO;
+    for (int i=0; i<4; i++)
+        s[i] = t[i];
+    return true;
+}
+
+
+RandomGenerator *get_random_generator()
+{
+    if (g_thread_random_generator)
+        return g_thread_random_generator;
+    return &g_random_generator;
+}
+
+
+void set_thread_random_generator(RandomGenerator *rng)
+{
+    g_thread_random_generator = rng;
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,109 @@
+//=============================================================================
+// Random number generation
+
+#ifndef ARGWEAVER_RANDOM_H
+#define ARGWEAVER_RANDOM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+
+
+namespace argweaver {
+
+
+// Algorithms for generating random numbers
+enum RandomKind {
+    RANDOM_XOSHIRO=0,  // xoshiro256**
+    RANDOM_LIBC        // rand() of the C library (as in older versions)
+};
+
+
+// A stream of random numbers.
+//
+// xoshiro256** streams can be split into independent streams with jump(),
+// which advances a stream by 2^128 numbers, and their state can be saved
+// and restored.  RANDOM_LIBC streams use the hidden global state of rand(),
+// so they can neither be split nor saved.
+class RandomGenerator
+{
+public:
+    explicit RandomGenerator(uint64_t seed=0, RandomKind kind=RANDOM_XOSHIRO)
+    {
+        set_seed(seed, kind);
+    }
+
+    void set_seed(uint64_t seed, RandomKind kind=RANDOM_XOSHIRO);
+
+    inline RandomKind get_kind() const { return kind; }
+
+    // Returns the next 64 random bits (xoshiro256** only)
+    inline uint64_t next()
+    {
+        const uint64_t result = rotl(s[1] * 5, 7) * 9;
+        const uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+
+    // Returns a uniform random number in (0, 1).  RANDOM_LIBC returns a
+    // number in [0, 1] as older versions did.
+    inline double uniform()
+    {
+        if (kind == RANDOM_LIBC)
+            return rand() / double(RAND_MAX);
+        return (double(next() >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+    }
+
+    // Returns a uniform random integer in [0, max)
+    inline int uniform_int(int max)
+    {
+        const int i = (kind == RANDOM_LIBC) ?
+            int(rand() / float(RAND_MAX) * max) : int(uniform() * max);
+        return (i == max) ? max - 1 : i;
+    }
+
+    // Advances the stream by 2^128 numbers
+    void jump();
+
+    // Returns a stream that starts at the current position of this stream
+    // and jumps this stream ahead of it.  Repeated splits give
+    // non-overlapping streams.
+    RandomGenerator split();
+
+    // Returns the state of the stream as a line of text, or an empty
+    // string if the state cannot be saved
+    std::string get_state() const;
+
+    // Restores a state returned by get_state().  Returns false if the
+    // state cannot be parsed.
+    bool set_state(const std::string &state);
+
+protected:
+    static inline uint64_t rotl(const uint64_t x, int k)
+    {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    RandomKind kind;
+    uint64_t s[4];
+};
+
+
+// Returns the stream used by frand(), irand() and friends in the calling
+// thread.  Unless set_thread_random_generator() was called this is the
+// global stream.
+RandomGenerator *get_random_generator();
+
+// Sets the stream of the calling thread.  NULL selects the global stream.
+void set_thread_random_generator(RandomGenerator *rng);
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_RANDOM_H
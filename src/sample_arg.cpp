@@ -10,6 +10,7 @@
 #include "local_tree.h"
 #include "logging.h"
 #include "model.h"
+#include "parallel.h"
 #include "sample_arg.h"
 #include "sample_thread.h"
 #include "sequences.h"
@@ -163,10 +164,11 @@ bool resample_arg_mcmc(const ArgModel *model, const Sequences *sequences,
     double npaths2 = count_total_arg_removal_paths(trees);
 
     // perform reject if needed
+    // NOTE: trees2 is no longer needed, so restore it by swapping
     double accept_prob = exp(npaths - npaths2);
     bool accept = (frand() < accept_prob);
     if (!accept)
-        trees->copy(trees2);
+        trees->swap(trees2);
 
     // logging
     printLog(LOG_LOW, "accept_prob = exp(%lf - %lf) = %f, accept = %d\n",
@@ -183,14 +185,14 @@ bool resample_arg_mcmc(const ArgModel *model, const Sequences *sequences,
 // Also sometimes resample leaves specifically
 void resample_arg_mcmc_all(const ArgModel *model, const Sequences *sequences,
                            LocalTrees *trees, double frac_leaf,
-                           int window, int step, int niters)
+                           int window, int step, int niters, ThreadPool *pool)
 {
     if (frand() < frac_leaf) {
         resample_arg_leaf(model, sequences, trees);
         printLog(LOG_LOW, "resample_arg_leaf: accept=%f\n", 1.0);
     } else {
         double accept_rate = resample_arg_regions(
-            model, sequences, trees, window, step, niters);
+            model, sequences, trees, window, step, niters, pool);
         printLog(LOG_LOW, "resample_arg_regions: accept=%f\n", accept_rate);
     }
 }
@@ -416,30 +418,21 @@ State find_state_sub_tree_internal(
 }
 
 
-// resample an ARG only for a given region
+// resample the ARG of a region that has been partitioned into its own
+// local trees
 // all branches are possible to resample
-// open_ended -- If true and region touches start or end of local trees do not
-//               conditioned on state.
-double resample_arg_region(
+// open_start, open_end -- If true, do not condition on the state at the
+//                         start (end) of the region.
+// nested_log -- If true, lower the log level while threading.  The log level
+//               is global and must not be changed by concurrent calls.
+static double resample_arg_region_trees(
     const ArgModel *model, const Sequences *sequences,
-    LocalTrees *trees, int region_start, int region_end, int niters,
-    bool open_ended)
+    LocalTrees *trees2, int niters, bool open_start, bool open_end,
+    bool nested_log=true)
 {
     const int maxtime = model->get_removed_root_time();
-
-    // special case: zero length region
-    if (region_start == region_end)
-        return 1.0;
-
-    // assert region is within trees
-    assert(region_start >= trees->start_coord);
-    assert(region_end <= trees->end_coord);
-    assert(region_start < region_end);
-
-    // partion trees into three segments
-    LocalTrees *trees2 = partition_local_trees(trees, region_start);
-    LocalTrees *trees3 = partition_local_trees(trees2, region_end);
-    assert(trees2->length() == region_end - region_start);
+    const int region_start = trees2->start_coord;
+    const int region_end = trees2->end_coord;
 
     // TODO: refactor
     // extend stub (zero length block) if it happens to exist
@@ -450,13 +443,14 @@ double resample_arg_region(
     }
 
     // perform several iterations of resampling
+    // the saved copy is reused between iterations to avoid reallocation
+    LocalTrees old_trees2;
     int accepts = 0;
     for (int i=0; i<niters; i++) {
         printLog(LOG_LOW, "region sample: iter=%d, region=(%d, %d)\n",
                  i, region_start, region_end);
 
         // save a copy of the local trees
-        LocalTrees old_trees2;
         old_trees2.copy(*trees2);
 
         // get starting and ending trees
@@ -478,26 +472,28 @@ double resample_arg_region(
             &end_tree, end_tree_partial, maxtime);
 
         // set start/end state to null if open ended is requested
-        if (open_ended) {
-            if (region_start == trees->start_coord)
-                start_state.set_null();
-            if (region_end == trees3->end_coord)
-                end_state.set_null();
-        }
+        if (open_start)
+            start_state.set_null();
+        if (open_end)
+            end_state.set_null();
 
         // sample new ARG conditional on start and end states
-        decLogLevel();
+        if (nested_log)
+            decLogLevel();
         cond_sample_arg_thread_internal(model, sequences, trees2,
                                         start_state, end_state);
-        incLogLevel();
+        if (nested_log)
+            incLogLevel();
         assert_trees(trees2);
         double npaths2 = count_total_arg_removal_paths(trees2);
 
         // perform reject if needed
+        // NOTE: restoring by swapping leaves the rejected trees in
+        // old_trees2, whose allocations are reused by the next copy
         double accept_prob = exp(npaths - npaths2);
         bool accept = (frand() < accept_prob);
         if (!accept)
-            trees2->copy(old_trees2);
+            trees2->swap(old_trees2);
         else
             accepts++;
 
@@ -512,6 +508,39 @@ double resample_arg_region(
         trees2->end_coord--;
     }
 
+    return accepts / double(niters);
+}
+
+
+// resample an ARG only for a given region
+// all branches are possible to resample
+// open_ended -- If true and region touches start or end of local trees do not
+//               conditioned on state.
+double resample_arg_region(
+    const ArgModel *model, const Sequences *sequences,
+    LocalTrees *trees, int region_start, int region_end, int niters,
+    bool open_ended)
+{
+    // special case: zero length region
+    if (region_start == region_end)
+        return 1.0;
+
+    // assert region is within trees
+    assert(region_start >= trees->start_coord);
+    assert(region_end <= trees->end_coord);
+    assert(region_start < region_end);
+
+    const bool open_start = open_ended && region_start == trees->start_coord;
+    const bool open_end = open_ended && region_end == trees->end_coord;
+
+    // partion trees into three segments
+    LocalTrees *trees2 = partition_local_trees(trees, region_start);
+    LocalTrees *trees3 = partition_local_trees(trees2, region_end);
+    assert(trees2->length() == region_end - region_start);
+
+    double accept_rate = resample_arg_region_trees(
+        model, sequences, trees2, niters, open_start, open_end);
+
     // rejoin trees
     append_local_trees(trees, trees2);
     append_local_trees(trees, trees3);
@@ -520,26 +549,154 @@ double resample_arg_region(
     delete trees2;
     delete trees3;
 
-    return accepts / double(niters);
+    return accept_rate;
+}
+
+
+// A region of the ARG that is resampled by one task of
+// resample_arg_regions_parallel()
+struct RegionTask
+{
+    LocalTrees *trees;
+    bool open_start;
+    bool open_end;
+    double accept_rate;
+    RandomGenerator rng;  // independent random stream of the task
+};
+
+struct RegionTasks
+{
+    const ArgModel *model;
+    const Sequences *sequences;
+    int niters;
+    vector<RegionTask> tasks;
+};
+
+static void resample_arg_region_task(int i, void *data)
+{
+    RegionTasks *regions = (RegionTasks*) data;
+    RegionTask &task = regions->tasks[i];
+    set_thread_random_generator(&task.rng);
+    task.accept_rate = resample_arg_region_trees(
+        regions->model, regions->sequences, task.trees, regions->niters,
+        task.open_start, task.open_end, false);
+    set_thread_random_generator(NULL);
+}
+
+
+// resample several non-overlapping regions of an ARG concurrently
+// regions must be sorted by start and non-empty
+// Each region uses its own random stream split from the caller's stream, so
+// the result is the same for any number of threads above one.  (With one
+// thread resample_arg_regions() draws from the caller's stream instead.)
+// Returns the sum of the acceptance rates of all regions.
+static double resample_arg_regions_parallel(
+    const ArgModel *model, const Sequences *sequences, LocalTrees *trees,
+    const vector<int> &starts, const vector<int> &ends, int niters,
+    ThreadPool *pool)
+{
+    const int nregions = starts.size();
+    const int trees_start = trees->start_coord;
+    const int trees_end = trees->end_coord;
+
+    // partition trees into alternating segments: gap, region, gap, ...
+    // trees keeps the first gap, pieces holds all later segments
+    RegionTasks regions;
+    regions.model = model;
+    regions.sequences = sequences;
+    regions.niters = niters;
+    vector<LocalTrees*> pieces;
+    LocalTrees *rest = trees;
+    for (int i=0; i<nregions; i++) {
+        assert(starts[i] < ends[i]);
+        assert(i == 0 || ends[i-1] <= starts[i]);
+
+        LocalTrees *region = partition_local_trees(rest, starts[i]);
+        rest = partition_local_trees(region, ends[i]);
+        assert(region->length() == ends[i] - starts[i]);
+        pieces.push_back(region);
+        pieces.push_back(rest);
+
+        RegionTask task;
+        task.trees = region;
+        task.open_start = (starts[i] == trees_start);
+        task.open_end = (ends[i] == trees_end);
+        task.accept_rate = 0.0;
+        task.rng = get_random_generator()->split();
+        regions.tasks.push_back(task);
+    }
+
+    pool->run(nregions, resample_arg_region_task, &regions);
+
+    // rejoin trees
+    for (unsigned int i=0; i<pieces.size(); i++) {
+        append_local_trees(trees, pieces[i]);
+        delete pieces[i];
+    }
+
+    double accept_rate = 0.0;
+    for (int i=0; i<nregions; i++)
+        accept_rate += regions.tasks[i].accept_rate;
+    return accept_rate;
 }
 
 
 // resample an ARG a region at a time in a sliding window
+// If a thread pool with several threads is given, windows that do not
+// overlap are resampled concurrently.  Windows are grouped into phases such
+// that the windows of one phase are separated by at least one window of
+// another phase (even and odd windows when step = window / 2).
 double resample_arg_regions(
     const ArgModel *model, const Sequences *sequences,
-    LocalTrees *trees, int window, int step, int niters)
+    LocalTrees *trees, int window, int step, int niters, ThreadPool *pool)
 {
     decLogLevel();
     double accept_rate = 0.0;
     int nwindows = 0;
-    for (int start=trees->start_coord;
-         start == trees->start_coord || start+window/2 <trees->end_coord;
-         start+=step)
-    {
-        nwindows++;
-        int end = min(start + window, trees->end_coord);
-        accept_rate += resample_arg_region(
-            model, sequences, trees, start, end, niters);
+
+    if (!pool || pool->get_num_threads() == 1 || step <= 0) {
+        for (int start=trees->start_coord;
+             start == trees->start_coord || start+window/2 <trees->end_coord;
+             start+=step)
+        {
+            nwindows++;
+            int end = min(start + window, trees->end_coord);
+            accept_rate += resample_arg_region(
+                model, sequences, trees, start, end, niters);
+        }
+    } else {
+        // determine windows
+        vector<int> starts, ends;
+        for (int start=trees->start_coord;
+             start == trees->start_coord || start+window/2 <trees->end_coord;
+             start+=step)
+        {
+            nwindows++;
+            starts.push_back(start);
+            ends.push_back(min(start + window, trees->end_coord));
+        }
+
+        // window i and i+nphases do not overlap
+        const int nphases = (window + step - 1) / step;
+
+        // the threads share the global log level
+        decLogLevel();
+        for (int phase=0; phase<nphases; phase++) {
+            vector<int> phase_starts, phase_ends;
+            for (int i=phase; i<nwindows; i+=nphases) {
+                if (starts[i] < ends[i]) {
+                    phase_starts.push_back(starts[i]);
+                    phase_ends.push_back(ends[i]);
+                } else {
+                    // zero length region, see resample_arg_region()
+                    accept_rate += 1.0;
+                }
+            }
+            accept_rate += resample_arg_regions_parallel(
+                model, sequences, trees, phase_starts, phase_ends, niters,
+                pool);
+        }
+        incLogLevel();
     }
     incLogLevel();
 
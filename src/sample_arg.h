@@ -11,6 +11,7 @@
 // arghmm includes
 #include "local_tree.h"
 #include "model.h"
+#include "parallel.h"
 #include "sequences.h"
 
 
@@ -35,7 +36,8 @@ bool resample_arg_mcmc(const ArgModel *model, const Sequences *sequences,
 
 void resample_arg_mcmc_all(const ArgModel *model, const Sequences *sequences,
                            LocalTrees *trees, double frac_leaf,
-                           int window, int step, int niters);
+                           int window, int step, int niters,
+                           ThreadPool *pool=NULL);
 
 void resample_arg_climb(const ArgModel *model, const Sequences *sequences,
                         LocalTrees *trees, double recomb_preference);
@@ -66,7 +68,8 @@ double resample_arg_cut(
 
 double resample_arg_regions(
     const ArgModel *model, const Sequences *sequences,
-    LocalTrees *trees, int window, int step, int niters=1);
+    LocalTrees *trees, int window, int step, int niters=1,
+    ThreadPool *pool=NULL);
 
 } // namespace argweaver
 
@@ -1,11 +1,14 @@
 // c++ includes
 #include <list>
 #include <vector>
+#include <float.h>
 #include <string.h>
 
 // arghmm includes
 #include "common.h"
 #include "emit.h"
+#include "forward_kernel.h"
+#include "forward_runs.h"
 #include "hmm.h"
 #include "local_tree.h"
 #include "logging.h"
@@ -183,21 +186,28 @@ void arghmm_forward_block_new(const LocalTree *tree, const int ntimes,
 
 // compute one block of forward algorithm with compressed transition matrices
 // NOTE: first column of forward table should be pre-populated
+//
+// If runs is given, long runs of shared emission rows may be skipped with
+// matrix powers (see ForwardRun), as selected by run_mode, and are
+// appended to runs.  start is the coordinate of fw[0].
+//
+// Temporaries are kept in workspace, if given, so that they can be reused
+// for the next block.
 void arghmm_forward_block(const LocalTree *tree, const int ntimes,
                           const int blocklen, const States &states,
                           const LineageCounts &lineages,
                           const TransMatrix *matrix,
-                          const double* const *emit, double **fw)
+                          const double* const *emit, double **fw,
+                          ForwardRuns *runs, int start,
+                          ForwardWorkspace *workspace,
+                          ForwardRunMode run_mode)
 {
     const int nstates = states.size();
     const LocalNode *nodes = tree->nodes;
 
     //  handle internal branch resampling special cases
     int minage = matrix->minage;
-    int maintree_root = 0;
     if (matrix->internal) {
-        maintree_root = nodes[tree->root].child[1];
-
         if (nstates == 0) {
             // handle fully given case
             for (int i=1; i<blocklen; i++)
@@ -206,93 +216,135 @@ void arghmm_forward_block(const LocalTree *tree, const int ntimes,
         }
     }
 
-    // compute ntimes*ntimes and ntime*nstates temp matrices
-    double tmatrix[ntimes][ntimes];
-    double tmatrix2[ntimes][nstates];
+    ForwardWorkspace local_workspace;
+    if (!workspace)
+        workspace = &local_workspace;
+    workspace->reserve(ntimes, tree->nnodes);
+
+    // compute ntimes*ntimes temp matrix
+    double *tmatrix = &workspace->tmatrix[0];
     for (int a=0; a<ntimes-1; a++) {
         for (int b=0; b<ntimes-1; b++) {
-            tmatrix[a][b] = matrix->get_time(a, b, 0, minage, false);
-            assert(!isnan(tmatrix[a][b]));
+            tmatrix[a*ntimes + b] = matrix->get_time(a, b, 0, minage, false);
+            assert(!isnan(tmatrix[a*ntimes + b]));
         }
+    }
 
-        for (int k=0; k<nstates; k++) {
-            const int b = states[k].time;
-            const int node2 = states[k].node;
-            const int c = nodes[node2].age;
-            assert(b >= minage);
-            tmatrix2[a][k] = matrix->get_time(a, b, c, minage, true) -
-                             matrix->get_time(a, b, 0, minage, false);
+    // get branches of the state space
+    // NOTE: states of the same branch are clustered together and their
+    // times are increasing, see get_coal_states()
+    int *branch_start = &workspace->branch_start[0];
+    int *branch_len = &workspace->branch_len[0];
+    int *branch_age = &workspace->branch_age[0];
+    int nbranches = 0;
+    int ntrans2 = 0;
+    for (int k=0; k<nstates; k++) {
+        if (k == 0 || states[k].node != states[k-1].node) {
+            branch_start[nbranches] = k;
+            branch_len[nbranches] = 0;
+            branch_age[nbranches] = states[k].time;
+            nbranches++;
         }
+        assert(states[k].time == branch_age[nbranches-1] +
+               branch_len[nbranches-1]);
+        branch_len[nbranches-1]++;
     }
-
-    // get max time
-    int maxtime = 0;
-    for (int k=0; k<nstates; k++)
-        if (maxtime < states[k].time)
-            maxtime = states[k].time;
-
-    // get branch ages
-    NodeStateLookup state_lookup(states, tree->nnodes);
-    int ages1[tree->nnodes];
-    int ages2[tree->nnodes];
-    int indexes[tree->nnodes];
-    for (int i=0; i<tree->nnodes; i++) {
-        ages1[i] = max(nodes[i].age, minage);
-        indexes[i] = state_lookup.lookup(i, ages1[i]);
-        if (matrix->internal)
-            ages2[i] = (i == maintree_root || i == tree->root) ?
-                maxtime : nodes[nodes[i].parent].age;
-        else
-            ages2[i] = (i == tree->root) ? maxtime : nodes[nodes[i].parent].age;
+    for (int n=0; n<nbranches; n++)
+        ntrans2 += branch_len[n] * branch_len[n];
+
+    // compute same branch transition terms, packed branch by branch
+    // such that trans2[j][k] is the extra term for the transition from
+    // the j-th to the k-th state of the branch
+    double *tmatrix2 = ForwardWorkspace::grow(workspace->tmatrix2,
+                                              max(ntrans2, 1));
+    double *t2 = tmatrix2;
+    for (int n=0; n<nbranches; n++) {
+        const int start = branch_start[n];
+        const int len = branch_len[n];
+        const int c = nodes[states[start].node].age;
+        for (int j=0; j<len; j++) {
+            const int a = branch_age[n] + j;
+            for (int k=0; k<len; k++) {
+                const int b = branch_age[n] + k;
+                assert(b >= minage);
+                *t2++ = matrix->get_time(a, b, c, minage, true) -
+                    matrix->get_time(a, b, 0, minage, false);
+            }
+        }
     }
 
+    // compute the remaining columns of the block
+    ForwardColumnsFunc forward_columns = get_forward_columns_func();
+    if (!runs || run_mode == FORWARD_RUNS_OFF) {
+        forward_columns(ntimes, nstates, blocklen, tmatrix, tmatrix2,
+                        nbranches, branch_start, branch_len, branch_age,
+                        emit, fw);
+        return;
+    }
 
-    double tmatrix_fgroups[ntimes];
-    double fgroups[ntimes];
-    for (int i=1; i<blocklen; i++) {
-        const double *col1 = fw[i-1];
-        double *col2 = fw[i];
-        const double *emit2 = emit[i];
-
-        // precompute the fgroup sums
-        fill(fgroups, fgroups+ntimes, 0.0);
-        for (int j=0; j<nstates; j++) {
-            const int a = states[j].time;
-            fgroups[a] += col1[j];
+    // Find runs of shared emission rows and skip the long ones with matrix
+    // powers.  Columns between runs are computed as usual.  Runs never
+    // start at the first column so that their first column belongs to
+    // this block even if fw[0] is the last column of the previous block.
+    const double step_cost = double(ntimes) * ntimes + ntrans2 + 3 * nstates;
+    double *trans = NULL;
+    int direct = 1;  // first column not computed yet
+    for (int i=1; i<blocklen;) {
+        int end = i + 1;
+        while (end < blocklen && emit[end] == emit[i])
+            end++;
+        const int len = end - i;
+
+        if (i < 2 || len < 2 || !use_forward_run(run_mode, len, nstates, step_cost)) {
+            i = end;
+            continue;
         }
 
-        // multiply tmatrix and fgroups together
-        for (int b=0; b<ntimes-1; b++) {
-            double sum = 0.0;
-            for (int a=0; a<ntimes-1; a++)
-                sum += tmatrix[a][b] * fgroups[a];
-            tmatrix_fgroups[b] = sum;
-        }
+        // compute columns before run
+        if (direct < i)
+            forward_columns(ntimes, nstates, i - direct + 1, tmatrix,
+                            tmatrix2, nbranches, branch_start, branch_len,
+                            branch_age, &emit[direct-1], &fw[direct-1]);
 
-        // fill in one column of forward table
-        double norm = 0.0;
-        for (int k=0; k<nstates; k++) {
-            const int b = states[k].time;
-            const int node2 = states[k].node;
-            const int age1 = ages1[node2];
-            const int age2 = ages2[node2];
-
-            assert(!isnan(col1[k]));
-
-            // same branch case
-            double sum = tmatrix_fgroups[b];
-            const int j1 = indexes[node2];
-            for (int j=j1, a=age1; a<=age2; j++, a++)
-                sum += tmatrix2[a][k] * col1[j];
-
-            col2[k] = sum * emit2[k];
-            norm += col2[k];
+        // get dense transition matrix
+        if (!trans) {
+            trans = ForwardWorkspace::grow(workspace->trans,
+                                           nstates * nstates);
+            for (int j=0; j<nstates; j++)
+                for (int k=0; k<nstates; k++)
+                    trans[j*nstates + k] =
+                        tmatrix[states[j].time*ntimes + states[k].time];
+            const double *t2 = tmatrix2;
+            for (int n=0; n<nbranches; n++) {
+                const int bstart = branch_start[n];
+                const int blen = branch_len[n];
+                for (int j=bstart; j<bstart+blen; j++)
+                    for (int k=bstart; k<bstart+blen; k++)
+                        trans[j*nstates + k] += *t2++;
+            }
         }
 
-        // normalize column for numerical stability
+        ForwardRun run;
+        run.start = start + i - 1;
+        run.len = len;
+        run.emit.assign(emit[i], emit[i] + nstates);
+        run.diag.resize(nstates);
         for (int k=0; k<nstates; k++)
-            col2[k] /= norm;
+            run.diag[k] = trans[k*nstates + k] * emit[i][k];
+        run.log_scale = forward_run_power(nstates, len, trans, emit[i],
+                                          fw[i-1], fw[end-1]);
+        runs->push_back(run);
+
+        direct = end;
+        i = end;
     }
+
+    // compute columns after last run
+    if (direct < blocklen)
+        forward_columns(ntimes, nstates, blocklen - direct + 1,
+                        tmatrix, tmatrix2, nbranches, branch_start,
+                        branch_len, branch_age, &emit[direct-1],
+                        &fw[direct-1]);
 }
 
 
@@ -400,6 +452,7 @@ void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
     ArgModel local_model;
 
     double **fw = forward->get_table();
+    forward->runs.clear();
 
     // forward algorithm over local trees
     for (matrix_iter->begin(); matrix_iter->more(); matrix_iter->next()) {
@@ -450,7 +503,9 @@ void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
         else
             arghmm_forward_block(tree, model->ntimes, blocklen,
                                  states, lineages, matrices.transmat,
-                                 emit, fw_block);
+                                 emit, fw_block, &forward->runs,
+                                 fw_block - fw, matrix_iter->get_workspace(),
+                                 model->forward_run_mode);
 
         // safety check
         double top2 = max_array(fw[pos + matrices.blocklen - 1], nstates);
@@ -459,6 +514,107 @@ void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
 }
 
 
+// Number of columns computed at a time when the forward table is stored in
+// single precision
+static const int FORWARD_FLOAT_CHUNK = 256;
+
+
+// Stores a forward column in single precision.  Probabilities too small for
+// a normal float are raised to FLT_MIN rather than flushed to zero or kept
+// as denormals, so that every state possible in double precision can still
+// be sampled in the traceback.
+static inline void store_float_column(const double *col, int nstates,
+                                      float *dest)
+{
+    for (int k=0; k<nstates; k++)
+        dest[k] = (col[k] > 0.0 && col[k] < FLT_MIN) ? FLT_MIN : float(col[k]);
+}
+
+
+// Run forward algorithm for all blocks, storing the table in single
+// precision.  Columns are computed in double precision a chunk at a time
+// and only rounded when they are stored, so the recursion itself is the
+// same as for a double precision table.
+void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
+    const Sequences *sequences, ArgHmmMatrixIter *matrix_iter,
+    ArgHmmForwardTableFloat *forward, bool prior_given, bool internal)
+{
+    LineageCounts lineages(model->ntimes);
+    States states;
+    ArgModel local_model;
+
+    float **fw = forward->get_table();
+    forward->runs.clear();
+
+    // cols[0] holds the last computed column in double precision
+    vector<double> buf;
+    vector<double*> cols(FORWARD_FLOAT_CHUNK);
+    vector<double> last;
+
+    // forward algorithm over local trees
+    for (matrix_iter->begin(); matrix_iter->more(); matrix_iter->next()) {
+        // get block information
+        LocalTree *tree = matrix_iter->get_tree_spr()->tree;
+        ArgHmmMatrices &matrices = matrix_iter->ref_matrices();
+        int pos = matrix_iter->get_block_start();
+        int end = pos + matrices.blocklen;
+        int nstates = max(matrices.nstates2, 1);
+        model->get_local_model(pos, local_model);
+
+        // allocate the forward table
+        if (pos > trees->start_coord || !prior_given)
+            forward->new_block(pos, end, matrices.nstates2);
+
+        buf.resize(FORWARD_FLOAT_CHUNK * nstates);
+        for (int i=0; i<FORWARD_FLOAT_CHUNK; i++)
+            cols[i] = &buf[i * nstates];
+
+        matrices.states_model.get_coal_states(tree, states);
+        lineages.count(tree, internal);
+
+        // compute first column of block, unless the block continues the
+        // state space of the previous block
+        int i = pos;
+        if (pos == trees->start_coord) {
+            if (prior_given)
+                std::copy(fw[pos], fw[pos] + nstates, cols[0]);
+            else
+                calc_state_priors(states, &lineages, &local_model,
+                                  cols[0], matrices.states_model.minage);
+        } else if (matrices.transmat_switch) {
+            arghmm_forward_switch(&last[0], cols[0],
+                matrices.transmat_switch, matrices.emit[0]);
+        } else {
+            std::copy(last.begin(), last.end(), cols[0]);
+            i = pos - 1;
+        }
+        if (i == pos)
+            store_float_column(cols[0], nstates, fw[pos]);
+
+        double top = max_array(cols[0], nstates);
+        assert(top > 0.0);
+
+        // calculate rest of block a chunk at a time
+        while (i < end - 1) {
+            const int n = min(FORWARD_FLOAT_CHUNK, end - i);
+            arghmm_forward_block(tree, model->ntimes, n, states, lineages,
+                                 matrices.transmat, &matrices.emit[i - pos],
+                                 &cols[0], NULL, 0,
+                                 matrix_iter->get_workspace());
+            for (int k=1; k<n; k++)
+                store_float_column(cols[k], nstates, fw[i + k]);
+            std::copy(cols[n-1], cols[n-1] + nstates, cols[0]);
+            i += n - 1;
+        }
+        last.assign(cols[0], cols[0] + nstates);
+
+        // safety check
+        double top2 = max_array(fw[end - 1], nstates);
+        assert(top2 > 0.0);
+    }
+}
+
+
 
 
 //=============================================================================
@@ -466,15 +622,65 @@ void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
 
 
 
+// Computes the transition probabilities trans[j] from every state j to
+// state k.  States of other branches only depend on their time, so they
+// are looked up from one row of times.  Same as matrix->get(tree, states,
+// j, k) for every j.
+void get_transition_column(
+    const LocalTree *tree, const States &states, const TransMatrix *matrix,
+    int k, double *time_trans, double *trans)
+{
+    const int nstates = states.size();
+    if (nstates == 0) {
+        // fully given internal branch
+        trans[0] = matrix->get(tree, states, 0, k);
+        return;
+    }
+
+    int minage = 0;
+    if (matrix->internal) {
+        const int subtree_root = tree->nodes[tree->root].child[0];
+        minage = tree->nodes[subtree_root].age;
+    }
+
+    const int node2 = states[k].node;
+    const int b = states[k].time;
+    const int c = tree->nodes[node2].age;
+    const int ntimes = matrix->ntimes;
+
+    for (int a=0; a<ntimes-1; a++)
+        time_trans[a] = matrix->get_time(a, b, c, minage, false);
+    for (int j=0; j<nstates; j++)
+        trans[j] = time_trans[states[j].time];
+
+    // states on the same branch are contiguous, see get_coal_states()
+    int j = k;
+    while (j > 0 && states[j-1].node == node2)
+        j--;
+    for (; j<nstates && states[j].node == node2; j++)
+        trans[j] = matrix->get_time(states[j].time, b, c, minage, true);
+}
+
+
+// Samples path[0..blocklen-2] given path[blocklen-1].  T is the precision
+// in which the forward table is stored.
+template <class T>
 double sample_hmm_posterior(
     int blocklen, const LocalTree *tree, const States &states,
-    const TransMatrix *matrix, const double *const *fw, int *path)
+    const TransMatrix *matrix, const T *const *fw, int *path,
+    ForwardWorkspace *workspace=NULL)
 {
     // NOTE: path[n-1] must already be sampled
 
     const int nstates = max(states.size(), (size_t)1);
-    double A[nstates];
-    double trans[nstates];
+    ForwardWorkspace local_workspace;
+    if (!workspace)
+        workspace = &local_workspace;
+    workspace->reserve_traceback(matrix->ntimes, nstates);
+    double *A = &workspace->weights[0];
+    double *sums = &workspace->weight_sums[0];
+    double *trans = &workspace->trans_col[0];
+    double *time_trans = &workspace->time_trans[0];
     int last_k = -1;
     double lnl = 0.0;
 
@@ -484,14 +690,11 @@ double sample_hmm_posterior(
 
         // recompute transition probabilities if state (k) changes
         if (k != last_k) {
-            for (int j=0; j<nstates; j++)
-                trans[j] = matrix->get(tree, states, j, k);
+            get_transition_column(tree, states, matrix, k, time_trans, trans);
             last_k = k;
         }
 
-        for (int j=0; j<nstates; j++)
-            A[j] = fw[i][j] * trans[j];
-        path[i] = sample(A, nstates);
+        path[i] = sample_column(fw[i], trans, nstates, A, sums);
         //lnl += log(A[path[i]]);
 
         // DEBUG
@@ -502,8 +705,147 @@ double sample_hmm_posterior(
 }
 
 
+void sample_forward_run_leaving(
+    const ForwardRun &run, const LocalTree *tree, const States &states,
+    const TransMatrix *matrix, int ntimes, const double *fw0, int *path,
+    ForwardWorkspace *workspace)
+{
+    const int len = run.len;
+    const int nstates = run.emit.size();
+    const int k = path[len];
+
+    ForwardWorkspace local_workspace;
+    if (!workspace)
+        workspace = &local_workspace;
+    workspace->reserve_traceback(matrix->ntimes, nstates);
+
+    // recompute the columns of the run
+    double **cols = new_matrix<double>(len, nstates);
+    vector<const double*> emit(len, &run.emit[0]);
+    LineageCounts lineages(ntimes);
+    std::copy(fw0, fw0 + nstates, cols[0]);
+    arghmm_forward_block(tree, ntimes, len, states, lineages, matrix,
+                         &emit[0], cols, NULL, 0, workspace);
+
+    // transition probabilities into state k
+    double *trans = &workspace->trans_col[0];
+    get_transition_column(tree, states, matrix, k, &workspace->time_trans[0],
+                          trans);
+
+    // The traceback stays in k from column len-1 down to i+1 and leaves k
+    // at column i with probability prod_{j>i} stay[j] * leave[i].  The
+    // probability of leaving is summed over the other states rather than
+    // taken as 1 - stay, which would round to zero when staying is likely.
+    vector<double> log_weights(len);
+    double log_stay = 0.0;
+    for (int i=len-1; i>=0; i--) {
+        double stay = cols[i][k] * trans[k];
+        double leave = 0.0;
+        for (int j=0; j<nstates; j++)
+            if (j != k)
+                leave += cols[i][j] * trans[j];
+        const double total = stay + leave;
+        log_weights[i] = log_stay + log(leave / total);
+        log_stay += log(stay / total);
+    }
+
+    // choose the column at which the path leaves k
+    const double max_weight = *max_element(log_weights.begin(),
+                                           log_weights.end());
+    if (max_weight == -INFINITY) {
+        // the path cannot leave k
+        for (int i=0; i<len; i++)
+            path[i] = k;
+        delete_matrix<double>(cols, len);
+        return;
+    }
+    vector<double> weights(len);
+    for (int i=0; i<len; i++)
+        weights[i] = exp(log_weights[i] - max_weight);
+    const int i = sample(&weights[0], len);
+
+    // choose the state it leaves to and sample the rest of the run
+    for (int j=i+1; j<len; j++)
+        path[j] = k;
+    double *A = &workspace->weights[0];
+    for (int j=0; j<nstates; j++)
+        A[j] = (j == k) ? 0.0 : cols[i][j] * trans[j];
+    path[i] = sample(A, nstates);
+    sample_hmm_posterior<double>(i + 1, tree, states, matrix, cols, path,
+                                 workspace);
+
+    delete_matrix<double>(cols, len);
+}
+
+
+// Samples the path across a run of columns skipped by the forward
+// algorithm, given the state path[run.len] after the run.  fw[0] and
+// path[0] are the column and state at run.start.
+//
+// Usually the path stays in the same state for the whole run, which is
+// decided directly from the run's scale.  Otherwise the path is sampled
+// conditioned on leaving the state.
+template <class T>
+static void sample_forward_run(
+    const ForwardRun &run, const LocalTree *tree, const States &states,
+    const TransMatrix *matrix, int ntimes, const T *const *fw,
+    int *path, ForwardWorkspace *workspace)
+{
+    const int len = run.len;
+    const int nstates = run.emit.size();
+    const int k = path[len];
+
+    // probability that the path stays in state k across the whole run
+    const double log_stay = log(fw[0][k]) + len * log(run.diag[k])
+        - run.log_scale - log(fw[len][k]);
+    if (log(frand()) < log_stay) {
+        for (int i=0; i<len; i++)
+            path[i] = k;
+        return;
+    }
+
+    // reserved here, so that the buffers keep their place in the traceback
+    workspace->reserve_traceback(matrix->ntimes, nstates);
+    double *col = &workspace->column[0];
+    std::copy(fw[0], fw[0] + nstates, col);
+    sample_forward_run_leaving(run, tree, states, matrix, ntimes, col, path,
+                               workspace);
+}
+
+
+// Same as sample_hmm_posterior, but also samples across runs of columns
+// skipped by the forward algorithm.  runs are the runs within the block
+// in order of position and pos is the coordinate of fw[0].
+template <class T>
+static double sample_hmm_posterior_runs(
+    int blocklen, const LocalTree *tree, const States &states,
+    const TransMatrix *matrix, int ntimes,
+    const ForwardRun *runs, int nruns, int pos,
+    const T *const *fw, int *path, ForwardWorkspace *workspace)
+{
+    double lnl = 0.0;
+    int end = blocklen;  // path[end-1] is already sampled
+
+    for (int r=nruns-1; r>=0; r--) {
+        const int start = runs[r].start - pos;
+        const int run_end = start + runs[r].len;
+
+        lnl += sample_hmm_posterior(end - run_end, tree, states, matrix,
+                                    &fw[run_end], &path[run_end], workspace);
+        sample_forward_run(runs[r], tree, states, matrix, ntimes,
+                           &fw[start], &path[start], workspace);
+        end = start + 1;
+    }
+
+    lnl += sample_hmm_posterior(end, tree, states, matrix, fw, path,
+                                workspace);
+    return lnl;
+}
+
+
+template <class T>
 int sample_hmm_posterior_step(const TransMatrixSwitch *matrix,
-                              const double *col1, int state2)
+                              const T *col1, int state2)
 {
     const int nstates1 = max(matrix->nstates1, 1);
     double A[nstates1];
@@ -518,13 +860,17 @@ int sample_hmm_posterior_step(const TransMatrixSwitch *matrix,
 }
 
 
-double stochastic_traceback(
+template <class T>
+static double stochastic_traceback_table(
     const LocalTrees *trees, const ArgModel *model,
     ArgHmmMatrixIter *matrix_iter,
-    double **fw, int *path, bool last_state_given, bool internal)
+    T **fw, int *path, bool last_state_given, bool internal,
+    const ForwardRuns *runs)
 {
     States states;
     double lnl = 0.0;
+    int last_run = runs ? runs->size() : 0;
+    ForwardWorkspace *workspace = matrix_iter->get_workspace();
 
     // choose last column first
     matrix_iter->rbegin();
@@ -533,8 +879,10 @@ double stochastic_traceback(
     if (!last_state_given) {
         ArgHmmMatrices &mat = matrix_iter->ref_matrices();
         const int nstates = max(mat.nstates2, 1);
-        path[pos-1] = sample(fw[pos-1], nstates);
-        lnl = fw[pos-1][path[pos-1]];
+        double col[nstates];
+        std::copy(fw[pos-1], fw[pos-1] + nstates, col);
+        path[pos-1] = sample(col, nstates);
+        lnl = col[path[pos-1]];
     }
 
     // iterate backward through blocks
@@ -544,8 +892,21 @@ double stochastic_traceback(
         mat.states_model.get_coal_states(tree, states);
         pos -= mat.blocklen;
 
-        lnl += sample_hmm_posterior(mat.blocklen, tree, states,
-                                    mat.transmat, &fw[pos], &path[pos]);
+        // find skipped runs within block
+        int first_run = last_run;
+        while (first_run > 0 && (*runs)[first_run-1].start >= pos)
+            first_run--;
+
+        if (first_run < last_run)
+            lnl += sample_hmm_posterior_runs(
+                mat.blocklen, tree, states, mat.transmat, model->ntimes,
+                &(*runs)[first_run], last_run - first_run, pos,
+                &fw[pos], &path[pos], workspace);
+        else
+            lnl += sample_hmm_posterior(mat.blocklen, tree, states,
+                                        mat.transmat, &fw[pos], &path[pos],
+                                        workspace);
+        last_run = first_run;
 
         // fill in last col of next block
         if (pos > trees->start_coord) {
@@ -559,7 +920,7 @@ double stochastic_traceback(
             } else {
                 // use normal matrix
                 lnl += sample_hmm_posterior(2, tree, states,
-                    mat.transmat, &fw[pos-1], &path[pos-1]);
+                    mat.transmat, &fw[pos-1], &path[pos-1], workspace);
             }
         }
     }
@@ -568,27 +929,355 @@ double stochastic_traceback(
 }
 
 
+double stochastic_traceback(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter,
+    double **fw, int *path, bool last_state_given, bool internal,
+    const ForwardRuns *runs)
+{
+    return stochastic_traceback_table(trees, model, matrix_iter, fw, path,
+                                      last_state_given, internal, runs);
+}
+
+
+double stochastic_traceback(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter,
+    float **fw, int *path, bool last_state_given, bool internal)
+{
+    return stochastic_traceback_table(trees, model, matrix_iter, fw, path,
+                                      last_state_given, internal,
+                                      (const ForwardRuns*) NULL);
+}
+
+
+
+//=============================================================================
+// Checkpointed forward algorithm and traceback
+
+
+// A block of the ARG with its matrices, kept while its columns are needed
+class CheckpointBlock
+{
+public:
+    CheckpointBlock() :
+        tree(NULL), start(0), end(0)
+    {}
+
+    void set(ArgHmmMatrixIter *matrix_iter)
+    {
+        ArgHmmMatrices &m = matrix_iter->ref_matrices();
+        mat = m;
+        m.detach();
+        tree = matrix_iter->get_tree_spr()->tree;
+        mat.states_model.get_coal_states(tree, states);
+        start = matrix_iter->get_block_start();
+        end = matrix_iter->get_block_end();
+    }
+
+    ArgHmmMatrices mat;
+    LocalTree *tree;
+    States states;
+    int start;
+    int end;
+};
+
+
+// Returns the index of the block containing position pos
+static int find_block_index(ArgHmmMatrixIter *matrix_iter, int pos)
+{
+    int low = 0;
+    int high = matrix_iter->get_num_blocks() - 1;
+    while (low < high) {
+        const int mid = (low + high + 1) / 2;
+        matrix_iter->set_block_index(mid);
+        if (matrix_iter->get_block_start() <= pos)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    return low;
+}
+
+
+// Computes forward columns [p, q) of a block from column p-1 ('prev').
+// cols[0] is the column at p.  prior, if given, is the first column of the
+// ARG.
+static void forward_block_range(
+    const LocalTrees *trees, const ArgModel *model, CheckpointBlock &block,
+    bool internal, int p, int q, const double *prev, const double *prior,
+    double **cols, ForwardWorkspace *workspace)
+{
+    ArgHmmMatrices &mat = block.mat;
+    LineageCounts lineages(model->ntimes);
+    lineages.count(block.tree, internal);
+
+    // first column of the ARG or of a block with a new state space
+    int first = p;
+    if (p == block.start && p == trees->start_coord) {
+        if (prior) {
+            std::copy(prior, prior + max(mat.transmat->nstates, 1), cols[0]);
+        } else {
+            ArgModel local_model;
+            model->get_local_model(p, local_model);
+            calc_state_priors(block.states, &lineages, &local_model, cols[0],
+                              mat.states_model.minage);
+        }
+        prev = cols[0];
+        first++;
+    } else if (p == block.start && mat.transmat_switch) {
+        arghmm_forward_switch(prev, cols[0], mat.transmat_switch,
+                              mat.emit[0]);
+        prev = cols[0];
+        first++;
+    }
+
+    // remaining columns use the transition matrix of the block
+    const int n = q - first;
+    if (n > 0) {
+        vector<const double*> emit(n + 1);
+        vector<double*> fw(n + 1);
+        fw[0] = const_cast<double*>(prev);
+        for (int i=1; i<=n; i++) {
+            emit[i] = mat.emit[first + i - 1 - block.start];
+            fw[i] = cols[first + i - 1 - p];
+        }
+        arghmm_forward_block(block.tree, model->ntimes, n + 1, block.states,
+                             lineages, mat.transmat, &emit[0], &fw[0],
+                             NULL, 0, workspace);
+    }
+}
+
+
+void arghmm_forward_alg_checkpoints(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, ArgHmmForwardCheckpoints *forward,
+    bool internal)
+{
+    vector<double> prev;
+
+    for (matrix_iter->begin(); matrix_iter->more(); matrix_iter->next()) {
+        CheckpointBlock block;
+        block.set(matrix_iter);
+        const int nstates = max(block.mat.transmat->nstates, 1);
+
+        // compute block in pieces that end at segment ends
+        for (int p=block.start; p<block.end;) {
+            const int seg = forward->get_segment(p);
+            const int q = min(block.end, forward->get_segment_end(seg));
+            double **cols = new_matrix<double>(q - p, nstates);
+            forward_block_range(trees, model, block, internal, p, q,
+                                prev.empty() ? NULL : &prev[0],
+                                forward->get_prior(), cols,
+                                matrix_iter->get_workspace());
+
+            if (q == forward->get_segment_end(seg))
+                forward->set_checkpoint(seg, cols[q-p-1], nstates);
+            prev.assign(cols[q-p-1], cols[q-p-1] + nstates);
+            delete_matrix<double>(cols, q - p);
+            p = q;
+        }
+
+        block.mat.clear();
+    }
+}
+
+
+double stochastic_traceback_checkpoints(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, const ArgHmmForwardCheckpoints *forward,
+    int *path, bool internal, bool last_state_given)
+{
+    typedef map<int, CheckpointBlock> BlockMap;
+    BlockMap blocks;
+    double lnl = 0.0;
+    const int nsegments = forward->get_num_segments();
+
+    for (int seg=nsegments-1; seg>=0; seg--) {
+        const int a = forward->get_segment_start(seg);
+        const int b = forward->get_segment_end(seg);
+        const bool last_seg = (seg == nsegments - 1);
+
+        // get blocks of segment and of the position after it
+        const int first_block = find_block_index(matrix_iter, a);
+        const int last_block = find_block_index(
+            matrix_iter, last_seg ? b - 1 : b);
+        int max_nstates = 1;
+        for (int i=first_block; i<=last_block; i++) {
+            if (blocks.find(i) == blocks.end()) {
+                matrix_iter->set_block_index(i);
+                blocks[i].set(matrix_iter);
+            }
+            max_nstates = max(max_nstates, blocks[i].mat.transmat->nstates);
+        }
+
+        // recompute forward columns of segment
+        double **cols = new_matrix<double>(b - a, max_nstates);
+        const double *prev = (seg > 0) ? forward->get_checkpoint(seg-1) : NULL;
+        for (int i=first_block; i<=last_block; i++) {
+            CheckpointBlock &block = blocks[i];
+            const int p = max(a, block.start);
+            const int q = min(b, block.end);
+            if (p >= q)
+                continue;
+            forward_block_range(trees, model, block, internal, p, q,
+                                prev, forward->get_prior(), &cols[p-a],
+                                matrix_iter->get_workspace());
+            prev = cols[q-1-a];
+        }
+
+        // sample last position of segment
+        if (last_seg) {
+            if (!last_state_given) {
+                CheckpointBlock &block = blocks[last_block];
+                const int nstates = max(block.mat.transmat->nstates, 1);
+                path[b-1] = sample(cols[b-1-a], nstates);
+                lnl = cols[b-1-a][path[b-1]];
+            }
+        } else {
+            CheckpointBlock &block = blocks[last_block];
+            if (b == block.start && block.mat.transmat_switch) {
+                path[b-1] = sample_hmm_posterior_step(
+                    block.mat.transmat_switch, cols[b-1-a], path[b]);
+                lnl += log(cols[b-1-a][path[b-1]] *
+                           block.mat.transmat_switch->get(path[b-1], path[b]));
+            } else {
+                double *fw[2] = {cols[b-1-a], NULL};
+                lnl += sample_hmm_posterior(2, block.tree, block.states,
+                                            block.mat.transmat, fw,
+                                            &path[b-1],
+                                            matrix_iter->get_workspace());
+            }
+        }
+
+        // sample rest of segment, one block at a time
+        for (int i=last_block; i>=first_block; i--) {
+            CheckpointBlock &block = blocks[i];
+            const int p = max(a, block.start);
+            const int q = min(b, block.end);
+            if (p >= q)
+                continue;
+            lnl += sample_hmm_posterior(q - p, block.tree, block.states,
+                                        block.mat.transmat, &cols[p-a],
+                                        &path[p],
+                                        matrix_iter->get_workspace());
+
+            // sample last position of previous block within segment
+            if (p > a) {
+                if (block.mat.transmat_switch) {
+                    path[p-1] = sample_hmm_posterior_step(
+                        block.mat.transmat_switch, cols[p-1-a], path[p]);
+                    lnl += log(cols[p-1-a][path[p-1]] *
+                               block.mat.transmat_switch->get(path[p-1],
+                                                              path[p]));
+                } else {
+                    lnl += sample_hmm_posterior(2, block.tree, block.states,
+                        block.mat.transmat, &cols[p-1-a], &path[p-1],
+                        matrix_iter->get_workspace());
+                }
+            }
+        }
+        delete_matrix<double>(cols, b - a);
+
+        // only the first block may be needed by the previous segment
+        for (BlockMap::iterator it=blocks.begin(); it != blocks.end();) {
+            if (it->first > first_block) {
+                it->second.mat.clear();
+                blocks.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    for (BlockMap::iterator it=blocks.begin(); it != blocks.end(); ++it)
+        it->second.mat.clear();
+    return lnl;
+}
+
+
 
 //=============================================================================
 // ARG sampling
 
 
-// sample the thread of the last chromosome
-void sample_arg_thread(const ArgModel *model, const Sequences *sequences,
-                       LocalTrees *trees, int new_chrom)
+// Allocates the first block of a forward table and sets its first column
+template <class T>
+static void set_forward_prior(const LocalTrees *trees,
+                              ArgHmmForwardTableT<T> *forward,
+                              const vector<double> &prior)
 {
-    // allocate temp variables
-    ArgHmmForwardTable forward(trees->start_coord, trees->length());
-    int *thread_path_alloc = new int [trees->length()];
-    int *thread_path = &thread_path_alloc[-trees->start_coord];
+    const int start = trees->start_coord;
+    forward->new_block(start, start + trees->front().blocklen, prior.size());
+    T *col = forward->get_table()[start];
+    for (unsigned int i=0; i<prior.size(); i++)
+        col[i] = prior[i];
+}
 
-    // build matrices
-    ArgHmmMatrixIter matrix_iter(model, sequences, trees, new_chrom);
 
-    // compute forward table
+// Samples a thread path with the forward algorithm and a stochastic
+// traceback.  matrix_iter computes emissions, matrix_iter2 does not and is
+// used for the traceback unless the forward table is checkpointed.
+//
+// prior, if given, is the first column of the forward table instead of the
+// prior of the states.  If last_state_given, the last state of
+// thread_path is already set.
+static void sample_thread_path(
+    const LocalTrees *trees, const ArgModel *model,
+    const Sequences *sequences, ArgHmmMatrixIter *matrix_iter,
+    ArgHmmMatrixIter *matrix_iter2, int nstates, int *thread_path,
+    bool internal, const vector<double> *prior=NULL,
+    bool last_state_given=false)
+{
     Timer time;
-    arghmm_forward_alg(trees, model, sequences, &matrix_iter, &forward);
-    int nstates = get_num_coal_states(trees->front().tree, model->ntimes);
+    const int spacing = model->forward_checkpoints;
+
+    if (spacing >= 0) {
+        // keep only checkpoints of the forward table
+        ArgHmmForwardCheckpoints forward(trees->start_coord, trees->length(),
+                                         spacing);
+        if (prior)
+            forward.set_prior(&(*prior)[0], prior->size());
+        arghmm_forward_alg_checkpoints(trees, model, matrix_iter, &forward,
+                                       internal);
+        printTimerLog(time, LOG_LOW,
+                      "forward (%3d states, %6d blocks):",
+                      nstates, trees->get_num_trees());
+
+        time.start();
+        stochastic_traceback_checkpoints(trees, model, matrix_iter,
+                                         &forward, thread_path, internal,
+                                         last_state_given);
+        printTimerLog(time, LOG_LOW,
+                      "trace:                              ");
+        return;
+    }
+
+    if (model->forward_float) {
+        // store forward table in single precision
+        ArgHmmForwardTableFloat forward(trees->start_coord, trees->length());
+        if (prior)
+            set_forward_prior(trees, &forward, *prior);
+        arghmm_forward_alg(trees, model, sequences, matrix_iter, &forward,
+                           prior != NULL, internal);
+        printTimerLog(time, LOG_LOW,
+                      "forward (%3d states, %6d blocks):",
+                      nstates, trees->get_num_trees());
+
+        time.start();
+        stochastic_traceback(trees, model, matrix_iter2, forward.get_table(),
+                             thread_path, last_state_given, internal);
+        printTimerLog(time, LOG_LOW,
+                      "trace:                              ");
+        return;
+    }
+
+    // compute forward table
+    ArgHmmForwardTable forward(trees->start_coord, trees->length());
+    if (prior)
+        set_forward_prior(trees, &forward, *prior);
+    arghmm_forward_alg(trees, model, sequences, matrix_iter, &forward,
+                       prior != NULL, internal);
     printTimerLog(time, LOG_LOW,
                   "forward (%3d states, %6d blocks):",
                   nstates, trees->get_num_trees());
@@ -596,12 +1285,31 @@ void sample_arg_thread(const ArgModel *model, const Sequences *sequences,
     // traceback
     time.start();
     double **fw = forward.get_table();
-    ArgHmmMatrixIter matrix_iter2(model, NULL, trees, new_chrom);
-    stochastic_traceback(trees, model, &matrix_iter2, fw, thread_path);
+    stochastic_traceback(trees, model, matrix_iter2, fw, thread_path,
+                         last_state_given, internal, &forward.runs);
     printTimerLog(time, LOG_LOW,
                   "trace:                              ");
+}
 
-    time.start();
+
+void sample_arg_thread(const ArgModel *model, const Sequences *sequences,
+                       LocalTrees *trees, int new_chrom)
+{
+    // allocate temp variables
+    int *thread_path_alloc = new int [trees->length()];
+    int *thread_path = &thread_path_alloc[-trees->start_coord];
+
+    // build matrices
+    ArgHmmMatrixPipeline matrix_iter(model, sequences, trees, new_chrom,
+                                     get_matrix_threads());
+    ArgHmmMatrixIter matrix_iter2(model, NULL, trees, new_chrom);
+
+    // sample thread path
+    int nstates = get_num_coal_states(trees->front().tree, model->ntimes);
+    sample_thread_path(trees, model, sequences, &matrix_iter, &matrix_iter2,
+                       nstates, thread_path, false);
+
+    Timer time;
 
     // sample recombination points
     vector<int> recomb_pos;
@@ -629,37 +1337,24 @@ void sample_arg_thread_internal(
     const bool internal = true;
 
     // allocate temp variables
-    ArgHmmForwardTable forward(trees->start_coord, trees->length());
     int *thread_path_alloc = new int [trees->length()];
     int *thread_path = &thread_path_alloc[-trees->start_coord];
 
     // build matrices
-    ArgHmmMatrixIter matrix_iter(model, sequences, trees);
+    ArgHmmMatrixPipeline matrix_iter(model, sequences, trees, -1,
+                                     get_matrix_threads());
     matrix_iter.set_internal(internal, minage);
+    ArgHmmMatrixIter matrix_iter2(model, NULL, trees);
+    matrix_iter2.set_internal(internal, minage);
 
-
-    // compute forward table
-    Timer time;
-    arghmm_forward_alg(trees, model, sequences, &matrix_iter, &forward,
-                       false, internal);
+    // sample thread path
     int nstates = get_num_coal_states_internal(
         trees->front().tree, model->ntimes);
-    printTimerLog(time, LOG_LOW,
-                  "forward (%3d states, %6d blocks):",
-                  nstates, trees->get_num_trees());
-
-    // traceback
-    time.start();
-    double **fw = forward.get_table();
-    ArgHmmMatrixIter matrix_iter2(model, NULL, trees);
-    matrix_iter2.set_internal(internal, minage);
-    stochastic_traceback(trees, model, &matrix_iter2, fw, thread_path,
-                         false, internal);
-    printTimerLog(time, LOG_LOW,
-                  "trace:                              ");
+    sample_thread_path(trees, model, sequences, &matrix_iter, &matrix_iter2,
+                       nstates, thread_path, internal);
 
     // sample recombination points
-    time.start();
+    Timer time;
     vector<int> recomb_pos;
     vector<NodePoint> recombs;
     sample_recombinations(trees, model, &matrix_iter2,
@@ -723,7 +1418,8 @@ void cond_sample_arg_thread(const ArgModel *model, const Sequences *sequences,
 
     // traceback
     time.start();
-    stochastic_traceback(trees, model, &matrix_list, fw, thread_path, true);
+    stochastic_traceback(trees, model, &matrix_list, fw, thread_path, true,
+                         false, &forward.runs);
     printf("trace:       %e s\n", time.time());
     assert(fw[trees->start_coord][thread_path[trees->start_coord]] == 1.0);
 
@@ -755,55 +1451,38 @@ void cond_sample_arg_thread_internal(
     const State start_state, const State end_state)
 {
     // allocate temp variables
-    ArgHmmForwardTable forward(trees->start_coord, trees->length());
     States states;
-    double **fw = forward.get_table();
     int *thread_path_alloc = new int [trees->length()];
     int *thread_path = &thread_path_alloc[-trees->start_coord];
     const bool internal = true;
-    bool prior_given = true;
-    bool last_state_given = true;
 
     // build matrices
-    ArgHmmMatrixIter matrix_iter(model, sequences, trees);
+    ArgHmmMatrixPipeline matrix_iter(model, sequences, trees, -1,
+                                     get_matrix_threads());
     matrix_iter.set_internal(internal);
+    ArgHmmMatrixIter matrix_iter2(model, NULL, trees);
+    matrix_iter2.set_internal(internal);
 
-    // fill in first column of forward table
-    matrix_iter.begin();
-    matrix_iter.get_coal_states(states);
-    forward.new_block(matrix_iter.get_block_start(),
-                      matrix_iter.get_block_end(), states.size());
-
+    // first column of forward table
+    vector<double> prior;
+    matrix_iter.get_coal_states(trees->front().tree, states);
     if (states.size() > 0) {
         if (!start_state.is_null()) {
             // find start state
             int j = find_vector(states, start_state);
             assert(j != -1);
-            double *col = fw[trees->start_coord];
-            fill(col, col + states.size(), 0.0);
-            col[j] = 1.0;
-        } else {
-            // open ended, sample start state
-            prior_given = false;
+            prior.assign(states.size(), 0.0);
+            prior[j] = 1.0;
         }
+        // otherwise open ended, sample start state from the prior
     } else {
         // fully specified tree
-        fw[trees->start_coord][0] = 1.0;
+        prior.assign(1, 1.0);
     }
 
-    // compute forward table
-    Timer time;
-    arghmm_forward_alg(trees, model, sequences, &matrix_iter, &forward,
-                       prior_given, internal);
-    int nstates = get_num_coal_states_internal(
-        trees->front().tree, model->ntimes);
-    printTimerLog(time, LOG_LOW,
-                  "forward (%3d states, %6d blocks):",
-                  nstates, trees->get_num_trees());
-
     // fill in last state of traceback
-    matrix_iter.rbegin();
-    matrix_iter.get_coal_states(states);
+    bool last_state_given = true;
+    matrix_iter.get_coal_states(trees->back().tree, states);
     if (states.size() > 0) {
         if (!end_state.is_null()) {
             thread_path[trees->end_coord-1] = find_vector(states, end_state);
@@ -817,19 +1496,15 @@ void cond_sample_arg_thread_internal(
         thread_path[trees->end_coord-1] = 0;
     }
 
-    // traceback
-    time.start();
-    ArgHmmMatrixIter matrix_iter2(model, NULL, trees);
-    matrix_iter2.set_internal(internal);
-    stochastic_traceback(trees, model, &matrix_iter2, fw, thread_path,
-                         last_state_given, internal);
-    printTimerLog(time, LOG_LOW,
-                  "trace:                              ");
-    if (!start_state.is_null())
-        assert(fw[trees->start_coord][thread_path[trees->start_coord]] == 1.0);
+    // sample thread path
+    int nstates = get_num_coal_states_internal(
+        trees->front().tree, model->ntimes);
+    sample_thread_path(trees, model, sequences, &matrix_iter, &matrix_iter2,
+                       nstates, thread_path, internal,
+                       prior.empty() ? NULL : &prior, last_state_given);
 
     // sample recombination points
-    time.start();
+    Timer time;
     vector<int> recomb_pos;
     vector<NodePoint> recombs;
     sample_recombinations(trees, model, &matrix_iter2,
@@ -931,7 +1606,8 @@ intstate *arghmm_sample_posterior(
     // traceback
     int *ipath = new int [seqlen];
     stochastic_traceback(&trees, &model, &matrix_list,
-                         forward.get_table(), ipath);
+                         forward.get_table(), ipath, false, false,
+                         &forward.runs);
 
     // convert path
     if (path == NULL)
@@ -984,7 +1660,7 @@ void arghmm_sample_arg_thread_internal(LocalTrees *trees,
     ArgHmmMatrixIter matrix_iter2(&model, NULL, trees);
     matrix_iter2.set_internal(internal);
     stochastic_traceback(trees, &model, &matrix_iter2, fw, thread_path,
-                         false, internal);
+                         false, internal, &forward.runs);
 }
 
 
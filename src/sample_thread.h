@@ -9,6 +9,7 @@
 // arghmm includes
 #include "common.h"
 #include "emit.h"
+#include "forward_runs.h"
 #include "hmm.h"
 #include "local_tree.h"
 #include "logging.h"
@@ -32,17 +33,21 @@ using namespace std;
 // Forward tables
 
 
-class ArgHmmForwardTable
+// Forward table with columns stored as T.  Columns are always computed in
+// double precision, a float table only rounds them when storing, which
+// halves the memory of the table.
+template <class T>
+class ArgHmmForwardTableT
 {
 public:
-    ArgHmmForwardTable(int start_coord, int seqlen) :
+    ArgHmmForwardTableT(int start_coord, int seqlen) :
         start_coord(start_coord),
         seqlen(seqlen)
     {
-        fw = new double *[seqlen];
+        fw = new T *[seqlen];
     }
 
-    virtual ~ArgHmmForwardTable()
+    virtual ~ArgHmmForwardTableT()
     {
         delete_blocks();
         if (fw) {
@@ -58,7 +63,7 @@ public:
         // allocate block
         nstates = max(nstates, 1);
         int blocklen = end - start;
-        double *block = new double [blocklen * nstates];
+        T *block = new T [blocklen * nstates];
         blocks.push_back(block);
 
         // link block to fw table
@@ -74,28 +79,33 @@ public:
         for (unsigned int i=0; i<blocks.size(); i++)
             delete [] blocks[i];
         blocks.clear();
+        runs.clear();
     }
 
-    virtual double **get_table()
+    virtual T **get_table()
     {
         return &fw[-start_coord];
     }
 
-    virtual double **detach_table()
+    virtual T **detach_table()
     {
-        double **ptr = fw;
+        T **ptr = fw;
         fw = NULL;
         return ptr;
     }
 
     int start_coord;
     int seqlen;
+    ForwardRuns runs;  // runs of columns skipped by the forward algorithm
 
 protected:
-    double **fw;
-    vector<double*> blocks;
+    T **fw;
+    vector<T*> blocks;
 };
 
+typedef ArgHmmForwardTableT<double> ArgHmmForwardTable;
+typedef ArgHmmForwardTableT<float> ArgHmmForwardTableFloat;
+
 
 // older style allocation for testing with python
 class ArgHmmForwardTableOld : public ArgHmmForwardTable
@@ -124,9 +134,106 @@ public:
 };
 
 
+// Forward table that only keeps the last column of every segment of
+// 'spacing' columns (the checkpoints).  The other columns are recomputed
+// segment by segment during the traceback, so that only
+// O(seqlen / spacing + spacing) columns are stored at any time.
+class ArgHmmForwardCheckpoints
+{
+public:
+    // spacing <= 0 chooses sqrt(seqlen)
+    ArgHmmForwardCheckpoints(int start_coord, int seqlen, int spacing=0) :
+        start_coord(start_coord),
+        seqlen(seqlen),
+        spacing(spacing)
+    {
+        if (this->spacing <= 0)
+            this->spacing = max(int(ceil(sqrt(double(seqlen)))), 1);
+        nsegments = (seqlen + this->spacing - 1) / this->spacing;
+        checkpoints.resize(nsegments, NULL);
+    }
+
+    ~ArgHmmForwardCheckpoints()
+    {
+        for (int i=0; i<nsegments; i++)
+            delete [] checkpoints[i];
+    }
+
+    inline int get_num_segments() const
+    {
+        return nsegments;
+    }
+
+    // Returns the segment containing position pos
+    inline int get_segment(int pos) const
+    {
+        return (pos - start_coord) / spacing;
+    }
+
+    inline int get_segment_start(int seg) const
+    {
+        return start_coord + seg * spacing;
+    }
+
+    inline int get_segment_end(int seg) const
+    {
+        return min(start_coord + (seg + 1) * spacing, start_coord + seqlen);
+    }
+
+    // Stores a copy of the last column of segment seg
+    void set_checkpoint(int seg, const double *col, int nstates)
+    {
+        delete [] checkpoints[seg];
+        checkpoints[seg] = new double [nstates];
+        std::copy(col, col + nstates, checkpoints[seg]);
+    }
+
+    inline const double *get_checkpoint(int seg) const
+    {
+        return checkpoints[seg];
+    }
+
+    // Sets the first column of the table, which is otherwise the prior of
+    // the states
+    void set_prior(const double *col, int nstates)
+    {
+        prior.assign(col, col + nstates);
+    }
+
+    inline const double *get_prior() const
+    {
+        return prior.empty() ? NULL : &prior[0];
+    }
+
+    int start_coord;
+    int seqlen;
+    int spacing;
+
+protected:
+    int nsegments;
+    vector<double*> checkpoints;
+    vector<double> prior;
+};
+
+
 //=============================================================================
 // Forward algorithm for thread path
 
+void arghmm_forward_block(const LocalTree *tree, const int ntimes,
+                          const int blocklen, const States &states,
+                          const LineageCounts &lineages,
+                          const TransMatrix *matrix,
+                          const double* const *emit, double **fw,
+                          ForwardRuns *runs=NULL, int start=0,
+                          ForwardWorkspace *workspace=NULL,
+                          ForwardRunMode run_mode=FORWARD_RUNS_OFF);
+
+void arghmm_forward_block_slow(const LocalTree *tree, const int ntimes,
+                               const int blocklen, const States &states,
+                               const LineageCounts &lineages,
+                               const TransMatrix *matrix,
+                               const double* const *emit, double **fw);
+
 void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
     const Sequences *sequences, ArgHmmMatrixIter *matrix_iter,
     ArgHmmForwardTable *forward, bool prior_given=false,
@@ -135,7 +242,114 @@ void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
 double stochastic_traceback(
     const LocalTrees *trees, const ArgModel *model,
     ArgHmmMatrixIter *matrix_iter,
-    double **fw, int *path, bool last_state_given=false, bool internal=false);
+    double **fw, int *path, bool last_state_given=false, bool internal=false,
+    const ForwardRuns *runs=NULL);
+
+// Samples path[0..run.len-1] across a run of columns skipped by the forward
+// algorithm, conditioned on the path leaving the state path[run.len]
+// somewhere in the run.  fw0 is the forward column at run.start.
+void sample_forward_run_leaving(
+    const ForwardRun &run, const LocalTree *tree, const States &states,
+    const TransMatrix *matrix, int ntimes, const double *fw0, int *path,
+    ForwardWorkspace *workspace=NULL);
+
+// Computes the transition probabilities trans[j] from every state j to
+// state k, the same as matrix->get(tree, states, j, k).  time_trans needs
+// room for matrix->ntimes values.
+void get_transition_column(
+    const LocalTree *tree, const States &states, const TransMatrix *matrix,
+    int k, double *time_trans, double *trans);
+
+
+// Samples j with probability proportional to A[j] = col[j] * trans[j].
+// sums needs room for (nstates + 3) / 4 values.
+//
+// The weights are summed in blocks of four while they are computed, so
+// that the sampled block is found by a scan over the block sums and only
+// one block is scanned state by state.  Unlike sample(), states of zero
+// weight are never sampled unless all weights are zero.
+template <class T>
+inline int sample_column(const T *col, const double *trans,
+                         const int nstates, double *A, double *sums)
+{
+    const int nblocks = (nstates + 3) / 4;
+    const int nfull = nstates / 4;
+
+    double total = 0.0;
+    for (int b=0; b<nfull; b++) {
+        const int j = 4*b;
+        A[j] = col[j] * trans[j];
+        A[j+1] = col[j+1] * trans[j+1];
+        A[j+2] = col[j+2] * trans[j+2];
+        A[j+3] = col[j+3] * trans[j+3];
+        sums[b] = (A[j] + A[j+1]) + (A[j+2] + A[j+3]);
+        total += sums[b];
+    }
+    if (nfull < nblocks) {
+        double sum = 0.0;
+        for (int j=4*nfull; j<nstates; j++) {
+            A[j] = col[j] * trans[j];
+            sum += A[j];
+        }
+        sums[nfull] = sum;
+        total += sum;
+    }
+
+    // find block, then state within block.  States of zero weight are
+    // skipped, also when pick is zero.  If rounding leaves pick past the
+    // running sum, the last state of positive weight is taken.
+    const double pick = frand(total);
+    double x = 0.0, start = 0.0;
+    int b = -1;
+    for (int i=0; i<nblocks; i++) {
+        if (sums[i] > 0.0) {
+            b = i;
+            start = x;
+            x += sums[i];
+            if (x >= pick)
+                break;
+        }
+    }
+    if (b == -1)
+        return nstates - 1;
+
+    const int end = min(4*b + 4, nstates);
+    int last = -1;
+    x = start;
+    for (int j=4*b; j<end; j++) {
+        if (A[j] > 0.0) {
+            last = j;
+            x += A[j];
+            if (x >= pick)
+                return j;
+        }
+    }
+    return last;
+}
+
+// Forward algorithm and traceback with a single precision forward table.
+// Runs of identical emissions are not skipped.
+void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
+    const Sequences *sequences, ArgHmmMatrixIter *matrix_iter,
+    ArgHmmForwardTableFloat *forward, bool prior_given=false,
+    bool internal=false);
+
+double stochastic_traceback(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter,
+    float **fw, int *path, bool last_state_given=false, bool internal=false);
+
+// Forward algorithm and traceback keeping only checkpoints of the forward
+// table.  matrix_iter must have sequences for both.
+void arghmm_forward_alg_checkpoints(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, ArgHmmForwardCheckpoints *forward,
+    bool internal=false);
+
+double stochastic_traceback_checkpoints(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, const ArgHmmForwardCheckpoints *forward,
+    int *path, bool internal=false, bool last_state_given=false);
 
 //=============================================================================
 // ARG thread sampling
@@ -258,6 +258,22 @@ bool read_sites(const char *filename, Sites *sites,
 }
 
 
+// Write a Sites stream
+void write_sites(FILE *stream, const Sites *sites)
+{
+    fprintf(stream, "NAMES");
+    for (int i=0; i<sites->get_num_seqs(); i++)
+        fprintf(stream, "\t%s", sites->names[i].c_str());
+    fprintf(stream, "\n");
+    fprintf(stream, "REGION\t%s\t%d\t%d\n", sites->chrom.c_str(),
+            sites->start_coord + 1, sites->end_coord);
+
+    // convert to 1-index
+    for (int i=0; i<sites->get_num_sites(); i++)
+        fprintf(stream, "%d\t%s\n", sites->positions[i] + 1, sites->cols[i]);
+}
+
+
 // Converts a Sites alignment to a Sequences alignment
 void make_sequences_from_sites(const Sites *sites, Sequences *sequences,
                                char default_char)
@@ -296,6 +312,7 @@ void apply_mask_sequences<NullValue>(Sequences *sequences,
 {
     const char maskchar = 'N';
 
+    sequences->clear_site_flags();
     for (unsigned int k=0; k<maskmap.size(); k++) {
         for (int i=maskmap[k].start; i<maskmap[k].end; i++) {
             for (int j=0; j<sequences->get_num_seqs(); j++)
@@ -320,6 +337,164 @@ static inline bool is_invariant_site(const char *const *seqs,
 }
 
 
+// Computes per-site invariant and masked flags across all sequences
+void Sequences::find_site_flags()
+{
+    clear_site_flags();
+
+    const int nseqs = get_num_seqs();
+    if (nseqs == 0)
+        return;
+    invariant = new bool [max(seqlen, 1)];
+    masked = new bool [max(seqlen, 1)];
+
+    packed = new PackedSequences();
+    if (packed->pack(&seqs[0], nseqs, seqlen)) {
+        PackedSequences::Word select[packed->get_num_words()];
+        vector<int> seqids(nseqs);
+        for (int j=0; j<nseqs; j++)
+            seqids[j] = j;
+        packed->make_selection(&seqids[0], nseqs, select);
+        packed->find_site_flags(select, 0, seqlen, invariant, masked);
+    } else {
+        delete packed;
+        packed = NULL;
+        for (int i=0; i<seqlen; i++) {
+            invariant[i] = is_invariant_site(&seqs[0], nseqs, i);
+            masked[i] = invariant[i] && seqs[0][i] == 'N';
+        }
+    }
+}
+
+
+// Finds the invariant and masked sites [start, end) among the sequences
+// seqids
+void find_block_site_flags(const Sequences *seqs, const int *seqids,
+                           int nseqids, int start, int end,
+                           bool *invariant, bool *masked)
+{
+    const PackedSequences *packed = seqs->get_packed();
+    if (packed) {
+        PackedSequences::Word select[packed->get_num_words()];
+        packed->make_selection(seqids, nseqids, select);
+        packed->find_site_flags(select, start, end, invariant, masked);
+        return;
+    }
+
+    // sites invariant across all sequences are invariant in any subset
+    const bool *all_invariant = seqs->get_invariant_sites();
+    const bool *all_masked = seqs->get_masked_sites();
+    const char *subseqs[nseqids];
+    for (int j=0; j<nseqids; j++)
+        subseqs[j] = seqs->seqs[seqids[j]];
+
+    for (int i=start; i<end; i++) {
+        if (all_invariant && all_invariant[i]) {
+            invariant[i - start] = true;
+            masked[i - start] = all_masked[i];
+        } else {
+            invariant[i - start] = is_invariant_site(subseqs, nseqids, i);
+            masked[i - start] = invariant[i - start] && subseqs[0][i] == 'N';
+        }
+    }
+}
+
+
+//=============================================================================
+// packed sequences
+
+
+// Returns the code of a base in the packed planes, or -1 if it can't be
+// packed
+static inline int packed_base_code(char c)
+{
+    switch (c) {
+    case 'A': return 0;
+    case 'C': return 1;
+    case 'G': return 2;
+    case 'T': return 3;
+    case 'N': return 4;
+    default: return -1;
+    }
+}
+
+
+bool PackedSequences::pack(const char *const *seqs, int _nseqs, int _seqlen)
+{
+    clear();
+
+    // check alphabet first so that nothing is allocated on failure
+    for (int j=0; j<_nseqs; j++)
+        for (int i=0; i<_seqlen; i++)
+            if (packed_base_code(seqs[j][i]) == -1)
+                return false;
+
+    nseqs = _nseqs;
+    seqlen = _seqlen;
+    nwords = (nseqs + WORD_BITS - 1) / WORD_BITS;
+    const long sitewords = (long) NPLANES * nwords;
+    words = new Word [max(sitewords * seqlen, 1L)];
+    fill(words, words + sitewords * seqlen, Word(0));
+
+    for (int j=0; j<nseqs; j++) {
+        const char *seq = seqs[j];
+        const int w = j / WORD_BITS;
+        const Word bit = Word(1) << (j % WORD_BITS);
+        Word *site = &words[w];
+        for (int i=0; i<seqlen; i++, site += sitewords) {
+            const int code = packed_base_code(seq[i]);
+            if (code == 4) {
+                site[2*nwords] |= bit;
+            } else {
+                if (code & 1)
+                    site[0] |= bit;
+                if (code & 2)
+                    site[nwords] |= bit;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+void PackedSequences::make_selection(const int *seqids, int nseqids,
+                                     Word *select) const
+{
+    fill(select, select + nwords, Word(0));
+    for (int j=0; j<nseqids; j++)
+        select[seqids[j] / WORD_BITS] |= Word(1) << (seqids[j] % WORD_BITS);
+}
+
+
+// A site is invariant among the selected sequences if each bit plane is
+// either set for all of them or for none of them.
+void PackedSequences::find_site_flags(const Word *select, int start, int end,
+                                      bool *invariant, bool *masked) const
+{
+    for (int i=start; i<end; i++) {
+        const Word *site = get_site(i);
+        Word differ = 0;
+        Word has_n = 0;
+        for (int w=0; w<nwords; w++) {
+            const Word s = select[w];
+            for (int p=0; p<NPLANES; p++) {
+                const Word x = site[p*nwords + w] & s;
+                // record plane p as set (bit 2p) or unset (bit 2p+1)
+                differ |= (Word(x != 0) << (2*p)) |
+                    (Word(x != s) << (2*p + 1));
+            }
+            has_n |= site[2*nwords + w] & s;
+        }
+
+        // variant if some plane has both set and unset bits
+        const bool inv = !(differ & (differ >> 1) & Word(0x15));
+        invariant[i - start] = inv;
+        masked[i - start] = inv && has_n != 0;
+    }
+}
+
+
 // Converts a Sequences alignment to a Sites alignment
 void make_sites_from_sequences(const Sequences *sequences, Sites *sites)
 {
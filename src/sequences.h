@@ -11,7 +11,8 @@
 #ifndef ARGWEAVER_SEQUENCES_H
 #define ARGWEAVER_SEQUENCES_H
 
-// c++ includes
+// c/c++ includes
+#include <stdint.h>
 #include <string>
 #include <vector>
 
@@ -23,16 +24,106 @@ namespace argweaver {
 using namespace std;
 
 
+// A bit-packed, column-major copy of an alignment for fast per-site
+// queries over subsets of sequences.
+//
+// Each site is stored as three bit planes with one bit per sequence: the
+// low and high bits of the base (A=00, C=01, G=10, T=11) and a mask bit
+// for 'N'.  Sequence j is bit j % 64 of word j / 64 of each plane.
+class PackedSequences
+{
+public:
+    typedef uint64_t Word;
+    static const int WORD_BITS = 64;
+    static const int NPLANES = 3;
+
+    PackedSequences() :
+        nseqs(0), seqlen(0), nwords(0), words(NULL)
+    {}
+
+    ~PackedSequences()
+    {
+        clear();
+    }
+
+    // Packs an alignment.  Returns false (and packs nothing) if a sequence
+    // contains a character other than A, C, G, T or N.
+    bool pack(const char *const *seqs, int nseqs, int seqlen);
+
+    void clear()
+    {
+        delete [] words;
+        words = NULL;
+        nseqs = seqlen = nwords = 0;
+    }
+
+    inline int get_num_seqs() const
+    {
+        return nseqs;
+    }
+
+    inline int length() const
+    {
+        return seqlen;
+    }
+
+    // Returns the number of words in a selection of sequences
+    inline int get_num_words() const
+    {
+        return nwords;
+    }
+
+    // Sets 'select' (get_num_words() words) to the set of sequences seqids
+    void make_selection(const int *seqids, int nseqids, Word *select) const;
+
+    // Finds the invariant and masked sites among the selected sequences
+    // for sites [start, end).  Flags of site i are written to index
+    // i - start.  Same as comparing the characters of the sequences.
+    void find_site_flags(const Word *select, int start, int end,
+                         bool *invariant, bool *masked) const;
+
+    // Returns the base of sequence 'seq' at site 'pos' as 0-3 (see
+    // dna2int) or -1 for 'N'
+    inline int get_base(int pos, int seq) const
+    {
+        const Word *site = get_site(pos);
+        const int w = seq / WORD_BITS;
+        const Word bit = Word(1) << (seq % WORD_BITS);
+        if (site[2*nwords + w] & bit)
+            return -1;
+        return int((site[w] & bit) != 0) |
+            (int((site[nwords + w] & bit) != 0) << 1);
+    }
+
+protected:
+    inline const Word *get_site(int pos) const
+    {
+        return &words[(long) pos * NPLANES * nwords];
+    }
+
+    int nseqs;
+    int seqlen;
+    int nwords;   // words per plane
+    Word *words;  // NPLANES * nwords words per site
+
+private:
+    PackedSequences(const PackedSequences &other);
+    PackedSequences &operator=(const PackedSequences &other);
+};
+
+
 // The alignment of sequences
 class Sequences
 {
 public:
     explicit Sequences(int seqlen=0) :
-        seqlen(seqlen), owned(false)
+        seqlen(seqlen), owned(false), invariant(NULL), masked(NULL),
+        packed(NULL)
     {}
 
     Sequences(char **_seqs, int nseqs, int seqlen) :
-        seqlen(seqlen), owned(false)
+        seqlen(seqlen), owned(false), invariant(NULL), masked(NULL),
+        packed(NULL)
     {
         extend(_seqs, nseqs);
     }
@@ -40,7 +131,8 @@ public:
     // initialize from a subset of another Sequences alignment
     Sequences(const Sequences *sequences, int nseqs=-1, int _seqlen=-1,
               int offset=0) :
-        seqlen(_seqlen), owned(false)
+        seqlen(_seqlen), owned(false), invariant(NULL), masked(NULL),
+        packed(NULL)
     {
         // use same nseqs and/or seqlen by default
         if (nseqs == -1)
@@ -69,6 +161,7 @@ public:
 
     inline void set_length(int _seqlen)
     {
+        clear_site_flags();
         seqlen = _seqlen;
     }
 
@@ -90,6 +183,7 @@ public:
 
     void extend(char **_seqs, int nseqs)
     {
+        clear_site_flags();
         for (int i=0; i<nseqs; i++) {
             seqs.push_back(_seqs[i]);
             names.push_back("");
@@ -98,6 +192,7 @@ public:
 
     void extend(char **_seqs, char **_names, int nseqs)
     {
+        clear_site_flags();
         for (int i=0; i<nseqs; i++) {
             seqs.push_back(_seqs[i]);
             names.push_back(_names[i]);
@@ -115,13 +210,49 @@ public:
                 seqlen = new_seqlen;
         }
 
+        clear_site_flags();
         seqs.push_back(seq);
         names.push_back(name);
         return true;
     }
 
+    // Computes per-site flags shared by all emission calculations and, if
+    // possible, a packed copy of the alignment (see PackedSequences).
+    // A site is invariant if it is the same in all sequences and masked if
+    // it is also 'N'.  The flags are discarded when sequences are added and
+    // must be recomputed after sequences are modified in place.
+    void find_site_flags();
+
+    void clear_site_flags()
+    {
+        delete [] invariant;
+        delete [] masked;
+        delete packed;
+        invariant = NULL;
+        masked = NULL;
+        packed = NULL;
+    }
+
+    // Returns the per-site flags or NULL if they are not computed
+    inline const bool *get_invariant_sites() const
+    {
+        return invariant;
+    }
+
+    inline const bool *get_masked_sites() const
+    {
+        return masked;
+    }
+
+    // Returns the packed alignment or NULL if it is not computed
+    inline const PackedSequences *get_packed() const
+    {
+        return packed;
+    }
+
     void clear()
     {
+        clear_site_flags();
         if (owned) {
             const int nseqs = get_num_seqs();
             for (int i=0; i<nseqs; i++)
@@ -138,6 +269,14 @@ public:
 protected:
     int seqlen;
     bool owned;
+    bool *invariant;  // per-site flags, see find_site_flags()
+    bool *masked;
+    PackedSequences *packed;
+
+private:
+    // site flags are owned, prevent copying
+    Sequences(const Sequences &other);
+    Sequences &operator=(const Sequences &other);
 };
 
 
@@ -306,11 +445,18 @@ bool check_seq_names(Sequences *seqs);
 bool check_seq_name(const char *name);
 void resample_align(Sequences *aln, Sequences *aln2);
 
+// Finds the invariant and masked sites [start, end) among the sequences
+// seqids, using the packed alignment or site flags of seqs when available
+void find_block_site_flags(const Sequences *seqs, const int *seqids,
+                           int nseqids, int start, int end,
+                           bool *invariant, bool *masked);
+
 // sites functions
 bool read_sites(FILE *infile, Sites *sites,
                  int subregion_start=-1, int subregion_end=-1);
 bool read_sites(const char *filename, Sites *sites,
                  int subregion_start=-1, int subregion_end=-1);
+void write_sites(FILE *stream, const Sites *sites);
 
 void make_sequences_from_sites(const Sites *sites, Sequences *sequencess,
                                char default_char='A');
@@ -0,0 +1,92 @@
+#include <stdlib.h>
+
+#include "binary_sites.h"
+#include "compress.h"
+#include "getopt.h"
+#include "sequences.h"
+
+using namespace argweaver;
+
+void print_usage() {
+    printf("sites-convert: This program converts an alignment between the\n"
+           "  text sites format (*.sites, *.sites.gz) and the binary format\n"
+           "  (*.sitesb).  The format of the output is chosen by its\n"
+           "  extension.\n\n");
+    printf("Usage: ./sites-convert [OPTIONS] <input-file> <output-file>\n"
+           " OPTIONS:\n"
+           " --region <start-end>\n"
+           "   Only convert the sites in this region (1-based, inclusive).\n");
+}
+
+
+bool has_suffix(const string &filename, const string &suffix)
+{
+    return filename.size() >= suffix.size() &&
+        filename.compare(filename.size() - suffix.size(), suffix.size(),
+                         suffix) == 0;
+}
+
+
+int main(int argc, char *argv[]) {
+    char c;
+    int opt_idx;
+    int subregion[2] = {-1, -1};
+    struct option long_opts[] = {
+        {"region", 1, 0, 'r'},
+        {"help", 0, 0, 'h'},
+        {0,0,0,0}};
+    while ((c = (char)getopt_long(argc, argv, "r:h", long_opts, &opt_idx))
+           != -1) {
+        switch (c) {
+        case 'r':
+            if (sscanf(optarg, "%d-%d", &subregion[0], &subregion[1]) != 2) {
+                fprintf(stderr, "region is not specified as 'start-end'\n");
+                return 1;
+            }
+            subregion[0] -= 1;  // convert to 0-index
+            break;
+        case 'h':
+            print_usage();
+            return 0;
+        case '?':
+            fprintf(stderr, "unknown option. Try --help\n");
+            return 1;
+        }
+    }
+    if (optind != argc - 2) {
+        fprintf(stderr, "Bad arguments. Try --help\n");
+        return 1;
+    }
+    const char *infile = argv[optind];
+    const char *outfile = argv[optind + 1];
+
+    // read sites
+    Sites sites;
+    bool result;
+    if (is_sites_binary(infile)) {
+        result = read_sites_binary(infile, &sites, subregion[0], subregion[1]);
+    } else {
+        CompressStream stream(infile, "r");
+        result = stream.stream &&
+            read_sites(stream.stream, &sites, subregion[0], subregion[1]);
+    }
+    if (!result) {
+        fprintf(stderr, "Error reading %s.\n", infile);
+        return 1;
+    }
+
+    // write sites
+    if (has_suffix(outfile, BINARY_SITES_SUFFIX)) {
+        result = write_sites_binary(outfile, &sites);
+    } else {
+        CompressStream stream(outfile, "w");
+        if ((result = (stream.stream != NULL)))
+            write_sites(stream.stream, &sites);
+    }
+    if (!result) {
+        fprintf(stderr, "Error writing %s.\n", outfile);
+        return 1;
+    }
+
+    return 0;
+}
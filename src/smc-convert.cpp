@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+
+#include "binary_trees.h"
+#include "compress.h"
+#include "getopt.h"
+#include "local_tree.h"
+#include "logging.h"
+#include "parsing.h"
+
+using namespace argweaver;
+
+void print_usage() {
+    printf("smc-convert: This program converts an ARG between the text SMC\n"
+           "  format (*.smc, *.smc.gz) and the binary format (*.smcb).\n"
+           "  The format of the output is chosen by its extension.\n\n");
+    printf("Usage: ./smc-convert [OPTIONS] <input-file> <output-file>\n"
+           " OPTIONS:\n"
+           " --times <times.txt>\n"
+           "   File giving the discrete times used.  Without it the times\n"
+           "   are taken from the node ages and SPRs of a text input.\n");
+}
+
+
+// Collects the distinct times of the node ages and SPRs of a text SMC file
+bool infer_times(const char *filename, vector<double> &times)
+{
+    CompressStream stream(filename, "r");
+    if (!stream.stream)
+        return false;
+
+    vector<double> values;
+    char *line;
+    vector<string> tokens;
+    while ((line = fgetline(stream.stream))) {
+        if (strncmp(line, "TREE", 4) == 0) {
+            for (char *x = strstr(line, "age="); x; x = strstr(x + 4, "age="))
+                values.push_back(atof(x + 4));
+        } else if (strncmp(line, "SPR", 3) == 0) {
+            split(line, '\t', tokens);
+            if (tokens.size() >= 6) {
+                values.push_back(atof(tokens[3].c_str()));
+                values.push_back(atof(tokens[5].c_str()));
+            }
+        }
+        delete [] line;
+    }
+
+    // merge values that differ only by rounding
+    sort(values.begin(), values.end());
+    times.clear();
+    for (unsigned int i=0; i<values.size(); i++)
+        if (times.empty() ||
+            values[i] - times.back() > 1e-6 * max(1.0, fabs(values[i])))
+            times.push_back(values[i]);
+    return !times.empty();
+}
+
+
+bool has_suffix(const string &filename, const string &suffix)
+{
+    return filename.size() >= suffix.size() &&
+        filename.compare(filename.size() - suffix.size(), suffix.size(),
+                         suffix) == 0;
+}
+
+
+int main(int argc, char *argv[]) {
+    char c;
+    int opt_idx;
+    char *timesfile = NULL;
+    vector<double> times;
+    struct option long_opts[] = {
+        {"times", 1, 0, 't'},
+        {"help", 0, 0, 'h'},
+        {0,0,0,0}};
+    while ((c = (char)getopt_long(argc, argv, "t:h", long_opts, &opt_idx))
+           != -1) {
+        switch (c) {
+        case 't':
+            timesfile = optarg;
+            break;
+        case 'h':
+            print_usage();
+            return 0;
+        case '?':
+            fprintf(stderr, "unknown option. Try --help\n");
+            return 1;
+        }
+    }
+    if (optind != argc - 2) {
+        fprintf(stderr, "Bad arguments. Try --help\n");
+        return 1;
+    }
+    const char *infile = argv[optind];
+    const char *outfile = argv[optind + 1];
+    const bool binary_input = is_local_trees_binary(infile);
+
+    // read times
+    if (timesfile != NULL) {
+        FILE *tfile = fopen(timesfile, "r");
+        double t;
+        if (tfile == NULL) {
+            fprintf(stderr, "Error opening %s.\n", timesfile);
+            return 1;
+        }
+        while (EOF != fscanf(tfile, "%lf", &t))
+            times.push_back(t);
+        sort(times.begin(), times.end());
+        fclose(tfile);
+    } else if (binary_input) {
+        if (!read_local_trees_binary_times(infile, times)) {
+            fprintf(stderr, "Error reading %s.\n", infile);
+            return 1;
+        }
+    } else if (!infer_times(infile, times)) {
+        fprintf(stderr, "Error reading times from %s.\n", infile);
+        return 1;
+    }
+
+    // read ARG
+    LocalTrees trees;
+    vector<string> seqnames;
+    bool result;
+    if (binary_input) {
+        result = read_local_trees_binary(infile, &times[0], times.size(),
+                                         &trees, seqnames);
+    } else {
+        CompressStream stream(infile, "r");
+        result = stream.stream &&
+            read_local_trees(stream.stream, &times[0], times.size(),
+                             &trees, seqnames);
+    }
+    if (!result) {
+        fprintf(stderr, "Error reading %s.\n", infile);
+        return 1;
+    }
+
+    // write ARG
+    vector<const char*> names(seqnames.size());
+    for (unsigned int i=0; i<seqnames.size(); i++)
+        names[i] = seqnames[i].c_str();
+    const char *const *names2 = names.empty() ? NULL : &names[0];
+
+    if (has_suffix(outfile, BINARY_TREES_SUFFIX)) {
+        result = write_local_trees_binary(outfile, &trees, names2,
+                                          &times[0], times.size());
+    } else {
+        CompressStream stream(outfile, "w");
+        if ((result = (stream.stream != NULL)))
+            write_local_trees(stream.stream, &trees, names2, &times[0]);
+    }
+    if (!result) {
+        fprintf(stderr, "Error writing %s.\n", outfile);
+        return 1;
+    }
+
+    return 0;
+}
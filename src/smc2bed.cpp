@@ -1,121 +1,217 @@
 #include <iostream>
 #include <fstream>
 #include <assert.h>
+#include <limits.h>
+#include <queue>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include "Tree.h"
+#include "binary_trees.h"
 #include "compress.h"
 #include "getopt.h"
+#include "parallel.h"
 #include "parsing.h"
+#include "tabix.h"
 
 using namespace spidir;
 using namespace argweaver;
 
 void print_usage() {
-    printf("smc2bed: This program converts a single smc file into a\n"
-           "  bed file. The bed file format is chrom,start,end,sample,tree.\n"
+    printf("smc2bed: This program converts smc files into a bed file.\n"
+           "  The bed file format is chrom,start,end,sample,tree.\n"
            "  The tree nodes are labelled with NHX-style comments indicating\n"
            "  the nodes and times of the recombination event which leads to\n"
            "  the next tree.\n\n"
-           "This program is intended for use combining multiple SMC files\n"
-           "  from different MCMC samples; the pipeline for doing this is to\n"
-           "  run smc2bed on each file, piping the results to sort-bed, then\n"
-           "  bgzip. The resulting file can be indexed using tabix.\n\n");
-    printf("Usage: ./smc2bed [OPTIONS] <smc-file>\n"
-           "  smc-file can be gzipped\n"
+           "Given the smc files of several MCMC samples, the files are\n"
+           "  converted in parallel and merged into a single bed file sorted\n"
+           "  by position.  If the output file ends in .gz it is bgzipped and\n"
+           "  indexed with a tabix index (.tbi), ready for arg-summarize.\n\n");
+    printf("Usage: ./smc2bed [OPTIONS] <smc-file> [<smc-file> ...]\n"
+           "  smc-files can be gzipped or binary (*.smcb)\n"
            " OPTIONS:\n"
            " --region START-END\n"
            "   Process only these coordinates (1-based)\n"
            " --sample <sample>\n"
            "   Give the sample number for this file; this is important\n"
-           "   when combining multiple smc files.\n"
+           "   when combining multiple smc files.  With several files the\n"
+           "   sample numbers are taken from file names such as\n"
+           "   out.<sample>.smc.gz, or else numbered from this value.\n"
 	   " --times <times.txt>\n"
 	   "   File giving the discrete times used; will help avoid"
            "   rounding error\n"
-	   "   in branch lengths/ages\n");
+	   "   in branch lengths/ages\n"
+           " --output <out.bed.gz>\n"
+           "   Write to this file rather than standard output\n"
+           " --threads <n>\n"
+           "   Number of smc files to convert at once (default: 1)\n");
 }
 
 
+// Points the SPR at the nodes with the given ids and writes the tree as a
+// bed line, clipped to region
+void write_bed_tree(FILE *out, Tree *tree, NodeSpr *spr,
+                    int recomb_node, int coal_node,
+                    const char *chrom, int start, int end, int sample,
+                    const int region[2], const vector<double> &times)
+{
+    char tmpStr[1000];
+    if (recomb_node >= 0) {
+        sprintf(tmpStr, "%i", recomb_node);
+        spr->recomb_node = tree->nodes[tree->nodename_map[string(tmpStr)]];
+        sprintf(tmpStr, "%i", coal_node);
+        spr->coal_node = tree->nodes[tree->nodename_map[string(tmpStr)]];
 
+        if (spr->recomb_node->age-1 > spr->recomb_time)
+            assert(0);
+        if (spr->recomb_node != tree->root) {
+            if (spr->recomb_node->parent->age+1 < spr->recomb_time)
+                assert(0);
+        }
+        if (spr->coal_node->age-1 > spr->coal_time)
+            assert(0);
+        if (spr->coal_node != tree->root) {
+            if (spr->coal_node->parent->age+1 < spr->coal_time)
+                assert(0);
+        }
+        if (times.size() > 0) spr->correct_recomb_times(times);
+    }
+    if (region[0] >= 0 && start < region[0])
+        start = region[0];
+    if (region[1] >= 0 && end >= region[1]) {
+        end = region[1];
+        spr->recomb_node = spr->coal_node = NULL;
+    }
+    fprintf(out, "%s\t%i\t%i\t%i\t", chrom, start, end, sample);
+    tree->write_newick(out, false, true, 1, spr);
+    fprintf(out, "\n");
+}
 
-int main(int argc, char *argv[]) {
-    char c;
-    int region[2]={-1,-1}, orig_start, orig_end, start, end;
+
+// Builds a tree with real ages from a local tree.  Nodes are named by
+// their ids as in the newick trees of the text format, except for leaves,
+// which are named by the sequence names.
+Tree *make_tree(const LocalTree *ltree, const vector<double> &times,
+                const vector<string> &names)
+{
+    const int nnodes = ltree->nnodes;
+    Tree *tree = new Tree(nnodes);
+    char id[20];
+    for (int i=0; i<nnodes; i++) {
+        const LocalNode &lnode = ltree->nodes[i];
+        Node *node = tree->nodes[i];
+        node->name = i;
+        node->age = times[lnode.age];
+        snprintf(id, sizeof(id), "%d", i);
+        tree->nodename_map[id] = i;
+        node->longname = lnode.is_leaf() ? names[i] : id;
+        if (lnode.parent != -1)
+            node->dist = times[ltree->nodes[lnode.parent].age] - node->age;
+    }
+    for (int i=0; i<nnodes; i++) {
+        const LocalNode &lnode = ltree->nodes[i];
+        for (int j=0; j<2 && !lnode.is_leaf(); j++)
+            tree->nodes[i]->addChild(tree->nodes[lnode.child[j]]);
+    }
+    tree->root = tree->nodes[ltree->root];
+    return tree;
+}
+
+
+// Converts a binary SMC file, which is read without parsing newick
+int smc2bed_binary(const char *filename, const int region[2], int sample,
+                   const vector<double> &times, FILE *out)
+{
+    vector<double> file_times;
+    LocalTrees trees;
+    vector<string> names;
+    if (!read_local_trees_binary_times(filename, file_times) ||
+        !read_local_trees_binary(filename, &file_times[0], file_times.size(),
+                                 &trees, names, max(region[0], 0),
+                                 region[1] >= 0 ? region[1] : INT_MAX)) {
+        fprintf(stderr, "error reading %s\n", filename);
+        return 1;
+    }
+    if ((int) names.size() < trees.get_num_leaves()) {
+        fprintf(stderr, "error: expected names of all leaves\n");
+        return 1;
+    }
+
+    Tree *tree = NULL;
+    NodeSpr spr;
+    int end = trees.start_coord;
+    for (LocalTrees::iterator it=trees.begin(); it != trees.end(); ++it) {
+        int start = end;
+        end += it->blocklen;
+        if (region[1] >= 0 && start >= region[1])
+            break;
+        LocalTrees::iterator it2 = it;
+        ++it2;
+        if (region[0] >= 0 && end <= region[0])
+            continue;
+
+        if (tree == NULL || spr.recomb_node == NULL) {
+            delete tree;
+            tree = make_tree(it->tree, file_times, names);
+            spr.recomb_node = spr.coal_node = NULL;
+        } else {
+            tree->apply_spr(&spr);
+        }
+
+        int recomb_node = -1, coal_node = -1;
+        spr.recomb_node = spr.coal_node = NULL;
+        if (it2 != trees.end() && !(region[1] >= 0 && end >= region[1])) {
+            recomb_node = it2->spr.recomb_node;
+            coal_node = it2->spr.coal_node;
+            spr.recomb_time = file_times[it2->spr.recomb_time];
+            spr.coal_time = file_times[it2->spr.coal_time];
+        }
+        write_bed_tree(out, tree, &spr, recomb_node, coal_node,
+                       trees.chrom.c_str(), start, end, sample, region,
+                       times);
+    }
+    delete tree;
+    return 0;
+}
+
+
+// Converts a text SMC file
+int smc2bed_text(const char *filename, const int region[2], int sample,
+                 const vector<double> &times, FILE *out)
+{
+    int orig_start, orig_end, start, end;
     vector<string> names;
-    string currstr;
     char *line = NULL;
     char chrom[1000];
     char *newick=NULL;
     Tree *tree=NULL;
     NodeSpr *spr=NULL;
-    char *timesfile=NULL;
-    int recomb_node, coal_node, sample=0, opt_idx;
-    vector<double> times;
-    struct option long_opts[] = {
-        {"region", 1, 0, 'r'},
-        {"sample", 1, 0, 's'},
-	{"times", 1, 0, 't'},
-        {"help", 0, 0, 'h'},
-        {0,0,0,0}};
-    while ((c = (char)getopt_long(argc, argv, "r:s:t:h", long_opts, &opt_idx))
-           != -1) {
-        switch (c) {
-        case 'r':
-            if (2 != (sscanf(optarg, "%d-%d", &region[0], &region[1]))) {
-                fprintf(stderr, "error parsing region %s\n", optarg);
-                return 1;
-            }
-            region[0]--;  //convert to 0-based
-            break;
-        case 's':
-            sample = atoi(optarg);
-            break;
-	case 't':
-	    timesfile = optarg;
-	    break;
-        case 'h':
-            print_usage();
-            return 0;
-        case '?':
-            fprintf(stderr, "unknown option. Try --help\n");
-            return 1;
-        }
-    }
-    if (optind != argc - 1) {
-        fprintf(stderr, "Bad arguments. Try --help\n");
-        return 1;
-    }
+    int recomb_node, coal_node;
 
-    if (timesfile != NULL) {
-	FILE *infile = fopen(timesfile, "r");
-	double t;
-	if (infile == NULL) {
-	    fprintf(stderr, "Error opening %s.\n", timesfile);
-	    return 1;
-	}
-	while (EOF != fscanf(infile, "%lf", &t))
-	    times.push_back(t);
-	std::sort(times.begin(), times.end());
-	fclose(infile);
-	//      fprintf(stderr, "read %i times\n", (int)times.size());
+    CompressStream instream(filename, "r");
+    if (!instream.stream) {
+        fprintf(stderr, "error opening %s\n", filename);
+        return 1;
     }
-    CompressStream instream(argv[optind], "r");
-    fprintf(stderr, "opening %s\n", argv[optind]);
     line = fgetline(instream.stream);
-    chomp(line);
-    if (strncmp(line, "NAMES", 5) != 0) {
+    if (line == NULL || strncmp(line, "NAMES", 5) != 0) {
         fprintf(stderr, "error: Expected first line of input to be NAMES");
         return 1;
     }
+    chomp(line);
     split(&line[6], "\t", names);
+    delete [] line;
     line= fgetline(instream.stream);
-    chomp(line);
-    if (strncmp(line, "REGION", 6) != 0) {
+    if (line == NULL || strncmp(line, "REGION", 6) != 0) {
         fprintf(stderr, "error: Expected second line of input to be REGION");
+        return 1;
     }
+    chomp(line);
     if (sscanf(&line[7], "%1000s\t%d\t%d", chrom, &orig_start, &orig_end) != 3) {
         fprintf(stderr, "error parsing REGION string in second line\n");
         return 1;
     }
+    delete [] line;
     while ((line = fgetline(instream.stream))) {
         chomp(line);
         if (strncmp(line, "TREE", 4)==0) {
@@ -142,7 +238,8 @@ int main(int argc, char *argv[]) {
             newick = find(line+5, newick_end, '\t')+1;
             newick = find(newick, newick_end, '\t')+1;
 	    if (tree == NULL || spr->recomb_node == NULL) {
-	      if (tree != NULL) delete tree;
+	      delete tree;
+	      delete spr;
 	      tree = new Tree(string(newick), times);
               spr = new NodeSpr(tree, newick, times);
 
@@ -163,6 +260,7 @@ int main(int argc, char *argv[]) {
             if (line == NULL) {
 	      spr->recomb_node = NULL;
 	      spr->coal_node = NULL;
+	      recomb_node = coal_node = -1;
             } else if (strncmp(line, "SPR", 3)==0) {
 	      int tempend;
 	      if (5 != sscanf(&line[4], "%d\t%d\t%lf\t%d\t%lf",
@@ -184,44 +282,293 @@ int main(int argc, char *argv[]) {
 	      return 1;
             }
 
-            //now have to rename all leaf nodes and remove all NHX comments
-	    char tmpStr[1000];
-	    if (recomb_node >= 0) {
-	      sprintf(tmpStr, "%i", recomb_node);
-	      //	    char *tmpStr = itoa(recomb_node);
-	      spr->recomb_node =
-                  tree->nodes[tree->nodename_map[string(tmpStr)]];
-	      sprintf(tmpStr, "%i", coal_node);
-	      spr->coal_node = tree->nodes[tree->nodename_map[string(tmpStr)]];
-
-	      if (spr->recomb_node->age-1 > spr->recomb_time)
-		assert(0);
-	      if (spr->recomb_node != tree->root) {
-		if (spr->recomb_node->parent->age+1 < spr->recomb_time)
-		  assert(0);
-	      }
-	      if (spr->coal_node->age-1 > spr->coal_time)
-		assert(0);
-	      if (spr->coal_node != tree->root) {
-		if (spr->coal_node->parent->age+1 < spr->coal_time) {
-		    assert(0);
-		  }
-	       }
-	      if (times.size() > 0) spr->correct_recomb_times(times);
-	    }
-            if (region[0] >= 0 && start < region[0])
-                start = region[0];
-            if (region[1] >= 0 && end >= region[1]) {
-                end = region[1];
-		spr->recomb_node = spr->coal_node = NULL;
-	    }
-            printf("%s\t%i\t%i\t%i\t", chrom, start, end, sample);
-            tree->write_newick(stdout, false, true, 1, spr);
-            printf("\n");
+            write_bed_tree(out, tree, spr, recomb_node, coal_node, chrom,
+                           start, end, sample, region, times);
             if (line == NULL) break;
-            delete [] line;
         }
+        delete [] line;
     }
+    delete tree;
+    delete spr;
     instream.close();
     return 0;
 }
+
+
+int smc2bed(const char *filename, const int region[2], int sample,
+            const vector<double> &times, FILE *out)
+{
+    fprintf(stderr, "opening %s\n", filename);
+    if (is_local_trees_binary(filename))
+        return smc2bed_binary(filename, region, sample, times, out);
+    return smc2bed_text(filename, region, sample, times, out);
+}
+
+
+//=============================================================================
+// converting several files
+
+// Returns the sample number of a file named like out.<sample>.smc.gz, or
+// -1 if there is none
+int get_sample_number(const string &filename)
+{
+    const size_t slash = filename.rfind('/');
+    const string name = filename.substr(slash == string::npos ? 0 : slash + 1);
+    const size_t suffix = name.rfind(".smc");
+    if (suffix == string::npos)
+        return -1;
+    size_t i = suffix;
+    while (i > 0 && isdigit(name[i-1]))
+        i--;
+    if (i == suffix || i == 0 || name[i-1] != '.')
+        return -1;
+    return atoi(name.substr(i, suffix - i).c_str());
+}
+
+
+// Each file is converted into a temporary bgzipped bed file
+class Smc2BedJob
+{
+public:
+    vector<string> files;
+    vector<int> samples;
+    vector<string> tmpfiles;
+    vector<int> status;
+    const int *region;
+    vector<double> times;
+};
+
+
+void smc2bed_task(int i, void *data)
+{
+    Smc2BedJob *job = (Smc2BedJob*) data;
+    FILE *out = write_compress(job->tmpfiles[i].c_str());
+    if (!out) {
+        fprintf(stderr, "error writing %s\n", job->tmpfiles[i].c_str());
+        job->status[i] = 1;
+        return;
+    }
+    job->status[i] = smc2bed(job->files[i].c_str(), job->region,
+                             job->samples[i], job->times, out);
+    if (close_compress(out) != 0)
+        job->status[i] = 1;
+}
+
+
+// Next line of one converted file during the merge
+class BedSource
+{
+public:
+    char *line;
+    string chrom;
+    int start;
+    int end;
+    int index;
+
+    // Returns true if this line comes after the line of other
+    bool operator>(const BedSource &other) const
+    {
+        int cmp = chrom.compare(other.chrom);
+        if (cmp != 0)
+            return cmp > 0;
+        if (start != other.start)
+            return start > other.start;
+        if (end != other.end)
+            return end > other.end;
+        return index > other.index;
+    }
+};
+
+
+bool read_bed_source(FILE *stream, int index, BedSource *source)
+{
+    source->line = fgetline(stream);
+    if (source->line == NULL)
+        return false;
+    const char *tab = strchr(source->line, '\t');
+    if (tab == NULL ||
+        sscanf(tab, "\t%d\t%d", &source->start, &source->end) != 2) {
+        fprintf(stderr, "error: bad bed line\n");
+        delete [] source->line;
+        return false;
+    }
+    source->chrom.assign(source->line, tab - source->line);
+    source->index = index;
+    return true;
+}
+
+
+// Converts files in parallel and merges them into out, sorted by position
+int smc2bed_merge(Smc2BedJob &job, int nthreads, FILE *out)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL)
+        tmpdir = "/tmp";
+    const int nfiles = job.files.size();
+    job.status.assign(nfiles, 1);
+    for (int i=0; i<nfiles; i++) {
+        string name = string(tmpdir) + "/smc2bed.XXXXXX";
+        int fd = mkstemp(&name[0]);
+        if (fd == -1) {
+            fprintf(stderr, "error creating temporary file in %s\n", tmpdir);
+            return 1;
+        }
+        close(fd);
+        job.tmpfiles.push_back(name);
+    }
+
+    // files are compressed one per thread
+    const int compress_threads = get_compress_threads();
+    set_compress_threads(1);
+    {
+        ThreadPool pool(nthreads);
+        pool.run(nfiles, smc2bed_task, &job);
+    }
+    set_compress_threads(compress_threads);
+
+    int status = 0;
+    vector<FILE*> streams(nfiles, (FILE*) NULL);
+    priority_queue<BedSource, vector<BedSource>, greater<BedSource> > queue;
+    for (int i=0; i<nfiles && status == 0; i++) {
+        status = job.status[i];
+        if (status == 0)
+            streams[i] = read_compress(job.tmpfiles[i].c_str());
+        BedSource source;
+        if (streams[i] && read_bed_source(streams[i], i, &source))
+            queue.push(source);
+    }
+
+    // k-way merge
+    while (status == 0 && !queue.empty()) {
+        BedSource source = queue.top();
+        queue.pop();
+        fputs(source.line, out);
+        delete [] source.line;
+        if (read_bed_source(streams[source.index], source.index, &source))
+            queue.push(source);
+    }
+
+    while (!queue.empty()) {
+        delete [] queue.top().line;
+        queue.pop();
+    }
+    for (int i=0; i<nfiles; i++) {
+        if (streams[i])
+            close_compress(streams[i]);
+        unlink(job.tmpfiles[i].c_str());
+    }
+    return status;
+}
+
+
+int main(int argc, char *argv[]) {
+    char c;
+    int region[2]={-1,-1};
+    char *timesfile=NULL;
+    char *outfile=NULL;
+    int sample=0, nthreads=1, opt_idx;
+    vector<double> times;
+    struct option long_opts[] = {
+        {"region", 1, 0, 'r'},
+        {"sample", 1, 0, 's'},
+	{"times", 1, 0, 't'},
+        {"output", 1, 0, 'o'},
+        {"threads", 1, 0, 'p'},
+        {"help", 0, 0, 'h'},
+        {0,0,0,0}};
+    while ((c = (char)getopt_long(argc, argv, "r:s:t:o:p:h", long_opts,
+                                  &opt_idx)) != -1) {
+        switch (c) {
+        case 'r':
+            if (2 != (sscanf(optarg, "%d-%d", &region[0], &region[1]))) {
+                fprintf(stderr, "error parsing region %s\n", optarg);
+                return 1;
+            }
+            region[0]--;  //convert to 0-based
+            break;
+        case 's':
+            sample = atoi(optarg);
+            break;
+	case 't':
+	    timesfile = optarg;
+	    break;
+        case 'o':
+            outfile = optarg;
+            break;
+        case 'p':
+            nthreads = atoi(optarg);
+            if (nthreads < 1) {
+                fprintf(stderr, "error: --threads must be at least 1\n");
+                return 1;
+            }
+            break;
+        case 'h':
+            print_usage();
+            return 0;
+        case '?':
+            fprintf(stderr, "unknown option. Try --help\n");
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Bad arguments. Try --help\n");
+        return 1;
+    }
+
+    if (timesfile != NULL) {
+	FILE *infile = fopen(timesfile, "r");
+	double t;
+	if (infile == NULL) {
+	    fprintf(stderr, "Error opening %s.\n", timesfile);
+	    return 1;
+	}
+	while (EOF != fscanf(infile, "%lf", &t))
+	    times.push_back(t);
+	std::sort(times.begin(), times.end());
+	fclose(infile);
+	//      fprintf(stderr, "read %i times\n", (int)times.size());
+    }
+
+    set_compress_threads(nthreads);
+    FILE *out = stdout;
+    CompressStream *outstream = NULL;
+    if (outfile != NULL) {
+        outstream = new CompressStream(outfile, "w");
+        if (!outstream->stream) {
+            fprintf(stderr, "Error opening %s.\n", outfile);
+            delete outstream;
+            return 1;
+        }
+        out = outstream->stream;
+    }
+
+    int status;
+    if (optind == argc - 1) {
+        status = smc2bed(argv[optind], region, sample, times, out);
+    } else {
+        Smc2BedJob job;
+        job.region = region;
+        job.times = times;
+        bool numbered = true;
+        for (int i=optind; i<argc; i++) {
+            job.files.push_back(argv[i]);
+            job.samples.push_back(get_sample_number(argv[i]));
+            if (job.samples.back() < 0)
+                numbered = false;
+        }
+        for (unsigned int i=0; i<job.samples.size() && !numbered; i++)
+            job.samples[i] = sample + i;
+        status = smc2bed_merge(job, nthreads, out);
+    }
+
+    if (outfile == NULL)
+        return status;
+    delete outstream;
+
+    // index bgzipped output
+    const int len = strlen(outfile);
+    if (status == 0 && len > 3 && strcmp(&outfile[len - 3], ".gz") == 0 &&
+        !write_tabix_index(outfile))
+        status = 1;
+    return status;
+}
@@ -1,6 +1,14 @@
+#include <sys/stat.h>
 #include <unistd.h>
 #include <string>
 #include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <algorithm>
+#include <list>
+#include <map>
+#include <vector>
 
 #include "tabix.h"
 #include "parsing.h"
@@ -11,6 +19,883 @@ namespace argweaver {
 using namespace std;
 
 
+//=============================================================================
+// BGZF block reader
+//
+// Positions in BGZF files are virtual offsets: the offset of a block in the
+// compressed file in the upper 48 bits and an offset into the uncompressed
+// block in the lower 16 bits.
+
+#define TABIX_BLOCK_CACHE 64
+
+
+class BgzfBlock
+{
+public:
+    string data;
+    uint64_t next;  // compressed offset of the following block
+};
+
+
+class BgzfReader
+{
+public:
+    BgzfReader() : infile(NULL)
+    {
+        pthread_mutex_init(&lock, NULL);
+    }
+
+    ~BgzfReader()
+    {
+        for (map<uint64_t, Entry>::iterator it=cache.begin();
+             it != cache.end(); ++it)
+            delete it->second.block;
+        if (infile)
+            fclose(infile);
+        pthread_mutex_destroy(&lock);
+    }
+
+    bool open(const char *filename)
+    {
+        infile = fopen(filename, "rb");
+        return infile != NULL;
+    }
+
+    // Copies the uncompressed block at compressed offset coffset into
+    // block.  Returns false at the end of the file or on error.
+    bool read_block(uint64_t coffset, BgzfBlock *block)
+    {
+        pthread_mutex_lock(&lock);
+        map<uint64_t, Entry>::iterator it = cache.find(coffset);
+        bool found = (it != cache.end());
+        if (found) {
+            lru.splice(lru.begin(), lru, it->second.pos);
+            *block = *it->second.block;
+        } else {
+            found = decode_block(coffset, block);
+            if (found)
+                add_block(coffset, *block);
+        }
+        pthread_mutex_unlock(&lock);
+        return found;
+    }
+
+protected:
+    bool decode_block(uint64_t coffset, BgzfBlock *block)
+    {
+        unsigned char header[12];
+        if (fseeko(infile, coffset, SEEK_SET) != 0 ||
+            fread(header, 1, 12, infile) != 12 ||
+            header[0] != 0x1f || header[1] != 0x8b || !(header[3] & 4))
+            return false;
+
+        // find the BC subfield holding the block size
+        const int xlen = header[10] | (header[11] << 8);
+        vector<unsigned char> extra(xlen);
+        if (fread(&extra[0], 1, xlen, infile) != size_t(xlen))
+            return false;
+        int bsize = -1;
+        for (int i=0; i + 4 <= xlen; ) {
+            const int slen = extra[i+2] | (extra[i+3] << 8);
+            if (extra[i] == 'B' && extra[i+1] == 'C' && slen == 2 &&
+                i + 6 <= xlen)
+                bsize = extra[i+4] | (extra[i+5] << 8);
+            i += 4 + slen;
+        }
+        const int remaining = bsize + 1 - 12 - xlen;
+        if (bsize < 0 || remaining < 8)
+            return false;
+
+        vector<unsigned char> body(remaining);
+        if (fread(&body[0], 1, remaining, infile) != size_t(remaining))
+            return false;
+        const unsigned char *footer = &body[remaining - 8];
+        const unsigned int isize = footer[4] | (footer[5] << 8) |
+            (footer[6] << 16) | ((unsigned int) footer[7] << 24);
+
+        block->data.resize(isize);
+        block->next = coffset + bsize + 1;
+        if (isize == 0)
+            return true;
+
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, -15) != Z_OK)
+            return false;
+        zs.next_in = &body[0];
+        zs.avail_in = remaining - 8;
+        zs.next_out = (Bytef*) &block->data[0];
+        zs.avail_out = isize;
+        const int ret = inflate(&zs, Z_FINISH);
+        inflateEnd(&zs);
+        return ret == Z_STREAM_END;
+    }
+
+    void add_block(uint64_t coffset, const BgzfBlock &block)
+    {
+        if (cache.size() >= TABIX_BLOCK_CACHE) {
+            map<uint64_t, Entry>::iterator old = cache.find(lru.back());
+            delete old->second.block;
+            cache.erase(old);
+            lru.pop_back();
+        }
+        lru.push_front(coffset);
+        Entry entry = {new BgzfBlock(block), lru.begin()};
+        cache[coffset] = entry;
+    }
+
+    struct Entry {
+        BgzfBlock *block;
+        list<uint64_t>::iterator pos;
+    };
+
+    FILE *infile;
+    pthread_mutex_t lock;
+    map<uint64_t, Entry> cache;  // recently used blocks
+    list<uint64_t> lru;          // cached offsets, most recent first
+};
+
+
+//=============================================================================
+// tabix index (.tbi and .csi)
+
+struct TabixChunk
+{
+    uint64_t beg;
+    uint64_t end;
+
+    bool operator<(const TabixChunk &other) const
+    {
+        return beg < other.beg;
+    }
+};
+
+
+class TabixRef
+{
+public:
+    map<unsigned int, vector<TabixChunk> > bins;
+    vector<uint64_t> linear;
+};
+
+
+class TabixIndex
+{
+public:
+    TabixIndex() :
+        format(0), col_seq(1), col_beg(2), col_end(3), meta('#'), skip(0),
+        min_shift(14), depth(5)
+    {}
+
+    // Reads filename.tbi or filename.csi
+    bool read(const char *filename)
+    {
+        string data;
+        if (read_all(string(filename) + ".tbi", &data) &&
+            data.compare(0, 4, "TBI\1") == 0)
+            return parse_tbi(data);
+        if (read_all(string(filename) + ".csi", &data) &&
+            data.compare(0, 4, "CSI\1") == 0)
+            return parse_csi(data);
+        return false;
+    }
+
+    // Returns the chunks that may contain records overlapping [beg, end)
+    // of sequence tid
+    void query(int tid, int64_t beg, int64_t end,
+               vector<TabixChunk> &chunks) const
+    {
+        chunks.clear();
+        if (tid < 0 || tid >= (int) refs.size() || beg >= end)
+            return;
+        const TabixRef &ref = refs[tid];
+
+        uint64_t min_off = 0;
+        if (!ref.linear.empty()) {
+            size_t i = min(size_t(beg >> min_shift), ref.linear.size() - 1);
+            min_off = ref.linear[i];
+        }
+
+        // bins overlapping the region at each level
+        int s = min_shift + depth * 3;
+        if (end > (int64_t(1) << s))
+            end = int64_t(1) << s;
+        end--;
+        for (int l=0, t=0; l<=depth; s-=3, t+=1<<(l*3), l++) {
+            for (int64_t b=t + (beg >> s); b<=t + (end >> s); b++) {
+                map<unsigned int, vector<TabixChunk> >::const_iterator it =
+                    ref.bins.find(b);
+                if (it == ref.bins.end())
+                    continue;
+                for (size_t i=0; i<it->second.size(); i++)
+                    if (it->second[i].end > min_off)
+                        chunks.push_back(it->second[i]);
+            }
+        }
+
+        // merge overlapping chunks so that no record is read twice
+        sort(chunks.begin(), chunks.end());
+        size_t n = 0;
+        for (size_t i=0; i<chunks.size(); i++) {
+            if (n > 0 && chunks[i].beg <= chunks[n-1].end)
+                chunks[n-1].end = max(chunks[n-1].end, chunks[i].end);
+            else
+                chunks[n++] = chunks[i];
+        }
+        chunks.resize(n);
+    }
+
+    int get_tid(const string &name) const
+    {
+        map<string, int>::const_iterator it = names.find(name);
+        return it == names.end() ? -1 : it->second;
+    }
+
+    int format;
+    int col_seq;
+    int col_beg;
+    int col_end;
+    int meta;
+    int skip;
+
+protected:
+    static bool read_all(const string &filename, string *data)
+    {
+        if (access(filename.c_str(), F_OK) != 0)
+            return false;
+        gzFile infile = gzopen(filename.c_str(), "rb");
+        if (!infile)
+            return false;
+        data->clear();
+        char buf[1 << 16];
+        int n;
+        while ((n = gzread(infile, buf, sizeof(buf))) > 0)
+            data->append(buf, n);
+        gzclose(infile);
+        return n == 0;
+    }
+
+    // Little-endian reads that fail past the end of the data
+    class Cursor
+    {
+    public:
+        Cursor(const string &data, size_t pos) :
+            data(data), pos(pos), ok(true) {}
+
+        uint64_t get(int nbytes)
+        {
+            if (pos + nbytes > data.size()) {
+                ok = false;
+                return 0;
+            }
+            uint64_t x = 0;
+            for (int i=0; i<nbytes; i++)
+                x |= uint64_t((unsigned char) data[pos + i]) << (8 * i);
+            pos += nbytes;
+            return x;
+        }
+        int32_t get_int() { return int32_t(get(4)); }
+
+        const string &data;
+        size_t pos;
+        bool ok;
+    };
+
+    // Reads the tabix header that follows the magic of a .tbi file and
+    // forms the auxiliary data of a .csi file
+    bool parse_conf(Cursor &c)
+    {
+        format = c.get_int();
+        col_seq = c.get_int();
+        col_beg = c.get_int();
+        col_end = c.get_int();
+        meta = c.get_int();
+        skip = c.get_int();
+        const int l_nm = c.get_int();
+        if (!c.ok || l_nm < 0 || c.pos + l_nm > c.data.size())
+            return false;
+        for (size_t p=c.pos; p<c.pos + l_nm; ) {
+            string name(c.data.c_str() + p);
+            const int tid = names.size();
+            names[name] = tid;
+            p += name.size() + 1;
+        }
+        c.pos += l_nm;
+        return true;
+    }
+
+    bool parse_tbi(const string &data)
+    {
+        Cursor c(data, 4);
+        const int n_ref = c.get_int();
+        if (!parse_conf(c))
+            return false;
+        min_shift = 14;
+        depth = 5;
+
+        refs.resize(max(n_ref, 0));
+        for (int i=0; i<n_ref && c.ok; i++) {
+            const int n_bin = c.get_int();
+            for (int j=0; j<n_bin && c.ok; j++) {
+                const unsigned int bin = c.get(4);
+                read_chunks(c, refs[i].bins[bin]);
+            }
+            const int n_intv = c.get_int();
+            for (int j=0; j<n_intv && c.ok; j++)
+                refs[i].linear.push_back(c.get(8));
+        }
+        return c.ok;
+    }
+
+    bool parse_csi(const string &data)
+    {
+        Cursor c(data, 4);
+        min_shift = c.get_int();
+        depth = c.get_int();
+        const int l_aux = c.get_int();
+        const size_t aux_end = c.pos + l_aux;
+        if (l_aux < 28 || !parse_conf(c))
+            return false;
+        c.pos = aux_end;
+
+        const int n_ref = c.get_int();
+        refs.resize(max(n_ref, 0));
+        for (int i=0; i<n_ref && c.ok; i++) {
+            const int n_bin = c.get_int();
+            for (int j=0; j<n_bin && c.ok; j++) {
+                const unsigned int bin = c.get(4);
+                c.get(8);  // loffset
+                read_chunks(c, refs[i].bins[bin]);
+            }
+        }
+        return c.ok;
+    }
+
+    void read_chunks(Cursor &c, vector<TabixChunk> &chunks)
+    {
+        const int n_chunk = c.get_int();
+        for (int k=0; k<n_chunk && c.ok; k++) {
+            TabixChunk chunk;
+            chunk.beg = c.get(8);
+            chunk.end = c.get(8);
+            chunks.push_back(chunk);
+        }
+    }
+
+    int min_shift;
+    int depth;
+    map<string, int> names;
+    vector<TabixRef> refs;
+};
+
+
+//=============================================================================
+// index writer
+
+// Returns the smallest bin of the tabix binning scheme containing [beg, end)
+static int reg2bin(int64_t beg, int64_t end)
+{
+    end--;
+    if (beg >> 14 == end >> 14) return ((1 << 15) - 1) / 7 + (beg >> 14);
+    if (beg >> 17 == end >> 17) return ((1 << 12) - 1) / 7 + (beg >> 17);
+    if (beg >> 20 == end >> 20) return ((1 << 9) - 1) / 7 + (beg >> 20);
+    if (beg >> 23 == end >> 23) return ((1 << 6) - 1) / 7 + (beg >> 23);
+    if (beg >> 26 == end >> 26) return ((1 << 3) - 1) / 7 + (beg >> 26);
+    return 0;
+}
+
+
+static void put_le(string &data, uint64_t x, int nbytes)
+{
+    for (int i=0; i<nbytes; i++)
+        data += char((x >> (8 * i)) & 0xff);
+}
+
+
+// Adds a record at virtual offsets [vbeg, vend) to the index of a sequence
+static void index_record(TabixRef &ref, int64_t beg, int64_t end,
+                         uint64_t vbeg, uint64_t vend)
+{
+    vector<TabixChunk> &chunks = ref.bins[reg2bin(beg, end)];
+    if (!chunks.empty() && chunks.back().end == vbeg) {
+        chunks.back().end = vend;
+    } else {
+        TabixChunk chunk = {vbeg, vend};
+        chunks.push_back(chunk);
+    }
+
+    const size_t last = (end - 1) >> 14;
+    if (ref.linear.size() <= last)
+        ref.linear.resize(last + 1, 0);
+    for (size_t i=beg >> 14; i<=last; i++)
+        if (ref.linear[i] == 0)
+            ref.linear[i] = vbeg;
+}
+
+
+bool write_tabix_index(const char *filename)
+{
+    BgzfReader reader;
+    if (!reader.open(filename)) {
+        printError("cannot read '%s'", filename);
+        return false;
+    }
+
+    // find the virtual offsets of the records
+    vector<string> names;
+    vector<TabixRef> refs;
+    int64_t last_beg = 0;
+    string line;
+    uint64_t vbeg = 0;
+    BgzfBlock block;
+    for (uint64_t coffset=0; reader.read_block(coffset, &block);
+         coffset = block.next) {
+        for (size_t pos=0; pos < block.data.size(); ) {
+            const char *start = block.data.c_str() + pos;
+            const char *stop = (const char*) memchr(
+                start, '\n', block.data.size() - pos);
+            if (!stop) {
+                line.append(start, block.data.size() - pos);
+                break;
+            }
+            line.append(start, stop);
+            pos = stop - block.data.c_str() + 1;
+            // a line ending a block ends at the start of the next one
+            const uint64_t vend = (pos < block.data.size()) ?
+                ((coffset << 16) | pos) : (block.next << 16);
+
+            if (!line.empty() && line[0] != '#') {
+                vector<string> cols;
+                split(line.c_str(), '\t', cols);
+                if (cols.size() < 3) {
+                    printError("bad BED line in '%s'", filename);
+                    return false;
+                }
+                const int64_t beg = atoll(cols[1].c_str());
+                int64_t end = atoll(cols[2].c_str());
+                if (end <= beg)
+                    end = beg + 1;
+
+                if (names.empty() || cols[0] != names.back()) {
+                    if (find(names.begin(), names.end(), cols[0]) !=
+                        names.end()) {
+                        printError("'%s' is not sorted by chromosome",
+                                   filename);
+                        return false;
+                    }
+                    names.push_back(cols[0]);
+                    refs.push_back(TabixRef());
+                } else if (beg < last_beg) {
+                    printError("'%s' is not sorted by start", filename);
+                    return false;
+                }
+                last_beg = beg;
+                index_record(refs.back(), beg, end, vbeg, vend);
+            }
+            line.clear();
+            vbeg = vend;
+        }
+    }
+
+    // offsets of windows without records are those of the previous window
+    for (size_t i=0; i<refs.size(); i++)
+        for (size_t j=1; j<refs[i].linear.size(); j++)
+            if (refs[i].linear[j] == 0)
+                refs[i].linear[j] = refs[i].linear[j-1];
+
+    // BED preset: 0-based starts in column 2 and ends in column 3
+    string data = "TBI\1";
+    put_le(data, refs.size(), 4);
+    const int conf[] = {0x10000, 1, 2, 3, '#', 0};
+    for (int i=0; i<6; i++)
+        put_le(data, conf[i], 4);
+    string all_names;
+    for (size_t i=0; i<names.size(); i++)
+        all_names += names[i] + '\0';
+    put_le(data, all_names.size(), 4);
+    data += all_names;
+
+    for (size_t i=0; i<refs.size(); i++) {
+        const TabixRef &ref = refs[i];
+        put_le(data, ref.bins.size(), 4);
+        for (map<unsigned int, vector<TabixChunk> >::const_iterator it=
+                 ref.bins.begin(); it != ref.bins.end(); ++it) {
+            put_le(data, it->first, 4);
+            put_le(data, it->second.size(), 4);
+            for (size_t j=0; j<it->second.size(); j++) {
+                put_le(data, it->second[j].beg, 8);
+                put_le(data, it->second[j].end, 8);
+            }
+        }
+        put_le(data, ref.linear.size(), 4);
+        for (size_t j=0; j<ref.linear.size(); j++)
+            put_le(data, ref.linear[j], 8);
+    }
+
+    const string index_file = string(filename) + ".tbi";
+    FILE *out = write_compress(index_file.c_str());
+    if (!out) {
+        printError("cannot write '%s'", index_file.c_str());
+        return false;
+    }
+    const bool ok = fwrite(data.c_str(), 1, data.size(), out) == data.size();
+    return (close_compress(out) == 0) && ok;
+}
+
+
+//=============================================================================
+// cache of indexed files
+
+// Identifies the contents of a file by its device, inode, size and
+// modification time.  A missing file has a stamp of zeros.
+class FileStamp
+{
+public:
+    FileStamp() : dev(0), ino(0), size(0), mtime(0), mtime_nsec(0) {}
+
+    void read(const char *filename)
+    {
+        struct stat st;
+        if (stat(filename, &st) != 0) {
+            *this = FileStamp();
+            return;
+        }
+        dev = st.st_dev;
+        ino = st.st_ino;
+        size = st.st_size;
+        mtime = st.st_mtim.tv_sec;
+        mtime_nsec = st.st_mtim.tv_nsec;
+    }
+
+    bool operator==(const FileStamp &other) const
+    {
+        return dev == other.dev && ino == other.ino && size == other.size &&
+            mtime == other.mtime && mtime_nsec == other.mtime_nsec;
+    }
+
+    bool operator!=(const FileStamp &other) const
+    {
+        return !(*this == other);
+    }
+
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+};
+
+
+// An indexed file opened by read_tabix().  It is shared by the cache and
+// the streams reading it, and deleted when the last of them releases it.
+class TabixFile
+{
+public:
+    TabixFile() : nrefs(0) {}
+
+    // Stamps filename and its possible index files
+    static void get_stamps(const char *filename, FileStamp *stamps)
+    {
+        stamps[0].read(filename);
+        stamps[1].read((string(filename) + ".tbi").c_str());
+        stamps[2].read((string(filename) + ".csi").c_str());
+    }
+
+    TabixIndex index;
+    BgzfReader reader;
+    FileStamp stamps[3];  // as returned by get_stamps() before opening
+    int nrefs;            // guarded by g_tabix_lock
+};
+
+
+static map<string, TabixFile*> g_tabix_files;
+static pthread_mutex_t g_tabix_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// Drops a reference to file.  g_tabix_lock must be held.
+static void unref_tabix_file(TabixFile *file)
+{
+    if (--file->nrefs == 0)
+        delete file;
+}
+
+
+// Returns the cached index and reader of filename, or NULL if the file
+// has no index.  The file is reopened if it or its index has changed
+// since it was cached.  The file must be released with
+// release_tabix_file().
+static TabixFile *get_tabix_file(const char *filename)
+{
+    FileStamp stamps[3];
+    TabixFile::get_stamps(filename, stamps);
+
+    pthread_mutex_lock(&g_tabix_lock);
+    TabixFile *file = NULL;
+    map<string, TabixFile*>::iterator it = g_tabix_files.find(filename);
+    if (it != g_tabix_files.end()) {
+        file = it->second;
+        for (int i=0; i<3; i++) {
+            if (file->stamps[i] != stamps[i]) {
+                // streams still reading the old file keep it
+                unref_tabix_file(file);
+                g_tabix_files.erase(it);
+                file = NULL;
+                break;
+            }
+        }
+    }
+    if (!file) {
+        file = new TabixFile();
+        copy(stamps, stamps + 3, file->stamps);
+        if (!file->index.read(filename) || !file->reader.open(filename)) {
+            delete file;
+            file = NULL;
+        } else {
+            g_tabix_files[filename] = file;
+            file->nrefs = 1;
+        }
+    }
+    if (file)
+        file->nrefs++;
+    pthread_mutex_unlock(&g_tabix_lock);
+    return file;
+}
+
+
+static void release_tabix_file(TabixFile *file)
+{
+    pthread_mutex_lock(&g_tabix_lock);
+    unref_tabix_file(file);
+    pthread_mutex_unlock(&g_tabix_lock);
+}
+
+
+void clear_tabix_cache()
+{
+    pthread_mutex_lock(&g_tabix_lock);
+    for (map<string, TabixFile*>::iterator it=g_tabix_files.begin();
+         it != g_tabix_files.end(); ++it)
+        unref_tabix_file(it->second);
+    g_tabix_files.clear();
+    pthread_mutex_unlock(&g_tabix_lock);
+}
+
+
+//=============================================================================
+// region queries
+
+// Parses "chrom", "chrom:start" or "chrom:start-end" (1-based, inclusive)
+// into a 0-based half-open interval
+static bool parse_region(const char *region, string *chrom,
+                         int64_t *beg, int64_t *end)
+{
+    string str;
+    for (const char *c=region; *c; c++)
+        if (*c != ',')
+            str += *c;
+
+    *beg = 0;
+    *end = int64_t(1) << 62;
+    size_t colon = str.rfind(':');
+    if (colon == string::npos) {
+        *chrom = str;
+        return !str.empty();
+    }
+    *chrom = str.substr(0, colon);
+    char *ptr;
+    *beg = strtoll(str.c_str() + colon + 1, &ptr, 10) - 1;
+    if (*ptr == '-')
+        *end = strtoll(ptr + 1, &ptr, 10);
+    return *ptr == '\0' && *beg >= 0 && *beg < *end;
+}
+
+
+// Streams the lines of a file that overlap a region
+class TabixReader
+{
+public:
+    TabixReader(TabixFile *file, int tid, int64_t beg, int64_t end) :
+        file(file), tid(tid), beg(beg), end(end),
+        header(true), ichunk(0), voffset(0), block_offset(1), nlines(0),
+        done(false), pos(0)
+    {
+        file->index.query(tid, beg, end, chunks);
+    }
+
+    ~TabixReader()
+    {
+        release_tabix_file(file);
+    }
+
+    ssize_t read(char *buf, size_t size)
+    {
+        size_t n = 0;
+        while (n < size) {
+            if (pos == pending.size()) {
+                pending.clear();
+                pos = 0;
+                if (done || !next_record())
+                    break;
+            }
+            size_t m = min(size - n, pending.size() - pos);
+            memcpy(buf + n, pending.c_str() + pos, m);
+            pos += m;
+            n += m;
+        }
+        return n;
+    }
+
+protected:
+    // Appends the next header line or overlapping record to pending
+    bool next_record()
+    {
+        const TabixIndex &index = file->index;
+        string line;
+
+        // header lines at the start of the file
+        while (header) {
+            if (read_line(&line) &&
+                ((!line.empty() && line[0] == index.meta) ||
+                 nlines <= index.skip)) {
+                pending = line + "\n";
+                return true;
+            }
+            header = false;
+            if (ichunk < chunks.size())
+                voffset = chunks[ichunk].beg;
+        }
+
+        while (ichunk < chunks.size()) {
+            if (voffset >= chunks[ichunk].end) {
+                if (++ichunk < chunks.size())
+                    voffset = chunks[ichunk].beg;
+                continue;
+            }
+            if (!read_line(&line))
+                break;
+
+            int rtid;
+            int64_t rbeg, rend;
+            if (!parse_record(line, &rtid, &rbeg, &rend))
+                continue;
+            if (rtid != tid || rbeg >= end)
+                break;
+            if (rend > beg) {
+                pending = line + "\n";
+                return true;
+            }
+        }
+        done = true;
+        return false;
+    }
+
+    // Reads the line at the current virtual offset
+    bool read_line(string *line)
+    {
+        line->clear();
+        while (true) {
+            const uint64_t coffset = voffset >> 16;
+            size_t uoffset = voffset & 0xffff;
+            if (coffset != block_offset) {
+                if (!file->reader.read_block(coffset, &block))
+                    return !line->empty();
+                block_offset = coffset;
+            }
+            if (uoffset >= block.data.size()) {
+                const uint64_t next = block.next;
+                if (!file->reader.read_block(next, &block)) {
+                    block_offset = 1;
+                    return !line->empty();
+                }
+                block_offset = next;
+                voffset = next << 16;
+                continue;
+            }
+
+            const char *start = block.data.c_str() + uoffset;
+            const char *stop = (const char*) memchr(
+                start, '\n', block.data.size() - uoffset);
+            if (stop) {
+                line->append(start, stop);
+                uoffset = stop - block.data.c_str() + 1;
+                // a line ending a block ends at the start of the next one
+                if (uoffset < block.data.size())
+                    voffset = (coffset << 16) | uoffset;
+                else
+                    voffset = block.next << 16;
+                if (!line->empty() && (*line)[line->size() - 1] == '\r')
+                    line->resize(line->size() - 1);
+                nlines++;
+                return true;
+            }
+            line->append(start, block.data.size() - uoffset);
+            voffset = (coffset << 16) | block.data.size();
+        }
+    }
+
+    bool parse_record(const string &line, int *rtid,
+                      int64_t *rbeg, int64_t *rend) const
+    {
+        const TabixIndex &index = file->index;
+        if (line.empty() || line[0] == index.meta)
+            return false;
+
+        vector<string> cols;
+        split(line.c_str(), '\t', cols);
+        const int ncols = cols.size();
+        if (index.col_seq > ncols || index.col_beg > ncols)
+            return false;
+
+        const int preset = index.format & 0xffff;
+        const bool zero_based = (index.format & 0x10000) != 0;
+        *rtid = index.get_tid(cols[index.col_seq - 1]);
+        *rbeg = atoll(cols[index.col_beg - 1].c_str()) - (zero_based ? 0 : 1);
+        *rend = *rbeg + 1;
+        if (preset == 0 && index.col_end > 0 && index.col_end <= ncols)
+            *rend = atoll(cols[index.col_end - 1].c_str());
+        else if (preset == 2 && ncols > 3)
+            *rend = *rbeg + cols[3].size();  // VCF: length of REF
+        if (*rend <= *rbeg)
+            *rend = *rbeg + 1;
+        return true;
+    }
+
+    TabixFile *file;
+    int tid;
+    int64_t beg;
+    int64_t end;
+
+    bool header;
+    vector<TabixChunk> chunks;
+    size_t ichunk;
+    uint64_t voffset;
+    BgzfBlock block;
+    uint64_t block_offset;  // offset of block (1 if none)
+    int nlines;
+    bool done;
+
+    string pending;  // output not yet returned by read()
+    size_t pos;
+};
+
+
+#ifdef __GLIBC__
+
+static ssize_t tabix_read(void *cookie, char *buf, size_t size)
+{
+    return ((TabixReader*) cookie)->read(buf, size);
+}
+
+
+static int tabix_close(void *cookie)
+{
+    delete (TabixReader*) cookie;
+    return 0;
+}
+
+#endif // __GLIBC__
+
+
 FILE *read_tabix(const char *filename, const char *region,
                  const char *tabix_dir) {
     FILE *pipe;
@@ -19,10 +904,31 @@ FILE *read_tabix(const char *filename, const char *region,
         return read_compress(filename);
     }
 
+#ifdef __GLIBC__
+    // use the index directly if there is one
+    TabixFile *file = get_tabix_file(filename);
+    if (file) {
+        string chrom;
+        int64_t beg, end;
+        if (!parse_region(region, &chrom, &beg, &end)) {
+            printError("bad region format (%s)\n", region);
+            release_tabix_file(file);
+            return NULL;
+        }
+        TabixReader *reader = new TabixReader(
+            file, file->index.get_tid(chrom), beg, end);
+        cookie_io_functions_t funcs = {tabix_read, NULL, NULL, tabix_close};
+        FILE *stream = fopencookie(reader, "r", funcs);
+        if (!stream)
+            delete reader;
+        return stream;
+    }
+#endif
+
     string cmd = "tabix -h " + quote_arg(filename) + " " +  region;
     if (tabix_dir != NULL)
         cmd = string(tabix_dir) + "/" + cmd;
-    pipe = popen(cmd.c_str(), "r");
+    pipe = open_pipe(cmd.c_str(), "r");
     if (pipe == NULL) {
         printError("Error opening %s with tabix. Is tabix installed and"
                    " in your PATH?\n",
@@ -33,7 +939,7 @@ FILE *read_tabix(const char *filename, const char *region,
 
 
 int close_tabix(FILE *stream) {
-    return pclose(stream);
+    return close_compress(stream);
 }
 
 }
@@ -10,10 +10,24 @@ namespace argweaver {
 
 using namespace std;
 
+// Opens the lines of a bgzipped file that overlap region, preceded by its
+// header lines.  The tabix index (.tbi or .csi) is read in-process and
+// cached along with recently decompressed blocks, so repeated queries do
+// not reopen the file unless it or its index has changed.  Files without
+// an index are passed to the tabix program in tabix_dir.  If region is
+// NULL the whole file is read.
 FILE *read_tabix(const char *filename, const char *region,
                  const char *tabix_dir);
 int close_tabix(FILE *stream);
 
+// Drops all files cached by read_tabix().  Open streams keep reading
+// their files.
+void clear_tabix_cache();
+
+// Writes the tabix index (filename.tbi) of a bgzipped BED file, which
+// must be sorted by chromosome and start
+bool write_tabix_index(const char *filename);
+
 class TabixStream
 {
 public:
@@ -0,0 +1,61 @@
+
+#include "gtest/gtest.h"
+
+#include <string>
+
+#include "compress.h"
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+// A file written across several BGZF blocks is read back unchanged and
+// ends with the empty BGZF block that tabix expects.
+TEST(CompressTest, test_bgzf_round_trip)
+{
+    const char *filename = "test_compress.gz";
+    string text;
+    for (int i=0; i<20000; i++) {
+        char line[100];
+        snprintf(line, sizeof(line), "chr1\t%d\t%d\tline %d\n", i, i+1, i*7);
+        text += line;
+    }
+    ASSERT_GT(text.size(), size_t(3 * BGZF_BLOCK_SIZE));
+
+    set_compress_threads(3);
+    FILE *out = write_compress(filename);
+    ASSERT_TRUE(out != NULL);
+    fwrite(text.c_str(), 1, text.size(), out);
+    EXPECT_EQ(0, close_compress(out));
+    set_compress_threads(1);
+
+    FILE *raw = fopen(filename, "rb");
+    unsigned char header[16];
+    ASSERT_EQ(size_t(16), fread(header, 1, 16, raw));
+    EXPECT_EQ(0x1f, header[0]);
+    EXPECT_EQ(0x8b, header[1]);
+    EXPECT_EQ('B', header[12]);
+    EXPECT_EQ('C', header[13]);
+    fseek(raw, -28, SEEK_END);
+    unsigned char eof[28];
+    ASSERT_EQ(size_t(28), fread(eof, 1, 28, raw));
+    EXPECT_EQ(0x1b, eof[16]);
+    fclose(raw);
+
+    FILE *in = read_compress(filename);
+    ASSERT_TRUE(in != NULL);
+    string text2;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+        text2.append(buf, n);
+    close_compress(in);
+    EXPECT_TRUE(text == text2);
+
+    remove(filename);
+}
+
+
+} // namespace argweaver
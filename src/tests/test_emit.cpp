@@ -0,0 +1,270 @@
+#include "gtest/gtest.h"
+
+#include "common.h"
+#include "emit.h"
+#include "local_tree.h"
+#include "matrices.h"
+#include "model.h"
+#include "random.h"
+#include "sequences.h"
+#include "states.h"
+
+#include "test_util.h"
+
+
+namespace argweaver {
+
+
+// Makes sequences in which many variant sites share a pattern, since there
+// are few sequences and mutations are frequent.  If masked is true, some
+// sites are masked.
+static void make_pattern_seqs(char **seqs, int nseqs, int seqlen, int seed,
+                              bool masked)
+{
+    make_random_seqs(seqs, nseqs, seqlen, seed, .1);
+    if (!masked)
+        return;
+    for (int i=0; i<seqlen; i++)
+        if (frand() < .05)
+            for (int j=0; j<nseqs; j++)
+                seqs[j][i] = 'N';
+}
+
+
+// Emissions of variant sites computed once per site pattern should match
+// the emissions computed by adding the new branch for each state.
+TEST(EmitTest, test_emissions_external_patterns)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    const int seqlen = 500;
+    const int nseqs = 5;
+
+    int ptree[] = {4, 4, 5, 5, 6, 6, -1};
+    int ages[] = {0, 0, 0, 0, 3, 6, 9};
+    LocalTree tree(ptree, 7, ages);
+
+    char *seqs[nseqs];
+    make_pattern_seqs(seqs, nseqs, seqlen, 1, true);
+
+    States states;
+    get_coal_states(&tree, model.ntimes, states);
+    const int nstates = states.size();
+    double **emit = new_matrix<double>(seqlen, nstates);
+    double **emit2 = new_matrix<double>(seqlen, nstates);
+    calc_emissions_external(states, &tree, seqs, nseqs, seqlen, &model, emit);
+    calc_emissions_external_slow(states, &tree, seqs, nseqs, seqlen, &model,
+                                 emit2);
+
+    // invariant sites use an approximation and are not compared
+    for (int i=0; i<seqlen; i++) {
+        int j = 1;
+        while (j < nseqs && seqs[j][i] == seqs[0][i])
+            j++;
+        if (j == nseqs)
+            continue;
+        for (int j=0; j<nstates; j++)
+            EXPECT_NEAR(emit[i][j], emit2[i][j], 1e-9 * emit2[i][j])
+                << "site " << i << " state " << j;
+    }
+
+    delete_matrix<double>(emit, seqlen);
+    delete_matrix<double>(emit2, seqlen);
+    delete_random_seqs(seqs, nseqs);
+}
+
+
+// The likelihood of a block should be the sum of the likelihoods of its
+// sites, whether or not they share patterns.  (Masked sites are left out,
+// since likelihood_tree() gives all invariant sites the likelihood of the
+// first one.)
+TEST(EmitTest, test_likelihood_tree_patterns)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    const int seqlen = 500;
+    const int nseqs = 4;
+
+    int ptree[] = {4, 4, 5, 5, 6, 6, -1};
+    int ages[] = {0, 0, 0, 0, 3, 6, 9};
+    LocalTree tree(ptree, 7, ages);
+
+    char *seqs[nseqs];
+    make_pattern_seqs(seqs, nseqs, seqlen, 2, false);
+
+    const double lnl = likelihood_tree(&tree, &model, seqs, nseqs, 0, seqlen);
+    double lnl2 = 0.0;
+    for (int i=0; i<seqlen; i++)
+        lnl2 += likelihood_tree(&tree, &model, seqs, nseqs, i, i+1);
+    EXPECT_NEAR(lnl, lnl2, 1e-9 * fabs(lnl2));
+
+    delete_random_seqs(seqs, nseqs);
+}
+
+
+// Computes the emissions of the block [start, end) for threading new_chrom.
+static ArgHmmMatrices calc_test_emissions(
+    const ArgModel &model, const Sequences &sequences,
+    const LocalTrees &trees, int start, int end, int new_chrom)
+{
+    ArgHmmMatrices matrices;
+    calc_arghmm_matrices(&model, &sequences, &trees, NULL, &trees.front(),
+                         start, end, new_chrom,
+                         StatesModel(model.ntimes, false, 0), &matrices);
+    return matrices;
+}
+
+
+// Returns true if two emission matrices have the same values and the same
+// sites share rows.
+static bool same_emissions(const ArgHmmMatrices &matrices,
+                           const ArgHmmMatrices &matrices2)
+{
+    const int nstates = matrices.nstates2;
+    for (int i=0; i<matrices.blocklen; i++) {
+        for (int k=0; k<nstates; k++)
+            if (matrices.emit[i][k] != matrices2.emit[i][k])
+                return false;
+        for (int j=0; j<i; j++)
+            if ((matrices.emit[i] == matrices.emit[j]) !=
+                (matrices2.emit[i] == matrices2.emit[j]))
+                return false;
+    }
+    return true;
+}
+
+
+// Cached emissions should equal freshly computed ones, a block whose sites
+// differ only in being masked or invariant should not share an entry, and
+// least recently used entries should be evicted to respect the size limit.
+TEST(EmitTest, test_emission_cache)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    const int seqlen = 200;
+    const int nseqs = 5;
+    const int new_chrom = 4;
+
+    int ptree[] = {4, 4, 5, 5, 6, 6, -1};
+    int ages[] = {0, 0, 0, 0, 3, 6, 9};
+    int ispr[] = {-1, -1, -1, -1};
+    int *ptrees[] = {ptree};
+    int *agess[] = {ages};
+    int *isprs[] = {ispr};
+    int blocklens[] = {seqlen};
+    LocalTrees trees(ptrees, agess, isprs, blocklens, 1, 7);
+
+    char *seqs[nseqs], *seqs2[nseqs];
+    make_pattern_seqs(seqs, nseqs, seqlen, 3, true);
+    for (int j=0; j<nseqs; j++)
+        seqs2[j] = new char [seqlen];
+
+    // the same sequences with the masked sites made invariant
+    for (int j=0; j<nseqs; j++)
+        for (int i=0; i<seqlen; i++)
+            seqs2[j][i] = (seqs[j][i] == 'N') ? 'A' : seqs[j][i];
+    Sequences sequences(seqs, nseqs, seqlen);
+    Sequences sequences2(seqs2, nseqs, seqlen);
+
+    EmissionCache cache(1000000);
+    ArgModel cached_model(model);
+    cached_model.emission_cache = &cache;
+
+    // a cache hit returns the emissions of a fresh calculation
+    ArgHmmMatrices fresh = calc_test_emissions(
+        model, sequences, trees, 0, seqlen, new_chrom);
+    ArgHmmMatrices miss = calc_test_emissions(
+        cached_model, sequences, trees, 0, seqlen, new_chrom);
+    ArgHmmMatrices hit = calc_test_emissions(
+        cached_model, sequences, trees, 0, seqlen, new_chrom);
+    EXPECT_EQ(cache.get_misses(), 1);
+    EXPECT_EQ(cache.get_hits(), 1);
+    EXPECT_TRUE(same_emissions(fresh, miss));
+    EXPECT_TRUE(same_emissions(fresh, hit));
+    EXPECT_NE(hit.emit[0], miss.emit[0]);
+
+    // masked and invariant sites give separate entries
+    ArgHmmMatrices fresh2 = calc_test_emissions(
+        model, sequences2, trees, 0, seqlen, new_chrom);
+    ArgHmmMatrices miss2 = calc_test_emissions(
+        cached_model, sequences2, trees, 0, seqlen, new_chrom);
+    EXPECT_EQ(cache.get_misses(), 2);
+    EXPECT_TRUE(same_emissions(fresh2, miss2));
+    EXPECT_FALSE(same_emissions(fresh, miss2));
+
+    // another alignment with the same invariant and masked sites, as when
+    // the model is reused for other sequences, gives a separate entry
+    char *seqs3[nseqs];
+    for (int j=0; j<nseqs; j++) {
+        seqs3[j] = new char [seqlen];
+        std::copy(seqs[j], seqs[j] + seqlen, seqs3[j]);
+    }
+    int site = 0;
+    while (seqs[1][site] == seqs[2][site] || seqs[1][site] == 'N')
+        site++;
+    ASSERT_LT(site, seqlen);
+    seqs3[new_chrom][site] = (seqs[new_chrom][site] == 'A') ? 'C' : 'A';
+    Sequences sequences3(seqs3, nseqs, seqlen);
+    ArgHmmMatrices fresh3 = calc_test_emissions(
+        model, sequences3, trees, 0, seqlen, new_chrom);
+    ArgHmmMatrices miss3 = calc_test_emissions(
+        cached_model, sequences3, trees, 0, seqlen, new_chrom);
+    EXPECT_EQ(cache.get_misses(), 3);
+    EXPECT_TRUE(same_emissions(fresh3, miss3));
+    EXPECT_FALSE(same_emissions(fresh, miss3));
+
+    fresh.clear();
+    miss.clear();
+    hit.clear();
+    fresh2.clear();
+    miss2.clear();
+    fresh3.clear();
+    miss3.clear();
+
+    // room for two blocks of 20 variant sites
+    const int blocklen = 20;
+    const int nstates = 4;
+    bool invariant[blocklen], masked[blocklen];
+    std::fill(invariant, invariant + blocklen, false);
+    std::fill(masked, masked + blocklen, false);
+    const long entry_size = blocklen * nstates + blocklen;
+    EmissionCache small_cache(2 * entry_size + entry_size / 2);
+    vector<EmissionKey> keys;
+    for (int i=0; i<4; i++)
+        keys.push_back(EmissionKey(trees.front().tree, &trees, i * blocklen,
+                                   (i + 1) * blocklen, false, 0, new_chrom,
+                                   invariant, masked, 0, &model));
+    double **emit = new_block_emissions(blocklen, nstates, invariant, masked);
+    for (int i=0; i<blocklen; i++)
+        for (int k=0; k<nstates; k++)
+            emit[i][k] = i + k;
+
+    small_cache.put(keys[0], blocklen, nstates, emit);
+    small_cache.put(keys[1], blocklen, nstates, emit);
+    EXPECT_EQ(small_cache.get_size(), 2 * entry_size);
+
+    // using the first entry makes the second the least recently used
+    double **emit2 = small_cache.get(keys[0], blocklen, nstates);
+    ASSERT_TRUE(emit2 != NULL);
+    delete_matrix<double>(emit2, blocklen);
+    small_cache.put(keys[2], blocklen, nstates, emit);
+    EXPECT_LE(small_cache.get_size(), small_cache.get_max_size());
+    EXPECT_TRUE(small_cache.get(keys[1], blocklen, nstates) == NULL);
+    for (int j=0; j<3; j += 2) {
+        emit2 = small_cache.get(keys[j], blocklen, nstates);
+        ASSERT_TRUE(emit2 != NULL);
+        EXPECT_EQ(emit2[blocklen-1][nstates-1], emit[blocklen-1][nstates-1]);
+        delete_matrix<double>(emit2, blocklen);
+    }
+
+    // entries larger than the cache are not stored
+    EmissionCache tiny_cache(entry_size - 1);
+    tiny_cache.put(keys[3], blocklen, nstates, emit);
+    EXPECT_EQ(tiny_cache.get_size(), 0);
+    EXPECT_TRUE(tiny_cache.get(keys[3], blocklen, nstates) == NULL);
+
+    delete_matrix<double>(emit, blocklen);
+    delete_random_seqs(seqs, nseqs);
+    delete_random_seqs(seqs2, nseqs);
+    delete_random_seqs(seqs3, nseqs);
+}
+
+
+} // namespace argweaver
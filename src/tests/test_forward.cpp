@@ -0,0 +1,987 @@
+#include <float.h>
+#include <string.h>
+
+#include "gtest/gtest.h"
+
+#include "common.h"
+#include "forward_kernel.h"
+#include "local_tree.h"
+#include "logging.h"
+#include "matrices.h"
+#include "model.h"
+#include "sample_arg.h"
+#include "sample_thread.h"
+#include "sequences.h"
+#include "states.h"
+#include "trans.h"
+
+#include "test_util.h"
+
+
+namespace argweaver {
+
+
+// Make a caterpillar tree with nleaves leaves whose internal nodes are
+// spread over the time points.
+static void make_caterpillar_tree(LocalTree *tree, int nleaves, int ntimes)
+{
+    const int nnodes = 2 * nleaves - 1;
+    int ptree[nnodes];
+    int ages[nnodes];
+
+    for (int i=0; i<nleaves; i++)
+        ages[i] = 0;
+    for (int i=0; i<nleaves-1; i++) {
+        const int node = nleaves + i;
+        ages[node] = 1 + (i * (ntimes - 3)) / max(nleaves - 2, 1);
+        ptree[node] = (i < nleaves - 2) ? node + 1 : -1;
+    }
+    ptree[0] = nleaves;
+    for (int i=1; i<nleaves; i++)
+        ptree[i] = nleaves + max(i - 1, 0);
+
+    tree->set_ptree(ptree, nnodes, ages);
+}
+
+
+// Fill emissions and first forward column with random values.
+static void make_random_block(int blocklen, int nstates,
+                              double **emit, double **fw)
+{
+    for (int i=0; i<blocklen; i++)
+        for (int k=0; k<nstates; k++)
+            emit[i][k] = frand(.1, 1.0);
+    for (int k=0; k<nstates; k++)
+        fw[0][k] = frand(.1, 1.0);
+}
+
+
+// Run forward block with every supported kernel and compare to the dense
+// reference implementation.
+static void check_forward_block(const ArgModel &model, const LocalTree &tree,
+                                bool internal,
+                                ForwardWorkspace *workspace=NULL)
+{
+    const int ntimes = model.ntimes;
+    const int blocklen = 50;
+
+    States states;
+    get_coal_states(&tree, ntimes, states, internal);
+    const int nstates = states.size();
+    ASSERT_GT(nstates, 0);
+
+    LineageCounts lineages(ntimes);
+    lineages.count(&tree, internal);
+    TransMatrix matrix(ntimes, nstates);
+    calc_transition_probs(&tree, &model, states, &lineages, &matrix,
+                          internal);
+
+    double **emit = new_matrix<double>(blocklen, nstates);
+    double **fw = new_matrix<double>(blocklen, nstates);
+    double **fw2 = new_matrix<double>(blocklen, nstates);
+    make_random_block(blocklen, nstates, emit, fw);
+    std::copy(fw[0], fw[0] + nstates, fw2[0]);
+
+    arghmm_forward_block_slow(&tree, ntimes, blocklen, states, lineages,
+                              &matrix, emit, fw2);
+
+    const ForwardKernel kernels[] = {
+        FORWARD_KERNEL_SCALAR, FORWARD_KERNEL_AVX2, FORWARD_KERNEL_AVX512};
+    const ForwardKernel orig_kernel = get_forward_kernel();
+    for (unsigned int j=0; j<sizeof(kernels) / sizeof(kernels[0]); j++) {
+        if (!set_forward_kernel(kernels[j]))
+            continue;
+
+        for (int i=1; i<blocklen; i++)
+            std::fill(fw[i], fw[i] + nstates, 0.0);
+        arghmm_forward_block(&tree, ntimes, blocklen, states, lineages,
+                             &matrix, emit, fw, NULL, 0, workspace);
+
+        for (int i=1; i<blocklen; i++)
+            for (int k=0; k<nstates; k++)
+                EXPECT_NEAR(fw[i][k], fw2[i][k], 1e-10 * fw2[i][k])
+                    << get_forward_kernel_name(kernels[j])
+                    << " column " << i << " state " << k;
+    }
+    set_forward_kernel(orig_kernel);
+
+    delete_matrix<double>(emit, blocklen);
+    delete_matrix<double>(fw, blocklen);
+    delete_matrix<double>(fw2, blocklen);
+}
+
+
+// The compressed forward block should agree with the dense transition matrix.
+TEST(ForwardTest, test_forward_block_external)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    LocalTree tree;
+    make_caterpillar_tree(&tree, 8, model.ntimes);
+    check_forward_block(model, tree, false);
+}
+
+
+// The compressed forward block should agree with the dense transition matrix
+// when threading an internal branch.
+TEST(ForwardTest, test_forward_block_internal)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    LocalTree tree;
+    make_caterpillar_tree(&tree, 8, model.ntimes);
+
+    // Make tree a partial tree by setting root age above valid range.
+    tree.nodes[tree.root].age = model.get_removed_root_time();
+    check_forward_block(model, tree, true);
+}
+
+
+// A workspace reused for blocks of different state spaces should give the
+// same results as a fresh one.
+TEST(ForwardTest, test_forward_block_workspace)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    ForwardWorkspace workspace;
+    LocalTree tree, small_tree;
+    make_caterpillar_tree(&tree, 8, model.ntimes);
+    make_caterpillar_tree(&small_tree, 3, model.ntimes);
+
+    check_forward_block(model, tree, false, &workspace);
+    check_forward_block(model, small_tree, false, &workspace);
+    tree.nodes[tree.root].age = model.get_removed_root_time();
+    check_forward_block(model, tree, true, &workspace);
+}
+
+
+// The transition lookup tables should reproduce the direct calculation.
+TEST(ForwardTest, test_trans_tables)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    const int ntimes = model.ntimes;
+    LocalTree tree;
+    make_caterpillar_tree(&tree, 8, ntimes);
+
+    States states;
+    get_coal_states(&tree, ntimes, states, false);
+    LineageCounts lineages(ntimes);
+    lineages.count(&tree, false);
+
+    for (int minage=0; minage<3; minage++) {
+        TransMatrix matrix(ntimes, states.size());
+        calc_transition_probs(&tree, &model, states, &lineages, &matrix,
+                              false, minage);
+        ASSERT_TRUE(matrix.has_tables);
+
+        for (int a=0; a<ntimes-1; a++)
+            for (int b=0; b<ntimes-1; b++)
+                for (int c=0; c<=b; c++) {
+                    EXPECT_EQ(matrix.get_time(a, b, c, minage, true),
+                              matrix.calc_time(a, b, c, minage, true));
+                    EXPECT_EQ(matrix.get_time(a, b, c, minage, false),
+                              matrix.calc_time(a, b, c, minage, false));
+                }
+    }
+}
+
+
+// Checks get_transition_column() against matrix->get() for every pair of
+// states
+static void check_transition_column(const LocalTree &tree,
+                                    const States &states,
+                                    const TransMatrix &matrix)
+{
+    const int nstates = max(int(states.size()), 1);
+    vector<double> time_trans(matrix.ntimes), trans(nstates);
+    for (int k=0; k<nstates; k++) {
+        get_transition_column(&tree, states, &matrix, k, &time_trans[0],
+                              &trans[0]);
+        for (int j=0; j<nstates; j++)
+            EXPECT_EQ(matrix.get(&tree, states, j, k), trans[j])
+                << "state " << j << " to " << k;
+    }
+}
+
+
+// The transition column into a state should equal the transition matrix,
+// for external and internal branches, with and without a minimum age, and
+// for a fully given internal branch.
+TEST(ForwardTest, test_transition_column)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    const int ntimes = model.ntimes;
+
+    LocalTree tree;
+    make_caterpillar_tree(&tree, 8, ntimes);
+    States states;
+    get_coal_states(&tree, ntimes, states, false);
+    LineageCounts lineages(ntimes);
+    lineages.count(&tree, false);
+    TransMatrix matrix(ntimes, states.size());
+    calc_transition_probs(&tree, &model, states, &lineages, &matrix);
+    check_transition_column(tree, states, matrix);
+
+    // the subtree of the removed branch starts at time 3
+    int ptree[] = {4, 4, 5, 5, 6, 6, -1};
+    int ages[] = {0, 0, 0, 0, 3, 5, model.get_removed_root_time()};
+    LocalTree tree2(ptree, 7, ages);
+    ASSERT_EQ(tree2.nodes[tree2.nodes[tree2.root].child[0]].age, 3);
+    LineageCounts lineages2(ntimes);
+    lineages2.count(&tree2, true);
+    for (int minage=0; minage<=3; minage += 3) {
+        States states2;
+        get_coal_states_internal(&tree2, ntimes, states2, minage);
+        ASSERT_GT(states2.size(), 0u);
+        TransMatrix matrix2(ntimes, states2.size());
+        calc_transition_probs(&tree2, &model, states2, &lineages2, &matrix2,
+                              true, 3);
+        check_transition_column(tree2, states2, matrix2);
+    }
+
+    // no states
+    States states3;
+    TransMatrix matrix3(ntimes, 0);
+    calc_transition_probs(&tree2, &model, states3, &lineages2, &matrix3,
+                          true, 3);
+    ASSERT_TRUE(matrix3.internal);
+    check_transition_column(tree2, states3, matrix3);
+}
+
+
+// Counts the states drawn by sample_column() from weights col * trans and
+// compares them with the expected frequencies.  States of zero weight
+// should never be drawn.
+template <class T>
+static void check_sample_column(const vector<T> &col,
+                                const vector<double> &trans, int nsamples)
+{
+    const int nstates = col.size();
+    vector<double> A(nstates), sums((nstates + 3) / 4);
+    double total = 0.0;
+    for (int j=0; j<nstates; j++)
+        total += col[j] * trans[j];
+
+    vector<int> counts(nstates, 0);
+    for (int n=0; n<nsamples; n++) {
+        const int j = sample_column(&col[0], &trans[0], nstates, &A[0],
+                                    &sums[0]);
+        ASSERT_GE(j, 0);
+        ASSERT_LT(j, nstates);
+        counts[j]++;
+    }
+
+    for (int j=0; j<nstates; j++) {
+        const double p = col[j] * trans[j] / total;
+        if (p == 0.0) {
+            EXPECT_EQ(counts[j], 0) << "state " << j;
+        } else {
+            const double sd = sqrt(nsamples * p * (1.0 - p));
+            EXPECT_NEAR(counts[j], nsamples * p, 5 * sd + 1)
+                << "state " << j;
+        }
+    }
+}
+
+
+// sample_column() should draw each state in proportion to its weight,
+// whether the number of states is a multiple of the block size or not,
+// and never draw states of zero weight, also at the ends of blocks and in
+// blocks that have no weight at all.
+TEST(ForwardTest, test_sample_column)
+{
+    get_random_generator()->set_seed(1);
+    const int sizes[] = {1, 3, 4, 11, 37};
+    for (int s=0; s<5; s++) {
+        const int nstates = sizes[s];
+        vector<double> col(nstates), trans(nstates);
+        vector<float> colf(nstates);
+        for (int j=0; j<nstates; j++) {
+            col[j] = colf[j] = frand(.1, 1.0);
+            trans[j] = frand(.1, 1.0);
+        }
+        check_sample_column(col, trans, 20000);
+        check_sample_column(colf, trans, 20000);
+        if (nstates < 4)
+            continue;
+
+        // zero weights at the start and end of blocks, a block without
+        // weight, a zero column entry and a last state of zero weight
+        trans[0] = 0.0;
+        trans[3] = 0.0;
+        for (int j=4; j<std::min(8, nstates); j++)
+            trans[j] = 0.0;
+        col[nstates / 2] = colf[nstates / 2] = 0.0;
+        trans[nstates - 1] = 0.0;
+        check_sample_column(col, trans, 20000);
+        check_sample_column(colf, trans, 20000);
+
+        // only one state has weight
+        std::fill(trans.begin(), trans.end(), 0.0);
+        trans[1] = 1e-300;
+        check_sample_column(col, trans, 1000);
+    }
+}
+
+
+// Sets the global generator so that its next output is bits.  next()
+// returns rotl(s[1] * 5, 7) * 9, so s[1] is found by undoing each step.
+static void set_next_random_bits(uint64_t bits)
+{
+    const uint64_t inv9 = 0x8e38e38e38e38e39ULL, inv5 = 0xcccccccccccccccdULL;
+    uint64_t y = bits * inv9;
+    y = (y >> 7) | (y << 57);
+    char state[100];
+    snprintf(state, sizeof(state), "xoshiro256** 1 %llx 1 1",
+             (unsigned long long) (y * inv5));
+    ASSERT_TRUE(get_random_generator()->set_state(state));
+}
+
+
+// The extreme draws must not land on states of zero weight.
+TEST(ForwardTest, test_sample_column_ties)
+{
+    double A[9], sums[3];
+
+    // the smallest draw gives a pick of zero for tiny weights; the
+    // leading block and state of zero weight must be passed over
+    const double col[] = {1, 1, 1, 1, 1, 1e-300, 1e-300, 1, 1};
+    const double trans[] = {0, 0, 0, 0, 0, 1e-10, 1e-10, 0, 0};
+    set_next_random_bits(0);
+    EXPECT_EQ(5, sample_column(col, trans, 9, A, sums));
+
+    // the largest draw picks the total, which the running sum inside the
+    // block falls short of through rounding; trailing blocks are empty
+    const double col2[] = {1, 0, 1e-16, 1e-16, 1, 1, 1, 1, 1};
+    const double trans2[] = {1, 1, 1, 1, 0, 0, 0, 0, 0};
+    set_next_random_bits(~0ULL);
+    EXPECT_EQ(3, sample_column(col2, trans2, 9, A, sums));
+
+    // neither draw picks the zero weights around a single state
+    const double trans3[] = {0, 0, 0, 0, 0, 0, 1, 0, 0};
+    set_next_random_bits(0);
+    EXPECT_EQ(6, sample_column(col, trans3, 9, A, sums));
+    set_next_random_bits(~0ULL);
+    EXPECT_EQ(6, sample_column(col, trans3, 9, A, sums));
+}
+
+
+// Skipping a run of shared emission rows with a matrix power should give
+// the same columns as computing every column.
+TEST(ForwardTest, test_forward_runs)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    const int ntimes = model.ntimes;
+    const int blocklen = 300;
+    LocalTree tree;
+    make_caterpillar_tree(&tree, 4, ntimes);
+
+    States states;
+    get_coal_states(&tree, ntimes, states, false);
+    const int nstates = states.size();
+    LineageCounts lineages(ntimes);
+    lineages.count(&tree, false);
+    TransMatrix matrix(ntimes, nstates);
+    calc_transition_probs(&tree, &model, states, &lineages, &matrix);
+
+    // sites 5..254 share one emission row
+    double **rows = new_matrix<double>(blocklen, nstates);
+    double **fw = new_matrix<double>(blocklen, nstates);
+    double **fw2 = new_matrix<double>(blocklen, nstates);
+    make_random_block(blocklen, nstates, rows, fw);
+    std::copy(fw[0], fw[0] + nstates, fw2[0]);
+    const double *emit[blocklen];
+    for (int i=0; i<blocklen; i++)
+        emit[i] = (i >= 5 && i < 255) ? rows[5] : rows[i];
+
+    arghmm_forward_block(&tree, ntimes, blocklen, states, lineages,
+                         &matrix, emit, fw2);
+
+    ForwardRuns runs;
+    arghmm_forward_block(&tree, ntimes, blocklen, states, lineages,
+                         &matrix, emit, fw, &runs, 100, NULL,
+                         FORWARD_RUNS_ALWAYS);
+
+    ASSERT_EQ(runs.size(), 1u);
+    EXPECT_EQ(runs[0].start, 104);
+    EXPECT_EQ(runs[0].len, 250);
+    for (int i=0; i<blocklen; i++) {
+        if (i > 4 && i < 254)
+            continue;
+        for (int k=0; k<nstates; k++)
+            EXPECT_NEAR(fw[i][k], fw2[i][k], 1e-8 * fw2[i][k])
+                << "column " << i << " state " << k;
+    }
+
+    // the run's scale is the total of the unnormalized columns
+    double log_scale = 0.0;
+    for (int i=5; i<255; i++) {
+        double total = 0.0;
+        for (int j=0; j<nstates; j++)
+            total += matrix.get(&tree, states, j, 0) * fw2[i-1][j] *
+                emit[i][0] / fw2[i][0];
+        log_scale += log(total);
+    }
+    EXPECT_NEAR(runs[0].log_scale, log_scale, 1e-8 * fabs(log_scale));
+
+    delete_matrix<double>(rows, blocklen);
+    delete_matrix<double>(fw, blocklen);
+    delete_matrix<double>(fw2, blocklen);
+}
+
+
+// When staying in a state across a run is very likely, a path sampled on
+// the condition that it leaves the state should leave it at each column
+// as often as the full traceback does.
+TEST(ForwardTest, test_forward_run_leaving)
+{
+    ArgModel model(20, 200e3, 1e4, 1e-14, 2.5e-8);
+    const int ntimes = model.ntimes;
+    const int len = 200;
+    LocalTree tree;
+    make_caterpillar_tree(&tree, 4, ntimes);
+
+    States states;
+    get_coal_states(&tree, ntimes, states, false);
+    const int nstates = states.size();
+    LineageCounts lineages(ntimes);
+    lineages.count(&tree, false);
+    TransMatrix matrix(ntimes, nstates);
+    calc_transition_probs(&tree, &model, states, &lineages, &matrix);
+
+    // a run sharing one emission row
+    get_random_generator()->set_seed(1);
+    ForwardRun run;
+    run.start = 0;
+    run.len = len;
+    run.emit.resize(nstates);
+    vector<double> fw0(nstates);
+    for (int j=0; j<nstates; j++) {
+        run.emit[j] = frand(.1, 1.0);
+        fw0[j] = frand(.1, 1.0);
+    }
+
+    // unnormalized forward columns, as log scale and normalized column
+    double **cols = new_matrix<double>(len, nstates);
+    vector<double> log_scale(len, 0.0);
+    std::copy(fw0.begin(), fw0.end(), cols[0]);
+    for (int i=1; i<len; i++) {
+        double total = 0.0;
+        for (int j=0; j<nstates; j++) {
+            double sum = 0.0;
+            for (int s=0; s<nstates; s++)
+                sum += cols[i-1][s] * matrix.get(&tree, states, s, j);
+            cols[i][j] = sum * run.emit[j];
+            total += cols[i][j];
+        }
+        for (int j=0; j<nstates; j++)
+            cols[i][j] /= total;
+        log_scale[i] = log_scale[i-1] + log(total);
+    }
+
+    // most likely state after the run
+    int k = 0;
+    for (int j=1; j<nstates; j++)
+        if (cols[len-1][j] > cols[len-1][k])
+            k = j;
+
+    // log q[i] is the probability that the full traceback stays in k from
+    // column len-1 down to column i
+    const double trans_kk = matrix.get(&tree, states, k, k);
+    double last = 0.0;
+    for (int s=0; s<nstates; s++)
+        last += cols[len-1][s] * matrix.get(&tree, states, s, k);
+    vector<double> log_q(len + 1, 0.0);
+    for (int i=0; i<len; i++)
+        log_q[i] = log(cols[i][k]) + log_scale[i]
+            + (len - 1 - i) * log(trans_kk * run.emit[k]) + log(trans_kk)
+            - log_scale[len-1] - log(last);
+    const double prob_leave = -expm1(log_q[0]);
+    ASSERT_GT(prob_leave, 0.0);
+    ASSERT_LT(prob_leave, 1e-4);
+
+    // expected number of departures per bin of columns
+    const int nsamples = 4000;
+    const int nbins = 10;
+    const int binsize = len / nbins;
+    double expected[nbins];
+    std::fill(expected, expected + nbins, 0.0);
+    for (int i=0; i<len; i++)
+        expected[i / binsize] += nsamples * exp(log_q[i+1]) *
+            -expm1(log_q[i] - log_q[i+1]) / prob_leave;
+
+    int counts[nbins];
+    std::fill(counts, counts + nbins, 0);
+    int nstay = 0;
+    vector<int> path(len + 1);
+    for (int n=0; n<nsamples; n++) {
+        path[len] = k;
+        sample_forward_run_leaving(run, &tree, states, &matrix, ntimes,
+                                   &fw0[0], &path[0]);
+        int i = len - 1;
+        while (i >= 0 && path[i] == k)
+            i--;
+        if (i < 0)
+            nstay++;
+        else
+            counts[i / binsize]++;
+    }
+
+    EXPECT_EQ(nstay, 0);
+    for (int b=0; b<nbins; b++) {
+        const double sd = sqrt(expected[b] * (1.0 - expected[b] / nsamples));
+        EXPECT_NEAR(counts[b], expected[b], 5 * sd + 3) << "bin " << b;
+    }
+
+    delete_matrix<double>(cols, len);
+}
+
+
+// Log likelihood of a thread path through a single local tree
+static double calc_path_likelihood(const ArgModel &model,
+                                   const LocalTree *tree,
+                                   const ArgHmmMatrices &matrices,
+                                   const int *path, int seqlen)
+{
+    States states;
+    get_coal_states(tree, model.ntimes, states, false);
+    LineageCounts lineages(model.ntimes);
+    lineages.count(tree, false);
+    double prior[states.size()];
+    calc_state_priors(states, &lineages, &model, prior);
+
+    double lnl = log(prior[path[0]]) + log(matrices.emit[0][path[0]]);
+    for (int i=1; i<seqlen; i++)
+        lnl += log(matrices.transmat->get(tree, states, path[i-1], path[i]))
+            + log(matrices.emit[i][path[i]]);
+    return lnl;
+}
+
+
+// A single precision forward table should agree with the double precision
+// table up to rounding and sample paths with the same likelihoods.
+TEST(ForwardTest, test_forward_float)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    const int seqlen = 3000;
+    const int nseqs = 5;
+    const int new_chrom = 4;
+
+    // one local tree over the existing four sequences
+    int ptree[] = {4, 4, 5, 5, 6, 6, -1};
+    int ages[] = {0, 0, 0, 0, 3, 6, 9};
+    int ispr[] = {-1, -1, -1, -1};
+    int *ptrees[] = {ptree};
+    int *agess[] = {ages};
+    int *isprs[] = {ispr};
+    int blocklens[] = {seqlen};
+    LocalTrees trees(ptrees, agess, isprs, blocklens, 1, 7);
+
+    // sequences with a few mutations
+    char *seqs[nseqs];
+    make_random_seqs(seqs, nseqs, seqlen, 1, .02);
+    Sequences sequences(seqs, nseqs, seqlen);
+
+    ArgHmmMatrixIter matrix_iter(&model, &sequences, &trees, new_chrom);
+    ArgHmmMatrixIter matrix_iter2(&model, NULL, &trees, new_chrom);
+
+    ArgHmmForwardTable forward(0, seqlen);
+    arghmm_forward_alg(&trees, &model, &sequences, &matrix_iter, &forward);
+    ArgHmmForwardTableFloat forward2(0, seqlen);
+    arghmm_forward_alg(&trees, &model, &sequences, &matrix_iter, &forward2);
+
+    double **fw = forward.get_table();
+    float **fw2 = forward2.get_table();
+    const int nstates = get_num_coal_states(trees.front().tree, model.ntimes);
+    for (int i=0; i<seqlen; i++)
+        for (int k=0; k<nstates; k++)
+            EXPECT_NEAR(fw2[i][k], fw[i][k], 1e-6 * fw[i][k] + 1e-37)
+                << "column " << i << " state " << k;
+
+    // paths sampled from both tables with the same random numbers
+    matrix_iter.begin();
+    const ArgHmmMatrices &matrices = matrix_iter.ref_matrices();
+    const LocalTree *tree = trees.front().tree;
+    int path[seqlen], path2[seqlen];
+    const int nsamples = 20;
+    for (int j=0; j<nsamples; j++) {
+        get_random_generator()->set_seed(j);
+        stochastic_traceback(&trees, &model, &matrix_iter2, fw, path);
+        get_random_generator()->set_seed(j);
+        stochastic_traceback(&trees, &model, &matrix_iter2, fw2, path2);
+
+        const double lnl = calc_path_likelihood(
+            model, tree, matrices, path, seqlen);
+        const double lnl2 = calc_path_likelihood(
+            model, tree, matrices, path2, seqlen);
+        EXPECT_NEAR(lnl, lnl2, 1e-3 * fabs(lnl));
+    }
+
+    delete_random_seqs(seqs, nseqs);
+}
+
+
+// Reads an ARG of three sequences with two local trees, the second starting
+// at position 'recomb'
+static bool read_two_tree_arg(const ArgModel &model, int seqlen, int recomb,
+                              LocalTrees *trees)
+{
+    char smc[1000];
+    snprintf(smc, sizeof(smc),
+             "NAMES\ta\tb\tc\n"
+             "REGION\tchr\t1\t%d\n"
+             "TREE\t1\t%d\t((0:%f[&&NHX:age=0],1:%f[&&NHX:age=0])3:%f"
+             "[&&NHX:age=%f],2:%f[&&NHX:age=0])4[&&NHX:age=%f]\n"
+             "SPR\t%d\t1\t0\t2\t%f\n"
+             "TREE\t%d\t%d\t((1:%f[&&NHX:age=0],2:%f[&&NHX:age=0])3:%f"
+             "[&&NHX:age=%f],0:%f[&&NHX:age=0])4[&&NHX:age=%f]\n",
+             seqlen, recomb,
+             model.times[3], model.times[3], model.times[6] - model.times[3],
+             model.times[3], model.times[6], model.times[6],
+             recomb, model.times[3],
+             recomb + 1, seqlen,
+             model.times[3], model.times[3], model.times[6] - model.times[3],
+             model.times[3], model.times[6], model.times[6]);
+
+    FILE *infile = tmpfile();
+    fputs(smc, infile);
+    rewind(infile);
+    vector<string> seqnames;
+    bool result = read_local_trees(infile, model.times, model.ntimes,
+                                   trees, seqnames);
+    fclose(infile);
+    return result;
+}
+
+
+// The forward algorithm options belong to the model, so that copies and
+// local models use the same forward table as the model they came from.
+TEST(ForwardTest, test_forward_options_model)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    EXPECT_EQ(-1, model.forward_checkpoints);
+    EXPECT_FALSE(model.forward_float);
+    EXPECT_EQ(FORWARD_RUNS_OFF, model.forward_run_mode);
+
+    model.forward_checkpoints = 100;
+    model.forward_float = true;
+    model.forward_run_mode = FORWARD_RUNS_AUTO;
+
+    ArgModel copy(model);
+    ArgModel shared(model, 1e-8, 1e-8);
+    ArgModel local, local2;
+    model.get_local_model(0, local);
+    model.get_local_model_index(0, local2);
+    const ArgModel *models[] = {&copy, &shared, &local, &local2};
+    for (int i=0; i<4; i++) {
+        EXPECT_EQ(100, models[i]->forward_checkpoints) << i;
+        EXPECT_TRUE(models[i]->forward_float) << i;
+        EXPECT_EQ(FORWARD_RUNS_AUTO, models[i]->forward_run_mode) << i;
+    }
+}
+
+
+// A checkpointed forward table should have the same columns at its
+// checkpoints as the full table and, with the same random numbers, sample
+// the same paths.
+TEST(ForwardTest, test_forward_checkpoints)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    const int seqlen = 3000;
+    const int nseqs = 4;
+    const int new_chrom = 3;
+    LocalTrees trees;
+    ASSERT_TRUE(read_two_tree_arg(model, seqlen, 1100, &trees));
+    ASSERT_EQ(trees.get_num_trees(), 2);
+
+    // sequences with a few mutations
+    char *seqs[nseqs];
+    make_random_seqs(seqs, nseqs, seqlen, 1, .02);
+    Sequences sequences(seqs, nseqs, seqlen);
+
+    ArgHmmMatrixIter matrix_iter(&model, &sequences, &trees, new_chrom);
+    ArgHmmMatrixIter matrix_iter2(&model, NULL, &trees, new_chrom);
+    ArgHmmForwardTable forward(0, seqlen);
+    arghmm_forward_alg(&trees, &model, &sequences, &matrix_iter, &forward);
+    double **fw = forward.get_table();
+
+    // spacings with segments that end before, at and after the block end
+    const int spacings[] = {100, 275, 1100, 0};
+    for (int s=0; s<4; s++) {
+        ArgHmmForwardCheckpoints checkpoints(0, seqlen, spacings[s]);
+        arghmm_forward_alg_checkpoints(&trees, &model, &matrix_iter,
+                                       &checkpoints);
+
+        for (int seg=0; seg<checkpoints.get_num_segments(); seg++) {
+            const int pos = checkpoints.get_segment_end(seg) - 1;
+            const double *col = checkpoints.get_checkpoint(seg);
+            const int nstates = get_num_coal_states(
+                trees.front().tree, model.ntimes);
+            for (int k=0; k<nstates; k++)
+                EXPECT_NEAR(col[k], fw[pos][k], 1e-10 * fw[pos][k])
+                    << "spacing " << spacings[s] << " column " << pos
+                    << " state " << k;
+        }
+
+        int path[seqlen], path2[seqlen];
+        for (int j=0; j<10; j++) {
+            get_random_generator()->set_seed(j);
+            stochastic_traceback(&trees, &model, &matrix_iter2, fw, path);
+            get_random_generator()->set_seed(j);
+            stochastic_traceback_checkpoints(&trees, &model, &matrix_iter,
+                                             &checkpoints, path2);
+            for (int i=0; i<seqlen; i++)
+                ASSERT_EQ(path[i], path2[i])
+                    << "spacing " << spacings[s] << " seed " << j
+                    << " position " << i;
+        }
+    }
+
+    delete_random_seqs(seqs, nseqs);
+}
+
+
+// Over a long block without recombination and with a low mutation rate,
+// the forward probabilities of states that disagree with the data decay
+// below the range of a normal float.  The single precision table should
+// keep them positive, so that paths sampled from it are the ones sampled
+// from the double precision table.
+TEST(ForwardTest, test_forward_float_underflow)
+{
+    ArgModel model(20, 200e3, 1e4, 1e-30, 1e-11);
+    const int seqlen = 20000;
+    const int nseqs = 5;
+    const int new_chrom = 4;
+
+    // one local tree over the existing four sequences
+    int ptree[] = {4, 4, 5, 5, 6, 6, -1};
+    int ages[] = {0, 0, 0, 0, 3, 6, 9};
+    int ispr[] = {-1, -1, -1, -1};
+    int *ptrees[] = {ptree};
+    int *agess[] = {ages};
+    int *isprs[] = {ispr};
+    int blocklens[] = {seqlen};
+    LocalTrees trees(ptrees, agess, isprs, blocklens, 1, 7);
+
+    // the new sequence carries the mutations of sequence 0
+    char *seqs[nseqs];
+    make_random_seqs(seqs, nseqs, seqlen, 1);
+    memcpy(seqs[new_chrom], seqs[0], seqlen);
+    Sequences sequences(seqs, nseqs, seqlen);
+
+    ArgHmmMatrixIter matrix_iter(&model, &sequences, &trees, new_chrom);
+    ArgHmmMatrixIter matrix_iter2(&model, NULL, &trees, new_chrom);
+    ArgHmmForwardTable forward(0, seqlen);
+    arghmm_forward_alg(&trees, &model, &sequences, &matrix_iter, &forward);
+    ArgHmmForwardTableFloat forward2(0, seqlen);
+    arghmm_forward_alg(&trees, &model, &sequences, &matrix_iter, &forward2);
+    double **fw = forward.get_table();
+    float **fw2 = forward2.get_table();
+
+    // small probabilities are kept as normal floats
+    int nsmall = 0;
+    const int nstates = get_num_coal_states(trees.front().tree, model.ntimes);
+    for (int i=0; i<seqlen; i++) {
+        for (int k=0; k<nstates; k++) {
+            if (fw[i][k] == 0.0) {
+                EXPECT_EQ(fw2[i][k], 0.0f);
+            } else if (fw[i][k] < FLT_MIN) {
+                nsmall++;
+                ASSERT_EQ(fw2[i][k], FLT_MIN)
+                    << "column " << i << " state " << k;
+            } else {
+                ASSERT_NEAR(fw2[i][k], fw[i][k], 1e-6 * fw[i][k])
+                    << "column " << i << " state " << k;
+            }
+        }
+    }
+    EXPECT_GT(nsmall, 0);
+
+    // paths sampled from both tables with the same random numbers
+    matrix_iter.begin();
+    const ArgHmmMatrices &matrices = matrix_iter.ref_matrices();
+    const LocalTree *tree = trees.front().tree;
+    int path[seqlen], path2[seqlen];
+    for (int j=0; j<20; j++) {
+        get_random_generator()->set_seed(j);
+        stochastic_traceback(&trees, &model, &matrix_iter2, fw, path);
+        get_random_generator()->set_seed(j);
+        stochastic_traceback(&trees, &model, &matrix_iter2, fw2, path2);
+
+        const double lnl = calc_path_likelihood(
+            model, tree, matrices, path, seqlen);
+        const double lnl2 = calc_path_likelihood(
+            model, tree, matrices, path2, seqlen);
+        ASSERT_TRUE(lnl2 > -INFINITY) << "seed " << j;
+        EXPECT_NEAR(lnl, lnl2, 1e-3 * fabs(lnl));
+    }
+
+    delete_random_seqs(seqs, nseqs);
+}
+
+
+// Counts the values that differ between the matrices of a block
+static int count_matrix_differences(const ArgHmmMatrices &a,
+                                    const ArgHmmMatrices &b,
+                                    const LocalTree *tree,
+                                    const States &states)
+{
+    if (a.nstates1 != b.nstates1 || a.nstates2 != b.nstates2 ||
+        a.blocklen != b.blocklen ||
+        (a.transmat_switch == NULL) != (b.transmat_switch == NULL))
+        return -1;
+
+    int ndiffs = 0;
+    for (int i=0; i<a.blocklen; i++)
+        for (int k=0; k<a.nstates2; k++)
+            ndiffs += (a.emit[i][k] != b.emit[i][k]);
+    for (int j=0; j<a.nstates2; j++)
+        for (int k=0; k<a.nstates2; k++)
+            ndiffs += (a.transmat->get(tree, states, j, k) !=
+                       b.transmat->get(tree, states, j, k));
+    if (a.transmat_switch) {
+        for (int j=0; j<a.nstates1; j++)
+            for (int k=0; k<a.nstates2; k++)
+                ndiffs += (a.transmat_switch->get(j, k) !=
+                           b.transmat_switch->get(j, k));
+    }
+    return ndiffs;
+}
+
+
+// Matrices computed ahead by a pipeline should equal those computed on the
+// calling thread, also when blocks are read out of order, which stops the
+// workers, and when no matrix threads are free.
+TEST(ForwardTest, test_matrix_pipeline)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    const int seqlen = 50000;
+    const int nseqs = 6;
+    const int new_chrom = 5;
+
+    char *seqs[nseqs];
+    make_random_seqs(seqs, nseqs, seqlen, 1);
+    Sequences sequences(seqs, nseqs, seqlen);
+    Sequences sequences2(&sequences, new_chrom);
+    LocalTrees trees(0, seqlen);
+    sample_arg_seq(&model, &sequences2, &trees);
+
+    // matrices computed one block at a time
+    ArgHmmMatrixIter matrix_iter(&model, &sequences, &trees, new_chrom);
+    vector<ArgHmmMatrices> expected;
+    vector<const LocalTree*> block_trees;
+    for (matrix_iter.begin(); matrix_iter.more(); matrix_iter.next()) {
+        ArgHmmMatrices &matrices = matrix_iter.ref_matrices();
+        expected.push_back(matrices);
+        matrices.detach();
+        block_trees.push_back(matrix_iter.get_tree_spr()->tree);
+    }
+    const int nblocks = expected.size();
+    ASSERT_GT(nblocks, 10);
+
+    const int orig_threads = get_matrix_threads();
+    set_matrix_threads(3);
+    ArgHmmMatrixPipeline pipeline(&model, &sequences, &trees, new_chrom, 3, 2);
+    States states;
+
+    // in order, and reading the middle block twice
+    for (int pass=0; pass<2; pass++) {
+        int i = 0;
+        for (pipeline.begin(); pipeline.more(); pipeline.next(), i++) {
+            pipeline.get_coal_states(block_trees[i], states);
+            EXPECT_EQ(count_matrix_differences(
+                pipeline.ref_matrices(), expected[i], block_trees[i],
+                states), 0) << "pass " << pass << " block " << i;
+            if (pass == 1 && i == nblocks / 2) {
+                EXPECT_EQ(count_matrix_differences(
+                    pipeline.ref_matrices(), expected[i], block_trees[i],
+                    states), 0) << "block " << i << " read again";
+            }
+        }
+        EXPECT_EQ(i, nblocks);
+    }
+
+    // jumping to another block
+    pipeline.begin();
+    pipeline.ref_matrices();
+    pipeline.set_block_index(nblocks - 2);
+    for (int i=nblocks-2; pipeline.more(); pipeline.next(), i++) {
+        pipeline.get_coal_states(block_trees[i], states);
+        EXPECT_EQ(count_matrix_differences(
+            pipeline.ref_matrices(), expected[i], block_trees[i], states), 0)
+            << "block " << i << " after jump";
+    }
+
+    // while another pipeline holds all matrix threads
+    {
+        ArgHmmMatrixPipeline pipeline2(&model, &sequences, &trees,
+                                       new_chrom, 3, 2);
+        pipeline2.begin();
+        int i = 0;
+        for (pipeline.begin(); pipeline.more(); pipeline.next(), i++) {
+            pipeline.get_coal_states(block_trees[i], states);
+            EXPECT_EQ(count_matrix_differences(
+                pipeline.ref_matrices(), expected[i], block_trees[i],
+                states), 0) << "block " << i << " without threads";
+        }
+        EXPECT_EQ(i, nblocks);
+    }
+    set_matrix_threads(orig_threads);
+
+    for (int i=0; i<nblocks; i++)
+        expected[i].clear();
+    delete_random_seqs(seqs, nseqs);
+}
+
+
+// Benchmark each forward kernel.
+// Run with:
+//   src/tests/test --gtest_also_run_disabled_tests
+//       --gtest_filter=ForwardTest.DISABLED_bench_forward_block
+TEST(ForwardTest, DISABLED_bench_forward_block)
+{
+    const int nleaves = 100;
+    const int blocklen = 2000;
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    const int ntimes = model.ntimes;
+    LocalTree tree;
+    make_caterpillar_tree(&tree, nleaves, ntimes);
+
+    States states;
+    get_coal_states(&tree, ntimes, states, false);
+    const int nstates = states.size();
+    LineageCounts lineages(ntimes);
+    lineages.count(&tree, false);
+    TransMatrix matrix(ntimes, nstates);
+    calc_transition_probs(&tree, &model, states, &lineages, &matrix);
+
+    double **emit = new_matrix<double>(blocklen, nstates);
+    double **fw = new_matrix<double>(blocklen, nstates);
+    make_random_block(blocklen, nstates, emit, fw);
+
+    const ForwardKernel kernels[] = {
+        FORWARD_KERNEL_SCALAR, FORWARD_KERNEL_AVX2, FORWARD_KERNEL_AVX512};
+    const ForwardKernel orig_kernel = get_forward_kernel();
+    double scalar_time = 0.0;
+    for (unsigned int j=0; j<sizeof(kernels) / sizeof(kernels[0]); j++) {
+        if (!set_forward_kernel(kernels[j]))
+            continue;
+
+        Timer timer;
+        const int nreps = 10;
+        for (int rep=0; rep<nreps; rep++)
+            arghmm_forward_block(&tree, ntimes, blocklen, states, lineages,
+                                 &matrix, emit, fw);
+        double t = timer.time() / nreps;
+        if (kernels[j] == FORWARD_KERNEL_SCALAR)
+            scalar_time = t;
+        printf("forward block %-7s (%d states, %d columns): "
+               "%8.3f ms  speedup %.2fx\n",
+               get_forward_kernel_name(kernels[j]), nstates, blocklen,
+               t * 1e3, scalar_time / t);
+    }
+    set_forward_kernel(orig_kernel);
+
+    delete_matrix<double>(emit, blocklen);
+    delete_matrix<double>(fw, blocklen);
+}
+
+
+}  // namespace argweaver
@@ -1,6 +1,12 @@
 #include "gtest/gtest.h"
 
+#include "binary_trees.h"
 #include "local_tree.h"
+#include "model.h"
+#include "sample_arg.h"
+#include "sequences.h"
+
+#include "test_util.h"
 
 
 namespace argweaver {
@@ -80,4 +86,243 @@ TEST(LocalTreeTest, parse_local_tree_extra_meta_data)
 }
 
 
+// Write text local trees
+static string local_trees_text(const LocalTrees &trees,
+                               const vector<string> &seqnames,
+                               const double *times)
+{
+    vector<const char*> names;
+    for (unsigned int i=0; i<seqnames.size(); i++)
+        names.push_back(seqnames[i].c_str());
+
+    FILE *out = tmpfile();
+    write_local_trees(out, &trees, &names[0], times);
+    string text(ftell(out), '\0');
+    rewind(out);
+    EXPECT_EQ(fread(&text[0], 1, text.size(), out), text.size());
+    fclose(out);
+    return text;
+}
+
+
+// Round trip local trees through the binary format.
+TEST(LocalTreeTest, local_trees_binary)
+{
+    const char *smc =
+        "NAMES\ta\tb\tc\n"
+        "REGION\tchr\t1\t30\n"
+        "TREE\t1\t10\t((0:10[&&NHX:age=0],1:10[&&NHX:age=0])3:10[&&NHX:age=10],2:20[&&NHX:age=0])4[&&NHX:age=20]\n"
+        "SPR\t10\t1\t0\t2\t10\n"
+        "TREE\t11\t30\t((1:10[&&NHX:age=0],2:10[&&NHX:age=0])3:10[&&NHX:age=10],0:20[&&NHX:age=0])4[&&NHX:age=20]\n";
+    int ntimes = 5;
+    double times[] = {0, 10, 20, 30, 40};
+
+    FILE *infile = tmpfile();
+    fputs(smc, infile);
+    rewind(infile);
+    LocalTrees trees;
+    vector<string> seqnames;
+    EXPECT_TRUE(read_local_trees(infile, times, ntimes, &trees, seqnames));
+    fclose(infile);
+
+    FILE *binfile = tmpfile();
+    vector<const char*> names;
+    for (unsigned int i=0; i<seqnames.size(); i++)
+        names.push_back(seqnames[i].c_str());
+    write_local_trees_binary(binfile, &trees, &names[0], times, ntimes);
+    rewind(binfile);
+    LocalTrees trees2;
+    vector<string> seqnames2;
+    EXPECT_TRUE(read_local_trees_binary(binfile, times, ntimes,
+                                        &trees2, seqnames2));
+
+    // Assert same trees.
+    EXPECT_EQ(trees2.get_num_trees(), 2);
+    EXPECT_EQ(seqnames2, seqnames);
+    EXPECT_EQ(local_trees_text(trees2, seqnames2, times),
+              local_trees_text(trees, seqnames, times));
+
+    // Assert region read.
+    LocalTrees trees3;
+    rewind(binfile);
+    EXPECT_TRUE(read_local_trees_binary(binfile, times, ntimes,
+                                        &trees3, seqnames2, 12, 20));
+    EXPECT_EQ(trees3.get_num_trees(), 2);
+    fclose(binfile);
+}
+
+
+// Region reads of an ARG spanning several blocks of the binary format
+// should give the trees of the blocks overlapping the region, as found in
+// a full read.
+TEST(LocalTreeTest, local_trees_binary_blocks)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-7, 2.5e-8);
+    const int seqlen = 20000;
+    const int nseqs = 8;
+
+    char *seqs[nseqs];
+    make_random_seqs(seqs, nseqs, seqlen, 6);
+    Sequences sequences(seqs, nseqs, seqlen);
+    LocalTrees trees(0, seqlen);
+    sample_arg_seq(&model, &sequences, &trees);
+    const int ntrees = trees.get_num_trees();
+    ASSERT_GT(ntrees, 2 * BINARY_TREES_BLOCK);
+
+    vector<string> seqnames;
+    vector<const char*> names;
+    for (int i=0; i<nseqs; i++) {
+        char name[10];
+        snprintf(name, sizeof(name), "n%d", i);
+        seqnames.push_back(name);
+    }
+    for (int i=0; i<nseqs; i++)
+        names.push_back(seqnames[i].c_str());
+
+    FILE *binfile = tmpfile();
+    write_local_trees_binary(binfile, &trees, &names[0], model.times,
+                             model.ntimes);
+    rewind(binfile);
+    LocalTrees trees2;
+    vector<string> seqnames2;
+    ASSERT_TRUE(read_local_trees_binary(binfile, model.times, model.ntimes,
+                                        &trees2, seqnames2));
+    const string text = local_trees_text(trees, seqnames, model.times);
+    EXPECT_EQ(local_trees_text(trees2, seqnames2, model.times), text);
+
+    // start coordinate of each tree
+    vector<int> tree_starts;
+    int pos = 0;
+    for (LocalTrees::const_iterator it=trees.begin(); it != trees.end();
+         ++it) {
+        tree_starts.push_back(pos);
+        pos += it->blocklen;
+    }
+
+    // within the first block, across the boundary of the second and third
+    // blocks, and up to the end
+    const int b = BINARY_TREES_BLOCK;
+    const int regions[][2] = {
+        {tree_starts[3], tree_starts[10]},
+        {tree_starts[2*b - 5], tree_starts[2*b + 5]},
+        {tree_starts[2*b], tree_starts[2*b] + 1},
+        {tree_starts[ntrees - 1], seqlen}};
+    for (int r=0; r<4; r++) {
+        const int start = regions[r][0], end = regions[r][1];
+        LocalTrees trees3;
+        rewind(binfile);
+        ASSERT_TRUE(read_local_trees_binary(binfile, model.times,
+                                            model.ntimes, &trees3,
+                                            seqnames2, start, end));
+
+        // whole blocks of trees are read
+        const int first = (upper_bound(tree_starts.begin(), tree_starts.end(),
+                                       start) - tree_starts.begin() - 1) / b;
+        const int last = (upper_bound(tree_starts.begin(), tree_starts.end(),
+                                      end - 1) - tree_starts.begin() - 1) / b;
+        const int start2 = tree_starts[first * b];
+        const int end2 = ((last + 1) * b < ntrees) ?
+            tree_starts[(last + 1) * b] : seqlen;
+        EXPECT_EQ(trees3.start_coord, start2) << r;
+        EXPECT_EQ(trees3.end_coord, end2) << r;
+
+        // same trees as the slice of a full read, which is split between
+        // trees and needs no trimming
+        LocalTrees slice;
+        slice.copy(trees2);
+        LocalTrees *middle = partition_local_trees(&slice, start2, false);
+        LocalTrees *rest = partition_local_trees(middle, end2, false);
+        EXPECT_EQ(local_trees_text(trees3, seqnames2, model.times),
+                  local_trees_text(*middle, seqnames2, model.times)) << r;
+        delete middle;
+        delete rest;
+    }
+    fclose(binfile);
+    delete_random_seqs(seqs, nseqs);
+}
+
+
+// Copies keep the nodes of all trees in one arena, which partitioning and
+// appending move between local trees without copying nodes.
+TEST(LocalTreeTest, local_trees_arena)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    const int seqlen = 50000;
+    const int nseqs = 6;
+
+    char *seqs[nseqs];
+    make_random_seqs(seqs, nseqs, seqlen, 5);
+    Sequences sequences(seqs, nseqs, seqlen);
+    LocalTrees trees(0, seqlen);
+    sample_arg_seq(&model, &sequences, &trees);
+    const int ntrees = trees.get_num_trees();
+    ASSERT_GT(ntrees, 10);
+
+    vector<string> seqnames;
+    for (int i=0; i<nseqs; i++) {
+        char name[10];
+        snprintf(name, sizeof(name), "n%d", i);
+        seqnames.push_back(name);
+    }
+    const string text = local_trees_text(trees, seqnames, model.times);
+
+    // one slot per tree in order of blocks
+    LocalTrees trees2;
+    trees2.copy(trees);
+    LocalNodeArena *arena = trees2.front().tree->arena;
+    ASSERT_TRUE(arena != NULL);
+    EXPECT_EQ(ntrees, arena->refs);
+    const int capacity = trees2.front().tree->capacity;
+    vector<LocalTree*> tree_ptrs;
+    vector<int> tree_starts;
+    int pos = trees2.start_coord;
+    for (LocalTrees::iterator it=trees2.begin(); it != trees2.end(); ++it) {
+        EXPECT_EQ(arena, it->tree->arena);
+        EXPECT_EQ(arena->nodes + tree_ptrs.size() * capacity,
+                  it->tree->nodes);
+        tree_ptrs.push_back(it->tree);
+        tree_starts.push_back(pos);
+        pos += it->blocklen;
+    }
+    EXPECT_EQ(text, local_trees_text(trees2, seqnames, model.times));
+
+    // copying again reuses the trees and the arena
+    trees2.copy(trees);
+    EXPECT_EQ(arena, trees2.front().tree->arena);
+    EXPECT_EQ(tree_ptrs[0], trees2.front().tree);
+
+    // partition and rejoin at tree boundaries, which need no trimming
+    LocalTrees *trees3 = partition_local_trees(
+        &trees2, tree_starts[ntrees / 3], false);
+    LocalTrees *trees4 = partition_local_trees(
+        trees3, tree_starts[2 * ntrees / 3], false);
+    EXPECT_EQ(ntrees, arena->refs);
+    EXPECT_EQ(tree_ptrs[ntrees / 3], trees3->front().tree);
+    EXPECT_EQ(tree_ptrs[2 * ntrees / 3], trees4->front().tree);
+    append_local_trees(&trees2, trees3);
+    append_local_trees(&trees2, trees4);
+    delete trees3;
+    delete trees4;
+    EXPECT_TRUE(assert_trees(&trees2));
+    EXPECT_EQ(ntrees, arena->refs);
+    EXPECT_EQ(text, local_trees_text(trees2, seqnames, model.times));
+    int i = 0;
+    for (LocalTrees::iterator it=trees2.begin(); it != trees2.end(); ++it)
+        EXPECT_EQ(tree_ptrs[i++], it->tree);
+
+    // the arena outlives the trees moved out of trees2 and is only reused
+    // once no other local trees use it
+    trees3 = partition_local_trees(&trees2, tree_starts[ntrees / 2], false);
+    const string text3 = local_trees_text(*trees3, seqnames, model.times);
+    trees2.copy(trees);
+    EXPECT_NE(arena, trees2.front().tree->arena);
+    EXPECT_EQ(ntrees - ntrees / 2, arena->refs);
+    EXPECT_EQ(text, local_trees_text(trees2, seqnames, model.times));
+    EXPECT_EQ(text3, local_trees_text(*trees3, seqnames, model.times));
+    delete trees3;
+
+    delete_random_seqs(seqs, nseqs);
+}
+
+
 }  // namespace
@@ -3,11 +3,18 @@
 #include "common.h"
 #include "local_tree.h"
 #include "model.h"
+#include "emit.h"
+#include "parallel.h"
+#include "random.h"
 #include "recomb.h"
+#include "sample_arg.h"
+#include "sequences.h"
 #include "states.h"
 #include "thread.h"
 #include "total_prob.h"
 
+#include "test_util.h"
+
 
 namespace argweaver {
 
@@ -274,4 +281,269 @@ TEST(ProbTest, test_sample_recomb_internal)
 }
 
 
+
+// The cached ARG statistics should match a full recomputation, also after
+// the ARG has been partially resampled.
+TEST(ProbTest, test_arg_stats_cache)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    const int seqlen = 20000;
+    const int nseqs = 6;
+
+    char *seqs[nseqs];
+    make_random_seqs(seqs, nseqs, seqlen, 1);
+    Sequences sequences(seqs, nseqs, seqlen);
+
+    LocalTrees trees(0, seqlen);
+    sample_arg_seq(&model, &sequences, &trees);
+
+    ArgStatsCache cache;
+    for (int iter=0; iter<3; iter++) {
+        double prior, likelihood, arglen;
+        int noncompats;
+        cache.calc(&model, &sequences, &trees, NULL,
+                   &prior, &likelihood, &noncompats, &arglen);
+
+        EXPECT_NEAR(prior, calc_arg_prior(&model, &trees),
+                    1e-9 * fabs(prior));
+        EXPECT_NEAR(likelihood, calc_arg_likelihood(&model, &sequences, &trees),
+                    1e-9 * fabs(likelihood));
+        EXPECT_EQ(noncompats, count_noncompat(&trees, seqs, nseqs, seqlen));
+        EXPECT_NEAR(arglen, get_arglen(&trees, model.times), 1e-9 * arglen);
+
+        resample_arg(&model, &sequences, &trees);
+    }
+
+    delete_random_seqs(seqs, nseqs);
+}
+
+
+
+// With a compressed alignment the cached statistics should be those of the
+// uncompressed ARG, as computed before the cache was introduced.
+TEST(ProbTest, test_arg_stats_cache_compressed)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    const int seqlen = 20000;
+    const int nseqs = 6;
+    const int compress = 5;
+
+    char *seqs[nseqs];
+    make_random_seqs(seqs, nseqs, seqlen, 4, .002);
+    Sequences sequences(seqs, nseqs, seqlen);
+
+    // compress the alignment as arg-sample does, for a region that does
+    // not start at zero
+    Sites sites;
+    SitesMapping sites_mapping;
+    make_sites_from_sequences(&sequences, &sites);
+    const int offset = 1000;
+    sites.start_coord += offset;
+    sites.end_coord += offset;
+    for (unsigned int i=0; i<sites.positions.size(); i++)
+        sites.positions[i] += offset;
+    ASSERT_TRUE(find_compress_cols(&sites, compress, &sites_mapping));
+    compress_sites(&sites, &sites_mapping);
+    Sequences sequences2;
+    make_sequences_from_sites(&sites, &sequences2);
+    ASSERT_LT(sequences2.length(), seqlen / 2);
+    ASSERT_EQ(offset, sites_mapping.old_start);
+    model.rho *= compress;
+    model.mu *= compress;
+
+    LocalTrees trees(0, sequences2.length());
+    sample_arg_seq(&model, &sequences2, &trees);
+
+    ArgStatsCache cache;
+    for (int iter=0; iter<3; iter++) {
+        double prior, likelihood, arglen;
+        int noncompats;
+        cache.calc(&model, &sequences2, &trees, &sites_mapping,
+                   &prior, &likelihood, &noncompats, &arglen);
+
+        char *seqs2[nseqs];
+        for (int j=0; j<nseqs; j++)
+            seqs2[j] = sequences2.seqs[trees.seqids[j]];
+        EXPECT_EQ(noncompats, count_noncompat(&trees, seqs2, nseqs,
+                                              sequences2.length()));
+
+        uncompress_local_trees(&trees, &sites_mapping);
+        EXPECT_NEAR(prior, calc_arg_prior(&model, &trees),
+                    1e-9 * fabs(prior));
+        const double likelihood2 = calc_arg_likelihood(
+            &model, &sequences2, &trees, &sites_mapping);
+        EXPECT_NEAR(likelihood, likelihood2, 1e-9 * fabs(likelihood));
+        EXPECT_NEAR(arglen, get_arglen(&trees, model.times), 1e-9 * arglen);
+        compress_local_trees(&trees, &sites_mapping);
+
+        resample_arg(&model, &sequences2, &trees);
+    }
+
+    delete_random_seqs(seqs, nseqs);
+}
+
+
+
+// The likelihood and prior computed on several threads should be exactly
+// those computed on one thread.
+TEST(ProbTest, test_arg_prob_threads)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    const int seqlen = 20000;
+    const int nseqs = 6;
+
+    char *seqs[nseqs];
+    make_random_seqs(seqs, nseqs, seqlen, 2);
+    Sequences sequences(seqs, nseqs, seqlen);
+
+    LocalTrees trees(0, seqlen);
+    sample_arg_seq(&model, &sequences, &trees);
+
+    set_prob_threads(1);
+    const double prior = calc_arg_prior(&model, &trees);
+    const double likelihood = calc_arg_likelihood(&model, &sequences, &trees);
+
+    for (int nthreads=2; nthreads<=4; nthreads++) {
+        set_prob_threads(nthreads);
+        EXPECT_EQ(prior, calc_arg_prior(&model, &trees));
+        EXPECT_EQ(likelihood, calc_arg_likelihood(&model, &sequences, &trees));
+    }
+    set_prob_threads(1);
+
+    delete_random_seqs(seqs, nseqs);
+}
+
+
+
+// Returns an ARG in the text format
+static string local_trees_text(const LocalTrees *trees,
+                               const Sequences &sequences, const double *times)
+{
+    FILE *out = tmpfile();
+    write_local_trees(out, trees, sequences, times);
+    string text(ftell(out), '\0');
+    rewind(out);
+    EXPECT_EQ(fread(&text[0], 1, text.size(), out), text.size());
+    fclose(out);
+    return text;
+}
+
+
+// Windows resampled concurrently should give the same ARG for any number
+// of threads above one.
+TEST(ProbTest, test_resample_arg_regions_threads)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    const int seqlen = 20000;
+    const int nseqs = 6;
+
+    char *seqs[nseqs];
+    make_random_seqs(seqs, nseqs, seqlen, 5);
+    Sequences sequences(seqs, nseqs, seqlen);
+
+    LocalTrees trees(0, seqlen);
+    sample_arg_seq(&model, &sequences, &trees);
+    const string text0 = local_trees_text(&trees, sequences, model.times);
+
+    const int nthreads[] = {2, 4};
+    string text[2];
+    for (int i=0; i<2; i++) {
+        LocalTrees trees2;
+        trees2.copy(trees);
+        ThreadPool pool(nthreads[i]);
+        get_random_generator()->set_seed(7);
+        resample_arg_regions(&model, &sequences, &trees2, 2000, 1000, 1,
+                             &pool);
+        EXPECT_TRUE(assert_trees(&trees2));
+        text[i] = local_trees_text(&trees2, sequences, model.times);
+    }
+    EXPECT_NE(text0, text[0]);
+    EXPECT_EQ(text[0], text[1]);
+
+    delete_random_seqs(seqs, nseqs);
+}
+
+
+
+// Where a removal path can continue on two branches it should take the
+// second one with probability prob_switch, in both directions from the
+// starting position.
+TEST(ProbTest, test_removal_path_switch)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    const int seqlen = 50000;
+    const int nseqs = 6;
+
+    char *seqs[nseqs];
+    make_random_seqs(seqs, nseqs, seqlen, 3);
+    Sequences sequences(seqs, nseqs, seqlen);
+
+    LocalTrees trees(0, seqlen);
+    sample_arg_seq(&model, &sequences, &trees);
+    const int ntrees = trees.get_num_trees();
+    const int nnodes = trees.nnodes;
+    ASSERT_GT(ntrees, 10);
+
+    // branches that follow each branch between trees i-1 and i
+    vector<int> starts(ntrees);
+    vector<int> next_nodes(ntrees * nnodes * 2, -1);
+    vector<int> prev_nodes(ntrees * nnodes * 2, -1);
+    const LocalTree *last_tree = NULL;
+    int end = trees.start_coord;
+    int k = 0;
+    for (LocalTrees::const_iterator it=trees.begin(); it!=trees.end();
+         ++it, k++) {
+        starts[k] = end;
+        end += it->blocklen;
+        if (last_tree) {
+            get_all_next_removal_nodes(
+                last_tree, it->tree, it->spr, it->mapping,
+                (int (*)[2]) &next_nodes[k * nnodes * 2]);
+            get_all_prev_removal_nodes(
+                last_tree, it->tree, it->spr, it->mapping,
+                (int (*)[2]) &prev_nodes[k * nnodes * 2]);
+        }
+        last_tree = it->tree;
+    }
+
+    const double probs[] = {0.0, 0.3, 1.0};
+    int path[ntrees];
+    for (int p=0; p<3; p++) {
+        int nsplits = 0, nswitches = 0;
+        for (int n=0; n<1000; n++) {
+            const int node = irand(nnodes);
+            const int pos = irand(trees.start_coord, trees.end_coord);
+            sample_arg_removal_path(&trees, node, pos, path, probs[p]);
+            const int b = upper_bound(starts.begin(), starts.end(), pos) -
+                starts.begin() - 1;
+            ASSERT_EQ(path[b], node);
+
+            for (int i=0; i<ntrees; i++) {
+                const int *choices;
+                if (i > b)
+                    choices = &next_nodes[(i * nnodes + path[i-1]) * 2];
+                else if (i < b)
+                    choices = &prev_nodes[((i+1) * nnodes + path[i+1]) * 2];
+                else
+                    continue;
+
+                ASSERT_TRUE(path[i] == choices[0] ||
+                            (choices[1] != -1 && path[i] == choices[1]));
+                if (choices[1] != -1) {
+                    nsplits++;
+                    if (path[i] == choices[1])
+                        nswitches++;
+                }
+            }
+        }
+
+        ASSERT_GT(nsplits, 100);
+        const double sd = sqrt(probs[p] * (1.0 - probs[p]) / nsplits);
+        EXPECT_NEAR(nswitches / double(nsplits), probs[p], 5 * sd + 1e-9)
+            << "prob_switch " << probs[p];
+    }
+
+    delete_random_seqs(seqs, nseqs);
+}
+
 }  // namespace
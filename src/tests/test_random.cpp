@@ -0,0 +1,97 @@
+#include "gtest/gtest.h"
+
+#include "random.h"
+
+
+namespace argweaver {
+
+
+// Streams should reproduce the reference xoshiro256** and splitmix64
+// outputs (http://prng.di.unimi.it).
+TEST(RandomTest, test_reference_values)
+{
+    RandomGenerator rng;
+    ASSERT_TRUE(rng.set_state("xoshiro256** 1 2 3 4"));
+    const uint64_t expected[] = {
+        11520ULL, 0ULL, 1509978240ULL, 1215971899390074240ULL,
+        1216172134540287360ULL, 607988272756665600ULL};
+    for (int i=0; i<6; i++)
+        EXPECT_EQ(expected[i], rng.next()) << i;
+
+    // jump() from the same state
+    ASSERT_TRUE(rng.set_state("xoshiro256** 1 2 3 4"));
+    rng.jump();
+    EXPECT_EQ("xoshiro256** 8c7a153956b5f3d1 701f1a713401d85e "
+              "6527f66a65469085 8386b786c4408050", rng.get_state());
+    EXPECT_EQ(13534147089533256664ULL, rng.next());
+    EXPECT_EQ(7126240192422241655ULL, rng.next());
+
+    // seeds are expanded with splitmix64
+    rng.set_seed(0);
+    EXPECT_EQ("xoshiro256** e220a8397b1dcdaf 6e789e6aa1b965f4 "
+              "06c45d188009454f f88bb8a8724c81ec", rng.get_state());
+    rng.set_seed(7);
+    EXPECT_EQ(12923355070828475994ULL, rng.next());
+    EXPECT_EQ(5142052590334782674ULL, rng.next());
+    EXPECT_EQ(15488392906492639638ULL, rng.next());
+}
+
+
+// A restored state continues the same stream and split streams differ from
+// the stream they were split from.
+TEST(RandomTest, test_state_and_split)
+{
+    RandomGenerator rng(7);
+    for (int i=0; i<10; i++)
+        rng.next();
+
+    RandomGenerator rng2;
+    ASSERT_TRUE(rng2.set_state(rng.get_state()));
+    for (int i=0; i<100; i++)
+        EXPECT_EQ(rng.next(), rng2.next());
+    EXPECT_FALSE(rng2.set_state("not a state"));
+
+    RandomGenerator child = rng.split();
+    RandomGenerator child2 = rng.split();
+    for (int i=0; i<1000; i++) {
+        const uint64_t a = child.next(), b = child2.next(), c = rng.next();
+        EXPECT_NE(a, b) << i;
+        EXPECT_NE(b, c) << i;
+        EXPECT_NE(a, c) << i;
+    }
+
+    for (int i=0; i<1000; i++) {
+        const double u = rng.uniform();
+        EXPECT_GT(u, 0.0);
+        EXPECT_LT(u, 1.0);
+        const int k = rng.uniform_int(5);
+        EXPECT_GE(k, 0);
+        EXPECT_LT(k, 5);
+    }
+}
+
+
+// Splitting streams from the same seed gives the same child streams, so
+// that runs with several threads are reproducible.
+TEST(RandomTest, test_split_reproducible)
+{
+    RandomGenerator rng(11), rng2(11);
+    for (int i=0; i<2; i++) {
+        RandomGenerator child = rng.split();
+        RandomGenerator child2 = rng2.split();
+        EXPECT_EQ(child.get_state(), child2.get_state());
+        for (int j=0; j<1000; j++)
+            EXPECT_EQ(child.next(), child2.next()) << i << " " << j;
+    }
+    EXPECT_EQ(rng.get_state(), rng2.get_state());
+
+    // a child starts where its parent was and the parent jumps ahead
+    RandomGenerator rng3(11), jumped(11);
+    RandomGenerator child3 = rng3.split();
+    jumped.jump();
+    EXPECT_EQ(RandomGenerator(11).get_state(), child3.get_state());
+    EXPECT_EQ(jumped.get_state(), rng3.get_state());
+}
+
+
+} // namespace argweaver
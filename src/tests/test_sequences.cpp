@@ -0,0 +1,121 @@
+#include "gtest/gtest.h"
+
+#include "binary_sites.h"
+#include "seq.h"
+#include "sequences.h"
+
+
+namespace argweaver {
+
+
+// Packed site flags agree with comparing characters, including subsets of
+// sequences that span several words.
+TEST(SequencesTest, test_packed_site_flags)
+{
+    const int nseqs = 70;
+    const int seqlen = 400;
+    const char *bases = "ACGTN";
+
+    srand(1);
+    Sequences seqs(seqlen);
+    seqs.set_owned(true);
+    for (int j=0; j<nseqs; j++) {
+        char *seq = new char [seqlen + 1];
+        for (int i=0; i<seqlen; i++) {
+            // mostly invariant or masked columns with some variation
+            const int r = rand() % 100;
+            if (r < 3)
+                seq[i] = bases[rand() % 5];
+            else
+                seq[i] = (i % 7 == 0) ? 'N' : bases[i % 4];
+        }
+        seq[seqlen] = '\0';
+        seqs.append("", seq);
+    }
+
+    // character based flags
+    int seqids[nseqs];
+    const int nsub = 50;
+    for (int j=0; j<nsub; j++)
+        seqids[j] = (j * 37) % nseqs;
+    bool invariant[seqlen], masked[seqlen];
+    find_block_site_flags(&seqs, seqids, nsub, 0, seqlen, invariant, masked);
+
+    // packed flags
+    seqs.find_site_flags();
+    const PackedSequences *packed = seqs.get_packed();
+    ASSERT_TRUE(packed != NULL);
+    bool invariant2[seqlen], masked2[seqlen];
+    find_block_site_flags(&seqs, seqids, nsub, 0, seqlen,
+                          invariant2, masked2);
+
+    int ninvariant = 0;
+    for (int i=0; i<seqlen; i++) {
+        EXPECT_EQ(invariant[i], invariant2[i]);
+        EXPECT_EQ(masked[i], masked2[i]);
+        ninvariant += invariant[i];
+    }
+    EXPECT_GT(ninvariant, 0);
+    EXPECT_LT(ninvariant, seqlen);
+
+    for (int j=0; j<nseqs; j++)
+        for (int i=0; i<seqlen; i++)
+            EXPECT_EQ(dna2int[(int) seqs.seqs[j][i]], packed->get_base(i, j));
+}
+
+
+// Round trip sites through the binary format, reading the whole file and a
+// subregion of it.
+TEST(SequencesTest, test_sites_binary)
+{
+    const char *text =
+        "NAMES\ta\tb\tc\n"
+        "REGION\tchr\t1\t100\n"
+        "3\tAAC\n"
+        "10\tNgT\n"
+        "40\tCCA\n"
+        "41\tTGT\n"
+        "80\tAAN\n";
+    const char *filename = "test_sequences.sitesb";
+
+    FILE *infile = tmpfile();
+    fputs(text, infile);
+    rewind(infile);
+    Sites sites;
+    ASSERT_TRUE(read_sites(infile, &sites));
+    fclose(infile);
+
+    ASSERT_TRUE(write_sites_binary(filename, &sites));
+    EXPECT_TRUE(is_sites_binary(filename));
+    Sites sites2;
+    ASSERT_TRUE(read_sites_binary(filename, &sites2));
+
+    EXPECT_EQ(sites.names, sites2.names);
+    EXPECT_EQ(sites.chrom, sites2.chrom);
+    EXPECT_EQ(sites.start_coord, sites2.start_coord);
+    EXPECT_EQ(sites.end_coord, sites2.end_coord);
+    EXPECT_EQ(sites.positions, sites2.positions);
+    ASSERT_EQ(sites.get_num_sites(), sites2.get_num_sites());
+    for (int i=0; i<sites.get_num_sites(); i++)
+        EXPECT_STREQ(sites.cols[i], sites2.cols[i]);
+
+    // a subregion keeps the same sites as the text reader
+    for (int start=0; start<85; start += 7) {
+        const int end = start + 40;
+        infile = tmpfile();
+        fputs(text, infile);
+        rewind(infile);
+        Sites sites3, sites4;
+        ASSERT_TRUE(read_sites(infile, &sites3, start, end));
+        fclose(infile);
+        ASSERT_TRUE(read_sites_binary(filename, &sites4, start, end));
+        EXPECT_EQ(sites3.start_coord, sites4.start_coord);
+        EXPECT_EQ(sites3.end_coord, sites4.end_coord);
+        EXPECT_EQ(sites3.positions, sites4.positions);
+    }
+
+    remove(filename);
+}
+
+
+} // namespace argweaver
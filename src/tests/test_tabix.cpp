@@ -0,0 +1,647 @@
+
+#include "gtest/gtest.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "binary_trees.h"
+#include "common.h"
+#include "compress.h"
+#include "local_tree.h"
+#include "model.h"
+#include "random.h"
+#include "sample_arg.h"
+#include "tabix.h"
+
+#include "test_util.h"
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+struct BedRecord
+{
+    string chrom;
+    int64_t beg;
+    int64_t end;
+    string line;
+};
+
+
+// Makes records sorted by chromosome and start on each of chroms.  Most
+// are short, some span many bins of the index.
+static void make_bed_records(const vector<string> &chroms, int nrecords,
+                             vector<BedRecord> &records)
+{
+    records.clear();
+    for (size_t c=0; c<chroms.size(); c++) {
+        int64_t beg = 1000;
+        for (int i=0; i<nrecords; i++) {
+            BedRecord record;
+            record.chrom = chroms[c];
+            beg += irand(300);
+            record.beg = beg;
+            record.end = beg + 1 + irand(100);
+            if (irand(100) == 0)
+                record.end = beg + 1 + irand(2000000);
+            char line[200];
+            snprintf(line, sizeof(line), "%s\t%lld\t%lld\tsample%d\t%f",
+                     record.chrom.c_str(), (long long) record.beg,
+                     (long long) record.end, irand(100), frand());
+            record.line = line;
+            records.push_back(record);
+        }
+    }
+}
+
+
+// Writes records to a BGZF file after the header lines.  Returns the
+// uncompressed text.
+static string write_bed(const char *filename, const string &header,
+                        const vector<BedRecord> &records)
+{
+    string text = header;
+    for (size_t i=0; i<records.size(); i++)
+        text += records[i].line + "\n";
+
+    FILE *out = write_compress(filename);
+    EXPECT_TRUE(out != NULL);
+    fwrite(text.c_str(), 1, text.size(), out);
+    EXPECT_EQ(0, close_compress(out));
+    return text;
+}
+
+
+// Finds the compressed offsets and uncompressed sizes of the blocks of a
+// BGZF file
+static bool get_bgzf_blocks(const char *filename, vector<uint64_t> &offsets,
+                            vector<uint64_t> &sizes)
+{
+    FILE *infile = fopen(filename, "rb");
+    if (!infile)
+        return false;
+    string data;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), infile)) > 0)
+        data.append(buf, n);
+    fclose(infile);
+
+    const unsigned char *bytes = (const unsigned char*) data.c_str();
+    for (size_t pos=0; pos + 18 <= data.size(); ) {
+        // BGZF blocks have a single BC extra subfield with the block size
+        if (bytes[pos+12] != 'B' || bytes[pos+13] != 'C')
+            return false;
+        const size_t bsize = bytes[pos+16] | (bytes[pos+17] << 8);
+        const unsigned char *footer = &bytes[pos + bsize + 1 - 4];
+        offsets.push_back(pos);
+        sizes.push_back(footer[0] | (footer[1] << 8) | (footer[2] << 16) |
+                        ((uint64_t) footer[3] << 24));
+        pos += bsize + 1;
+    }
+    return true;
+}
+
+
+// Returns the virtual offset of uncompressed position pos.  A position at
+// the end of a block is the start of the next block.
+static uint64_t get_virtual_offset(const vector<uint64_t> &offsets,
+                                   const vector<uint64_t> &sizes,
+                                   uint64_t pos)
+{
+    for (size_t i=0; i<offsets.size(); i++) {
+        if (pos < sizes[i])
+            return (offsets[i] << 16) | pos;
+        pos -= sizes[i];
+    }
+    return offsets.back() << 16;
+}
+
+
+// Returns the bin of [beg, end) in a binning scheme with the given
+// min_shift and depth
+static int reg2bin(int64_t beg, int64_t end, int min_shift, int depth)
+{
+    int s = min_shift;
+    int t = ((1 << (depth * 3)) - 1) / 7;
+    end--;
+    for (int l=depth; l>0; l--) {
+        if (beg >> s == end >> s)
+            return t + (beg >> s);
+        s += 3;
+        t -= 1 << ((l - 1) * 3);
+    }
+    return 0;
+}
+
+
+static void put_le(string &data, uint64_t x, int nbytes)
+{
+    for (int i=0; i<nbytes; i++)
+        data += char((x >> (8 * i)) & 0xff);
+}
+
+
+struct IndexChunk
+{
+    uint64_t beg;
+    uint64_t end;
+};
+
+
+// Writes the index of a BED file with the records of text: a .tbi if csi
+// is false, otherwise a .csi with min_shift and depth
+static void write_index(const char *filename, const string &text,
+                        bool csi, int min_shift=14, int depth=5)
+{
+    vector<uint64_t> offsets, sizes;
+    ASSERT_TRUE(get_bgzf_blocks(filename, offsets, sizes));
+
+    vector<string> names;
+    vector<map<int, vector<IndexChunk> > > bins;
+    vector<vector<uint64_t> > linear;
+    for (size_t pos=0; pos<text.size(); ) {
+        const size_t stop = text.find('\n', pos);
+        const string line = text.substr(pos, stop - pos);
+        const uint64_t vbeg = get_virtual_offset(offsets, sizes, pos);
+        const uint64_t vend = get_virtual_offset(offsets, sizes, stop + 1);
+        pos = stop + 1;
+        if (line[0] == '#')
+            continue;
+
+        char chrom[100];
+        long long beg, end;
+        ASSERT_EQ(3, sscanf(line.c_str(), "%99s %lld %lld",
+                            chrom, &beg, &end));
+        if (names.empty() || names.back() != chrom) {
+            names.push_back(chrom);
+            bins.resize(names.size());
+            linear.resize(names.size());
+        }
+
+        vector<IndexChunk> &chunks =
+            bins.back()[reg2bin(beg, end, min_shift, depth)];
+        if (!chunks.empty() && chunks.back().end == vbeg) {
+            chunks.back().end = vend;
+        } else {
+            IndexChunk chunk = {vbeg, vend};
+            chunks.push_back(chunk);
+        }
+        vector<uint64_t> &windows = linear.back();
+        for (int64_t i=beg >> 14; i<=(end - 1) >> 14; i++) {
+            if (windows.size() <= size_t(i))
+                windows.resize(i + 1, 0);
+            if (windows[i] == 0)
+                windows[i] = vbeg;
+        }
+    }
+
+    // tabix header for the BED preset
+    string conf;
+    const int conf_values[] = {0x10000, 1, 2, 3, '#', 0};
+    for (int i=0; i<6; i++)
+        put_le(conf, conf_values[i], 4);
+    string all_names;
+    for (size_t i=0; i<names.size(); i++)
+        all_names += names[i] + '\0';
+    put_le(conf, all_names.size(), 4);
+    conf += all_names;
+
+    string data;
+    if (csi) {
+        data = "CSI\1";
+        put_le(data, min_shift, 4);
+        put_le(data, depth, 4);
+        put_le(data, conf.size(), 4);
+        data += conf;
+    } else {
+        data = "TBI\1";
+        put_le(data, names.size(), 4);
+        data += conf;
+    }
+    if (csi)
+        put_le(data, names.size(), 4);
+
+    for (size_t i=0; i<names.size(); i++) {
+        put_le(data, bins[i].size(), 4);
+        for (map<int, vector<IndexChunk> >::const_iterator it=
+                 bins[i].begin(); it != bins[i].end(); ++it) {
+            put_le(data, it->first, 4);
+            if (csi)
+                put_le(data, it->second[0].beg, 8);  // loffset
+            put_le(data, it->second.size(), 4);
+            for (size_t j=0; j<it->second.size(); j++) {
+                put_le(data, it->second[j].beg, 8);
+                put_le(data, it->second[j].end, 8);
+            }
+        }
+        if (!csi) {
+            for (size_t j=1; j<linear[i].size(); j++)
+                if (linear[i][j] == 0)
+                    linear[i][j] = linear[i][j-1];
+            put_le(data, linear[i].size(), 4);
+            for (size_t j=0; j<linear[i].size(); j++)
+                put_le(data, linear[i][j], 8);
+        }
+    }
+
+    const string index_file = string(filename) + (csi ? ".csi" : ".tbi");
+    FILE *out = write_compress(index_file.c_str());
+    ASSERT_TRUE(out != NULL);
+    fwrite(data.c_str(), 1, data.size(), out);
+    EXPECT_EQ(0, close_compress(out));
+}
+
+
+// Returns the output of read_tabix() for region
+static string query_tabix(const char *filename, const char *region)
+{
+    FILE *stream = read_tabix(filename, region, NULL);
+    EXPECT_TRUE(stream != NULL) << region;
+    if (!stream)
+        return "";
+    string text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), stream)) > 0)
+        text.append(buf, n);
+    close_tabix(stream);
+    return text;
+}
+
+
+// Returns the header followed by the records overlapping a region
+// (1-based, inclusive)
+static string filter_bed(const string &header,
+                         const vector<BedRecord> &records,
+                         const string &chrom, int64_t start, int64_t end)
+{
+    string text = header;
+    for (size_t i=0; i<records.size(); i++)
+        if (records[i].chrom == chrom && records[i].beg < end &&
+            records[i].end > start - 1)
+            text += records[i].line + "\n";
+    return text;
+}
+
+
+// Checks read_tabix() against filter_bed() for regions of all records and
+// at their edges
+static void check_tabix_regions(const char *filename, const string &header,
+                                const vector<BedRecord> &records,
+                                const vector<string> &chroms)
+{
+    vector<pair<string, pair<int64_t, int64_t> > > regions;
+    for (size_t c=0; c<chroms.size(); c++) {
+        // whole chromosome, empty regions before the first record and past
+        // the last
+        regions.push_back(make_pair(chroms[c], make_pair(1, int64_t(1) << 40)));
+        regions.push_back(make_pair(chroms[c], make_pair(1, 1000)));
+        regions.push_back(make_pair(chroms[c], make_pair(
+            int64_t(1) << 30, int64_t(1) << 31)));
+
+        // random regions of several sizes
+        for (int i=0; i<30; i++) {
+            const int64_t start = 1 + irand(2000000);
+            const int64_t len = (i % 3 == 0) ? 1 : irand(i % 3 == 1 ?
+                                                          1000 : 200000);
+            regions.push_back(make_pair(chroms[c],
+                                        make_pair(start, start + len)));
+        }
+    }
+
+    // edges of records: ending just before and at a record's first base,
+    // starting at and just after its last base
+    for (int i=0; i<20; i++) {
+        const BedRecord &record = records[irand(records.size())];
+        regions.push_back(make_pair(record.chrom,
+                                    make_pair(record.beg - 10, record.beg)));
+        regions.push_back(make_pair(record.chrom,
+                                    make_pair(record.beg - 10, record.beg + 1)));
+        regions.push_back(make_pair(record.chrom,
+                                    make_pair(record.end, record.end + 10)));
+        regions.push_back(make_pair(record.chrom,
+                                    make_pair(record.end + 1, record.end + 10)));
+    }
+
+    for (size_t i=0; i<regions.size(); i++) {
+        const string &chrom = regions[i].first;
+        const int64_t start = max(regions[i].second.first, int64_t(1));
+        const int64_t end = regions[i].second.second;
+        char region[200];
+        snprintf(region, sizeof(region), "%s:%lld-%lld", chrom.c_str(),
+                 (long long) start, (long long) end);
+        const string expected = filter_bed(header, records, chrom, start, end);
+        EXPECT_TRUE(query_tabix(filename, region) == expected) << region;
+    }
+
+    // unknown chromosome and whole chromosome without coordinates
+    EXPECT_TRUE(query_tabix(filename, "chrX:1-1000000") == header);
+    EXPECT_TRUE(query_tabix(filename, chroms[1].c_str()) ==
+                filter_bed(header, records, chroms[1], 1, int64_t(1) << 40));
+}
+
+
+// Records read through a .tbi or a .csi index should be those of a
+// brute-force search of the file.
+TEST(TabixTest, test_read_tabix)
+{
+    const char *filename = "test_tabix.bed.gz";
+    const string index_files[] = {string(filename) + ".tbi",
+                                  string(filename) + ".csi"};
+    get_random_generator()->set_seed(1);
+
+    vector<string> chroms;
+    chroms.push_back("chr1");
+    chroms.push_back("chr2");
+    chroms.push_back("chr10");
+    vector<BedRecord> records;
+    make_bed_records(chroms, 8000, records);
+    const string header = "#chrom\tstart\tend\tname\tvalue\n";
+    const string text = write_bed(filename, header, records);
+    vector<uint64_t> offsets, sizes;
+    ASSERT_TRUE(get_bgzf_blocks(filename, offsets, sizes));
+    ASSERT_GT(offsets.size(), 5u);
+
+    write_index(filename, text, false);
+    clear_tabix_cache();
+    check_tabix_regions(filename, header, records, chroms);
+    remove(index_files[0].c_str());
+
+    // a .csi index with another binning scheme
+    write_index(filename, text, true, 12, 6);
+    clear_tabix_cache();
+    check_tabix_regions(filename, header, records, chroms);
+    remove(index_files[1].c_str());
+
+    clear_tabix_cache();
+    remove(filename);
+}
+
+
+
+// An index written by write_tabix_index() should find the same records as
+// a brute-force search of the file.
+TEST(TabixTest, test_write_tabix_index)
+{
+    const char *filename = "test_tabix_write.bed.gz";
+    const string index_file = string(filename) + ".tbi";
+    get_random_generator()->set_seed(2);
+
+    vector<string> chroms;
+    chroms.push_back("chr1");
+    chroms.push_back("chr2");
+    chroms.push_back("chr10");
+    vector<BedRecord> records;
+    make_bed_records(chroms, 8000, records);
+    const string header = "#chrom\tstart\tend\tname\tvalue\n";
+    write_bed(filename, header, records);
+
+    remove(index_file.c_str());
+    ASSERT_TRUE(write_tabix_index(filename));
+    clear_tabix_cache();
+    check_tabix_regions(filename, header, records, chroms);
+
+    // files not sorted by start or with a chromosome split in two are not
+    // indexed
+    vector<BedRecord> unsorted = records;
+    swap(unsorted[10], unsorted[20]);
+    write_bed(filename, header, unsorted);
+    EXPECT_FALSE(write_tabix_index(filename));
+
+    unsorted = records;
+    unsorted.push_back(records[0]);
+    write_bed(filename, header, unsorted);
+    EXPECT_FALSE(write_tabix_index(filename));
+
+    clear_tabix_cache();
+    remove(index_file.c_str());
+    remove(filename);
+}
+
+
+// A file rewritten or replaced after it was read should be read again,
+// while streams opened before keep reading the old file.
+TEST(TabixTest, test_read_tabix_changed)
+{
+    const char *filename = "test_tabix_changed.bed.gz";
+    const char *filename2 = "test_tabix_changed2.bed.gz";
+    const string index_file = string(filename) + ".tbi";
+    const string index_file2 = string(filename2) + ".tbi";
+    get_random_generator()->set_seed(4);
+
+    vector<string> chroms;
+    chroms.push_back("chr1");
+    const string header = "#chrom\tstart\tend\tname\tvalue\n";
+    const int64_t chrom_end = int64_t(1) << 40;
+    vector<BedRecord> records, records2, records3;
+    make_bed_records(chroms, 1000, records);
+    make_bed_records(chroms, 2000, records2);
+    make_bed_records(chroms, 3000, records3);
+
+    clear_tabix_cache();
+    write_bed(filename, header, records);
+    ASSERT_TRUE(write_tabix_index(filename));
+    EXPECT_EQ(query_tabix(filename, "chr1"),
+              filter_bed(header, records, "chr1", 1, chrom_end));
+
+    // rewritten in place
+    write_bed(filename, header, records2);
+    ASSERT_TRUE(write_tabix_index(filename));
+    EXPECT_EQ(query_tabix(filename, "chr1"),
+              filter_bed(header, records2, "chr1", 1, chrom_end));
+
+    // replaced by another file while a stream is open
+    FILE *stream = read_tabix(filename, "chr1", NULL);
+    ASSERT_TRUE(stream != NULL);
+    string text(10, '\0');
+    ASSERT_EQ(fread(&text[0], 1, text.size(), stream), text.size());
+    write_bed(filename2, header, records3);
+    ASSERT_TRUE(write_tabix_index(filename2));
+    ASSERT_EQ(0, rename(filename2, filename));
+    ASSERT_EQ(0, rename(index_file2.c_str(), index_file.c_str()));
+    EXPECT_EQ(query_tabix(filename, "chr1"),
+              filter_bed(header, records3, "chr1", 1, chrom_end));
+    clear_tabix_cache();
+
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), stream)) > 0)
+        text.append(buf, n);
+    close_tabix(stream);
+    EXPECT_EQ(text, filter_bed(header, records2, "chr1", 1, chrom_end));
+
+    remove(index_file.c_str());
+    remove(filename);
+}
+
+
+// Returns the text of a possibly compressed file
+static string read_text(const char *filename)
+{
+    string text;
+    FILE *infile = read_compress(filename);
+    EXPECT_TRUE(infile != NULL) << filename;
+    if (!infile)
+        return text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), infile)) > 0)
+        text.append(buf, n);
+    close_compress(infile);
+    return text;
+}
+
+
+// Splits text into BED records
+static void parse_bed_records(const string &text, vector<BedRecord> &records)
+{
+    records.clear();
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find('\n', pos);
+        if (end == string::npos)
+            end = text.size();
+        BedRecord record;
+        record.line = text.substr(pos, end - pos);
+        char chrom[100];
+        long long beg, stop;
+        EXPECT_EQ(3, sscanf(record.line.c_str(), "%99s\t%lld\t%lld",
+                            chrom, &beg, &stop)) << record.line;
+        record.chrom = chrom;
+        record.beg = beg;
+        record.end = stop;
+        records.push_back(record);
+        pos = end + 1;
+    }
+}
+
+
+static bool bed_record_less(const BedRecord &a, const BedRecord &b)
+{
+    if (a.chrom != b.chrom)
+        return a.chrom < b.chrom;
+    if (a.beg != b.beg)
+        return a.beg < b.beg;
+    return a.end < b.end;
+}
+
+
+// Returns the path of bin/smc2bed, found from the path of the test binary
+// src/tests/test so that the tests can run from any directory
+static string get_smc2bed_path()
+{
+    char path[PATH_MAX];
+    const ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len <= 0)
+        return "bin/smc2bed";
+    path[len] = '\0';
+    string dir = path;
+    for (int i=0; i<3; i++)
+        dir = dir.substr(0, dir.rfind('/'));
+    return dir + "/bin/smc2bed";
+}
+
+
+// The merged bed file of several samples should be the outputs for each
+// sample alone, sorted by position with ties in the order of the files,
+// and its index should find the records overlapping a region.
+TEST(TabixTest, test_smc2bed_merge)
+{
+    ArgModel model(20, 200e3, 1e4, 1.5e-8, 2.5e-8);
+    const int seqlen = 50000;
+    const int nseqs = 5;
+    const char *names[nseqs] = {"n0", "n1", "n2", "n3", "n4"};
+
+    const string smc2bed = get_smc2bed_path();
+    ASSERT_EQ(0, access(smc2bed.c_str(), X_OK)) << smc2bed;
+    char tmpdir[] = "/tmp/argweaver_test_XXXXXX";
+    ASSERT_TRUE(mkdtemp(tmpdir) != NULL);
+    const string dir = tmpdir;
+
+    char *seqs[nseqs];
+    make_random_seqs(seqs, nseqs, seqlen, 3);
+    Sequences sequences(seqs, nseqs, seqlen);
+
+    // samples in text and binary smc files.  The last sample has the ARG
+    // of the first, so that all of their records are ties.
+    const int nsamples = 3;
+    const string smc_files[nsamples] = {dir + "/out.10.smc.gz",
+                                        dir + "/out.20.smc.gz",
+                                        dir + "/out.30.smcb"};
+    const int sample_numbers[nsamples] = {10, 20, 30};
+    for (int i=0; i<nsamples - 1; i++) {
+        LocalTrees trees(0, seqlen);
+        sample_arg_seq(&model, &sequences, &trees);
+        trees.chrom = "chr1";
+        ASSERT_TRUE(write_local_trees(smc_files[i].c_str(), &trees, names,
+                                      model.times));
+        if (i == 0) {
+            ASSERT_TRUE(write_local_trees_binary(
+                smc_files[nsamples - 1].c_str(), &trees, names,
+                model.times, model.ntimes));
+        }
+    }
+
+    // each sample alone
+    const string bed_file = dir + "/sample.bed";
+    vector<BedRecord> expected;
+    for (int i=0; i<nsamples; i++) {
+        char cmd[2000];
+        snprintf(cmd, sizeof(cmd), "%s --sample %d %s > %s",
+                 smc2bed.c_str(), sample_numbers[i], smc_files[i].c_str(),
+                 bed_file.c_str());
+        ASSERT_EQ(0, system(cmd)) << cmd;
+        vector<BedRecord> records;
+        parse_bed_records(read_text(bed_file.c_str()), records);
+        EXPECT_GT(records.size(), 10u);
+        expected.insert(expected.end(), records.begin(), records.end());
+    }
+    remove(bed_file.c_str());
+    stable_sort(expected.begin(), expected.end(), bed_record_less);
+
+    // all samples merged, taking the sample numbers from the file names
+    const string filename = dir + "/merged.bed.gz";
+    const string index_file = filename + ".tbi";
+    string cmd = smc2bed + " --threads 2 --output " + filename;
+    for (int i=0; i<nsamples; i++)
+        cmd += " " + smc_files[i];
+    ASSERT_EQ(0, system(cmd.c_str())) << cmd;
+
+    vector<BedRecord> records;
+    parse_bed_records(read_text(filename.c_str()), records);
+    ASSERT_EQ(expected.size(), records.size());
+    for (size_t i=0; i<records.size(); i++)
+        EXPECT_EQ(expected[i].line, records[i].line) << i;
+
+    clear_tabix_cache();
+    for (int i=0; i<20; i++) {
+        const int64_t start = 1 + irand(seqlen);
+        const int64_t end = start + irand(5000);
+        char region[200];
+        snprintf(region, sizeof(region), "chr1:%lld-%lld",
+                 (long long) start, (long long) end);
+        EXPECT_TRUE(query_tabix(filename.c_str(), region) ==
+                    filter_bed("", expected, "chr1", start, end)) << region;
+    }
+
+    clear_tabix_cache();
+    remove(index_file.c_str());
+    remove(filename.c_str());
+    for (int i=0; i<nsamples; i++)
+        remove(smc_files[i].c_str());
+    rmdir(tmpdir);
+    delete_random_seqs(seqs, nseqs);
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,33 @@
+#include "common.h"
+#include "random.h"
+
+#include "test_util.h"
+
+
+namespace argweaver {
+
+
+void make_random_seqs(char **seqs, int nseqs, int seqlen, int seed,
+                      double mutrate)
+{
+    const char *bases = "ACGT";
+
+    get_random_generator()->set_seed(seed);
+    for (int j=0; j<nseqs; j++)
+        seqs[j] = new char [seqlen];
+    for (int i=0; i<seqlen; i++) {
+        const char base = bases[irand(4)];
+        for (int j=0; j<nseqs; j++)
+            seqs[j][i] = (frand() < mutrate) ? bases[irand(4)] : base;
+    }
+}
+
+
+void delete_random_seqs(char **seqs, int nseqs)
+{
+    for (int j=0; j<nseqs; j++)
+        delete [] seqs[j];
+}
+
+
+} // namespace argweaver
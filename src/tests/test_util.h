@@ -0,0 +1,23 @@
+//=============================================================================
+// Fixtures shared by the unit tests
+
+#ifndef ARGWEAVER_TEST_UTIL_H
+#define ARGWEAVER_TEST_UTIL_H
+
+
+namespace argweaver {
+
+
+// Allocates nseqs sequences of length seqlen, drawn after seeding the
+// random generator with seed.  Each site has a random base, which a
+// sequence replaces by a random base with probability mutrate.
+void make_random_seqs(char **seqs, int nseqs, int seqlen, int seed,
+                      double mutrate=.01);
+
+// Deletes sequences allocated by make_random_seqs()
+void delete_random_seqs(char **seqs, int nseqs);
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_TEST_UTIL_H
@@ -392,7 +392,7 @@ void add_arg_thread(LocalTrees *trees, const StatesModel &states_model,
             // insert new tree and spr into local trees list
             it->blocklen = pos - start;
             ++it;
-            it = trees->trees.insert(it,
+            it = trees->insert(it,
                 LocalTreeSpr(new_tree, spr2, block_end - pos, mapping2));
 
 
@@ -720,7 +720,7 @@ void sample_arg_removal_path_forward(
             if (next_nodes[1] == -1)
                 j = 0;
             else
-                j = int(rand() < prob_switch);
+                j = int(frand() < prob_switch);
             path[i++] = next_nodes[j];
 
             // ensure that a removal path re-enters the local tree correctly
@@ -744,9 +744,9 @@ void sample_arg_removal_path_backward(
     const LocalTree *tree2 = it->tree;
     const Spr *spr2 = &it->spr;
     const int *mapping2 = it->mapping;
-    --it;
 
-    for (; it != trees->end(); --it) {
+    while (it != trees->begin()) {
+        --it;
         int prev_nodes[2];
         LocalTree *tree1 = it->tree;
         assert(!spr2->is_null());
@@ -757,7 +757,7 @@ void sample_arg_removal_path_backward(
         if (prev_nodes[1] == -1)
             j = 0;
         else
-            j = int(rand() < prob_switch);
+            j = int(frand() < prob_switch);
         path[i--] = prev_nodes[j];
 
         spr2 = &it->spr;
@@ -1428,7 +1428,7 @@ void add_arg_thread_path(LocalTrees *trees, const StatesModel &states_model,
             // insert new tree and spr into local trees list
             it->blocklen = pos - start;
             ++it;
-            it = trees->trees.insert(it,
+            it = trees->insert(it,
                 LocalTreeSpr(new_tree, spr2, block_end - pos, mapping2));
 
             // remember the previous tree for next iteration of loop
@@ -109,7 +109,18 @@ public:
 };
 
 
+// find the possible next (or previous) branches of every branch in a
+// removal path from tree1 to tree2
+void get_all_next_removal_nodes(const LocalTree *tree1, const LocalTree *tree2,
+                                const Spr &spr2, const int *mapping2,
+                                int next_nodes[][2]);
+void get_all_prev_removal_nodes(const LocalTree *tree1, const LocalTree *tree2,
+                                const Spr &spr2, const int *mapping2,
+                                int prev_nodes[][2]);
+
 // sample removal paths
+// Where a removal path can continue on two branches, it takes the second
+// one with probability prob_switch.
 void sample_arg_removal_path(const LocalTrees *trees, int node, int *path);
 void sample_arg_removal_path(
     const LocalTrees *trees, int node, int pos, int *path,
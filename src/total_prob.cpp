@@ -1,4 +1,5 @@
 // c++ includes
+#include <algorithm>
 #include <list>
 #include <vector>
 #include <string.h>
@@ -7,7 +8,9 @@
 #include "common.h"
 #include "emit.h"
 #include "local_tree.h"
+#include "parallel.h"
 #include "sequences.h"
+#include "total_prob.h"
 #include "trans.h"
 
 
@@ -16,31 +19,194 @@ using namespace std;
 namespace argweaver {
 
 
-double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
-                           const LocalTrees *trees)
+//=============================================================================
+// parallel evaluation of ARG blocks
+
+
+static int g_prob_threads = 1;
+static ThreadPool *g_prob_pool = NULL;
+static pthread_mutex_t g_prob_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+void set_prob_threads(int nthreads)
 {
-    double lnl = 0.0;
-    int nseqs = sequences->get_num_seqs();
+    pthread_mutex_lock(&g_prob_pool_lock);
+    g_prob_threads = max(nthreads, 1);
+    delete g_prob_pool;
+    g_prob_pool = NULL;
+    pthread_mutex_unlock(&g_prob_pool_lock);
+}
 
-    // special case for truck genealogies
-    if (trees->nnodes < 3)
-        return lnl += log(.25) * sequences->length();
+
+int get_prob_threads()
+{
+    return g_prob_threads;
+}
+
+
+// A block of an ARG
+struct ArgBlock
+{
+    const LocalTree *tree;
+    const Spr *next_spr;  // SPR ending the block, NULL for the last block
+    int start;
+    int end;
+};
+
+
+static void get_arg_blocks(const LocalTrees *trees, vector<ArgBlock> &blocks)
+{
+    blocks.clear();
+    int end = trees->start_coord;
+    for (LocalTrees::const_iterator it=trees->begin(); it != trees->end();) {
+        ArgBlock block;
+        block.tree = it->tree;
+        block.start = end;
+        block.end = end = end + it->blocklen;
+        ++it;
+        block.next_spr = (end < trees->end_coord) ? &it->spr : NULL;
+        blocks.push_back(block);
+    }
+}
+
+
+// Computes the terms of blocks [start, end)
+typedef void (*BlockRangeFunc)(int start, int end, void *data);
+
+struct BlockRangeJob
+{
+    BlockRangeFunc func;
+    void *data;
+    int nblocks;
+    int ntasks;
+};
+
+
+static void block_range_task(int task, void *data)
+{
+    BlockRangeJob *job = (BlockRangeJob*) data;
+    const int start = int(long(task) * job->nblocks / job->ntasks);
+    const int end = int(long(task + 1) * job->nblocks / job->ntasks);
+    job->func(start, end, job->data);
+}
+
+
+// Runs func over all blocks, using the prob threads if there are several.
+// func must store the terms of each block separately, so that they can be
+// summed in block order and the sum does not depend on the number of
+// threads.  If the pool is already in use, for example by another thread,
+// the blocks are computed by the calling thread.
+static void run_block_ranges(int nblocks, BlockRangeFunc func, void *data)
+{
+    if (nblocks > 1 && pthread_mutex_trylock(&g_prob_pool_lock) == 0) {
+        if (g_prob_threads > 1) {
+            if (!g_prob_pool)
+                g_prob_pool = new ThreadPool(g_prob_threads);
+            BlockRangeJob job = {func, data, nblocks,
+                                 min(nblocks, 4 * g_prob_threads)};
+            g_prob_pool->run(job.ntasks, block_range_task, &job);
+            pthread_mutex_unlock(&g_prob_pool_lock);
+            return;
+        }
+        pthread_mutex_unlock(&g_prob_pool_lock);
+    }
+    func(0, nblocks, data);
+}
+
+
+static double sum_terms(const vector<double> &terms)
+{
+    double total = 0.0;
+    for (unsigned int i=0; i<terms.size(); i++)
+        total += terms[i];
+    return total;
+}
+
+
+//=============================================================================
+// ARG likelihood
+
+
+// Likelihood of the block [start, end) of uncompressed coordinates of an
+// ARG, whose variant sites are given by sites_mapping
+static double calc_block_likelihood(const ArgModel *model,
+                                    const Sequences *sequences,
+                                    const int *seqids, const LocalTree *tree,
+                                    int start, int end,
+                                    const SitesMapping* sites_mapping)
+{
+    const int nseqs = sequences->get_num_seqs();
+    const int blocklen = end - start;
+    const char default_char = 'A';
+    const vector<int> &all_sites = sites_mapping->all_sites;
 
     // get sequences for trees
     char *seqs[nseqs];
+    char *matrix = new char [blocklen*nseqs];
     for (int j=0; j<nseqs; j++)
-        seqs[j] = sequences->seqs[trees->seqids[j]];
+        seqs[j] = &matrix[j*blocklen];
+
+    // find first site within this block
+    unsigned int i2 = lower_bound(all_sites.begin(), all_sites.end(), start) -
+        all_sites.begin();
+
+    // copy sites into new alignment
+    for (int i=start; i<end; i++) {
+        while (i2 < all_sites.size() && all_sites[i2] < i)
+            i2++;
+        if (i2 < all_sites.size() && i == all_sites[i2]) {
+            // copy site
+            for (int j=0; j<nseqs; j++)
+                seqs[j][i-start] = sequences->seqs[seqids[j]][i2];
+        } else {
+            // copy non-variant site
+            for (int j=0; j<nseqs; j++)
+                seqs[j][i-start] = default_char;
+        }
+    }
 
-    int end = trees->start_coord;
-    for (LocalTrees::const_iterator it=trees->begin(); it!=trees->end(); ++it) {
-        int start = end;
-        end = start + it->blocklen;
-        LocalTree *tree = it->tree;
+    double lnl = likelihood_tree(tree, model, seqs, nseqs, 0, blocklen);
+
+    delete [] matrix;
+    return lnl;
+}
 
-        lnl += likelihood_tree(tree, model, seqs, nseqs, start, end);
+
+struct LikelihoodJob
+{
+    const ArgModel *model;
+    const Sequences *sequences;
+    const LocalTrees *trees;
+    const SitesMapping *sites_mapping;
+    const char *const *seqs;
+    const ArgBlock *blocks;
+    double *terms;
+};
+
+
+static void likelihood_range(int start, int end, void *data)
+{
+    LikelihoodJob *job = (LikelihoodJob*) data;
+    const int nseqs = job->sequences->get_num_seqs();
+
+    for (int i=start; i<end; i++) {
+        const ArgBlock &block = job->blocks[i];
+        if (job->sites_mapping)
+            job->terms[i] = calc_block_likelihood(
+                job->model, job->sequences, &job->trees->seqids[0],
+                block.tree, block.start, block.end, job->sites_mapping);
+        else
+            job->terms[i] = likelihood_tree(
+                block.tree, job->model, job->seqs, nseqs,
+                block.start, block.end);
     }
+}
 
-    return lnl;
+
+double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
+                           const LocalTrees *trees)
+{
+    return calc_arg_likelihood(model, sequences, trees, NULL);
 }
 
 
@@ -49,55 +215,24 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
                            const LocalTrees *trees,
                            const SitesMapping* sites_mapping)
 {
-    if (!sites_mapping)
-        return calc_arg_likelihood(model, sequences, trees);
-
-    double lnl = 0.0;
-    int nseqs = sequences->get_num_seqs();
-    const char default_char = 'A';
-
     // special case for truck genealogies
     if (trees->nnodes < 3)
-        return lnl += log(.25) * sequences->length();
+        return log(.25) * sequences->length();
 
-    int end = trees->start_coord;
-    for (LocalTrees::const_iterator it=trees->begin(); it!=trees->end(); ++it) {
-        int start = end;
-        int blocklen = it->blocklen;
-        end = start + blocklen;
-        LocalTree *tree = it->tree;
-
-        // get sequences for trees
-        char *seqs[nseqs];
-        char *matrix = new char [blocklen*nseqs];
-        for (int j=0; j<nseqs; j++)
-            seqs[j] = &matrix[j*blocklen];
-
-        // find first site within this block
-        unsigned int i2 = 0;
-
-        // copy sites into new alignment
-        for (int i=start; i<end; i++) {
-            while (i2 < sites_mapping->all_sites.size() &&
-                   sites_mapping->all_sites[i2] < i)
-                i2++;
-            if (i == sites_mapping->all_sites[i2]) {
-                // copy site
-                for (int j=0; j<nseqs; j++)
-                    seqs[j][i-start] = sequences->seqs[trees->seqids[j]][i2];
-            } else {
-                // copy non-variant site
-                for (int j=0; j<nseqs; j++)
-                    seqs[j][i-start] = default_char;
-            }
-        }
-
-        lnl += likelihood_tree(tree, model, seqs, nseqs, 0, end-start);
+    // get sequences for trees
+    const int nseqs = sequences->get_num_seqs();
+    const char *seqs[nseqs];
+    for (int j=0; j<nseqs; j++)
+        seqs[j] = sequences->seqs[trees->seqids[j]];
 
-        delete [] matrix;
-    }
+    vector<ArgBlock> blocks;
+    get_arg_blocks(trees, blocks);
+    vector<double> terms(blocks.size());
+    LikelihoodJob job = {model, sequences, trees, sites_mapping, seqs,
+                         &blocks[0], &terms[0]};
+    run_block_ranges(blocks.size(), likelihood_range, &job);
 
-    return lnl;
+    return sum_terms(terms);
 }
 
 //=============================================================================
@@ -257,44 +392,70 @@ double calc_spr_prob(const ArgModel *model, const LocalTree *tree,
 
 
 
-// calculate the probability of an ARG given the model parameters
-double calc_arg_prior(const ArgModel *model, const LocalTrees *trees)
+// Probability of a block of length blocklen ending in the SPR next_spr, or
+// in the end of the ARG if next_spr is NULL
+static double calc_block_prior(const ArgModel *model, const LocalTree *tree,
+                               int blocklen, const Spr *next_spr,
+                               LineageCounts &lineages)
 {
     double lnl = 0.0;
-    LineageCounts lineages(model->ntimes);
-
-    // first tree prior
-    //lnl += calc_tree_prior(model, trees->front().tree, lineages);
+    double treelen = get_treelen(tree, model->times, model->ntimes, false);
+
+    // calculate probability P(blocklen | T_{i-1})
+    double recomb_rate = max(model->rho * treelen, model->rho);
+
+    if (next_spr) {
+        // not last block
+        // probability of recombining after blocklen
+        lnl += log(recomb_rate) - recomb_rate * blocklen;
+
+        // get SPR move information
+        lnl += calc_spr_prob(model, tree, *next_spr, lineages, treelen);
+    } else {
+        // last block
+        // probability of not recombining after blocklen
+        lnl += - recomb_rate * blocklen;
+    }
 
-    int end = trees->start_coord;
-    for (LocalTrees::const_iterator it=trees->begin(); it != trees->end();) {
-        end += it->blocklen;
-        LocalTree *tree = it->tree;
-        int blocklen = it->blocklen;
-        double treelen = get_treelen(tree, model->times, model->ntimes, false);
+    return lnl;
+}
 
-        // calculate probability P(blocklen | T_{i-1})
-        double recomb_rate = max(model->rho * treelen, model->rho);
 
-        if (end < trees->end_coord) {
-            // not last block
-            // probability of recombining after blocklen
-            lnl += log(recomb_rate) - recomb_rate * blocklen;
+struct PriorJob
+{
+    const ArgModel *model;
+    const ArgBlock *blocks;
+    double *terms;
+};
 
-            // get SPR move information
-            ++it;
-            const Spr *spr = &it->spr;
-            lnl += calc_spr_prob(model, tree, *spr, lineages, treelen);
 
-        } else {
-            // last block
-            // probability of not recombining after blocklen
-            lnl += - recomb_rate * blocklen;
-            ++it;
-        }
+static void prior_range(int start, int end, void *data)
+{
+    PriorJob *job = (PriorJob*) data;
+    LineageCounts lineages(job->model->ntimes);
+
+    for (int i=start; i<end; i++) {
+        const ArgBlock &block = job->blocks[i];
+        job->terms[i] = calc_block_prior(job->model, block.tree,
+                                         block.end - block.start,
+                                         block.next_spr, lineages);
     }
+}
 
-    return lnl;
+
+// calculate the probability of an ARG given the model parameters
+double calc_arg_prior(const ArgModel *model, const LocalTrees *trees)
+{
+    // first tree prior
+    //lnl += calc_tree_prior(model, trees->front().tree, lineages);
+
+    vector<ArgBlock> blocks;
+    get_arg_blocks(trees, blocks);
+    vector<double> terms(blocks.size());
+    PriorJob job = {model, &blocks[0], &terms[0]};
+    run_block_ranges(blocks.size(), prior_range, &job);
+
+    return sum_terms(terms);
 }
 
 
@@ -308,11 +469,206 @@ double calc_arg_joint_prob(const ArgModel *model, const Sequences *sequences,
 
 
 
+//=============================================================================
+// cache of ARG statistics
+
+
+// Mixes x into the hash h
+static inline uint64_t hash_mix(uint64_t h, int64_t x)
+{
+    h = (h ^ uint64_t(x)) * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 29);
+}
+
+
+// Hashes everything a block's statistics depend on: its tree, its
+// (compressed) coordinates and the SPR that ends it
+static uint64_t hash_block(const LocalTree *tree, int start, int blocklen,
+                           const Spr *next_spr)
+{
+    uint64_t h = hash_mix(0, tree->nnodes);
+    h = hash_mix(h, tree->root);
+    for (int i=0; i<tree->nnodes; i++) {
+        const LocalNode &node = tree->nodes[i];
+        h = hash_mix(h, node.parent);
+        h = hash_mix(h, node.child[0]);
+        h = hash_mix(h, node.child[1]);
+        h = hash_mix(h, node.age);
+    }
+    h = hash_mix(h, start);
+    h = hash_mix(h, blocklen);
+    if (next_spr) {
+        h = hash_mix(h, next_spr->recomb_node);
+        h = hash_mix(h, next_spr->recomb_time);
+        h = hash_mix(h, next_spr->coal_node);
+        h = hash_mix(h, next_spr->coal_time);
+    } else {
+        h = hash_mix(h, -1);
+    }
+    return h;
+}
+
+
+struct ArgStatsJob
+{
+    const ArgModel *model;
+    const Sequences *sequences;
+    const LocalTrees *trees;
+    const SitesMapping *sites_mapping;
+    const char *const *seqs;
+    const ArgBlock *blocks;     // uncompressed coordinates
+    const int *missing;         // blocks to compute
+    ArgStatsCache::BlockStats *stats;
+};
+
+
+static void arg_stats_range(int start, int end, void *data)
+{
+    ArgStatsJob *job = (ArgStatsJob*) data;
+    const ArgModel *model = job->model;
+    const int nleaves = job->trees->get_num_leaves();
+    const char *subseqs[nleaves];
+    LineageCounts lineages(model->ntimes);
+
+    for (int k=start; k<end; k++) {
+        const int i = job->missing[k];
+        const ArgBlock &block = job->blocks[i];
+        const LocalTree *tree = block.tree;
+        ArgStatsCache::BlockStats &stats = job->stats[i];
+
+        stats.prior = calc_block_prior(model, tree, block.end - block.start,
+                                       block.next_spr, lineages);
+
+        if (tree->nnodes < 3)
+            stats.likelihood = 0.0;
+        else if (job->sites_mapping)
+            stats.likelihood = calc_block_likelihood(
+                model, job->sequences, &job->trees->seqids[0], tree,
+                block.start, block.end, job->sites_mapping);
+        else
+            stats.likelihood = likelihood_tree(
+                tree, model, job->seqs, nleaves, block.start, block.end);
+
+        for (int j=0; j<nleaves; j++)
+            subseqs[j] = &job->seqs[j][stats.start];
+        stats.noncompats = count_noncompat(tree, subseqs, nleaves,
+                                           stats.blocklen, NULL);
+
+        // branch length as in get_arglen()
+        stats.treelen = 0.0;
+        for (int j=0; j<tree->nnodes; j++) {
+            const int parent = tree->nodes[j].parent;
+            if (parent != -1)
+                stats.treelen += model->times[tree->nodes[parent].age] -
+                    model->times[tree->nodes[j].age];
+        }
+    }
+}
+
+
+void ArgStatsCache::calc(const ArgModel *model, const Sequences *sequences,
+                         const LocalTrees *trees,
+                         const SitesMapping *sites_mapping,
+                         double *prior, double *likelihood, int *noncompats,
+                         double *arglen)
+{
+    // cached terms depend on the model parameters
+    const vector<double> popsizes(model->popsizes,
+                                  model->popsizes + model->ntimes);
+    if (popsizes != model_popsizes || model->rho != model_rho ||
+        model->mu != model_mu) {
+        blocks.clear();
+        model_popsizes = popsizes;
+        model_rho = model->rho;
+        model_mu = model->mu;
+    }
+
+    // get sequences for trees
+    const int nleaves = trees->get_num_leaves();
+    const char *seqs[nleaves];
+    for (int j=0; j<nleaves; j++)
+        seqs[j] = sequences->seqs[trees->seqids[j]];
+
+    // get uncompressed block lengths
+    vector<int> blocklens, blocklens2;
+    for (LocalTrees::const_iterator it=trees->begin(); it != trees->end();
+         ++it)
+        blocklens.push_back(it->blocklen);
+    if (sites_mapping)
+        sites_mapping->uncompress_blocks(blocklens, blocklens2);
+    else
+        blocklens2 = blocklens;
+
+    // get blocks in uncompressed coordinates, and look them up in the cache
+    const int nblocks = blocklens.size();
+    vector<ArgBlock> arg_blocks(nblocks);
+    vector<uint64_t> keys(nblocks);
+    vector<BlockStats> stats(nblocks);
+    vector<int> missing;
+    int end = trees->start_coord;
+    int end2 = sites_mapping ? sites_mapping->old_start : trees->start_coord;
+    LocalTrees::const_iterator it = trees->begin();
+    for (int i=0; i<nblocks; i++) {
+        ArgBlock &block = arg_blocks[i];
+        const int start = end;
+        block.tree = it->tree;
+        block.start = end2;
+        block.end = end2 = end2 + blocklens2[i];
+        end += blocklens[i];
+        ++it;
+        block.next_spr = (it != trees->end()) ? &it->spr : NULL;
+
+        keys[i] = hash_block(block.tree, start, blocklens[i], block.next_spr);
+        map<uint64_t, BlockStats>::iterator cached = blocks.find(keys[i]);
+        if (cached != blocks.end() && cached->second.start == start &&
+            cached->second.blocklen == blocklens[i]) {
+            stats[i] = cached->second;
+        } else {
+            stats[i].start = start;
+            stats[i].blocklen = blocklens[i];
+            missing.push_back(i);
+        }
+    }
+
+    // compute blocks that are not cached
+    if (!missing.empty()) {
+        ArgStatsJob job = {model, sequences, trees, sites_mapping, seqs,
+                           &arg_blocks[0], &missing[0], &stats[0]};
+        run_block_ranges(missing.size(), arg_stats_range, &job);
+    }
+
+    // sum terms in block order and keep only the blocks of this ARG
+    *prior = 0.0;
+    *likelihood = 0.0;
+    *noncompats = 0;
+    *arglen = 0.0;
+    map<uint64_t, BlockStats> blocks2;
+    for (int i=0; i<nblocks; i++) {
+        blocks2[keys[i]] = stats[i];
+        *prior += stats[i].prior;
+        *likelihood += stats[i].likelihood;
+        *noncompats += stats[i].noncompats;
+        *arglen += stats[i].treelen * blocklens2[i];
+    }
+    blocks.swap(blocks2);
+
+    // special case for truck genealogies
+    if (trees->nnodes < 3)
+        *likelihood = log(.25) * sequences->length();
+}
+
+
 //=============================================================================
 // C interface
 
 extern "C" {
 
+void arghmm_set_prob_threads(int nthreads)
+{
+    set_prob_threads(nthreads);
+}
+
+
 double arghmm_likelihood(LocalTrees *trees,
                          double *times, int ntimes,
                          double mu,
@@ -1,11 +1,21 @@
 #ifndef ARGWEAVER_TOTAL_PROB_H
 #define ARGWEAVER_TOTAL_PROB_H
 
+#include <map>
+#include <stdint.h>
+#include <vector>
+
 #include "local_tree.h"
 #include "model.h"
+#include "sequences.h"
 
 namespace argweaver {
 
+// Sets the number of threads used to compute the likelihood and prior of
+// an ARG over its blocks.  Results do not depend on the number of threads.
+void set_prob_threads(int nthreads);
+int get_prob_threads();
+
 void calc_coal_rates_full_tree(const ArgModel *model, const LocalTree *tree,
                                const Spr &spr, LineageCounts &lineages,
                                double *coal_rates);
@@ -27,6 +37,45 @@ double calc_arg_joint_prob(const ArgModel *model, const Sequences *sequences,
                            const LocalTrees *trees);
 
 
+// Caches the prior, likelihood, number of non-compatible sites and branch
+// length of each block of an ARG, as reported while sampling.  A block is
+// only recomputed when its tree, its coordinates or the SPR ending it have
+// changed since the last call, so an ARG that differs from the previous
+// one in a few blocks is cheap to evaluate.
+class ArgStatsCache
+{
+public:
+    ArgStatsCache() : model_rho(-1.0), model_mu(-1.0) {}
+
+    // Computes the statistics of an ARG.  If sites_mapping is given, trees
+    // and sequences are compressed, and the statistics are those of the
+    // uncompressed ARG.
+    void calc(const ArgModel *model, const Sequences *sequences,
+              const LocalTrees *trees, const SitesMapping *sites_mapping,
+              double *prior, double *likelihood, int *noncompats,
+              double *arglen);
+
+    void clear() { blocks.clear(); }
+
+    struct BlockStats {
+        int start;     // compressed coordinates
+        int blocklen;
+        double prior;
+        double likelihood;
+        int noncompats;
+        double treelen;
+    };
+
+protected:
+    map<uint64_t, BlockStats> blocks;  // keyed by hash of the block
+
+    // model the cached statistics were computed with
+    vector<double> model_popsizes;
+    double model_rho;
+    double model_mu;
+};
+
+
 
 } // namespace argweaver
 
@@ -112,6 +112,52 @@ void calc_transition_probs(const LocalTree *tree, const ArgModel *model,
         matrix->norecombs[b] = exp(-max(rho * treelen2, rho));
     }
     matrix->E[ntimes-2] = 1.0 / ncoals[ntimes-2];
+
+    matrix->calc_tables();
+}
+
+
+// Materialize lookup tables so that get_time() needs no exponentials.
+// The table entries are computed with the same operations as calc_time()
+// so that both give identical results.
+void TransMatrix::calc_tables()
+{
+    has_tables = false;
+    if (!use_tables || !diff_node_table)
+        return;
+
+    // only times 0..ntimes-2 are valid states
+    const int n = ntimes - 1;
+    std::fill(diff_node_table, diff_node_table + ntimes*ntimes, 0.0);
+    std::fill(same_node_table, same_node_table + ntimes*ntimes, 0.0);
+    std::fill(c_terms, c_terms + ntimes*ntimes, 0.0);
+    std::fill(minage_terms, minage_terms + ntimes, 0.0);
+
+    for (int b=0; b<n; b++) {
+        if (minage > 0)
+            minage_terms[b] = exp(lnG4[b] + lnB[minage-1]);
+        for (int c=1; c<ntimes; c++)
+            c_terms[c*ntimes + b] = exp(lnG4[b] + lnB[c-1]);
+    }
+
+    for (int a=0; a<n; a++) {
+        for (int b=0; b<n; b++) {
+            diff_node_table[a*ntimes + b] = calc_time(a, b, 0, minage, false);
+
+            double term;
+            if (a < b) {
+                term = 2 * (exp(lnE2[b] + lnB[a]) -
+                            exp(lnE2[b] + lnNegG1[a]));
+            } else {
+                const double last = (b > 0 ? exp(lnE2[b] + lnB[b-1]) : 0.0);
+                term = 2 * (last + (a == b ? G3[b] : G2[b]));
+            }
+            same_node_table[a*ntimes + b] = term;
+        }
+    }
+
+    tables_minage = minage;
+    has_tables = true;
 }
 
 
@@ -19,10 +19,17 @@ namespace argweaver {
 class TransMatrix
 {
 public:
-    TransMatrix(int ntimes, int nstates, bool alloc=true) :
+    TransMatrix(int ntimes, int nstates, bool alloc=true,
+                bool use_tables=true) :
         ntimes(ntimes),
         nstates(nstates),
         own_data(false),
+        use_tables(use_tables),
+        has_tables(false),
+        diff_node_table(NULL),
+        same_node_table(NULL),
+        c_terms(NULL),
+        minage_terms(NULL),
         internal(false)
     {
         if (alloc)
@@ -41,6 +48,12 @@ public:
             delete [] G3;
             delete [] lnG4;
             delete [] norecombs;
+            if (use_tables) {
+                delete [] diff_node_table;
+                delete [] same_node_table;
+                delete [] c_terms;
+                delete [] minage_terms;
+            }
         }
     }
 
@@ -58,8 +71,19 @@ public:
         G3 = new double [ntimes];
         lnG4 = new double [ntimes];
         norecombs = new double [ntimes];
+        if (use_tables) {
+            diff_node_table = new double [ntimes * ntimes];
+            same_node_table = new double [ntimes * ntimes];
+            c_terms = new double [ntimes * ntimes];
+            minage_terms = new double [ntimes];
+        }
     }
 
+    // Materialize the time-by-time lookup tables used by get_time() for
+    // the current minage.  Must be called after the intermediate terms
+    // (D, E, lnB, ...) are computed.
+    void calc_tables();
+
     // Probability of transition from state i to state j.
     inline double get(
         const LocalTree *tree, const States &states, int i, int j) const
@@ -88,6 +112,25 @@ public:
     // a minimum age ('minage') allowed for the state.
     inline double get_time(int a, int b, int c,
                            int minage, bool same_node) const
+    {
+        if (a < minage || b < minage)
+            return 0.0;
+        if (has_tables && minage == tables_minage) {
+            // same terms as below, only the exponentials are precomputed
+            if (!same_node)
+                return diff_node_table[a*ntimes + b];
+            const double p = D[a] * E[b] * (same_node_table[a*ntimes + b]
+                                            - c_terms[c*ntimes + b]
+                                            - minage_terms[b]);
+            return a == b ? p + norecombs[a] : p;
+        }
+
+        return calc_time(a, b, c, minage, same_node);
+    }
+
+    // Computes the same value as get_time() without using lookup tables.
+    inline double calc_time(int a, int b, int c,
+                            int minage, bool same_node) const
     {
         if (a < minage || b < minage)
             return 0.0;
@@ -149,6 +192,17 @@ public:
     double *lnG4;
     double *norecombs;
 
+    bool use_tables;   // If true, allocate lookup tables for get_time()
+    bool has_tables;   // If true, lookup tables are valid
+    int tables_minage; // minage for which lookup tables are valid
+    double *diff_node_table;  // [a*ntimes+b] transition probability between
+                              // different branches
+    double *same_node_table;  // [a*ntimes+b] same branch term before
+                              // scaling by D[a]*E[b]
+    double *c_terms;          // [c*ntimes+b] same branch term for a branch
+                              // of age c
+    double *minage_terms;     // [b] term for the minimum state age
+
     bool internal;  // If true, this matrix is for threading an internal branch.
     int minage;     // Minimum age of a state we can consider (due to threading
                     // an internal branch).